@@ -0,0 +1,236 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+/* MTRDMA data path arbitration, formerly the mtrdma_main daemon */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <glob.h>
+#include "mtrdma_arbiter.h"
+
+#define RNR_NAK_COUNTERS "/sys/class/infiniband/*/ports/*/hw_counters/rnr_nak_retry_err"
+#define MAX_RNR_NAK_COUNTERS 16
+
+static struct mtrdma_shm_context *shm_ctx = NULL;
+static struct mtrdma_nic_model nic_model;
+static uint32_t rnr_quiet_ticks[MAX_TENANT_NUM];
+static int rnr_nak_fds[MAX_RNR_NAK_COUNTERS];
+static int rnr_nak_fd_num;
+static uint64_t rnr_nak_seen;
+
+// Function to open the port counters of RNR NAKs received, the throttle stays off without any
+static void open_rnr_nak_counters(void) {
+	glob_t g;
+
+	rnr_nak_fd_num = 0;
+	if (glob(RNR_NAK_COUNTERS, 0, NULL, &g))
+		return;
+
+	for (size_t i = 0; i < g.gl_pathc && rnr_nak_fd_num < MAX_RNR_NAK_COUNTERS; i++) {
+		int fd = open(g.gl_pathv[i], O_RDONLY);
+
+		if (fd >= 0)
+			rnr_nak_fds[rnr_nak_fd_num++] = fd;
+	}
+	globfree(&g);
+}
+
+static uint64_t read_rnr_naks(void) {
+	uint64_t total = 0;
+	char buf[32];
+
+	for (int i = 0; i < rnr_nak_fd_num; i++) {
+		ssize_t n = pread(rnr_nak_fds[i], buf, sizeof(buf) - 1, 0);
+
+		if (n <= 0)
+			continue;
+		buf[n] = '\0';
+		total += strtoull(buf, NULL, 10);
+	}
+
+	return total;
+}
+
+// Function to create and initialize the shared memory the mlx5 provider attaches to
+int mtrdma_arbiter_init(const struct mtrdma_nic_model *nic) {
+	pthread_mutexattr_t attr;
+	pthread_condattr_t attrcond;
+	int shm_fd;
+
+	shm_fd = shm_open(MTRDMA_SHM_NAME, O_CREAT | O_RDWR, 0666);
+	if (shm_fd == -1) {
+		fprintf(stderr, "Failed to open %s: %s\n", MTRDMA_SHM_NAME, strerror(errno));
+		return -errno;
+	}
+
+	if (ftruncate(shm_fd, sizeof(struct mtrdma_shm_context)) < 0) {
+		int err = -errno;
+
+		fprintf(stderr, "Failed to size %s: %s\n", MTRDMA_SHM_NAME, strerror(errno));
+		close(shm_fd);
+		return err;
+	}
+
+	shm_ctx = mmap(NULL, sizeof(struct mtrdma_shm_context), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+	close(shm_fd);
+	if (shm_ctx == MAP_FAILED) {
+		shm_ctx = NULL;
+		fprintf(stderr, "Failed to map %s: %s\n", MTRDMA_SHM_NAME, strerror(errno));
+		return -errno;
+	}
+
+	shm_ctx->next_tenant_id = 0;
+	shm_ctx->tenant_num = 0;
+	shm_ctx->active_tenant_num = 0;
+	shm_ctx->active_qps_num = 0;
+	memset(shm_ctx->active_qps_per_tenant, 0, sizeof(shm_ctx->active_qps_per_tenant));
+	memset(shm_ctx->tenant_pid, 0, sizeof(shm_ctx->tenant_pid));
+	memset(shm_ctx->resp_rd_atomic_per_tenant, 0, sizeof(shm_ctx->resp_rd_atomic_per_tenant));
+	memset(shm_ctx->req_rd_atomic_per_tenant, 0, sizeof(shm_ctx->req_rd_atomic_per_tenant));
+	memset(shm_ctx->rd_atomic_qps_per_tenant, 0, sizeof(shm_ctx->rd_atomic_qps_per_tenant));
+	memset(shm_ctx->rd_atomic_limit, 0, sizeof(shm_ctx->rd_atomic_limit));
+	memset(shm_ctx->rq_starved_per_tenant, 0, sizeof(shm_ctx->rq_starved_per_tenant));
+	memset(shm_ctx->sq_stalled_per_tenant, 0, sizeof(shm_ctx->sq_stalled_per_tenant));
+	memset(shm_ctx->rnr_retry_exc_per_tenant, 0, sizeof(shm_ctx->rnr_retry_exc_per_tenant));
+	memset(shm_ctx->rnr_throttle, 0, sizeof(shm_ctx->rnr_throttle));
+	memset(shm_ctx->tenant_class, 0, sizeof(shm_ctx->tenant_class));
+	memset(shm_ctx->uar_db_per_tenant, 0, sizeof(shm_ctx->uar_db_per_tenant));
+	memset(shm_ctx->uar_contended_per_tenant, 0, sizeof(shm_ctx->uar_contended_per_tenant));
+	shm_ctx->active_rrtenant_num = 0;
+	shm_ctx->starved_rqtenant_num = 0;
+	memset(rnr_quiet_ticks, 0, sizeof(rnr_quiet_ticks));
+	open_rnr_nak_counters();
+	rnr_nak_seen = read_rnr_naks();
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutex_init(&shm_ctx->lock, &attr);
+
+	pthread_condattr_init(&attrcond);
+	pthread_condattr_setpshared(&attrcond, PTHREAD_PROCESS_SHARED);
+
+	for (uint32_t i = 0; i < MAX_TENANT_NUM; i++) {
+		pthread_mutex_init(&shm_ctx->mtrdma_thread_lock[i], &attr);
+		pthread_cond_init(&shm_ctx->mtrdma_thread_cond[i], &attrcond);
+	}
+
+	nic_model = *nic;
+	shm_ctx->max_qps_limit = nic_model.qps_capa;
+
+	return 0;
+}
+
+/*
+ * Inbound READs and atomics are served by the responder without going through
+ * any tenant's send queue, so the SQ credits never see them. When the depth
+ * all tenants accept exceeds the NIC budget, every tenant above its fair share
+ * gets a per QP max_dest_rd_atomic cap, which its provider applies through
+ * modify_qp. Tenants within their share, and everyone when the NIC isn't
+ * oversubscribed, are left uncapped.
+ */
+static void update_rd_atomic_limits(uint32_t tenant_num, uint32_t rrtn, uint64_t resp_total) {
+	uint32_t share;
+
+	if (!nic_model.resp_rd_atomic_capa || !rrtn || resp_total <= nic_model.resp_rd_atomic_capa) {
+		memset(shm_ctx->rd_atomic_limit, 0, sizeof(shm_ctx->rd_atomic_limit));
+		return;
+	}
+
+	share = nic_model.resp_rd_atomic_capa / rrtn;
+	for (uint32_t i = 0; i < tenant_num; i++) {
+		uint32_t qps = shm_ctx->rd_atomic_qps_per_tenant[i];
+		uint32_t limit = 0;
+
+		if (qps && shm_ctx->resp_rd_atomic_per_tenant[i] > share) {
+			limit = share / qps;
+			if (limit == 0)
+				limit = 1;
+		}
+		shm_ctx->rd_atomic_limit[i] = limit;
+	}
+}
+
+/*
+ * RNR NAKs cost a full rnr timer on the sender each, and a sender retrying
+ * into a receiver without buffers keeps its send queue from completing. Each
+ * tick in which the port RNR NAK counters rose halves the credit refill of
+ * the tenants whose RC send queues stalled, down to 1 >> RNR_THROTTLE_MAX,
+ * and each RNR_THROTTLE_DECAY_TICKS quiet ticks give one step back.
+ */
+static void update_rnr_throttle(uint32_t i, bool rnr_naks) {
+	uint32_t throttle = shm_ctx->rnr_throttle[i];
+
+	if (rnr_naks && shm_ctx->sq_stalled_per_tenant[i]) {
+		if (throttle < RNR_THROTTLE_MAX)
+			throttle++;
+		rnr_quiet_ticks[i] = 0;
+	} else if (throttle && ++rnr_quiet_ticks[i] >= RNR_THROTTLE_DECAY_TICKS) {
+		throttle--;
+		rnr_quiet_ticks[i] = 0;
+	}
+
+	shm_ctx->rnr_throttle[i] = throttle;
+}
+
+// Function to recompute the active tenant/QP counts and the QP limit, run every QPS_CHECK_INTERVAL
+void mtrdma_arbiter_tick(void) {
+	uint32_t atn = 0, aqn = 0, rrtn = 0, srtn = 0;
+	uint64_t resp_total = 0;
+	uint64_t max_msg_size = 0;
+	uint32_t tenant_num = shm_ctx->tenant_num;
+	uint32_t fu_qp_num;
+	uint64_t rnr_naks = read_rnr_naks();
+	bool rnr_nak_rise = rnr_naks > rnr_nak_seen;
+
+	rnr_nak_seen = rnr_naks;
+	if (tenant_num > MAX_TENANT_NUM)
+		tenant_num = MAX_TENANT_NUM;
+
+	for (uint32_t i = 0; i < tenant_num; i++) {
+		if (shm_ctx->active_qps_per_tenant[i]) {
+			atn++;
+			aqn += shm_ctx->active_qps_per_tenant[i];
+		}
+		if (shm_ctx->resp_rd_atomic_per_tenant[i]) {
+			rrtn++;
+			resp_total += shm_ctx->resp_rd_atomic_per_tenant[i];
+		}
+		if (shm_ctx->rq_starved_per_tenant[i])
+			srtn++;
+		update_rnr_throttle(i, rnr_nak_rise);
+	}
+
+	// QPs needed to fill the link at the NIC message rate, bounded by the QP cache capacity
+	if (max_msg_size == 0)
+		fu_qp_num = nic_model.qps_capa;
+	else
+		fu_qp_num = (nic_model.link_bw * 0.7 / (double)(max_msg_size * 8)) /
+			    (double)(nic_model.max_msg_rate / 1000.0);
+
+	if (fu_qp_num == 0)
+		fu_qp_num = 1;
+
+	shm_ctx->active_tenant_num = atn;
+	shm_ctx->active_qps_num = aqn;
+	shm_ctx->active_rrtenant_num = rrtn;
+	shm_ctx->starved_rqtenant_num = srtn;
+	update_rd_atomic_limits(tenant_num, rrtn, resp_total);
+	shm_ctx->max_qps_limit = nic_model.qps_capa > fu_qp_num ? fu_qp_num : nic_model.qps_capa;
+}
+
+// Function to unmap the shared memory, the segment is kept for tenants still attached
+void mtrdma_arbiter_cleanup(void) {
+	for (int i = 0; i < rnr_nak_fd_num; i++)
+		close(rnr_nak_fds[i]);
+	rnr_nak_fd_num = 0;
+	if (shm_ctx)
+		munmap(shm_ctx, sizeof(struct mtrdma_shm_context));
+	shm_ctx = NULL;
+}
+
+struct mtrdma_shm_context *mtrdma_arbiter_shm(void) {
+	return shm_ctx;
+}
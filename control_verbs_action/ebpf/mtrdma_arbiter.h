@@ -0,0 +1,62 @@
+#ifndef __MTRDMA_ARBITER_H
+#define __MTRDMA_ARBITER_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define MTRDMA_SHM_NAME "/mtrdma-shm"
+#define MAX_TENANT_NUM 3000
+#define QPS_CHECK_INTERVAL 10000   // 10ms, data path arbitration period
+#define RNR_THROTTLE_MAX 4         // Refill down to 1/16 for RNR NAK storms
+#define RNR_THROTTLE_DECAY_TICKS 10 // One step back per 100ms without RNR NAKs
+
+// Shared with providers/mlx5/mtrdma.h, the layout must stay identical
+struct mtrdma_shm_context
+{
+	uint32_t next_tenant_id;
+	uint32_t tenant_num;
+	uint32_t active_tenant_num;
+	uint64_t active_qps_num;
+	uint32_t max_qps_limit;
+	uint32_t active_rrtenant_num; // Tenants whose QPs accept inbound READ/atomics
+	uint32_t starved_rqtenant_num; // Tenants with a starved receive queue
+
+	uint32_t active_qps_per_tenant[MAX_TENANT_NUM];
+	int32_t tenant_pid[MAX_TENANT_NUM]; // Registering process, 0 once it has exited
+
+	uint32_t resp_rd_atomic_per_tenant[MAX_TENANT_NUM]; // Sum of max_dest_rd_atomic
+	uint32_t req_rd_atomic_per_tenant[MAX_TENANT_NUM];  // Sum of max_rd_atomic
+	uint32_t rd_atomic_qps_per_tenant[MAX_TENANT_NUM];
+	uint32_t rd_atomic_limit[MAX_TENANT_NUM]; // Per QP max_dest_rd_atomic cap, 0 for none
+
+	uint32_t rq_starved_per_tenant[MAX_TENANT_NUM];    // Used RC RQs/SRQs left without buffers
+	uint32_t sq_stalled_per_tenant[MAX_TENANT_NUM];    // RC SQs with WQEs outstanding and no progress
+	uint64_t rnr_retry_exc_per_tenant[MAX_TENANT_NUM]; // IBV_WC_RNR_RETRY_EXC_ERR completions, reported only
+	uint32_t rnr_throttle[MAX_TENANT_NUM]; // Credit refill shift, set by the daemon
+
+	uint32_t tenant_class[MAX_TENANT_NUM]; // 0 default, 1 latency, 2 bulk
+	uint64_t uar_db_per_tenant[MAX_TENANT_NUM];        // Doorbells through shared bfregs
+	uint64_t uar_contended_per_tenant[MAX_TENANT_NUM]; // Of those, found the bfreg locked
+
+	pthread_mutex_t mtrdma_thread_lock[MAX_TENANT_NUM];
+	pthread_cond_t mtrdma_thread_cond[MAX_TENANT_NUM];
+	pthread_mutex_t lock;
+};
+
+// NIC capacity model used to derive max_qps_limit
+struct mtrdma_nic_model
+{
+	uint32_t qps_capa;
+	uint32_t max_msg_rate;  // Kpps
+	uint64_t link_bw;       // Mbps
+	uint32_t resp_rd_atomic_capa; // Inbound READ/atomic depth shared by all tenants
+};
+
+int mtrdma_arbiter_init(const struct mtrdma_nic_model *nic);
+void mtrdma_arbiter_tick(void);
+void mtrdma_arbiter_cleanup(void);
+struct mtrdma_shm_context *mtrdma_arbiter_shm(void);
+
+#endif /* __MTRDMA_ARBITER_H */
@@ -28,14 +28,80 @@ struct {
 	__uint(max_entries, 256 * 1024);
 } rb SEC(".maps");
 
-// Interception configuration map
+// Interception configuration map, double-buffered
 struct {
 	__uint(type, BPF_MAP_TYPE_ARRAY);
-	__uint(max_entries, 1);
+	__uint(max_entries, CONFIG_SLOTS);
 	__type(key, __u32);
 	__type(value, struct interception_config);
 } intercept_config_map SEC(".maps");
 
+// Config generation, bumped by user space after filling the inactive slot
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, __u64);
+} config_generation SEC(".maps");
+
+// Per-cgroup overrides of the global config, one set per config slot
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_CGROUPS * CONFIG_SLOTS);
+	__type(key, struct cgroup_override_key);
+	__type(value, struct cgroup_override);
+} cgroup_overrides SEC(".maps");
+
+// In-flight MR registrations, keyed by pid_tgid
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 10240);
+	__type(key, __u64);
+	__type(value, struct mr_reg_args);
+} mr_reg_inflight SEC(".maps");
+
+// Live MRs and the cgroup their pinned memory is charged to
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_TRACKED_MRS);
+	__type(key, __u64); // struct ib_mr *
+	__type(value, struct mr_owner);
+} mr_owners SEC(".maps");
+
+// In-flight QP creations, keyed by pid_tgid, to read the QPN on return
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 10240);
+	__type(key, __u64);
+	__type(value, __u64); // struct ib_qp *
+} qp_create_inflight SEC(".maps");
+
+// Timed verbs in flight, keyed by pid_tgid
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 10240);
+	__type(key, __u64);
+	__type(value, struct verb_start);
+} verb_inflight SEC(".maps");
+
+// Per-cgroup control verb latency histograms
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 10240);
+	__type(key, struct latency_hist_key);
+	__type(value, struct latency_hist);
+} latency_hists SEC(".maps");
+
+// rdma_cma:cm_send_req tracepoint record (cma_qp_class)
+struct cm_send_req_ctx {
+	struct trace_entry ent;
+	__u32 cm_id;
+	__u32 tos;
+	__u32 qp_num;
+	__u8 srcaddr[28];
+	__u8 dstaddr[28];
+};
+
 // Helper function to get cgroup ID
 static __u64 get_cgroup_id() {
 	struct task_struct *task = (struct task_struct *)bpf_get_current_task();
@@ -43,14 +109,160 @@ static __u64 get_cgroup_id() {
 	return BPF_CORE_READ(cgrp, kn, id);
 }
 
+// Helper function to get the active interception config and the slot it lives in
+static __always_inline struct interception_config *get_config(__u32 *slot)
+{
+	__u32 key = 0;
+	__u64 *gen;
+
+	gen = bpf_map_lookup_elem(&config_generation, &key);
+	if (!gen)
+		return NULL;
+
+	*slot = *gen % CONFIG_SLOTS;
+	return bpf_map_lookup_elem(&intercept_config_map, slot);
+}
+
+// Helper function to get a cgroup's override from the same slot as its config
+static __always_inline struct cgroup_override *get_override(__u64 cgroup_id, __u32 slot)
+{
+	struct cgroup_override_key key = {
+		.cgroup_id = cgroup_id,
+		.slot = slot,
+	};
+
+	return bpf_map_lookup_elem(&cgroup_overrides, &key);
+}
+
+static __always_inline __u32 log2_u64(__u64 v)
+{
+	__u32 r = 0;
+
+	if (v >> 32) { v >>= 32; r += 32; }
+	if (v >> 16) { v >>= 16; r += 16; }
+	if (v >> 8) { v >>= 8; r += 8; }
+	if (v >> 4) { v >>= 4; r += 4; }
+	if (v >> 2) { v >>= 2; r += 2; }
+	if (v >> 1) { r += 1; }
+
+	return r;
+}
+
+// Remember when this thread entered a timed verb
+static __always_inline void latency_start(enum rdma_monitor_type type, __u32 qp_state)
+{
+	__u64 pid_tgid = bpf_get_current_pid_tgid();
+	struct verb_start start = {
+		.ts_ns = bpf_ktime_get_ns(),
+		.type = type,
+		.qp_state = qp_state,
+	};
+
+	bpf_map_update_elem(&verb_inflight, &pid_tgid, &start, BPF_ANY);
+}
+
+// Account the time since latency_start() to the caller's cgroup histogram
+static __always_inline void latency_end(void)
+{
+	__u64 pid_tgid = bpf_get_current_pid_tgid();
+	struct latency_hist_key hkey = {};
+	struct latency_hist zero = {};
+	struct latency_hist *hist;
+	struct verb_start *start;
+	__u64 delta;
+	__u32 slot;
+
+	start = bpf_map_lookup_elem(&verb_inflight, &pid_tgid);
+	if (!start)
+		return;
+
+	delta = bpf_ktime_get_ns() - start->ts_ns;
+	hkey.cgroup_id = get_cgroup_id();
+	hkey.type = start->type;
+	hkey.qp_state = start->qp_state;
+	bpf_map_delete_elem(&verb_inflight, &pid_tgid);
+
+	hist = bpf_map_lookup_elem(&latency_hists, &hkey);
+	if (!hist) {
+		bpf_map_update_elem(&latency_hists, &hkey, &zero, BPF_NOEXIST);
+		hist = bpf_map_lookup_elem(&latency_hists, &hkey);
+		if (!hist)
+			return;
+	}
+
+	slot = log2_u64(delta);
+	if (slot >= LAT_HIST_SLOTS)
+		slot = LAT_HIST_SLOTS - 1;
+
+	__sync_fetch_and_add(&hist->slots[slot], 1);
+	__sync_fetch_and_add(&hist->count, 1);
+	__sync_fetch_and_add(&hist->sum_ns, delta);
+	if (delta > hist->max_ns)
+		hist->max_ns = delta;
+}
+
+// Reserve a ring buffer record if this event is the cgroup's 1-in-N sample.
+// The caller fills the payload and submits it.
+static __always_inline struct event *trace_reserve(__u64 cgroup_id, enum rdma_monitor_type type)
+{
+	struct interception_config *config;
+	struct cgroup_stats *cgroup_stats_entry;
+	struct cgroup_override *override;
+	struct event *e;
+	__u32 sample_rate;
+	__u32 slot;
+	__u64 seq;
+
+	config = get_config(&slot);
+	if (!config || !config->trace_sample_rate)
+		return NULL;
+
+	sample_rate = config->trace_sample_rate;
+	override = get_override(cgroup_id, slot);
+	if (override && (override->mask & CGROUP_OVERRIDE_SAMPLE_RATE)) {
+		sample_rate = override->trace_sample_rate;
+		if (!sample_rate)
+			return NULL;
+	}
+
+	cgroup_stats_entry = bpf_map_lookup_elem(&cgroup_stats, &cgroup_id);
+	if (!cgroup_stats_entry)
+		return NULL;
+
+	seq = __sync_fetch_and_add(&cgroup_stats_entry->trace_seq, 1);
+	if (seq % sample_rate)
+		return NULL;
+
+	e = bpf_ringbuf_reserve(&rb, sizeof(*e), 0);
+	if (!e) {
+		__sync_fetch_and_add(&cgroup_stats_entry->trace_dropped, 1);
+		return NULL;
+	}
+
+	__builtin_memset(e, 0, sizeof(*e));
+	e->ts_ns = bpf_ktime_get_ns();
+	e->cgroup_id = cgroup_id;
+	e->pid = bpf_get_current_pid_tgid() >> 32;
+	e->type = type;
+	bpf_get_current_comm(&e->comm, sizeof(e->comm));
+
+	return e;
+}
+
 
 SEC("kprobe/mlx5_ib_create_qp")
-int BPF_KPROBE(ib_create_qp)
+int BPF_KPROBE(ib_create_qp, struct ib_qp *ibqp)
 {
 	__u64 cgroup_id = get_cgroup_id();
+	__u64 pid_tgid = bpf_get_current_pid_tgid();
+	__u64 qp_ptr = (__u64)ibqp;
 	struct cgroup_stats *cgroup_stats_entry;
 	struct cgroup_stats new_cgroup_stats = {};
 
+	// The QPN is only assigned once the driver returns
+	bpf_map_update_elem(&qp_create_inflight, &pid_tgid, &qp_ptr, BPF_ANY);
+	latency_start(RDMA_MONITOR_QP_CREATE, RDMA_MONITOR_QP_STATE_NONE);
+
 	// Update global resource count
 	__u32 key = 0;
 	struct resource_stats *stats = bpf_map_lookup_elem(&resource_counts, &key);
@@ -73,12 +285,45 @@ int BPF_KPROBE(ib_create_qp)
 	return 0;
 }
 
+SEC("kretprobe/mlx5_ib_create_qp")
+int BPF_KRETPROBE(ib_create_qp_ret, int ret)
+{
+	__u64 pid_tgid = bpf_get_current_pid_tgid();
+	struct ib_qp *ibqp;
+	struct event *e;
+	__u64 *qp_ptr;
+
+	latency_end();
+
+	qp_ptr = bpf_map_lookup_elem(&qp_create_inflight, &pid_tgid);
+	if (!qp_ptr)
+		return 0;
+
+	ibqp = (struct ib_qp *)*qp_ptr;
+	bpf_map_delete_elem(&qp_create_inflight, &pid_tgid);
+	if (ret)
+		return 0;
+
+	e = trace_reserve(get_cgroup_id(), RDMA_MONITOR_QP_CREATE);
+	if (!e)
+		return 0;
+
+	e->qp.qpn = BPF_CORE_READ(ibqp, qp_num);
+	bpf_ringbuf_submit(e, 0);
+
+	return 0;
+}
+
 SEC("kprobe/mlx5_ib_modify_qp")
 int BPF_KPROBE(ib_modify_qp, struct ib_qp *qp, struct ib_qp_attr *attr, int attr_mask)
 {
 	__u64 cgroup_id = get_cgroup_id();
 	struct cgroup_stats *cgroup_stats_entry;
 	struct cgroup_stats new_cgroup_stats = {};
+	struct event *e;
+
+	latency_start(RDMA_MONITOR_QP_MODIFY, (attr_mask & RDMA_MONITOR_QP_ATTR_STATE) ?
+		      BPF_CORE_READ(attr, qp_state) : RDMA_MONITOR_QP_STATE_NONE);
 
 	// Update per-cgroup statistics
 	cgroup_stats_entry = bpf_map_lookup_elem(&cgroup_stats, &cgroup_id);
@@ -89,6 +334,26 @@ int BPF_KPROBE(ib_modify_qp, struct ib_qp *qp, struct ib_qp_attr *attr, int attr
 		bpf_map_update_elem(&cgroup_stats, &cgroup_id, &new_cgroup_stats, BPF_ANY);
 	}
 
+	e = trace_reserve(cgroup_id, RDMA_MONITOR_QP_MODIFY);
+	if (!e)
+		return 0;
+
+	e->qp.qpn = BPF_CORE_READ(qp, qp_num);
+	e->qp.attr_mask = attr_mask;
+	if (attr_mask & RDMA_MONITOR_QP_ATTR_STATE)
+		e->qp.state = BPF_CORE_READ(attr, qp_state);
+	if (attr_mask & RDMA_MONITOR_QP_ATTR_DEST_QPN)
+		e->qp.dest_qpn = BPF_CORE_READ(attr, dest_qp_num);
+	bpf_ringbuf_submit(e, 0);
+
+	return 0;
+}
+
+SEC("kretprobe/mlx5_ib_modify_qp")
+int BPF_KRETPROBE(ib_modify_qp_ret)
+{
+	latency_end();
+
 	return 0;
 }
 
@@ -189,6 +454,8 @@ int BPF_KPROBE(ib_create_cq)
 	struct cgroup_stats *cgroup_stats_entry;
 	struct cgroup_stats new_cgroup_stats = {};
 
+	latency_start(RDMA_MONITOR_CQ_CREATE, RDMA_MONITOR_QP_STATE_NONE);
+
 	// Update global resource count
 	stats = bpf_map_lookup_elem(&resource_counts, &key);
 	if (stats) {
@@ -210,6 +477,14 @@ int BPF_KPROBE(ib_create_cq)
 	return 0;
 }
 
+SEC("kretprobe/mlx5_ib_create_cq")
+int BPF_KRETPROBE(ib_create_cq_ret)
+{
+	latency_end();
+
+	return 0;
+}
+
 SEC("kprobe/mlx5_ib_destroy_cq")
 int BPF_KPROBE(ib_destroy_cq)
 {
@@ -245,8 +520,15 @@ int BPF_KPROBE(ib_reg_user_mr, struct ib_pd *pd, u64 start, u64 length, u64 virt
 	__u32 key = 0;
 	struct resource_stats *stats;
 	__u64 cgroup_id = get_cgroup_id();
+	__u64 pid_tgid = bpf_get_current_pid_tgid();
 	struct cgroup_stats *cgroup_stats_entry;
 	struct cgroup_stats new_cgroup_stats = {};
+	struct interception_config *config;
+	struct cgroup_override *override;
+	struct mr_reg_args args = {};
+	__u64 max_pinned_bytes;
+	__u64 pinned = 0;
+	__u32 slot;
 
 	// Update global resource count
 	stats = bpf_map_lookup_elem(&resource_counts, &key);
@@ -264,19 +546,108 @@ int BPF_KPROBE(ib_reg_user_mr, struct ib_pd *pd, u64 start, u64 length, u64 virt
 	} else {
 		new_cgroup_stats.counts[RDMA_MONITOR_MR_REG] = 1;
 		bpf_map_update_elem(&cgroup_stats, &cgroup_id, &new_cgroup_stats, BPF_ANY);
+		cgroup_stats_entry = bpf_map_lookup_elem(&cgroup_stats, &cgroup_id);
+	}
+
+	// Pages spanned by [start, start + length) are what the umem pins. They
+	// are charged here, so concurrent registrations of one cgroup each see
+	// the others, and given back by the kretprobe if the registration fails
+	args.cgroup_id = cgroup_id;
+	args.va = start;
+	args.len = length;
+	args.access_flags = access_flags;
+	if (cgroup_stats_entry && !(access_flags & RDMA_MONITOR_ACCESS_ON_DEMAND) && length) {
+		args.pinned_bytes = ((start + length + RDMA_MONITOR_PAGE_SIZE - 1) &
+				     ~((__u64)RDMA_MONITOR_PAGE_SIZE - 1)) -
+				    (start & ~((__u64)RDMA_MONITOR_PAGE_SIZE - 1));
+		pinned = __sync_add_and_fetch(&cgroup_stats_entry->mr_pinned_bytes,
+					      args.pinned_bytes);
+		if (pinned > cgroup_stats_entry->mr_pinned_peak)
+			cgroup_stats_entry->mr_pinned_peak = pinned;
+	}
+	bpf_map_update_elem(&mr_reg_inflight, &pid_tgid, &args, BPF_ANY);
+	latency_start(RDMA_MONITOR_MR_REG, RDMA_MONITOR_QP_STATE_NONE);
+
+	if (!cgroup_stats_entry)
+		return 0;
+
+	// Pinned memory quota: a kprobe cannot fail the verb, so the offending
+	// task is signalled (if configured) before it gets to use the MR
+	config = get_config(&slot);
+	if (!config)
+		return 0;
+
+	max_pinned_bytes = config->max_pinned_bytes;
+	override = get_override(cgroup_id, slot);
+	if (override && (override->mask & CGROUP_OVERRIDE_PINNED_BYTES))
+		max_pinned_bytes = override->max_pinned_bytes;
+
+	if (max_pinned_bytes && pinned > max_pinned_bytes) {
+		__sync_fetch_and_add(&cgroup_stats_entry->mr_quota_violations, 1);
+		if (config->quota_signal)
+			bpf_send_signal(config->quota_signal);
+	}
+
+	return 0;
+}
+
+SEC("kretprobe/mlx5_ib_reg_user_mr")
+int BPF_KRETPROBE(ib_reg_user_mr_ret, struct ib_mr *mr)
+{
+	__u64 pid_tgid = bpf_get_current_pid_tgid();
+	struct cgroup_stats *cgroup_stats_entry;
+	struct mr_reg_args *args;
+	struct mr_owner owner = {};
+	__u64 mr_key = (__u64)mr;
+	__u64 va, len;
+	struct event *e;
+
+	latency_end();
+
+	args = bpf_map_lookup_elem(&mr_reg_inflight, &pid_tgid);
+	if (!args)
+		return 0;
+
+	owner.cgroup_id = args->cgroup_id;
+	owner.pinned_bytes = args->pinned_bytes;
+	owner.access_flags = args->access_flags;
+	va = args->va;
+	len = args->len;
+	bpf_map_delete_elem(&mr_reg_inflight, &pid_tgid);
+
+	cgroup_stats_entry = bpf_map_lookup_elem(&cgroup_stats, &owner.cgroup_id);
+
+	// ERR_PTR() on failure, nothing got pinned
+	if (!mr || mr_key >= (__u64)-4095) {
+		if (cgroup_stats_entry && owner.pinned_bytes)
+			__sync_fetch_and_sub(&cgroup_stats_entry->mr_pinned_bytes, owner.pinned_bytes);
+		return 0;
 	}
 
+	e = trace_reserve(owner.cgroup_id, RDMA_MONITOR_MR_REG);
+	if (e) {
+		e->mr.va = va;
+		e->mr.len = len;
+		e->mr.rkey = BPF_CORE_READ(mr, rkey);
+		e->mr.access_flags = owner.access_flags;
+		bpf_ringbuf_submit(e, 0);
+	}
+
+	bpf_map_update_elem(&mr_owners, &mr_key, &owner, BPF_ANY);
+
 	return 0;
 }
 
 SEC("kprobe/mlx5_ib_dereg_mr")
-int BPF_KPROBE(ib_dereg_mr)
+int BPF_KPROBE(ib_dereg_mr, struct ib_mr *ibmr)
 {
 	__u32 key = 0;
 	struct resource_stats *stats;
 	__u64 cgroup_id = get_cgroup_id();
 	struct cgroup_stats *cgroup_stats_entry;
 	struct cgroup_stats new_cgroup_stats = {};
+	struct mr_owner *owner;
+	__u64 mr_key = (__u64)ibmr;
 
 	// Update global resource count
 	stats = bpf_map_lookup_elem(&resource_counts, &key);
@@ -286,6 +657,15 @@ int BPF_KPROBE(ib_dereg_mr)
 		}
 	}
 
+	// Uncharge the cgroup that registered the MR, which need not be the caller
+	owner = bpf_map_lookup_elem(&mr_owners, &mr_key);
+	if (owner) {
+		cgroup_stats_entry = bpf_map_lookup_elem(&cgroup_stats, &owner->cgroup_id);
+		if (cgroup_stats_entry && cgroup_stats_entry->mr_pinned_bytes >= owner->pinned_bytes)
+			__sync_fetch_and_sub(&cgroup_stats_entry->mr_pinned_bytes, owner->pinned_bytes);
+		bpf_map_delete_elem(&mr_owners, &mr_key);
+	}
+
 	// Update per-cgroup statistics
 	cgroup_stats_entry = bpf_map_lookup_elem(&cgroup_stats, &cgroup_id);
 	if (cgroup_stats_entry) {
@@ -337,11 +717,12 @@ int BPF_KPROBE(ib_gid_query2)
 }
 
 SEC("tracepoint/rdma_cma/cm_send_req")
-int BPF_PROG(cm_send_req, u64 cm_id, u64 qp, u64 srcaddr, u64 dstaddr)
+int cm_send_req(struct cm_send_req_ctx *ctx)
 {
 	__u64 cgroup_id = get_cgroup_id();
 	struct cgroup_stats *cgroup_stats_entry;
 	struct cgroup_stats new_cgroup_stats = {};
+	struct event *e;
 
 	// Update per-cgroup statistics
 	cgroup_stats_entry = bpf_map_lookup_elem(&cgroup_stats, &cgroup_id);
@@ -352,5 +733,15 @@ int BPF_PROG(cm_send_req, u64 cm_id, u64 qp, u64 srcaddr, u64 dstaddr)
 		bpf_map_update_elem(&cgroup_stats, &cgroup_id, &new_cgroup_stats, BPF_ANY);
 	}
 
+	e = trace_reserve(cgroup_id, RDMA_MONITOR_CM_SEND_REQ);
+	if (!e)
+		return 0;
+
+	e->cm.cm_id = ctx->cm_id;
+	e->cm.qpn = ctx->qp_num;
+	__builtin_memcpy(e->cm.srcaddr, ctx->srcaddr, sizeof(e->cm.srcaddr));
+	__builtin_memcpy(e->cm.dstaddr, ctx->dstaddr, sizeof(e->cm.dstaddr));
+	bpf_ringbuf_submit(e, 0);
+
 	return 0;
 }
\ No newline at end of file
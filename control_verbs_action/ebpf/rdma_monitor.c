@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
 /* Copyright (c) 2020 Facebook */
+#define _GNU_SOURCE
 #include <argp.h>
 #include <signal.h>
 #include <stdio.h>
@@ -12,29 +13,85 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include "rdma_monitor.h"
+#include "mtrdma_arbiter.h"
 #include "rdma_monitor.skel.h"
 
 static volatile bool exiting = false;
 static unsigned long output_interval = 1; // 默认输出间隔为1秒
 static char config_file[256] = "config.txt"; // 默认配置文件
+static char trace_file[256] = ""; // Binary event log, disabled when empty
+static FILE *trace_fp = NULL;
+static unsigned long long trace_records = 0;
+static bool mtrdma_enabled = false; // Also own the MTRDMA shared memory and run data path arbitration
+
+// NIC capacity model for MTRDMA arbitration (ConnectX-5 100G)
+static struct mtrdma_nic_model nic_model = {
+	.qps_capa = 8,
+	.max_msg_rate = 12400,
+	.link_bw = 100000,
+	.resp_rd_atomic_capa = 256,
+};
+
+// Event loop sources
+enum loop_source {
+	LOOP_RINGBUF,
+	LOOP_CONFIG_WATCH,
+	LOOP_STATS_TIMER,
+	LOOP_ARBITER_TIMER,
+};
 
 // Global variable to store previous resource counts for change detection
 static struct resource_stats prev_stats = {0, 0, 0, 0};
 
+// A CGROUP line of the config file, resolved to the id the kernel sees
+struct config_override_entry {
+	char path[PATH_MAX];
+	__u64 cgroup_id;
+	struct cgroup_override override;
+};
+
 // Interception configuration
 static struct interception_config intercept_config = {0};
+static struct config_override_entry cgroup_overrides[MAX_CGROUPS];
+static int cgroup_override_num = 0;
+static __u64 config_gen = 0;
+
+// MTRDMA tenant (one per process using the provider) resolved to its cgroup
+struct tenant_map_entry {
+	__u32 tenant_id;
+	__s32 pid;
+	__u64 cgroup_id;
+};
+
+static struct tenant_map_entry tenant_map[MAX_TENANT_NUM];
+static int tenant_map_num = 0;
 
 // Function declarations
 static void print_separator();
 static void print_timestamp();
-static int parse_config_file(const char *filename);
+static int parse_config_file(const char *filename, struct interception_config *config,
+			     struct config_override_entry *overrides, int *override_num);
+static int parse_size(const char *str, __u64 *bytes);
+static int reload_config(struct rdma_monitor_bpf *skel);
+static int setup_config_watch(const char *filename);
+static bool config_file_changed(int inotify_fd, const char *filename);
+static int open_trace_file(const char *filename);
 static bool should_intercept_resource(enum rdma_resource_type resource_type, unsigned long resource_count);
 static bool should_intercept_frequency(enum rdma_monitor_type verb_type, unsigned long frequency);
+static bool should_intercept_pinned(__u64 cgroup_id, unsigned long long pinned_bytes);
 static void print_interception_config();
 static void print_resource_counts(struct resource_stats *stats);
 static void print_cgroup_stats(int cgroup_map_fd, int resource_map_fd);
 static void print_frequency_stats(struct resource_stats *current_stats, struct resource_stats *prev_stats_copy);
+static void print_latency_stats(int hist_map_fd);
+static void refresh_tenant_map(void);
+static void print_cgroup_tenants(__u64 cgroup_id);
+static void print_mtrdma_state(void);
 
 // Function to parse command line arguments
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
@@ -48,6 +105,13 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 		strncpy(config_file, arg, sizeof(config_file) - 1);
 		config_file[sizeof(config_file) - 1] = '\0';
 		break;
+	case 'o':
+		strncpy(trace_file, arg, sizeof(trace_file) - 1);
+		trace_file[sizeof(trace_file) - 1] = '\0';
+		break;
+	case 'm':
+		mtrdma_enabled = true;
+		break;
 	case ARGP_KEY_ARG:
 		argp_usage(state);
 		break;
@@ -62,6 +126,8 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 static struct argp_option options[] = {
 	{ "interval", 'i', "SECONDS", 0, "Output interval in seconds (default: 1)" },
 	{ "config", 'c', "CONFIG_FILE", 0, "Configuration file path (default: config.txt)" },
+	{ "output", 'o', "TRACE_FILE", 0, "Write sampled control events to a binary log (see TRACE_SAMPLE_RATE)" },
+	{ "mtrdma", 'm', NULL, 0, "Own the MTRDMA shared memory and run data path arbitration (replaces mtrdma_main)" },
 	{},
 };
 
@@ -88,22 +154,138 @@ static void print_timestamp() {
 	printf("[%s] ", timestamp);
 }
 
-// Function to parse configuration file
-static int parse_config_file(const char *filename) {
+// Function to parse a byte count with an optional K/M/G suffix
+static int parse_size(const char *str, __u64 *bytes) {
+	char *end;
+	unsigned long long value = strtoull(str, &end, 10);
+
+	if (end == str)
+		return -1;
+
+	switch (*end) {
+	case 'G': case 'g':
+		value <<= 10;
+		/* fallthrough */
+	case 'M': case 'm':
+		value <<= 10;
+		/* fallthrough */
+	case 'K': case 'k':
+		value <<= 10;
+		end++;
+		break;
+	default:
+		break;
+	}
+
+	if (*end != '\0' && *end != '\n' && *end != ' ' && *end != '\t' && *end != '#')
+		return -1;
+
+	*bytes = value;
+	return 0;
+}
+
+// Function to resolve a cgroup v2 directory to the kernfs id seen by get_cgroup_id()
+static int resolve_cgroup_id(const char *path, __u64 *cgroup_id) {
+	char full_path[PATH_MAX];
+	char handle_buf[sizeof(struct file_handle) + sizeof(__u64)] __attribute__((aligned(8)));
+	struct file_handle *handle = (struct file_handle *)handle_buf;
+	int mount_id;
+
+	// Relative paths are taken from the cgroup2 mount point
+	if (path[0] != '/')
+		snprintf(full_path, sizeof(full_path), "/sys/fs/cgroup/%s", path);
+	else
+		snprintf(full_path, sizeof(full_path), "%s", path);
+
+	handle->handle_bytes = sizeof(__u64);
+	if (name_to_handle_at(AT_FDCWD, full_path, handle, &mount_id, 0) < 0)
+		return -errno;
+
+	memcpy(cgroup_id, handle->f_handle, sizeof(*cgroup_id));
+	return 0;
+}
+
+// Function to apply one NAME VALUE setting to the global config or to a cgroup override
+static int parse_setting(const char *name, const char *value_str, struct interception_config *config,
+			 struct cgroup_override *override) {
+	long value;
+
+	// Memory quota settings take sizes rather than plain counts
+	if (strcmp(name, "MR_PINNED_BYTES") == 0) {
+		__u64 bytes;
+
+		if (parse_size(value_str, &bytes))
+			return -EINVAL;
+		if (override) {
+			override->max_pinned_bytes = bytes;
+			override->mask |= CGROUP_OVERRIDE_PINNED_BYTES;
+		} else {
+			config->max_pinned_bytes = bytes;
+		}
+		return 0;
+	}
+
+	if (sscanf(value_str, "%ld", &value) != 1 || value < 0)
+		return -EINVAL;
+
+	if (strcmp(name, "TRACE_SAMPLE_RATE") == 0) {
+		if (value > UINT_MAX)
+			return -EINVAL;
+		if (override) {
+			override->trace_sample_rate = value;
+			override->mask |= CGROUP_OVERRIDE_SAMPLE_RATE;
+		} else {
+			config->trace_sample_rate = value;
+		}
+		return 0;
+	}
+
+	// Everything below is global only
+	if (override)
+		return -ENOTSUP;
+
+	if (strcmp(name, "MR_QUOTA_SIGNAL") == 0) {
+		if (value >= NSIG)
+			return -EINVAL;
+		config->quota_signal = value;
+		return 0;
+	}
+
+	// Check if it's a resource type
+	for (int i = 0; i < RDMA_RESOURCE_MAX; i++) {
+		if (strcmp(name, rdma_resource_names[i]) == 0) {
+			config->max_resource_count[i] = value;
+			return 0;
+		}
+	}
+
+	// If not a resource type, check if it's a verb type
+	for (int i = 0; i < RDMA_MONITOR_TYPE_MAX; i++) {
+		if (strcmp(name, rdma_verb_names[i]) == 0) {
+			config->max_frequency[i] = value;
+			return 0;
+		}
+	}
+
+	return -ENOENT;
+}
+
+// Function to parse configuration file, returns the number of invalid lines or -1
+static int parse_config_file(const char *filename, struct interception_config *config,
+			     struct config_override_entry *overrides, int *override_num) {
+	int errors = 0;
+
+	// Unset thresholds stay disabled
+	memset(config, 0, sizeof(*config));
+	*override_num = 0;
+
 	FILE *file = fopen(filename, "r");
 	if (!file) {
 		fprintf(stderr, "Warning: Could not open config file %s, using default thresholds\n", filename);
-		// Set default thresholds
-		for (int i = 0; i < RDMA_RESOURCE_MAX; i++) {
-			intercept_config.max_resource_count[i] = 0;  // Disable by default
-		}
-		for (int i = 0; i < RDMA_MONITOR_TYPE_MAX; i++) {
-			intercept_config.max_frequency[i] = 0;  // Disable by default
-		}
 		return -1;
 	}
 
-	char line[256];
+	char line[PATH_MAX + 64];
 	while (fgets(line, sizeof(line), file)) {
 		// Skip comments and empty lines
 		if (line[0] == '#' || line[0] == '\n') {
@@ -111,42 +293,70 @@ static int parse_config_file(const char *filename) {
 		}
 
 		char name[32];
-		long value;
-		int matched = sscanf(line, "%31s %ld", name, &value);
-		
-		if (matched != 2) {
-			fprintf(stderr, "Warning: Invalid config line: %s", line);
-			continue;
-		}
+		char value_str[32];
+		char path[PATH_MAX];
+		struct cgroup_override *override = NULL;
+		int matched, err;
 
-		// Check if it's a resource type
-		bool found = false;
-		for (int i = 0; i < RDMA_RESOURCE_MAX; i++) {
-			if (strcmp(name, rdma_resource_names[i]) == 0) {
-				intercept_config.max_resource_count[i] = value;
-				found = true;
-				break;
+		// CGROUP <path> <NAME> <VALUE> overrides a setting for one cgroup
+		if (strncmp(line, "CGROUP", 6) == 0 && (line[6] == ' ' || line[6] == '\t')) {
+			__u64 cgroup_id;
+			int i;
+
+			matched = sscanf(line, "CGROUP %4095s %31s %31s", path, name, value_str);
+			if (matched != 3) {
+				fprintf(stderr, "Warning: Invalid config line: %s", line);
+				errors++;
+				continue;
 			}
-		}
-		
-		// If not a resource type, check if it's a verb type
-		if (!found) {
-			for (int i = 0; i < RDMA_MONITOR_TYPE_MAX; i++) {
-				if (strcmp(name, rdma_verb_names[i]) == 0) {
-					intercept_config.max_frequency[i] = value;
-					found = true;
+
+			err = resolve_cgroup_id(path, &cgroup_id);
+			if (err) {
+				fprintf(stderr, "Warning: Cannot resolve cgroup %s: %s\n", path, strerror(-err));
+				errors++;
+				continue;
+			}
+
+			for (i = 0; i < *override_num; i++) {
+				if (overrides[i].cgroup_id == cgroup_id)
 					break;
+			}
+			if (i == *override_num) {
+				if (*override_num == MAX_CGROUPS) {
+					fprintf(stderr, "Warning: More than %d cgroup overrides, ignoring: %s", MAX_CGROUPS, line);
+					errors++;
+					continue;
 				}
+				memset(&overrides[i], 0, sizeof(overrides[i]));
+				snprintf(overrides[i].path, sizeof(overrides[i].path), "%s", path);
+				overrides[i].cgroup_id = cgroup_id;
+				(*override_num)++;
+			}
+			override = &overrides[i].override;
+		} else {
+			matched = sscanf(line, "%31s %31s", name, value_str);
+			if (matched != 2) {
+				fprintf(stderr, "Warning: Invalid config line: %s", line);
+				errors++;
+				continue;
 			}
 		}
 
-		if (!found) {
+		err = parse_setting(name, value_str, config, override);
+		if (err == -ENOENT) {
 			fprintf(stderr, "Warning: Unknown name in config: %s\n", name);
+			errors++;
+		} else if (err == -ENOTSUP) {
+			fprintf(stderr, "Warning: %s cannot be overridden per cgroup\n", name);
+			errors++;
+		} else if (err) {
+			fprintf(stderr, "Warning: Invalid value in config: %s", line);
+			errors++;
 		}
 	}
 
 	fclose(file);
-	return 0;
+	return errors;
 }
 
 // Function to check if resource count based interception is needed
@@ -167,44 +377,69 @@ static bool should_intercept_frequency(enum rdma_monitor_type verb_type, unsigne
 	return false;
 }
 
+// Function to check if a cgroup's pinned MR memory exceeds the quota
+static bool should_intercept_pinned(__u64 cgroup_id, unsigned long long pinned_bytes) {
+	__u64 max_pinned_bytes = intercept_config.max_pinned_bytes;
+	
+	for (int i = 0; i < cgroup_override_num; i++) {
+		if (cgroup_overrides[i].cgroup_id == cgroup_id &&
+		    (cgroup_overrides[i].override.mask & CGROUP_OVERRIDE_PINNED_BYTES)) {
+			max_pinned_bytes = cgroup_overrides[i].override.max_pinned_bytes;
+			break;
+		}
+	}
+	
+	return max_pinned_bytes > 0 && pinned_bytes > max_pinned_bytes;
+}
+
 static void sig_handler(int sig)
 {
 	exiting = true;
 }
 
+// Function to open the binary event log and write its header
+static int open_trace_file(const char *filename) {
+	struct rdma_trace_header hdr = {};
+	struct timespec mono, real;
+
+	trace_fp = fopen(filename, "wb");
+	if (!trace_fp) {
+		fprintf(stderr, "Failed to open trace file %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+
+	// Records are fixed size and only ever appended, let stdio batch the writes
+	setvbuf(trace_fp, NULL, _IOFBF, 1 << 20);
+
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_REALTIME, &real);
+
+	memcpy(hdr.magic, RDMA_TRACE_MAGIC, sizeof(RDMA_TRACE_MAGIC));
+	hdr.version = RDMA_TRACE_VERSION;
+	hdr.record_size = sizeof(struct event);
+	hdr.realtime_offset_ns = (real.tv_sec - mono.tv_sec) * 1000000000ULL + real.tv_nsec - mono.tv_nsec;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, trace_fp) != 1) {
+		fprintf(stderr, "Failed to write trace header: %s\n", strerror(errno));
+		fclose(trace_fp);
+		trace_fp = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
 static int handle_event(void *ctx, void *data, size_t data_sz)
 {
-	// const struct event *e = data; // 注释掉未使用的变量
-	// char gid[33]; // Commented out as it's not used
+	if (!trace_fp || data_sz < sizeof(struct event))
+		return 0;
 
-	/* 注释掉详细的事件输出 */
-	/*
-	printf("%-16s %-8d %-32s", e->comm, e->pid, rdma_monitor_tpye_str(e->type));
-	switch (e->type)
-	{
-	case RDMA_MONITOR_QP_CREATE:
-		//printf("QPN: %-16d DQPN: %-16d FUNc: 1", e->qp.qpn, e->qp.dest_qpn);
-		break;
-	case RDMA_MONITOR_QP_MODIFY:
-		// gid_to_wire_gid(&e->qp.gid, gid);
-		printf("QPN: %-16d DQPN: %-16d FUNc: 1\n", e->qp.qpn, e->qp.dest_qpn);
-		break;
-	case RDMA_MONITOR_MR_REG:
-		// printf("VA: %-16llx LEN: %-16llu", e->mr.va, e->mr.len);
-		break;
-	case RDMA_MONITOR_CM_SEND_REQ:
-		// printf("CM ID: %-16d QPN: %-16d src: %s dst: %s", e->cm.cm_id, e->cm.qpn, e->cm.srcaddr, e->cm.dstaddr);
-		break;
-	case RDMA_MONITOR_GID_QUERY:
-		
-	// printf("CM ID: %-16d QPN: %-16d src: %s dst: %s", e->cm.cm_id, e->cm.qpn, e->cm.srcaddr, e->cm.dstaddr);
-		break;
-	default:
-		break;
+	// Stored verbatim, rdma_trace_decode turns the log back into text
+	if (fwrite(data, sizeof(struct event), 1, trace_fp) != 1) {
+		fprintf(stderr, "Failed to write trace record: %s\n", strerror(errno));
+		return -errno;
 	}
-	*/
-
-	// printf("\n");
+	trace_records++;
 
 	return 0;
 }
@@ -233,6 +468,41 @@ static void print_interception_config() {
 		}
 	}
 	
+	// Print pinned memory quota
+	printf("Pinned MR Memory Quota (per cgroup):\n");
+	if (intercept_config.max_pinned_bytes > 0) {
+		printf("  %-15s: >%llu bytes (%s)\n", "MR_PINNED_BYTES",
+		       (unsigned long long)intercept_config.max_pinned_bytes,
+		       intercept_config.quota_signal ? strsignal(intercept_config.quota_signal) : "account only");
+	} else {
+		printf("  %-15s: DISABLED\n", "MR_PINNED_BYTES");
+	}
+	
+	// Print event streaming config
+	printf("Event Streaming:\n");
+	if (intercept_config.trace_sample_rate > 0) {
+		printf("  %-15s: 1/%u per cgroup -> %s\n", "TRACE_SAMPLE_RATE",
+		       intercept_config.trace_sample_rate, trace_file);
+	} else {
+		printf("  %-15s: DISABLED\n", "TRACE_SAMPLE_RATE");
+	}
+	
+	// Print per-cgroup overrides
+	if (cgroup_override_num > 0) {
+		printf("Per-Cgroup Overrides:\n");
+		for (int i = 0; i < cgroup_override_num; i++) {
+			const struct cgroup_override *ov = &cgroup_overrides[i].override;
+			
+			printf("  %s (id %llu)\n", cgroup_overrides[i].path,
+			       (unsigned long long)cgroup_overrides[i].cgroup_id);
+			if (ov->mask & CGROUP_OVERRIDE_PINNED_BYTES)
+				printf("    %-15s: %llu bytes\n", "MR_PINNED_BYTES",
+				       (unsigned long long)ov->max_pinned_bytes);
+			if (ov->mask & CGROUP_OVERRIDE_SAMPLE_RATE)
+				printf("    %-15s: 1/%u\n", "TRACE_SAMPLE_RATE", ov->trace_sample_rate);
+		}
+	}
+	
 	// Print disabled interceptions
 	printf("Disabled Interceptions:\n");
 	bool has_disabled = false;
@@ -306,6 +576,10 @@ static void print_cgroup_stats(int cgroup_map_fd, int resource_map_fd) {
 				}
 			}
 			
+			if (stats.mr_pinned_bytes > 0 || stats.mr_quota_violations > 0) {
+				has_counts = true;
+			}
+			
 			if (has_counts) {
 				if (!has_data) {
 					print_timestamp();
@@ -315,6 +589,8 @@ static void print_cgroup_stats(int cgroup_map_fd, int resource_map_fd) {
 				}
 				
 				printf("CGROUP ID: %llu\n", next_key);
+				if (mtrdma_enabled)
+					print_cgroup_tenants(next_key);
 				for (int i = 0; i < RDMA_MONITOR_TYPE_MAX; i++) {
 					if (stats.counts[i] > 0) {
 						// Check if interception is needed
@@ -372,6 +648,19 @@ static void print_cgroup_stats(int cgroup_map_fd, int resource_map_fd) {
 						}
 					}
 				}
+				
+				// Pinned memory gauge and quota state
+				if (stats.mr_pinned_bytes > 0 || stats.mr_pinned_peak > 0) {
+					printf("  %-25s: %llu (peak %llu)%s\n", "MR_PINNED_BYTES",
+					       stats.mr_pinned_bytes, stats.mr_pinned_peak,
+					       should_intercept_pinned(next_key, stats.mr_pinned_bytes) ? " (*** OVER QUOTA ***)" : "");
+				}
+				if (stats.mr_quota_violations > 0) {
+					printf("  %-25s: %llu\n", "MR_QUOTA_VIOLATIONS", stats.mr_quota_violations);
+				}
+				if (stats.trace_dropped > 0) {
+					printf("  %-25s: %llu\n", "TRACE_DROPPED", stats.trace_dropped);
+				}
 				printf("\n");
 			}
 		}
@@ -414,22 +703,388 @@ static void print_frequency_stats(struct resource_stats *current_stats, struct r
 	printf("\n");
 }
 
+// Function to get the upper bound (ns) of the log2 slot holding the given percentile
+static unsigned long long hist_percentile(const struct latency_hist *hist, double pct) {
+	unsigned long long target = (unsigned long long)(hist->count * pct / 100.0);
+	unsigned long long seen = 0;
+
+	if (target == 0)
+		target = 1;
+
+	for (int i = 0; i < LAT_HIST_SLOTS; i++) {
+		seen += hist->slots[i];
+		if (seen >= target)
+			return 1ULL << (i + 1);
+	}
+	return hist->max_ns;
+}
+
+// Function to print per-cgroup control verb latency (cumulative since start)
+static void print_latency_stats(int hist_map_fd) {
+	static const char *qp_state_names[] = { "RESET", "INIT", "RTR", "RTS", "SQD", "SQE", "ERR" };
+	struct latency_hist_key lookup_key = {}, next_key;
+	struct latency_hist hist;
+	bool has_data = false;
+	bool first = true;
+	
+	while (bpf_map_get_next_key(hist_map_fd, first ? NULL : &lookup_key, &next_key) == 0) {
+		first = false;
+		lookup_key = next_key;
+		if (bpf_map_lookup_elem(hist_map_fd, &next_key, &hist) != 0 || hist.count == 0)
+			continue;
+		
+		if (!has_data) {
+			print_timestamp();
+			printf("Control Verb Latency (kernel side, cumulative):\n");
+			print_separator();
+			printf("%-20s %-12s %-6s %10s %10s %10s %10s %10s\n", "CGROUP ID", "VERB", "STATE",
+			       "CALLS", "AVG(us)", "P50(us)", "P99(us)", "MAX(us)");
+			has_data = true;
+		}
+		
+		printf("%-20llu %-12s %-6s %10llu %10.1f %10.1f %10.1f %10.1f\n", next_key.cgroup_id,
+		       rdma_verb_names[next_key.type < RDMA_MONITOR_TYPE_MAX ? next_key.type : 0],
+		       next_key.qp_state < RDMA_MONITOR_QP_STATE_NONE ? qp_state_names[next_key.qp_state] : "-",
+		       hist.count, hist.sum_ns / 1000.0 / hist.count,
+		       hist_percentile(&hist, 50) / 1000.0, hist_percentile(&hist, 99) / 1000.0,
+		       hist.max_ns / 1000.0);
+	}
+	
+	if (has_data) {
+		print_separator();
+		printf("\n");
+	}
+}
+
 // Function to update interception configuration in eBPF map
 static int update_ebpf_intercept_config(struct rdma_monitor_bpf *skel) {
 	int config_map_fd = bpf_map__fd(skel->maps.intercept_config_map);
+	int gen_map_fd = bpf_map__fd(skel->maps.config_generation);
+	int override_map_fd = bpf_map__fd(skel->maps.cgroup_overrides);
+	struct cgroup_override_key lookup_key, next_key;
+	__u64 next_gen = config_gen + 1;
+	__u32 slot = next_gen % CONFIG_SLOTS;
+	__u32 key = 0;
+	bool first = true;
+	int err;
+	
+	// Fill the slot the kernel is not reading, overrides included, then flip
+	// to it with one store so no event sees a mix of two generations
+	err = bpf_map_update_elem(config_map_fd, &slot, &intercept_config, BPF_ANY);
+	if (err)
+		return err;
+	
+	for (int i = 0; i < cgroup_override_num; i++) {
+		struct cgroup_override_key ov_key = {
+			.cgroup_id = cgroup_overrides[i].cgroup_id,
+			.slot = slot,
+		};
+		
+		err = bpf_map_update_elem(override_map_fd, &ov_key, &cgroup_overrides[i].override, BPF_ANY);
+		if (err)
+			return err;
+	}
+	
+	// Drop the slot's leftovers from the generation before last
+	while (bpf_map_get_next_key(override_map_fd, first ? NULL : &lookup_key, &next_key) == 0) {
+		bool keep = next_key.slot != slot;
+		
+		first = false;
+		for (int i = 0; !keep && i < cgroup_override_num; i++) {
+			if (cgroup_overrides[i].cgroup_id == next_key.cgroup_id)
+				keep = true;
+		}
+		
+		if (keep) {
+			lookup_key = next_key;
+		} else {
+			bpf_map_delete_elem(override_map_fd, &next_key);
+			// Deleting the cursor restarts the walk from the first key
+			first = true;
+		}
+	}
+	
+	err = bpf_map_update_elem(gen_map_fd, &key, &next_gen, BPF_ANY);
+	if (err)
+		return err;
+	config_gen = next_gen;
+	
+	return 0;
+}
+
+// Function to re-read the config file and swap it in if it is valid
+static int reload_config(struct rdma_monitor_bpf *skel) {
+	static struct config_override_entry new_overrides[MAX_CGROUPS];
+	struct interception_config new_config;
+	int new_override_num;
+	int errors, err;
+	
+	errors = parse_config_file(config_file, &new_config, new_overrides, &new_override_num);
+	if (errors) {
+		print_timestamp();
+		printf("Config reload rejected: %s has %s, keeping generation %llu\n", config_file,
+		       errors < 0 ? "gone away" : "invalid lines", (unsigned long long)config_gen);
+		return -EINVAL;
+	}
+	
+	// Streaming stays tied to -o, whatever the file says
+	if (!trace_fp)
+		new_config.trace_sample_rate = 0;
+	else if (!new_config.trace_sample_rate)
+		new_config.trace_sample_rate = 1;
+	
+	intercept_config = new_config;
+	memcpy(cgroup_overrides, new_overrides, sizeof(new_overrides[0]) * new_override_num);
+	cgroup_override_num = new_override_num;
+	
+	err = update_ebpf_intercept_config(skel);
+	if (err) {
+		fprintf(stderr, "Failed to update interception config map: %d\n", err);
+		return err;
+	}
+	
+	print_timestamp();
+	printf("Config reloaded from %s (generation %llu)\n", config_file, (unsigned long long)config_gen);
+	print_interception_config();
+	
+	return 0;
+}
+
+// Function to watch the config file's directory, editors usually replace the file by rename
+static int setup_config_watch(const char *filename) {
+	char dir[PATH_MAX];
+	char *slash;
+	int fd;
+	
+	snprintf(dir, sizeof(dir), "%s", filename);
+	slash = strrchr(dir, '/');
+	if (slash)
+		*slash = '\0';
+	else
+		snprintf(dir, sizeof(dir), ".");
+	
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	
+	if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		int err = -errno;
+		
+		close(fd);
+		return err;
+	}
+	
+	return fd;
+}
+
+// Function to drain pending inotify events, true if one of them is the config file
+static bool config_file_changed(int inotify_fd, const char *filename) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const char *base = strrchr(filename, '/');
+	bool changed = false;
+	ssize_t len;
+	
+	base = base ? base + 1 : filename;
+	
+	while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+		for (char *ptr = buf; ptr < buf + len;) {
+			struct inotify_event *event = (struct inotify_event *)ptr;
+			
+			if (event->len && strcmp(event->name, base) == 0)
+				changed = true;
+			ptr += sizeof(struct inotify_event) + event->len;
+		}
+	}
+	
+	return changed;
+}
+
+// Function to resolve the cgroup v2 membership of a process
+static int resolve_pid_cgroup(pid_t pid, __u64 *cgroup_id) {
+	char path[64], line[PATH_MAX];
+	int err = -ENOENT;
+	FILE *fp;
+	
+	snprintf(path, sizeof(path), "/proc/%d/cgroup", pid);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+	
+	while (fgets(line, sizeof(line), fp)) {
+		// The unified hierarchy is the "0::/path" line
+		if (strncmp(line, "0::", 3) == 0) {
+			line[strcspn(line, "\n")] = '\0';
+			err = resolve_cgroup_id(line[3] == '/' && line[4] ? line + 4 : ".", cgroup_id);
+			break;
+		}
+	}
+	
+	fclose(fp);
+	return err;
+}
+
+// Function to rebuild the tenant to cgroup mapping from the pids tenants registered in the shm
+static void refresh_tenant_map(void) {
+	struct mtrdma_shm_context *shm = mtrdma_arbiter_shm();
+	uint32_t tenant_num = shm->tenant_num;
+	
+	if (tenant_num > MAX_TENANT_NUM)
+		tenant_num = MAX_TENANT_NUM;
+	
+	tenant_map_num = 0;
+	for (uint32_t i = 0; i < tenant_num; i++) {
+		struct tenant_map_entry *entry = &tenant_map[tenant_map_num];
+		
+		entry->pid = shm->tenant_pid[i];
+		// A tenant that died without unregistering leaves its pid behind
+		if (entry->pid <= 0 || (kill(entry->pid, 0) && errno == ESRCH))
+			continue;
+		if (resolve_pid_cgroup(entry->pid, &entry->cgroup_id))
+			continue;
+		entry->tenant_id = i;
+		tenant_map_num++;
+	}
+}
+
+// Function to print the MTRDMA tenants living in a cgroup next to its verb counts
+static void print_cgroup_tenants(__u64 cgroup_id) {
+	struct mtrdma_shm_context *shm = mtrdma_arbiter_shm();
+	unsigned long active_qps = 0;
+	int n = 0;
+	
+	for (int i = 0; i < tenant_map_num; i++) {
+		if (tenant_map[i].cgroup_id != cgroup_id)
+			continue;
+		printf("%s%u", n ? "," : "  MTRDMA Tenants           : ", tenant_map[i].tenant_id);
+		active_qps += shm->active_qps_per_tenant[tenant_map[i].tenant_id];
+		n++;
+	}
+	
+	if (n)
+		printf(" (active QPs %lu, QP limit %u)\n", active_qps, shm->max_qps_limit);
+	
+	for (int i = 0; i < tenant_map_num; i++) {
+		uint32_t id = tenant_map[i].tenant_id;
+		
+		if (tenant_map[i].cgroup_id != cgroup_id || !shm->rd_atomic_qps_per_tenant[id])
+			continue;
+		printf("  Tenant %-4u RD/Atomic    : resp %u, req %u over %u QPs, cap %u\n", id,
+		       shm->resp_rd_atomic_per_tenant[id], shm->req_rd_atomic_per_tenant[id],
+		       shm->rd_atomic_qps_per_tenant[id], shm->rd_atomic_limit[id]);
+	}
+	
+	for (int i = 0; i < tenant_map_num; i++) {
+		uint32_t id = tenant_map[i].tenant_id;
+		
+		if (tenant_map[i].cgroup_id != cgroup_id ||
+		    (!shm->rq_starved_per_tenant[id] && !shm->sq_stalled_per_tenant[id] &&
+		     !shm->rnr_retry_exc_per_tenant[id] && !shm->rnr_throttle[id]))
+			continue;
+		printf("  Tenant %-4u RNR          : starved RQs %u, stalled SQs %u, retry exceeded %llu, refill 1/%u\n", id,
+		       shm->rq_starved_per_tenant[id], shm->sq_stalled_per_tenant[id],
+		       (unsigned long long)shm->rnr_retry_exc_per_tenant[id],
+		       1U << shm->rnr_throttle[id]);
+	}
+	
+	for (int i = 0; i < tenant_map_num; i++) {
+		static const char *const class_name[] = { "default", "latency", "bulk" };
+		uint32_t id = tenant_map[i].tenant_id;
+		uint64_t db = shm->uar_db_per_tenant[id];
+		
+		if (tenant_map[i].cgroup_id != cgroup_id ||
+		    (!db && !shm->tenant_class[id]))
+			continue;
+		printf("  Tenant %-4u UAR          : %s, shared bfreg doorbells %llu, contended %.2f%%\n", id,
+		       shm->tenant_class[id] < 3 ? class_name[shm->tenant_class[id]] : "?",
+		       (unsigned long long)db,
+		       db ? 100.0 * shm->uar_contended_per_tenant[id] / db : 0.0);
+	}
+}
+
+// Function to print the data path arbitration state
+static void print_mtrdma_state(void) {
+	struct mtrdma_shm_context *shm = mtrdma_arbiter_shm();
+	
+	print_timestamp();
+	printf("MTRDMA Data Path Arbitration:\n");
+	print_separator();
+	printf("Registered Tenants: %u\n", shm->tenant_num);
+	printf("Mapped Tenants:     %d\n", tenant_map_num);
+	printf("Active Tenants:     %u\n", shm->active_tenant_num);
+	printf("Active QPs:         %llu\n", (unsigned long long)shm->active_qps_num);
+	printf("Active RR Tenants:  %u\n", shm->active_rrtenant_num);
+	printf("Starved RQ Tenants: %u\n", shm->starved_rqtenant_num);
+	printf("MAX_QPS_LIMIT:      %u\n", shm->max_qps_limit);
+	print_separator();
+	printf("\n");
+}
+
+// Function to create a periodic timerfd, the first expiry comes after one period
+static int setup_timer(unsigned long long period_ns) {
+	struct itimerspec its = {
+		.it_interval = { period_ns / 1000000000ULL, period_ns % 1000000000ULL },
+		.it_value = { period_ns / 1000000000ULL, period_ns % 1000000000ULL },
+	};
+	int fd;
+	
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	
+	if (timerfd_settime(fd, 0, &its, NULL) < 0) {
+		int err = -errno;
+		
+		close(fd);
+		return err;
+	}
+	
+	return fd;
+}
+
+// Function to register an fd with the event loop
+static int loop_add(int epoll_fd, int fd, enum loop_source source) {
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.u32 = source,
+	};
+	
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		return -errno;
+	return 0;
+}
+
+// Function to print all statistics for one output interval
+static void print_stats(int map_fd, int cgroup_map_fd, int hist_map_fd, struct resource_stats *prev_stats_copy) {
+	struct resource_stats stats;
 	__u32 key = 0;
 	
-	return bpf_map_update_elem(config_map_fd, &key, &intercept_config, BPF_ANY);
+	if (bpf_map_lookup_elem(map_fd, &key, &stats) != 0)
+		return;
+	
+	if (mtrdma_enabled)
+		refresh_tenant_map();
+	
+	print_resource_counts(&stats);
+	print_cgroup_stats(cgroup_map_fd, map_fd);
+	print_frequency_stats(&stats, prev_stats_copy);
+	print_latency_stats(hist_map_fd);
+	if (mtrdma_enabled)
+		print_mtrdma_state();
+	
+	// Update previous stats copy for next frequency calculation
+	*prev_stats_copy = stats;
 }
 
 int main(int argc, char **argv)
 {
 	struct ring_buffer *rb = NULL;
 	struct rdma_monitor_bpf *skel;
-	struct resource_stats stats, prev_stats_copy;
+	struct resource_stats prev_stats_copy;
+	struct epoll_event events[8];
 	int err;
-	int map_fd, cgroup_map_fd;
-	time_t last_output_time = 0;
+	int map_fd, cgroup_map_fd, hist_map_fd;
+	int config_watch_fd = -1;
+	int epoll_fd = -1, stats_timer_fd = -1, arbiter_timer_fd = -1;
 
 	/* Parse command line arguments */
 	err = argp_parse(&argp, argc, argv, 0, NULL, NULL);
@@ -437,12 +1092,26 @@ int main(int argc, char **argv)
 		return err;
 
 	/* Parse configuration file - 只读取但不使用拦截配置 */
-	parse_config_file(config_file);
+	parse_config_file(config_file, &intercept_config, cgroup_overrides, &cgroup_override_num);
+
+	/* Sampled events are only streamed when there is a log to write them to */
+	if (trace_file[0]) {
+		if (open_trace_file(trace_file))
+			return 1;
+		if (!intercept_config.trace_sample_rate)
+			intercept_config.trace_sample_rate = 1;
+	} else {
+		intercept_config.trace_sample_rate = 0;
+	}
 
 	/* Cleaner handling of Ctrl-C */
 	signal(SIGINT, sig_handler);
 	signal(SIGTERM, sig_handler);
 
+	/* Create the MTRDMA shm before any tenant starts, tenants attach to it on load */
+	if (mtrdma_enabled && mtrdma_arbiter_init(&nic_model))
+		return 1;
+
 	/* Load and verify BPF application */
 	skel = rdma_monitor_bpf__open();
 	if (!skel)
@@ -476,65 +1145,127 @@ int main(int argc, char **argv)
 		goto cleanup;
 	}
 
+	/* Push the parsed configuration so the kernel accounts the pinned memory quota */
+	err = update_ebpf_intercept_config(skel);
+	if (err)
+	{
+		fprintf(stderr, "Failed to update interception config map\n");
+		goto cleanup;
+	}
+	
+	/* Reload the config whenever the file is rewritten, without losing in-kernel counters */
+	config_watch_fd = setup_config_watch(config_file);
+	if (config_watch_fd < 0)
+		fprintf(stderr, "Warning: Cannot watch %s, config hot reload disabled: %s\n", config_file,
+			strerror(-config_watch_fd));
+	
+	/* One loop serves events, config changes, the output interval and arbitration */
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	stats_timer_fd = setup_timer(output_interval * 1000000000ULL);
+	if (mtrdma_enabled)
+		arbiter_timer_fd = setup_timer(QPS_CHECK_INTERVAL * 1000ULL);
+	if (epoll_fd < 0 || stats_timer_fd < 0 || (mtrdma_enabled && arbiter_timer_fd < 0) ||
+	    loop_add(epoll_fd, ring_buffer__epoll_fd(rb), LOOP_RINGBUF) ||
+	    loop_add(epoll_fd, stats_timer_fd, LOOP_STATS_TIMER) ||
+	    (config_watch_fd >= 0 && loop_add(epoll_fd, config_watch_fd, LOOP_CONFIG_WATCH)) ||
+	    (arbiter_timer_fd >= 0 && loop_add(epoll_fd, arbiter_timer_fd, LOOP_ARBITER_TIMER)))
+	{
+		err = -1;
+		fprintf(stderr, "Failed to set up event loop\n");
+		goto cleanup;
+	}
+	
 	/* Get map file descriptor for resource counts */
 	map_fd = bpf_map__fd(skel->maps.resource_counts);
 	cgroup_map_fd = bpf_map__fd(skel->maps.cgroup_stats);
+	hist_map_fd = bpf_map__fd(skel->maps.latency_hists);
 
 	/* Process events */
 	printf("RDMA Control Path Monitor Started (interval: %lu seconds)\n", output_interval);
+	if (mtrdma_enabled)
+		printf("MTRDMA arbitration on %s (QPS_CAPA: %u, LINK_BW: %llu Mbps, MSG_RATE: %u Kpps, RESP_RD_ATOMIC: %u)\n",
+		       MTRDMA_SHM_NAME, nic_model.qps_capa, (unsigned long long)nic_model.link_bw,
+		       nic_model.max_msg_rate, nic_model.resp_rd_atomic_capa);
 	print_separator();
 	printf("\n");
 	
 	// Print interception configuration - 但说明拦截已禁用
 	printf("NOTE: Interception is DISABLED. Only monitoring is active.\n");
+	if (intercept_config.max_pinned_bytes > 0) {
+		printf("NOTE: Pinned MR memory quota of %llu bytes per cgroup is accounted in the kernel (signal if MR_QUOTA_SIGNAL is set).\n",
+		       (unsigned long long)intercept_config.max_pinned_bytes);
+	}
 	print_separator();
 	printf("\n");
 	
 	// Initialize previous stats copy
 	prev_stats_copy = (struct resource_stats){0, 0, 0, 0};
 	
+	print_stats(map_fd, cgroup_map_fd, hist_map_fd, &prev_stats_copy);
+	
 	while (!exiting)
 	{
-		err = ring_buffer__poll(rb, 100 /* timeout, ms */);
-		/* Ctrl-C will cause -EINTR */
-		if (err == -EINTR)
-		{
-			err = 0;
-			break;
-		}
-		if (err < 0)
+		int n = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), -1);
+		/* Ctrl-C will cause EINTR */
+		if (n < 0)
 		{
-			printf("Error polling perf buffer: %d\n", err);
+			err = errno == EINTR ? 0 : -errno;
+			if (err)
+				printf("Error waiting for events: %d\n", err);
 			break;
 		}
 		
-		/* Check if it's time to output statistics */
-		time_t current_time = time(NULL);
-		if (current_time - last_output_time >= (time_t)output_interval) {
-			/* Check and display current resource counts */
-			__u32 key = 0;
-			if (bpf_map_lookup_elem(map_fd, &key, &stats) == 0) {
-				print_resource_counts(&stats);
-				print_cgroup_stats(cgroup_map_fd, map_fd);
-				print_frequency_stats(&stats, &prev_stats_copy);
-				
-				// Update previous stats copy for next frequency calculation
-				prev_stats_copy = stats;
-			}
+		for (int i = 0; i < n; i++) {
+			__u64 expirations;
 			
-			last_output_time = current_time;
+			switch (events[i].data.u32) {
+			case LOOP_RINGBUF:
+				err = ring_buffer__consume(rb);
+				if (err < 0)
+					printf("Error consuming ring buffer: %d\n", err);
+				break;
+			case LOOP_CONFIG_WATCH:
+				if (config_file_changed(config_watch_fd, config_file))
+					reload_config(skel);
+				break;
+			case LOOP_ARBITER_TIMER:
+				if (read(arbiter_timer_fd, &expirations, sizeof(expirations)) > 0)
+					mtrdma_arbiter_tick();
+				break;
+			case LOOP_STATS_TIMER:
+				if (read(stats_timer_fd, &expirations, sizeof(expirations)) > 0)
+					print_stats(map_fd, cgroup_map_fd, hist_map_fd, &prev_stats_copy);
+				break;
+			}
 		}
 	}
 	
+	/* Drain what is left in the ring buffer before closing the log */
+	if (trace_fp)
+		ring_buffer__consume(rb);
+	
 	print_separator();
 	print_timestamp();
 	printf("RDMA Control Path Monitor Stopped\n");
+	if (trace_fp)
+		printf("%llu events written to %s\n", trace_records, trace_file);
 	print_separator();
 
 cleanup:
 	/* Clean up */
 	ring_buffer__free(rb);
 	rdma_monitor_bpf__destroy(skel);
+	if (trace_fp)
+		fclose(trace_fp);
+	if (config_watch_fd >= 0)
+		close(config_watch_fd);
+	if (stats_timer_fd >= 0)
+		close(stats_timer_fd);
+	if (arbiter_timer_fd >= 0)
+		close(arbiter_timer_fd);
+	if (epoll_fd >= 0)
+		close(epoll_fd);
+	mtrdma_arbiter_cleanup();
 
 	return err < 0 ? -err : 0;
 }
\ No newline at end of file
@@ -8,6 +8,23 @@
 #define MAX_CGROUPS 64
 #define MAX_VERBS 11
 #define MAX_RESOURCES 4
+#define MAX_TRACKED_MRS 65536
+
+#define RDMA_MONITOR_PAGE_SIZE 4096
+// IB_ACCESS_ON_DEMAND: ODP MRs are faulted in lazily and do not pin memory
+#define RDMA_MONITOR_ACCESS_ON_DEMAND (1 << 6)
+
+// enum ib_qp_attr_mask bits read from ib_modify_qp attributes
+#define RDMA_MONITOR_QP_ATTR_STATE (1 << 0)
+#define RDMA_MONITOR_QP_ATTR_DEST_QPN (1 << 20)
+
+// Latency histograms: log2(ns) slots, and the state key used for verbs that are not a QP transition
+#define LAT_HIST_SLOTS 32
+#define RDMA_MONITOR_QP_STATE_NONE 7
+
+// Binary event log written by rdma_monitor -o, read by rdma_trace_decode
+#define RDMA_TRACE_MAGIC "RDMATRC"
+#define RDMA_TRACE_VERSION 1
 
 enum rdma_monitor_type {
 	RDMA_MONITOR_QP_CREATE,
@@ -34,7 +51,7 @@ enum rdma_resource_type {
 };
 
 // Verb names for configuration matching
-static const char *rdma_verb_names[RDMA_MONITOR_TYPE_MAX] = {
+static const char *rdma_verb_names[RDMA_MONITOR_TYPE_MAX] __attribute__((unused)) = {
 	"QP_CREATE",
 	"QP_MODIFY", 
 	"QP_DESTROY",
@@ -49,7 +66,7 @@ static const char *rdma_verb_names[RDMA_MONITOR_TYPE_MAX] = {
 };
 
 // Resource names for configuration matching
-static const char *rdma_resource_names[RDMA_RESOURCE_MAX] = {
+static const char *rdma_resource_names[RDMA_RESOURCE_MAX] __attribute__((unused)) = {
 	"QP_COUNT",
 	"PD_COUNT",
 	"CQ_COUNT",
@@ -97,6 +114,54 @@ struct resource_stats {
 // Structure for tracking per-cgroup statistics
 struct cgroup_stats {
 	__u64 counts[RDMA_MONITOR_TYPE_MAX];
+
+	// Pinned memory held by live MRs of this cgroup (bytes, page granular)
+	__u64 mr_pinned_bytes;
+	__u64 mr_pinned_peak;
+	// Registrations that would have pushed the cgroup over its quota
+	__u64 mr_quota_violations;
+
+	// Streamed event sampling: events seen, and samples lost to a full ring buffer
+	__u64 trace_seq;
+	__u64 trace_dropped;
+};
+
+// MR registration arguments stashed between kprobe and kretprobe, per thread
+struct mr_reg_args {
+	__u64 cgroup_id;
+	__u64 va;
+	__u64 len;
+	__u64 pinned_bytes;
+	__u32 access_flags;
+};
+
+// Start of an in-flight timed verb, keyed by pid_tgid
+struct verb_start {
+	__u64 ts_ns;
+	__u32 type; // enum rdma_monitor_type
+	__u32 qp_state; // modify: target state, else RDMA_MONITOR_QP_STATE_NONE
+};
+
+// Per-cgroup latency histogram key, one per verb and (for modify) target QP state
+struct latency_hist_key {
+	__u64 cgroup_id;
+	__u32 type;
+	__u32 qp_state;
+};
+
+// Kernel-side verb latency, slot i counts calls that took [2^i, 2^(i+1)) ns
+struct latency_hist {
+	__u64 slots[LAT_HIST_SLOTS];
+	__u64 count;
+	__u64 sum_ns;
+	__u64 max_ns;
+};
+
+// Owner of a live MR, keyed by its struct ib_mr pointer
+struct mr_owner {
+	__u64 cgroup_id;
+	__u64 pinned_bytes;
+	__u32 access_flags;
 };
 
 // Structure for interception thresholds
@@ -106,40 +171,74 @@ struct interception_config {
 	
 	// Max call frequency for frequency-based interception (0 to disable)
 	__u64 max_frequency[RDMA_MONITOR_TYPE_MAX];
+
+	// Per-cgroup pinned MR memory quota in bytes (0 to disable)
+	__u64 max_pinned_bytes;
+	// Signal sent to a task whose registration exceeds the quota (0: account only)
+	__u32 quota_signal;
+
+	// Stream one of every N control events per cgroup to the ring buffer (0: off)
+	__u32 trace_sample_rate;
 };
 
-union ibv_gid {
-	uint8_t			raw[16];
-	struct {
-		__be64	subnet_prefix;
-		__be64	interface_id;
-	} global;
+// Config slots: intercept_config_map holds two configs, the active one is
+// selected by the generation's low bit so a reload is a single map store
+#define CONFIG_SLOTS 2
+
+// Fields set in a per-cgroup override
+#define CGROUP_OVERRIDE_PINNED_BYTES (1 << 0)
+#define CGROUP_OVERRIDE_SAMPLE_RATE (1 << 1)
+
+// Overrides are double-buffered like the config: each entry belongs to one slot
+struct cgroup_override_key {
+	__u64 cgroup_id;
+	__u32 slot;
+	__u32 pad;
+};
+
+// Per-cgroup override of the kernel-enforced settings
+struct cgroup_override {
+	__u32 mask; // CGROUP_OVERRIDE_*
+	__u32 trace_sample_rate;
+	__u64 max_pinned_bytes;
 };
 
+// Fixed-size record streamed through the ring buffer and stored as-is in the binary log
 struct event {
+	__u64 ts_ns; // CLOCK_MONOTONIC
+	__u64 cgroup_id;
 	int pid;
 	enum rdma_monitor_type type;
 	char comm[TASK_COMM_LEN];
-	__u64 cgroup_id;  // 添加cgroup ID字段
-	struct qp {
-		__u32 qpn; // 本地QPN
-		__u32 dest_qpn; // 目的QPN	
-		union ibv_gid gid;
-	} qp;
-	struct mr {
-		__u64 va; // MR VA
-		__u64 rkey; // MR REKY
-		__u64 len; // MR LEN
-	} mr;
-	struct cm {
-		__u32 cm_id; // CM ID
-		__u32 qpn; // 本地QPN
-		__u8 srcaddr[28];
-		__u8 dstaddr[28];
-
-	} cm;
-
+	union {
+		struct qp {
+			__u32 qpn; // 本地QPN
+			__u32 dest_qpn; // 目的QPN
+			__u32 attr_mask; // modify: ib_qp_attr_mask
+			__u32 state; // modify: target state, if in attr_mask
+		} qp;
+		struct mr {
+			__u64 va; // MR VA
+			__u64 len; // MR LEN
+			__u32 rkey; // MR RKEY
+			__u32 access_flags;
+		} mr;
+		struct cm {
+			__u32 cm_id; // CM ID
+			__u32 qpn; // 本地QPN
+			__u8 srcaddr[28];
+			__u8 dstaddr[28];
+		} cm;
+	};
 };
 
+// Header at the start of a binary event log
+struct rdma_trace_header {
+	char magic[8];
+	__u32 version;
+	__u32 record_size;
+	// CLOCK_REALTIME - CLOCK_MONOTONIC when the log was opened, to date records
+	__u64 realtime_offset_ns;
+};
 
 #endif /* __RDMA_MONITOR_H */
\ No newline at end of file
@@ -0,0 +1,179 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+/* Offline decoder for the binary event log written by rdma_monitor -o */
+#include <argp.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <linux/types.h>
+#include "rdma_monitor.h"
+
+static bool csv_output = false;
+static const char *input_file = NULL;
+static __u64 cgroup_filter = 0;
+
+static const char *qp_state_names[] = {
+	"RESET", "INIT", "RTR", "RTS", "SQD", "SQE", "ERR"
+};
+
+// Function to parse command line arguments
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+	switch (key) {
+	case 'c':
+		csv_output = true;
+		break;
+	case 'g':
+		cgroup_filter = strtoull(arg, NULL, 10);
+		break;
+	case ARGP_KEY_ARG:
+		if (input_file)
+			argp_usage(state);
+		input_file = arg;
+		break;
+	case ARGP_KEY_END:
+		if (!input_file)
+			argp_usage(state);
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static struct argp_option options[] = {
+	{ "csv", 'c', NULL, 0, "Print records as CSV" },
+	{ "cgroup", 'g', "CGROUP_ID", 0, "Only print records of this cgroup" },
+	{},
+};
+
+static struct argp argp = {
+	.options = options,
+	.parser = parse_opt,
+	.args_doc = "TRACE_FILE",
+	.doc = "Decode an RDMA control path event log written by rdma_monitor -o",
+};
+
+// Function to format a sockaddr captured by the rdma_cma tracepoint
+static void format_sockaddr(const __u8 *raw, char *buf, size_t len) {
+	struct sockaddr_storage ss = {};
+
+	memcpy(&ss, raw, 28);
+	if (ss.ss_family == AF_INET) {
+		struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+		char ip[INET_ADDRSTRLEN];
+
+		inet_ntop(AF_INET, &sin->sin_addr, ip, sizeof(ip));
+		snprintf(buf, len, "%s:%u", ip, ntohs(sin->sin_port));
+	} else if (ss.ss_family == AF_INET6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+		char ip[INET6_ADDRSTRLEN];
+
+		inet_ntop(AF_INET6, &sin6->sin6_addr, ip, sizeof(ip));
+		snprintf(buf, len, "[%s]:%u", ip, ntohs(sin6->sin6_port));
+	} else {
+		snprintf(buf, len, "family-%u", ss.ss_family);
+	}
+}
+
+// Function to format the type specific part of a record
+static void format_payload(const struct event *e, char *buf, size_t len) {
+	char src[64], dst[64];
+
+	switch (e->type) {
+	case RDMA_MONITOR_QP_CREATE:
+		snprintf(buf, len, "qpn=%u", e->qp.qpn);
+		break;
+	case RDMA_MONITOR_QP_MODIFY:
+		if (e->qp.attr_mask & RDMA_MONITOR_QP_ATTR_STATE)
+			snprintf(buf, len, "qpn=%u dest_qpn=%u mask=0x%x state=%s", e->qp.qpn, e->qp.dest_qpn,
+				 e->qp.attr_mask, e->qp.state < 7 ? qp_state_names[e->qp.state] : "?");
+		else
+			snprintf(buf, len, "qpn=%u dest_qpn=%u mask=0x%x", e->qp.qpn, e->qp.dest_qpn,
+				 e->qp.attr_mask);
+		break;
+	case RDMA_MONITOR_MR_REG:
+		snprintf(buf, len, "va=0x%llx len=%llu rkey=0x%x access=0x%x", (unsigned long long)e->mr.va,
+			 (unsigned long long)e->mr.len, e->mr.rkey, e->mr.access_flags);
+		break;
+	case RDMA_MONITOR_CM_SEND_REQ:
+		format_sockaddr(e->cm.srcaddr, src, sizeof(src));
+		format_sockaddr(e->cm.dstaddr, dst, sizeof(dst));
+		snprintf(buf, len, "cm_id=%u qpn=%u src=%s dst=%s", e->cm.cm_id, e->cm.qpn, src, dst);
+		break;
+	default:
+		buf[0] = '\0';
+		break;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct rdma_trace_header hdr;
+	struct event e;
+	unsigned long long n = 0;
+	char payload[160];
+	char timestamp[32];
+	FILE *fp;
+	int err;
+
+	err = argp_parse(&argp, argc, argv, 0, NULL, NULL);
+	if (err)
+		return err;
+
+	fp = fopen(input_file, "rb");
+	if (!fp) {
+		fprintf(stderr, "Failed to open %s: %s\n", input_file, strerror(errno));
+		return 1;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    memcmp(hdr.magic, RDMA_TRACE_MAGIC, sizeof(RDMA_TRACE_MAGIC))) {
+		fprintf(stderr, "%s is not an rdma_monitor trace\n", input_file);
+		fclose(fp);
+		return 1;
+	}
+
+	if (hdr.version != RDMA_TRACE_VERSION || hdr.record_size != sizeof(struct event)) {
+		fprintf(stderr, "Unsupported trace version %u (record size %u, expected %zu)\n",
+			hdr.version, hdr.record_size, sizeof(struct event));
+		fclose(fp);
+		return 1;
+	}
+
+	if (csv_output)
+		printf("timestamp_ns,cgroup_id,pid,comm,type,details\n");
+
+	while (fread(&e, sizeof(e), 1, fp) == 1) {
+		__u64 ts = e.ts_ns + hdr.realtime_offset_ns;
+		time_t sec = ts / 1000000000ULL;
+		struct tm tm_info;
+
+		if (cgroup_filter && e.cgroup_id != cgroup_filter)
+			continue;
+
+		e.comm[TASK_COMM_LEN - 1] = '\0';
+		format_payload(&e, payload, sizeof(payload));
+
+		if (csv_output) {
+			printf("%llu,%llu,%d,%s,%s,%s\n", (unsigned long long)ts, (unsigned long long)e.cgroup_id,
+			       e.pid, e.comm, rdma_verb_names[e.type < RDMA_MONITOR_TYPE_MAX ? e.type : 0], payload);
+		} else {
+			localtime_r(&sec, &tm_info);
+			strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &tm_info);
+			printf("[%s.%09llu] %-20llu %-16s %-8d %-26s %s\n", timestamp,
+			       (unsigned long long)(ts % 1000000000ULL), (unsigned long long)e.cgroup_id,
+			       e.comm, e.pid, rdma_monitor_tpye_str(e.type), payload);
+		}
+		n++;
+	}
+
+	fclose(fp);
+	fprintf(stderr, "%llu records decoded\n", n);
+
+	return 0;
+}
@@ -23,8 +23,25 @@ struct mtrdma_shm_context
     uint32_t active_tenant_num;
     uint64_t active_qps_num;
     uint32_t max_qps_limit;
+    uint32_t active_rrtenant_num;
+    uint32_t starved_rqtenant_num;
 
     uint32_t active_qps_per_tenant[MAX_TENANT_NUM];
+    int32_t tenant_pid[MAX_TENANT_NUM];
+
+    uint32_t resp_rd_atomic_per_tenant[MAX_TENANT_NUM];
+    uint32_t req_rd_atomic_per_tenant[MAX_TENANT_NUM];
+    uint32_t rd_atomic_qps_per_tenant[MAX_TENANT_NUM];
+    uint32_t rd_atomic_limit[MAX_TENANT_NUM];
+
+    uint32_t rq_starved_per_tenant[MAX_TENANT_NUM];
+    uint32_t sq_stalled_per_tenant[MAX_TENANT_NUM];
+    uint64_t rnr_retry_exc_per_tenant[MAX_TENANT_NUM];
+    uint32_t rnr_throttle[MAX_TENANT_NUM];
+
+    uint32_t tenant_class[MAX_TENANT_NUM];
+    uint64_t uar_db_per_tenant[MAX_TENANT_NUM];
+    uint64_t uar_contended_per_tenant[MAX_TENANT_NUM];
 
     pthread_mutex_t mtrdma_thread_lock[MAX_TENANT_NUM];
     pthread_cond_t mtrdma_thread_cond[MAX_TENANT_NUM];
@@ -37,7 +54,7 @@ void main()
     int shm_fd;
 
     printf("Init mtrdma_shm\n");
-    shm_fd = shm_open("/home/phx/MTRDMA/mtrdma-shm", O_CREAT | O_RDWR, 0666);
+    shm_fd = shm_open("/mtrdma-shm", O_CREAT | O_RDWR, 0666);
 
     if (shm_fd == -1)
     {
@@ -103,7 +120,7 @@ void main()
            NIC_QPS_CAPA, NIC_LINK_BW, MAX_MSG_RATE, MSEN_QP_LIMIT, MAX_SIM_BTENANT_NUM);
     while (true)
     {
-        uint32_t atn = 0, aqn = 0;
+        uint32_t atn = 0, aqn = 0, rrtn = 0, srtn = 0;
         uint64_t max_msg_size = 0;
         uint32_t tnum = 0;
 
@@ -116,6 +133,10 @@ void main()
                 atn++;
                 aqn += shm_ctx->active_qps_per_tenant[i];
             }
+            if (shm_ctx->resp_rd_atomic_per_tenant[i])
+                rrtn++;
+            if (shm_ctx->rq_starved_per_tenant[i])
+                srtn++;
 
             if (tnum == shm_ctx->tenant_num)
                 break;
@@ -132,6 +153,8 @@ void main()
 
         shm_ctx->active_tenant_num = atn;
         shm_ctx->active_qps_num = aqn;
+        shm_ctx->active_rrtenant_num = rrtn;
+        shm_ctx->starved_rqtenant_num = srtn;
         shm_ctx->max_qps_limit = NIC_QPS_CAPA > fu_qp_num ? fu_qp_num : NIC_QPS_CAPA;
         // printf("Instant Global Tenant Num: %d, Active Tenant Num: %d, Active QPs Num: %ld, Active Resp Read Tenant Num: %d,  Delay Sensitive Num: %d, Msg Senstivie Num: %d, Bandwidth Sesitive Num: %d, MAX_QPS_LIMIT: %d\n", shm_ctx->tenant_num, shm_ctx->active_tenant_num, shm_ctx->active_qps_num, shm_ctx->active_rrtenant_num, shm_ctx->active_dtenant_num, shm_ctx->active_mtenant_num, shm_ctx->active_tenant_num - shm_ctx->active_stenant_num, shm_ctx->max_qps_limit);
         qps_check_timer = now;
@@ -141,7 +164,7 @@ void main()
 
         if (t > PRINT_INTERVAL)
         {
-            printf("Current Global Tenant Num: %d, Active Tenant Num: %d, MAX_QPS_LIMIT: %d\n", shm_ctx->tenant_num, shm_ctx->active_tenant_num, shm_ctx->max_qps_limit);
+            printf("Current Global Tenant Num: %d, Active Tenant Num: %d, Active Resp Read Tenant Num: %d, Starved RQ Tenant Num: %d, MAX_QPS_LIMIT: %d\n", shm_ctx->tenant_num, shm_ctx->active_tenant_num, shm_ctx->active_rrtenant_num, shm_ctx->starved_rqtenant_num, shm_ctx->max_qps_limit);
 
             print_timer = now;
         }
@@ -0,0 +1,1196 @@
+/*
+ * Copyright (c) 2005 Mellanox Technologies Ltd.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * $Id$
+ */
+
+/*
+ * Control path verbs benchmark.
+ *
+ * Times alloc/dealloc PD, create/destroy CQ, reg/dereg MR and create, modify
+ * (RESET->INIT->RTR->RTS, looped back to itself) and destroy RC QP, for a list
+ * of MR sizes, CQ sizes and QP depths. Every case runs in -P processes of -t
+ * threads each, which open the device on their own and start together. Every
+ * verb call is timed into a latency histogram, and the case reports the rate
+ * at which objects went through their whole create/destroy life.
+ *
+ * With --storm=<op> every case runs a second time next to a competing process
+ * that creates and destroys <op> objects as fast as it can, and the slowdown
+ * of the measured verbs against the quiet run is reported.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <infiniband/verbs.h>
+
+#include "perftest_histogram.h"
+
+#define MAX_SIZES		(16)
+#define MAX_THREADS		(64)
+#define MAX_PROCS		(64)
+#define MAX_OP_METRICS		(5)
+#define MAX_BATCH		(65536)
+#define DEF_ITERS		(1000)
+#define DEF_MR_SIZES		"4K,64K,1M,16M"
+#define DEF_CQ_SIZES		"64,4096"
+#define DEF_QP_DEPTHS		"128,4096"
+
+#define CTRL_BENCH_USAGE	"Usage: ib_ctrl_bench -d <dev> [options]\n"
+
+enum ctrl_op {OP_PD, OP_CQ, OP_MR, OP_QP, NUM_OPS};
+
+enum ctrl_metric {
+	M_ALLOC_PD,
+	M_DEALLOC_PD,
+	M_CREATE_CQ,
+	M_DESTROY_CQ,
+	M_REG_MR,
+	M_DEREG_MR,
+	M_CREATE_QP,
+	M_MODIFY_QP_INIT,
+	M_MODIFY_QP_RTR,
+	M_MODIFY_QP_RTS,
+	M_DESTROY_QP,
+	NUM_METRICS,
+};
+
+static const char *op_names[NUM_OPS] = {"pd", "cq", "mr", "qp"};
+
+static const char *metric_names[NUM_METRICS] = {
+	"alloc_pd", "dealloc_pd", "create_cq", "destroy_cq", "reg_mr", "dereg_mr",
+	"create_qp", "modify_qp_init", "modify_qp_rtr", "modify_qp_rts", "destroy_qp",
+};
+
+/* First metric of every op, the metrics of an op are consecutive */
+static const enum ctrl_metric op_first_metric[NUM_OPS + 1] = {
+	M_ALLOC_PD, M_CREATE_CQ, M_REG_MR, M_CREATE_QP, NUM_METRICS,
+};
+
+struct ctrl_bench_params {
+	char		*ib_devname;
+	int		ib_port;
+	int		gid_index;
+	int		ops[NUM_OPS];
+	uint64_t	sizes[NUM_OPS][MAX_SIZES];
+	int		num_sizes[NUM_OPS];
+	int		num_threads;
+	int		num_procs;
+	int		iters;
+	int		batch;
+	int		qp_rts;
+	int		storm_op;	/* -1 without --storm */
+	uint64_t	storm_size;
+	int		storm_threads;
+	char		*csv_file;
+	char		*json_file;
+};
+
+/* Latencies of one verb, in nsec */
+struct metric_result {
+	struct perftest_hist	hist;
+	uint64_t		errors;
+};
+
+/* Everything a process sends back to the parent, also used per thread */
+struct case_result {
+	struct metric_result	metrics[MAX_OP_METRICS];
+	uint64_t		objects;	/* Went through create and destroy */
+	uint64_t		start_ns;
+	uint64_t		end_ns;
+	int			rc;
+};
+
+/* Per process device state, shared by its threads */
+struct ctrl_device {
+	struct ibv_context	*context;
+	struct ibv_pd		*pd;
+	struct ibv_device_attr	dev_attr;
+	struct ibv_port_attr	port_attr;
+	union ibv_gid		gid;
+	int			gid_index;
+};
+
+struct worker {
+	const struct ctrl_bench_params	*params;
+	struct ctrl_device		*dev;
+	enum ctrl_op			op;
+	uint64_t			size;
+	int				storm;
+	pthread_barrier_t		*ready;
+	pthread_barrier_t		*go;
+	void				*buf;	/* MR op */
+	struct ibv_cq			*cq;	/* QP op */
+	void				**objs;
+	struct case_result		result;
+	pthread_t			thread;
+};
+
+struct result_row {
+	enum ctrl_metric	metric;
+	uint64_t		size;
+	int			storm;
+	int			baseline;	/* Row of the quiet run, for storm rows */
+	uint64_t		count;
+	uint64_t		errors;
+	double			rate;
+	double			avg_us;
+	double			p50_us;
+	double			p99_us;
+	double			p99_9_us;
+	double			max_us;
+};
+
+static struct result_row rows[NUM_METRICS * MAX_SIZES * 2];
+static int num_rows;
+
+static volatile sig_atomic_t storm_stop;
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static void usage(void)
+{
+	printf(CTRL_BENCH_USAGE);
+	printf("\nOptions:\n");
+	printf("  -d, --ib-dev=<dev>         Use IB device <dev>\n");
+	printf("  -i, --ib-port=<port>       Use port <port> of IB device (default 1)\n");
+	printf("  -x, --gid-index=<index>    GID index of the looped back QPs (default 0 on Ethernet)\n");
+	printf("  -o, --ops=<list>           Ops to run, of pd,cq,mr,qp (default all)\n");
+	printf("  -t, --threads=<num>        Threads per process (default 1, at most %d)\n", MAX_THREADS);
+	printf("  -P, --procs=<num>          Processes, each opening the device (default 1, at most %d)\n", MAX_PROCS);
+	printf("  -n, --iters=<num>          Objects every thread creates and destroys per case (default %d)\n", DEF_ITERS);
+	printf("  -b, --batch=<num>          Objects held at once before destroying them (default 1)\n");
+	printf("      --mr_sizes=<list>      MR sizes, with K/M/G suffixes (default %s)\n", DEF_MR_SIZES);
+	printf("      --cq_sizes=<list>      CQ sizes (default %s)\n", DEF_CQ_SIZES);
+	printf("      --qp_depths=<list>     QP send and receive queue depths (default %s)\n", DEF_QP_DEPTHS);
+	printf("      --qp_state=<init|rts>  Last state QPs are moved to (default rts)\n");
+	printf("      --storm=<op>[:<size>]  Run every case again next to a process churning <op> objects\n");
+	printf("      --storm_threads=<num>  Threads of the storm process (default 1)\n");
+	printf("      --csv=<file>           Write the results as CSV (- for stdout)\n");
+	printf("      --json=<file>          Write the results as JSON (- for stdout)\n");
+	printf("  -h, --help                 Display this help message\n");
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static int parse_op(const char *name)
+{
+	int op;
+
+	for (op = 0; op < NUM_OPS; op++) {
+		if (!strcmp(name, op_names[op]))
+			return op;
+	}
+	fprintf(stderr, " Unknown op %s, use pd, cq, mr or qp\n", name);
+	return -1;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static int parse_size(const char *str, uint64_t *size)
+{
+	char *end;
+	uint64_t value = strtoull(str, &end, 0);
+
+	switch (*end) {
+	case 'K': value <<= 10; end++; break;
+	case 'M': value <<= 20; end++; break;
+	case 'G': value <<= 30; end++; break;
+	}
+	if (*end != '\0' || !value) {
+		fprintf(stderr, " Invalid size %s\n", str);
+		return 1;
+	}
+	*size = value;
+	return 0;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static int parse_size_list(const char *list, uint64_t *sizes, int *num_sizes)
+{
+	char *copy = strdupa(list);
+	char *token, *saveptr = NULL;
+
+	*num_sizes = 0;
+	for (token = strtok_r(copy, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+		if (*num_sizes == MAX_SIZES) {
+			fprintf(stderr, " At most %d sizes per op\n", MAX_SIZES);
+			return 1;
+		}
+		if (parse_size(token, &sizes[(*num_sizes)++]))
+			return 1;
+	}
+	return !*num_sizes;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static int open_ctrl_device(const struct ctrl_bench_params *params, struct ctrl_device *dev)
+{
+	struct ibv_device **dev_list;
+	int i;
+
+	memset(dev, 0, sizeof(*dev));
+
+	dev_list = ibv_get_device_list(NULL);
+	if (!dev_list) {
+		fprintf(stderr, " Failed to get IB devices list\n");
+		return 1;
+	}
+	for (i = 0; dev_list[i]; i++) {
+		if (!strcmp(ibv_get_device_name(dev_list[i]), params->ib_devname))
+			break;
+	}
+	if (!dev_list[i]) {
+		fprintf(stderr, " IB device %s not found\n", params->ib_devname);
+		ibv_free_device_list(dev_list);
+		return 1;
+	}
+
+	dev->context = ibv_open_device(dev_list[i]);
+	ibv_free_device_list(dev_list);
+	if (!dev->context) {
+		fprintf(stderr, " Couldn't open %s\n", params->ib_devname);
+		return 1;
+	}
+
+	if (ibv_query_device(dev->context, &dev->dev_attr) ||
+	    ibv_query_port(dev->context, params->ib_port, &dev->port_attr)) {
+		fprintf(stderr, " Couldn't query %s port %d\n", params->ib_devname, params->ib_port);
+		goto err;
+	}
+
+	dev->gid_index = params->gid_index;
+	if (dev->gid_index < 0 && dev->port_attr.link_layer == IBV_LINK_LAYER_ETHERNET)
+		dev->gid_index = 0;
+	if (dev->gid_index >= 0 && ibv_query_gid(dev->context, params->ib_port, dev->gid_index, &dev->gid)) {
+		fprintf(stderr, " Couldn't read GID index %d\n", dev->gid_index);
+		goto err;
+	}
+
+	dev->pd = ibv_alloc_pd(dev->context);
+	if (!dev->pd) {
+		fprintf(stderr, " Couldn't allocate PD\n");
+		goto err;
+	}
+	return 0;
+
+err:
+	ibv_close_device(dev->context);
+	return 1;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static void close_ctrl_device(struct ctrl_device *dev)
+{
+	ibv_dealloc_pd(dev->pd);
+	ibv_close_device(dev->context);
+}
+
+/******************************************************************************
+ * Time one verb call, the result is 0 when it succeeded.
+ ******************************************************************************/
+#define TIME_VERB(w, metric, call)							\
+	({										\
+		struct metric_result *_m = &(w)->result.metrics[(metric) - op_first_metric[(w)->op]]; \
+		uint64_t _start = now_ns();						\
+		int _failed = !!(call);							\
+		uint64_t _end = now_ns();						\
+		if (_failed)								\
+			_m->errors++;							\
+		else if (!(w)->storm)							\
+			hist_record(&_m->hist, _end - _start);				\
+		_failed;								\
+	})
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static int modify_qp_loopback(struct worker *w, struct ibv_qp *qp)
+{
+	const struct ctrl_bench_params *params = w->params;
+	struct ctrl_device *dev = w->dev;
+	struct ibv_qp_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.qp_state = IBV_QPS_INIT;
+	attr.pkey_index = 0;
+	attr.port_num = params->ib_port;
+	attr.qp_access_flags = IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ;
+	if (TIME_VERB(w, M_MODIFY_QP_INIT, ibv_modify_qp(qp, &attr,
+			IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS)))
+		return 1;
+
+	if (!params->qp_rts)
+		return 0;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.qp_state = IBV_QPS_RTR;
+	attr.path_mtu = dev->port_attr.active_mtu;
+	attr.dest_qp_num = qp->qp_num;
+	attr.rq_psn = 0;
+	attr.max_dest_rd_atomic = 1;
+	attr.min_rnr_timer = 12;
+	attr.ah_attr.dlid = dev->port_attr.lid;
+	attr.ah_attr.port_num = params->ib_port;
+	if (dev->gid_index >= 0) {
+		attr.ah_attr.is_global = 1;
+		attr.ah_attr.grh.dgid = dev->gid;
+		attr.ah_attr.grh.sgid_index = dev->gid_index;
+		attr.ah_attr.grh.hop_limit = 1;
+	}
+	if (TIME_VERB(w, M_MODIFY_QP_RTR, ibv_modify_qp(qp, &attr,
+			IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN |
+			IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER)))
+		return 1;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.qp_state = IBV_QPS_RTS;
+	attr.timeout = 14;
+	attr.retry_cnt = 7;
+	attr.rnr_retry = 7;
+	attr.sq_psn = 0;
+	attr.max_rd_atomic = 1;
+	return TIME_VERB(w, M_MODIFY_QP_RTS, ibv_modify_qp(qp, &attr,
+			IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY |
+			IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC));
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static int create_object(struct worker *w, void **obj)
+{
+	struct ctrl_device *dev = w->dev;
+
+	switch (w->op) {
+	case OP_PD:
+		return TIME_VERB(w, M_ALLOC_PD, !(*obj = ibv_alloc_pd(dev->context)));
+	case OP_CQ:
+		return TIME_VERB(w, M_CREATE_CQ, !(*obj = ibv_create_cq(dev->context, w->size, NULL, NULL, 0)));
+	case OP_MR:
+		return TIME_VERB(w, M_REG_MR, !(*obj = ibv_reg_mr(dev->pd, w->buf, w->size,
+				IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ)));
+	case OP_QP: {
+		struct ibv_qp_init_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.send_cq = w->cq;
+		attr.recv_cq = w->cq;
+		attr.cap.max_send_wr = w->size;
+		attr.cap.max_recv_wr = w->size;
+		attr.cap.max_send_sge = 1;
+		attr.cap.max_recv_sge = 1;
+		attr.qp_type = IBV_QPT_RC;
+		if (TIME_VERB(w, M_CREATE_QP, !(*obj = ibv_create_qp(dev->pd, &attr))))
+			return 1;
+		if (modify_qp_loopback(w, *obj)) {
+			ibv_destroy_qp(*obj);
+			*obj = NULL;
+			return 1;
+		}
+		return 0;
+	}
+	default:
+		return 1;
+	}
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static int destroy_object(struct worker *w, void *obj)
+{
+	switch (w->op) {
+	case OP_PD: return TIME_VERB(w, M_DEALLOC_PD, ibv_dealloc_pd(obj));
+	case OP_CQ: return TIME_VERB(w, M_DESTROY_CQ, ibv_destroy_cq(obj));
+	case OP_MR: return TIME_VERB(w, M_DEREG_MR, ibv_dereg_mr(obj));
+	case OP_QP: return TIME_VERB(w, M_DESTROY_QP, ibv_destroy_qp(obj));
+	default: return 1;
+	}
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static int setup_worker(struct worker *w)
+{
+	int i;
+
+	for (i = 0; i < MAX_OP_METRICS; i++)
+		hist_reset(&w->result.metrics[i].hist);
+
+	w->objs = calloc(w->params->batch, sizeof(void *));
+	if (!w->objs)
+		return 1;
+
+	if (w->op == OP_MR) {
+		/* Touch the pages, so registration times pinning and not page faults */
+		if (posix_memalign(&w->buf, sysconf(_SC_PAGESIZE), w->size)) {
+			fprintf(stderr, " Couldn't allocate %lu bytes\n", (unsigned long)w->size);
+			return 1;
+		}
+		memset(w->buf, 0, w->size);
+	} else if (w->op == OP_QP) {
+		int cqe = w->size * 2 < (uint64_t)w->dev->dev_attr.max_cqe ? (int)w->size * 2 : w->dev->dev_attr.max_cqe;
+
+		w->cq = ibv_create_cq(w->dev->context, cqe, NULL, NULL, 0);
+		if (!w->cq) {
+			fprintf(stderr, " Couldn't create the CQ of the QPs\n");
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static void teardown_worker(struct worker *w)
+{
+	if (w->cq)
+		ibv_destroy_cq(w->cq);
+	free(w->buf);
+	free(w->objs);
+}
+
+/******************************************************************************
+ * Create a batch of objects then destroy it, iters times over, or until the
+ * storm is told to stop.
+ ******************************************************************************/
+static void *run_worker(void *arg)
+{
+	struct worker *w = arg;
+	uint64_t done = 0;
+	int i, n, rc;
+
+	rc = setup_worker(w);
+	pthread_barrier_wait(w->ready);
+	pthread_barrier_wait(w->go);
+	if (rc)
+		goto out;
+
+	w->result.start_ns = now_ns();
+	while (w->storm ? !storm_stop : done < (uint64_t)w->params->iters) {
+		n = w->storm ? w->params->batch : (int)(w->params->iters - done < (uint64_t)w->params->batch ?
+							 w->params->iters - done : (uint64_t)w->params->batch);
+
+		for (i = 0; i < n; i++) {
+			if (create_object(w, &w->objs[i])) {
+				rc = 1;
+				break;
+			}
+		}
+		n = i;
+		for (i = 0; i < n; i++) {
+			if (destroy_object(w, w->objs[i]))
+				rc = 1;
+		}
+		done += n;
+		if (rc)
+			break;
+	}
+	w->result.end_ns = now_ns();
+	w->result.objects = done;
+
+out:
+	w->result.rc = rc;
+	teardown_worker(w);
+	return NULL;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static void merge_result(struct case_result *dst, const struct case_result *src)
+{
+	int i;
+
+	for (i = 0; i < MAX_OP_METRICS; i++) {
+		hist_merge(&dst->metrics[i].hist, &src->metrics[i].hist);
+		dst->metrics[i].errors += src->metrics[i].errors;
+	}
+	dst->objects += src->objects;
+	if (src->start_ns && (!dst->start_ns || src->start_ns < dst->start_ns))
+		dst->start_ns = src->start_ns;
+	if (src->end_ns > dst->end_ns)
+		dst->end_ns = src->end_ns;
+	dst->rc |= src->rc;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static void init_result(struct case_result *result)
+{
+	int i;
+
+	memset(result, 0, sizeof(*result));
+	for (i = 0; i < MAX_OP_METRICS; i++)
+		hist_reset(&result->metrics[i].hist);
+}
+
+/******************************************************************************
+ * One process of a case. Once all its threads are set up it writes a byte to
+ * ready_fd, and starts them when go_fd reaches EOF, so that all processes
+ * start together. -1 skips either step.
+ ******************************************************************************/
+static int run_process(const struct ctrl_bench_params *params, enum ctrl_op op, uint64_t size,
+		       int num_threads, int storm, int ready_fd, int go_fd, struct case_result *result)
+{
+	struct ctrl_device dev;
+	struct worker *workers;
+	pthread_barrier_t ready, go;
+	char c = 'r';
+	int i;
+
+	init_result(result);
+
+	if (open_ctrl_device(params, &dev)) {
+		result->rc = 1;
+		if (ready_fd >= 0 && write(ready_fd, &c, 1) != 1)
+			return 1;
+		return 1;
+	}
+
+	workers = calloc(num_threads, sizeof(*workers));
+	if (!workers) {
+		close_ctrl_device(&dev);
+		result->rc = 1;
+		return 1;
+	}
+
+	pthread_barrier_init(&ready, NULL, num_threads + 1);
+	pthread_barrier_init(&go, NULL, num_threads + 1);
+	for (i = 0; i < num_threads; i++) {
+		workers[i].params = params;
+		workers[i].dev = &dev;
+		workers[i].op = op;
+		workers[i].size = size;
+		workers[i].storm = storm;
+		workers[i].ready = &ready;
+		workers[i].go = &go;
+		if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i])) {
+			fprintf(stderr, " Couldn't create worker thread\n");
+			exit(1);
+		}
+	}
+
+	pthread_barrier_wait(&ready);
+	if (ready_fd >= 0 && write(ready_fd, &c, 1) != 1)
+		result->rc = 1;
+	if (go_fd >= 0)
+		while (read(go_fd, &c, 1) > 0)
+			;
+	pthread_barrier_wait(&go);
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		merge_result(result, &workers[i].result);
+	}
+
+	pthread_barrier_destroy(&ready);
+	pthread_barrier_destroy(&go);
+	free(workers);
+	close_ctrl_device(&dev);
+	return result->rc;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static int read_full(int fd, void *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = read(fd, (char *)buf + done, len - done);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			return 1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static int write_full(int fd, const void *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = write(fd, (const char *)buf + done, len - done);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			return 1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static void storm_signal(int sig)
+{
+	(void)sig;
+	storm_stop = 1;
+}
+
+/******************************************************************************
+ * Fork a process of a case, its result comes back on *result_fd.
+ * The child closes close_fds, the parent's ends of the case pipes, first.
+ ******************************************************************************/
+static pid_t fork_process(const struct ctrl_bench_params *params, enum ctrl_op op, uint64_t size,
+			  int num_threads, int storm, int ready_fd, int go_fd, int *result_fd,
+			  const int *close_fds, int num_close_fds)
+{
+	int result_pipe[2];
+	pid_t pid;
+	int i;
+
+	if (pipe(result_pipe)) {
+		fprintf(stderr, " Couldn't create pipe: %s\n", strerror(errno));
+		return -1;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, " Couldn't fork: %s\n", strerror(errno));
+		close(result_pipe[0]);
+		close(result_pipe[1]);
+		return -1;
+	}
+
+	if (!pid) {
+		struct case_result result;
+
+		/* A writer left open on the go pipe would keep every process from starting */
+		for (i = 0; i < num_close_fds; i++)
+			close(close_fds[i]);
+		close(result_pipe[0]);
+		if (storm) {
+			struct sigaction sa;
+
+			/* The parent stops the storm with SIGTERM once the measured processes are done */
+			memset(&sa, 0, sizeof(sa));
+			sa.sa_handler = storm_signal;
+			sigaction(SIGTERM, &sa, NULL);
+		}
+		run_process(params, op, size, num_threads, storm, ready_fd, go_fd, &result);
+		_exit(write_full(result_pipe[1], &result, sizeof(result)) ? 1 : 0);
+	}
+
+	close(result_pipe[1]);
+	*result_fd = result_pipe[0];
+	return pid;
+}
+
+/******************************************************************************
+ * Run one case in params->num_procs processes, next to a storm process when
+ * storm is set. The storm runs until the measured processes are done.
+ ******************************************************************************/
+static int run_case(const struct ctrl_bench_params *params, enum ctrl_op op, uint64_t size,
+		    int storm, struct case_result *result, struct case_result *storm_result)
+{
+	pid_t pids[MAX_PROCS], storm_pid = -1;
+	int result_fds[MAX_PROCS], storm_fd = -1;
+	int close_fds[MAX_PROCS + 3];
+	int ready_pipe[2], go_pipe[2];
+	int i, num_close_fds, rc = 0;
+	char c;
+
+	init_result(result);
+	init_result(storm_result);
+
+	/* A single quiet process runs in place */
+	if (params->num_procs == 1 && !storm)
+		return run_process(params, op, size, params->num_threads, 0, -1, -1, result);
+
+	if (pipe(ready_pipe))
+		goto err_pipe;
+	if (pipe(go_pipe)) {
+		close(ready_pipe[0]);
+		close(ready_pipe[1]);
+		goto err_pipe;
+	}
+
+	close_fds[0] = ready_pipe[0];
+	close_fds[1] = go_pipe[1];
+	num_close_fds = 2;
+
+	if (storm) {
+		close_fds[num_close_fds] = go_pipe[0];
+		storm_pid = fork_process(params, params->storm_op, params->storm_size,
+					 params->storm_threads, 1, ready_pipe[1], -1, &storm_fd,
+					 close_fds, num_close_fds + 1);
+		if (storm_pid < 0 || read(ready_pipe[0], &c, 1) != 1) {
+			close(go_pipe[1]);
+			rc = 1;
+			goto out;
+		}
+	}
+
+	if (storm_fd >= 0)
+		close_fds[num_close_fds++] = storm_fd;
+
+	for (i = 0; i < params->num_procs; i++) {
+		pids[i] = fork_process(params, op, size, params->num_threads, 0, ready_pipe[1], go_pipe[0], &result_fds[i],
+				       close_fds, num_close_fds);
+		if (pids[i] < 0) {
+			fprintf(stderr, " Couldn't start process %d\n", i);
+			exit(1);
+		}
+		close_fds[num_close_fds++] = result_fds[i];
+	}
+
+	for (i = 0; i < params->num_procs; i++) {
+		if (read(ready_pipe[0], &c, 1) != 1)
+			rc = 1;
+	}
+	/* EOF on the go pipe starts them all */
+	close(go_pipe[1]);
+
+	for (i = 0; i < params->num_procs; i++) {
+		struct case_result proc_result;
+
+		if (read_full(result_fds[i], &proc_result, sizeof(proc_result))) {
+			fprintf(stderr, " Lost the results of process %d\n", i);
+			rc = 1;
+		} else {
+			merge_result(result, &proc_result);
+		}
+		close(result_fds[i]);
+		waitpid(pids[i], NULL, 0);
+	}
+	rc |= result->rc;
+
+out:
+	if (storm_pid > 0) {
+		kill(storm_pid, SIGTERM);
+		if (read_full(storm_fd, storm_result, sizeof(*storm_result)))
+			fprintf(stderr, " Lost the results of the storm process\n");
+		close(storm_fd);
+		waitpid(storm_pid, NULL, 0);
+	}
+	close(ready_pipe[0]);
+	close(ready_pipe[1]);
+	close(go_pipe[0]);
+	return rc;
+
+err_pipe:
+	fprintf(stderr, " Couldn't create pipe: %s\n", strerror(errno));
+	return 1;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static void add_rows(enum ctrl_op op, uint64_t size, int storm, const struct case_result *result)
+{
+	double seconds = result->end_ns > result->start_ns ? (result->end_ns - result->start_ns) / 1e9 : 0;
+	enum ctrl_metric m;
+
+	for (m = op_first_metric[op]; m < op_first_metric[op + 1]; m++) {
+		const struct metric_result *mr = &result->metrics[m - op_first_metric[op]];
+		struct result_row *row = &rows[num_rows];
+		int i;
+
+		if (!mr->hist.total && !mr->errors)
+			continue;
+
+		memset(row, 0, sizeof(*row));
+		row->metric = m;
+		row->size = size;
+		row->storm = storm;
+		row->baseline = -1;
+		row->count = mr->hist.total;
+		row->errors = mr->errors;
+		row->rate = seconds > 0 ? result->objects / seconds : 0;
+		row->avg_us = hist_mean(&mr->hist) / 1e3;
+		row->p50_us = hist_percentile(&mr->hist, 50) / 1e3;
+		row->p99_us = hist_percentile(&mr->hist, 99) / 1e3;
+		row->p99_9_us = hist_percentile(&mr->hist, 99.9) / 1e3;
+		row->max_us = mr->hist.total ? mr->hist.max / 1e3 : 0;
+
+		for (i = num_rows - 1; storm && i >= 0; i--) {
+			if (!rows[i].storm && rows[i].metric == row->metric && rows[i].size == size) {
+				row->baseline = i;
+				break;
+			}
+		}
+		num_rows++;
+	}
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static void print_row(const struct ctrl_bench_params *params, const struct result_row *row)
+{
+	printf(" %-15s %-11lu %-6s %-9" PRIu64 " %-7" PRIu64 " %-15.1f %-9.2f %-9.2f %-9.2f %-10.2f %-9.2f\n",
+	       metric_names[row->metric], (unsigned long)row->size,
+	       row->storm ? op_names[params->storm_op] : "-",
+	       row->count, row->errors, row->rate,
+	       row->avg_us, row->p50_us, row->p99_us, row->p99_9_us, row->max_us);
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static void print_storm_impact(void)
+{
+	int i;
+
+	printf("---------------------------------------------------------------------------------------\n");
+	printf(" Storm impact, ratio to the quiet run\n");
+	printf(" %-15s %-11s %-12s %-11s %-11s %-11s\n", "#verb", "size", "rate drop[%]", "avg", "p99", "p99.9");
+	for (i = 0; i < num_rows; i++) {
+		const struct result_row *row = &rows[i];
+		const struct result_row *base;
+
+		if (!row->storm || row->baseline < 0)
+			continue;
+		base = &rows[row->baseline];
+		printf(" %-15s %-11lu %-12.1f %-11.2f %-11.2f %-11.2f\n",
+		       metric_names[row->metric], (unsigned long)row->size,
+		       base->rate > 0 ? 100.0 * (base->rate - row->rate) / base->rate : 0,
+		       base->avg_us > 0 ? row->avg_us / base->avg_us : 0,
+		       base->p99_us > 0 ? row->p99_us / base->p99_us : 0,
+		       base->p99_9_us > 0 ? row->p99_9_us / base->p99_9_us : 0);
+	}
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static FILE *open_output(const char *file_name)
+{
+	FILE *fp;
+
+	if (!strcmp(file_name, "-"))
+		return stdout;
+
+	fp = fopen(file_name, "w");
+	if (!fp)
+		fprintf(stderr, " Cannot open %s: %s\n", file_name, strerror(errno));
+	return fp;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static int write_results_csv(const struct ctrl_bench_params *params, const char *file_name)
+{
+	FILE *fp = open_output(file_name);
+	int i;
+
+	if (!fp)
+		return 1;
+
+	fprintf(fp, "verb,size,procs,threads,storm,count,errors,rate_objs_per_sec,avg_us,p50_us,p99_us,p99_9_us,max_us,"
+		"rate_ratio,p99_ratio\n");
+	for (i = 0; i < num_rows; i++) {
+		const struct result_row *row = &rows[i];
+
+		fprintf(fp, "%s,%lu,%d,%d,%s,%" PRIu64 ",%" PRIu64 ",%.1f,%.2f,%.2f,%.2f,%.2f,%.2f,",
+			metric_names[row->metric], (unsigned long)row->size, params->num_procs, params->num_threads,
+			row->storm ? op_names[params->storm_op] : "", row->count, row->errors, row->rate,
+			row->avg_us, row->p50_us, row->p99_us, row->p99_9_us, row->max_us);
+		if (row->baseline >= 0 && rows[row->baseline].rate > 0 && rows[row->baseline].p99_us > 0)
+			fprintf(fp, "%.4f,%.4f\n", row->rate / rows[row->baseline].rate,
+				row->p99_us / rows[row->baseline].p99_us);
+		else
+			fprintf(fp, ",\n");
+	}
+
+	if (fp != stdout)
+		fclose(fp);
+	return 0;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static int write_results_json(const struct ctrl_bench_params *params, const char *file_name)
+{
+	FILE *fp = open_output(file_name);
+	int i;
+
+	if (!fp)
+		return 1;
+
+	fprintf(fp, "{\n\"device\": \"%s\",\n\"procs\": %d,\n\"threads\": %d,\n\"iters\": %d,\n\"batch\": %d,\n",
+		params->ib_devname, params->num_procs, params->num_threads, params->iters, params->batch);
+	if (params->storm_op >= 0)
+		fprintf(fp, "\"storm\": \"%s\",\n\"storm_size\": %lu,\n\"storm_threads\": %d,\n",
+			op_names[params->storm_op], (unsigned long)params->storm_size, params->storm_threads);
+	fprintf(fp, "\"results\": [\n");
+	for (i = 0; i < num_rows; i++) {
+		const struct result_row *row = &rows[i];
+
+		fprintf(fp, "{\"verb\": \"%s\", \"size\": %lu, \"storm\": %s, \"count\": %" PRIu64 ", \"errors\": %" PRIu64
+			", \"rate_objs_per_sec\": %.1f, \"avg_us\": %.2f, \"p50_us\": %.2f, \"p99_us\": %.2f"
+			", \"p99_9_us\": %.2f, \"max_us\": %.2f",
+			metric_names[row->metric], (unsigned long)row->size, row->storm ? "true" : "false",
+			row->count, row->errors, row->rate, row->avg_us, row->p50_us, row->p99_us,
+			row->p99_9_us, row->max_us);
+		if (row->baseline >= 0 && rows[row->baseline].rate > 0 && rows[row->baseline].p99_us > 0)
+			fprintf(fp, ", \"rate_ratio\": %.4f, \"p99_ratio\": %.4f",
+				row->rate / rows[row->baseline].rate, row->p99_us / rows[row->baseline].p99_us);
+		fprintf(fp, "}%s\n", i == num_rows - 1 ? "" : ",");
+	}
+	fprintf(fp, "]\n}\n");
+
+	if (fp != stdout)
+		fclose(fp);
+	return 0;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static int parse_args(struct ctrl_bench_params *params, int argc, char *argv[])
+{
+	static const struct option long_options[] = {
+		{ .name = "ib-dev",		.has_arg = 1, .val = 'd' },
+		{ .name = "ib-port",		.has_arg = 1, .val = 'i' },
+		{ .name = "gid-index",		.has_arg = 1, .val = 'x' },
+		{ .name = "ops",		.has_arg = 1, .val = 'o' },
+		{ .name = "threads",		.has_arg = 1, .val = 't' },
+		{ .name = "procs",		.has_arg = 1, .val = 'P' },
+		{ .name = "iters",		.has_arg = 1, .val = 'n' },
+		{ .name = "batch",		.has_arg = 1, .val = 'b' },
+		{ .name = "mr_sizes",		.has_arg = 1, .val = 'M' },
+		{ .name = "cq_sizes",		.has_arg = 1, .val = 'C' },
+		{ .name = "qp_depths",		.has_arg = 1, .val = 'Q' },
+		{ .name = "qp_state",		.has_arg = 1, .val = 'S' },
+		{ .name = "storm",		.has_arg = 1, .val = 'W' },
+		{ .name = "storm_threads",	.has_arg = 1, .val = 'T' },
+		{ .name = "csv",		.has_arg = 1, .val = 'c' },
+		{ .name = "json",		.has_arg = 1, .val = 'J' },
+		{ .name = "help",		.has_arg = 0, .val = 'h' },
+		{ 0 }
+	};
+	const char *mr_sizes = DEF_MR_SIZES, *cq_sizes = DEF_CQ_SIZES, *qp_depths = DEF_QP_DEPTHS;
+	char *ops = NULL, *token, *saveptr = NULL, *colon;
+	int c, op;
+
+	params->ib_port = 1;
+	params->gid_index = -1;
+	params->num_threads = 1;
+	params->num_procs = 1;
+	params->iters = DEF_ITERS;
+	params->batch = 1;
+	params->qp_rts = 1;
+	params->storm_op = -1;
+	params->storm_threads = 1;
+
+	while ((c = getopt_long(argc, argv, "d:i:x:o:t:P:n:b:h", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'd': params->ib_devname = optarg; break;
+		case 'i': params->ib_port = strtol(optarg, NULL, 0); break;
+		case 'x': params->gid_index = strtol(optarg, NULL, 0); break;
+		case 'o': ops = optarg; break;
+		case 't': params->num_threads = strtol(optarg, NULL, 0); break;
+		case 'P': params->num_procs = strtol(optarg, NULL, 0); break;
+		case 'n': params->iters = strtol(optarg, NULL, 0); break;
+		case 'b': params->batch = strtol(optarg, NULL, 0); break;
+		case 'M': mr_sizes = optarg; break;
+		case 'C': cq_sizes = optarg; break;
+		case 'Q': qp_depths = optarg; break;
+		case 'S':
+			if (!strcmp(optarg, "init")) {
+				params->qp_rts = 0;
+			} else if (strcmp(optarg, "rts")) {
+				fprintf(stderr, " --qp_state must be init or rts\n");
+				return 1;
+			}
+			break;
+		case 'W':
+			colon = strchr(optarg, ':');
+			if (colon)
+				*colon = '\0';
+			params->storm_op = parse_op(optarg);
+			if (params->storm_op < 0 || (colon && parse_size(colon + 1, &params->storm_size)))
+				return 1;
+			break;
+		case 'T': params->storm_threads = strtol(optarg, NULL, 0); break;
+		case 'c': params->csv_file = optarg; break;
+		case 'J': params->json_file = optarg; break;
+		case 'h': usage(); exit(0);
+		default:
+			fprintf(stderr, CTRL_BENCH_USAGE);
+			return 1;
+		}
+	}
+
+	if (optind != argc || !params->ib_devname) {
+		fprintf(stderr, CTRL_BENCH_USAGE);
+		return 1;
+	}
+
+	if (params->num_threads < 1 || params->num_threads > MAX_THREADS ||
+	    params->num_procs < 1 || params->num_procs > MAX_PROCS ||
+	    params->storm_threads < 1 || params->storm_threads > MAX_THREADS ||
+	    params->iters < 1 || params->batch < 1 || params->batch > MAX_BATCH) {
+		fprintf(stderr, " Threads, processes, iterations and batch must be positive"
+			" (at most %d threads, %d processes, batches of %d)\n", MAX_THREADS, MAX_PROCS, MAX_BATCH);
+		return 1;
+	}
+
+	if (ops) {
+		for (token = strtok_r(ops, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+			op = parse_op(token);
+			if (op < 0)
+				return 1;
+			params->ops[op] = 1;
+		}
+	} else {
+		for (op = 0; op < NUM_OPS; op++)
+			params->ops[op] = 1;
+	}
+
+	params->sizes[OP_PD][0] = 0;
+	params->num_sizes[OP_PD] = 1;
+	if (parse_size_list(mr_sizes, params->sizes[OP_MR], &params->num_sizes[OP_MR]) ||
+	    parse_size_list(cq_sizes, params->sizes[OP_CQ], &params->num_sizes[OP_CQ]) ||
+	    parse_size_list(qp_depths, params->sizes[OP_QP], &params->num_sizes[OP_QP]))
+		return 1;
+
+	/* Without a size the storm churns the smallest objects of its kind */
+	if (params->storm_op >= 0 && !params->storm_size && params->storm_op != OP_PD)
+		params->storm_size = params->storm_op == OP_MR ? 4096 : params->storm_op == OP_CQ ? 64 : 128;
+
+	return 0;
+}
+
+/******************************************************************************
+ ******************************************************************************/
+int main(int argc, char *argv[])
+{
+	struct ctrl_bench_params params;
+	struct case_result result, storm_result;
+	struct ctrl_device dev;
+	int op, s, storm, first, failed = 0;
+
+	memset(&params, 0, sizeof(params));
+	if (parse_args(&params, argc, argv))
+		return 1;
+
+	/* Fail early, rather than once per case */
+	if (open_ctrl_device(&params, &dev))
+		return 1;
+	close_ctrl_device(&dev);
+
+	printf(" Control verbs on %s port %d, %d process(es) x %d thread(s), %d objects per thread, batches of %d\n",
+	       params.ib_devname, params.ib_port, params.num_procs, params.num_threads, params.iters, params.batch);
+	if (params.storm_op >= 0)
+		printf(" Every case runs again next to a %s storm of %d thread(s)\n",
+		       op_names[params.storm_op], params.storm_threads);
+
+	printf("---------------------------------------------------------------------------------------\n");
+	printf(" %-15s %-11s %-6s %-9s %-7s %-15s %-9s %-9s %-9s %-10s %-9s\n", "#verb", "size", "storm",
+	       "count", "errors", "rate[objs/sec]", "avg[us]", "p50[us]", "p99[us]", "p99.9[us]", "max[us]");
+
+	for (op = 0; op < NUM_OPS; op++) {
+		if (!params.ops[op])
+			continue;
+
+		for (s = 0; s < params.num_sizes[op]; s++) {
+			for (storm = 0; storm <= (params.storm_op >= 0); storm++) {
+				if (run_case(&params, op, params.sizes[op][s], storm, &result, &storm_result))
+					failed = 1;
+
+				first = num_rows;
+				add_rows(op, params.sizes[op][s], storm, &result);
+				for (; first < num_rows; first++)
+					print_row(&params, &rows[first]);
+				if (storm && storm_result.end_ns > storm_result.start_ns)
+					printf(" # %s storm: %.1f objs/sec%s\n", op_names[params.storm_op],
+					       storm_result.objects / ((storm_result.end_ns - storm_result.start_ns) / 1e9),
+					       storm_result.rc ? ", with errors" : "");
+				fflush(stdout);
+			}
+		}
+	}
+
+	if (params.storm_op >= 0)
+		print_storm_impact();
+	printf("---------------------------------------------------------------------------------------\n");
+
+	if (params.csv_file && write_results_csv(&params, params.csv_file))
+		failed = 1;
+	if (params.json_file && write_results_json(&params, params.json_file))
+		failed = 1;
+
+	if (failed)
+		fprintf(stderr, " Some verbs failed, see the errors column\n");
+	return failed;
+}
@@ -0,0 +1,186 @@
+/* SPDX-License-Identifier: GPL-2.0 OR BSD-2-Clause */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#if !defined(__FreeBSD__)
+#include <linux/mempolicy.h>
+#endif
+#include "hugepage_memory.h"
+#include "perftest_parameters.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT	(26)
+#endif
+
+#define SMALL_PAGE_SIZE	(4096)
+#define MAX_NUMA_NODES	(1024)
+
+
+struct hugepage_memory_ctx {
+	struct memory_ctx base;
+	uint64_t page_size;
+	int numa_node;
+	const char *ib_devname;
+};
+
+
+int hugepage_memory_parse_size(const char *str, uint64_t *page_size)
+{
+	if (!strcmp(str, "2M") || !strcmp(str, "2m")) {
+		*page_size = 1ULL << 21;
+		return SUCCESS;
+	}
+	if (!strcmp(str, "1G") || !strcmp(str, "1g")) {
+		*page_size = 1ULL << 30;
+		return SUCCESS;
+	}
+	return FAILURE;
+}
+
+#if !defined(__FreeBSD__)
+static int device_numa_node(const char *ib_devname)
+{
+	char path[256];
+	FILE *fp;
+	int node = -1;
+
+	if (!ib_devname)
+		return -1;
+
+	snprintf(path, sizeof(path), "/sys/class/infiniband/%s/device/numa_node", ib_devname);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	if (fscanf(fp, "%d", &node) != 1)
+		node = -1;
+	fclose(fp);
+	return node;
+}
+
+static int bind_to_node(void *addr, uint64_t size, int node)
+{
+	unsigned long mask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
+
+	if (node < 0 || node >= MAX_NUMA_NODES)
+		return FAILURE;
+
+	memset(mask, 0, sizeof(mask));
+	mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+
+	/* Must precede the first touch, pages are placed when faulted in */
+	if (syscall(SYS_mbind, addr, size, MPOL_BIND, mask, MAX_NUMA_NODES + 1, MPOL_MF_STRICT)) {
+		fprintf(stderr, "Couldn't bind buffer to NUMA node %d: %s\n", node, strerror(errno));
+		return FAILURE;
+	}
+	return SUCCESS;
+}
+#endif
+
+int hugepage_memory_init(struct memory_ctx *ctx) {
+#if defined(__FreeBSD__)
+	fprintf(stderr, "Hugepage buffers are not supported on FreeBSD\n");
+	return FAILURE;
+#else
+	struct hugepage_memory_ctx *huge_ctx = container_of(ctx, struct hugepage_memory_ctx, base);
+
+	if (huge_ctx->numa_node == HUGEPAGE_MEM_NUMA_DEVICE) {
+		huge_ctx->numa_node = device_numa_node(huge_ctx->ib_devname);
+		if (huge_ctx->numa_node < 0)
+			printf("NUMA node of %s is unknown, hugepage buffers are not bound\n",
+			       huge_ctx->ib_devname ? huge_ctx->ib_devname : "the device");
+	}
+	return SUCCESS;
+#endif
+}
+
+int hugepage_memory_destroy(struct memory_ctx *ctx) {
+	struct hugepage_memory_ctx *huge_ctx = container_of(ctx, struct hugepage_memory_ctx, base);
+
+	free(huge_ctx);
+	return SUCCESS;
+}
+
+int hugepage_memory_allocate_buffer(struct memory_ctx *ctx, int alignment, uint64_t size, int *dmabuf_fd,
+				    uint64_t *dmabuf_offset, void **addr, bool *can_init) {
+#if defined(__FreeBSD__)
+	return FAILURE;
+#else
+	struct hugepage_memory_ctx *huge_ctx = container_of(ctx, struct hugepage_memory_ctx, base);
+	uint64_t page_size = huge_ctx->page_size;
+	uint64_t buf_size = (size + page_size - 1) & ~(page_size - 1);
+	uint64_t num_pages = buf_size / page_size;
+	uint64_t off;
+	double start, elapsed;
+	struct timespec ts;
+
+	if ((uint64_t)alignment > page_size) {
+		fprintf(stderr, "Alignment %d is larger than the hugepage size\n", alignment);
+		return FAILURE;
+	}
+
+	*addr = mmap(NULL, buf_size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+		     ((__builtin_ctzll(page_size)) << MAP_HUGE_SHIFT), -1, 0);
+	if (*addr == MAP_FAILED) {
+		fprintf(stderr, "Couldn't map %lu bytes of %luMB hugepages: %s\n",
+			buf_size, page_size >> 20, strerror(errno));
+		fprintf(stderr, "Please reserve them in /sys/kernel/mm/hugepages\n");
+		return FAILURE;
+	}
+
+	if (huge_ctx->numa_node >= 0 && bind_to_node(*addr, buf_size, huge_ctx->numa_node)) {
+		munmap(*addr, buf_size);
+		return FAILURE;
+	}
+
+	/*
+	 * Fault every page in now, the timed phase then never takes a page
+	 * fault, and a shortage of hugepages fails here rather than with SIGBUS.
+	 */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	start = ts.tv_sec + ts.tv_nsec / 1e9;
+	for (off = 0; off < buf_size; off += page_size)
+		((volatile char *)*addr)[off] = 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	elapsed = ts.tv_sec + ts.tv_nsec / 1e9 - start;
+
+	printf("allocated hugepage buffer of size %lu at %p, %lu x %luMB pages on NUMA node %d, prefaulted in %.3f ms\n",
+	       size, *addr, num_pages, page_size >> 20, huge_ctx->numa_node, elapsed * 1e3);
+	printf("MR needs %lu MTT entries (%lu with 4KB pages)\n",
+	       num_pages, (size + SMALL_PAGE_SIZE - 1) / SMALL_PAGE_SIZE);
+
+	*can_init = true;
+	return SUCCESS;
+#endif
+}
+
+int hugepage_memory_free_buffer(struct memory_ctx *ctx, int dmabuf_fd, void *addr, uint64_t size) {
+	struct hugepage_memory_ctx *huge_ctx = container_of(ctx, struct hugepage_memory_ctx, base);
+	uint64_t page_size = huge_ctx->page_size;
+
+	munmap(addr, (size + page_size - 1) & ~(page_size - 1));
+	return SUCCESS;
+}
+
+struct memory_ctx *hugepage_memory_create(struct perftest_parameters *params) {
+	struct hugepage_memory_ctx *ctx;
+
+	ALLOCATE(ctx, struct hugepage_memory_ctx, 1);
+	ctx->base.init = hugepage_memory_init;
+	ctx->base.destroy = hugepage_memory_destroy;
+	ctx->base.allocate_buffer = hugepage_memory_allocate_buffer;
+	ctx->base.free_buffer = hugepage_memory_free_buffer;
+	ctx->base.copy_host_to_buffer = memcpy;
+	ctx->base.copy_buffer_to_host = memcpy;
+	ctx->base.copy_buffer_to_buffer = memcpy;
+	ctx->page_size = params->hugepage_size;
+	ctx->numa_node = params->mem_numa_node;
+	ctx->ib_devname = params->ib_devname;
+	return &ctx->base;
+}
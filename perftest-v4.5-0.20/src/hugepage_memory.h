@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: GPL-2.0 OR BSD-2-Clause */
+
+#ifndef HUGEPAGE_MEMORY_H
+#define HUGEPAGE_MEMORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "memory.h"
+
+
+#define HUGEPAGE_MEM_NUMA_DEVICE	(-1)	/* Bind to the NUMA node of the device */
+
+struct perftest_parameters;
+
+int hugepage_memory_parse_size(const char *str, uint64_t *page_size);
+
+struct memory_ctx *hugepage_memory_create(struct perftest_parameters *params);
+
+#endif /* HUGEPAGE_MEMORY_H */
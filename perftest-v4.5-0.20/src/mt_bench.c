@@ -0,0 +1,869 @@
+/*
+ * Copyright (c) 2005 Mellanox Technologies Ltd.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * $Id$
+ */
+
+/*
+ * Multi-tenant isolation benchmark driver.
+ *
+ * Reads a spec file with one tenant per line, starts a server and a client
+ * instance of the matching ib_* test for every tenant against the same local
+ * device, runs them concurrently and collects their JSON reports into one
+ * per-tenant table plus Jain's fairness index over the bandwidth tenants.
+ *
+ * Spec line format:
+ *	NAME TEST [qps=N] [size=BYTES] [rate=VALUE[g|M|p]] [arrival=const|poisson] [iters=N] [weight=W] [cpu=N] [server_cpu=N] [--perftest_flag ...]
+ *
+ * TEST is one of write_bw, write_lat, read_bw, read_lat, send_bw, send_lat,
+ * atomic_bw, atomic_lat. Tenants run for --duration seconds unless iters is
+ * given; latency percentiles are only reported by iteration based runs, and
+ * by BW tenants with arrival= set, which send open loop at rate= and time
+ * every request from its scheduled send.
+ *
+ * cpu= pins the client and server_cpu= the server of a tenant; they are two
+ * processes on one host, so under MTRDMA every tenant line is accounted as
+ * two MTRDMA tenants.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <signal.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define MAX_TENANTS		(64)
+#define MAX_TENANT_ARGS		(48)
+#define MAX_LINE_LEN		(1024)
+#define DEF_BASE_PORT		(18515)
+#define DEF_DURATION		(10)
+#define STARTUP_DELAY_US	(1000000)	/* Time given to servers to listen before clients connect */
+#define WAIT_GRACE_SEC		(60)		/* Extra time before a hung --duration tenant is killed */
+
+#define MT_BENCH_USAGE	"Usage: ib_mt_bench -d <dev> [options] <spec_file>\n"
+
+enum tenant_result_state {
+	TENANT_NOT_STARTED,
+	TENANT_RUNNING,
+	TENANT_DONE,
+	TENANT_FAILED,
+};
+
+struct tenant {
+	char		name[64];
+	char		test[16];
+	int		qps;
+	unsigned long	size;
+	char		rate[32];
+	char		arrival[16];
+	unsigned long	iters;
+	double		weight;
+	int		cpu;
+	int		server_cpu;
+	char		*extra_args[MAX_TENANT_ARGS];
+	int		num_extra_args;
+
+	int		port;
+	pid_t		server_pid;
+	pid_t		client_pid;
+	int		state;
+
+	/* Results, taken from the client side JSON report */
+	int		has_bw;
+	int		has_lat;
+	int		has_percentiles;
+	double		bw_gbps;
+	double		msg_rate_mpps;
+	double		lat_avg;
+	double		lat_p50;
+	double		lat_p99;
+	double		lat_p99_9;
+};
+
+struct mt_bench_params {
+	char		*ib_devname;
+	int		ib_port;
+	int		gid_index;
+	int		base_port;
+	int		duration;
+	char		*out_dir;
+	char		*csv_file;
+	char		*json_file;
+	char		*bin_dir;
+	char		*spec_file;
+};
+
+static const char *supported_tests[] = {
+	"write_bw", "write_lat", "read_bw", "read_lat",
+	"send_bw", "send_lat", "atomic_bw", "atomic_lat",
+};
+
+static struct tenant tenants[MAX_TENANTS];
+static int num_tenants;
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static void usage(void)
+{
+	printf(MT_BENCH_USAGE);
+	printf("\nOptions:\n");
+	printf("  -d, --ib-dev=<dev>         Use IB device <dev> for every tenant\n");
+	printf("  -i, --ib-port=<port>       Use port <port> of IB device (default 1)\n");
+	printf("  -x, --gid-index=<index>    Test uses GID with GID index\n");
+	printf("  -p, --port=<port>          First TCP port, tenant i uses port+i (default %d)\n", DEF_BASE_PORT);
+	printf("  -D, --duration=<sec>       Run time of tenants without iters= (default %d)\n", DEF_DURATION);
+	printf("  -o, --out_dir=<dir>        Directory for per-tenant logs and JSON reports (default: mkdtemp in /tmp)\n");
+	printf("  -B, --bin_dir=<dir>        Directory of the ib_* binaries (default: next to ib_mt_bench, then PATH)\n");
+	printf("      --csv=<file>           Write the per-tenant results as CSV (- for stdout)\n");
+	printf("      --json=<file>          Write the per-tenant results as JSON (- for stdout)\n");
+	printf("  -h, --help                 Display this help message\n");
+	printf("\nSpec file, one tenant per line:\n");
+	printf("  NAME TEST [qps=N] [size=BYTES] [rate=VALUE[g|M|p]] [arrival=const|poisson] [iters=N] [weight=W] [cpu=N] [server_cpu=N] [--perftest_flag ...]\n");
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static int is_supported_test(const char *test)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(supported_tests) / sizeof(supported_tests[0]); i++) {
+		if (!strcmp(test, supported_tests[i]))
+			return 1;
+	}
+	return 0;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static int is_lat_test(const struct tenant *t)
+{
+	return strstr(t->test, "_lat") != NULL;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static int parse_tenant_token(struct tenant *t, char *token, const char *spec_file, int line_no)
+{
+	char *value;
+
+	if (!strncmp(token, "--", 2)) {
+		if (t->num_extra_args == MAX_TENANT_ARGS) {
+			fprintf(stderr, " %s:%d: Too many perftest flags\n", spec_file, line_no);
+			return 1;
+		}
+		t->extra_args[t->num_extra_args++] = strdup(token);
+		return 0;
+	}
+
+	value = strchr(token, '=');
+	if (!value) {
+		fprintf(stderr, " %s:%d: Expected key=value, got %s\n", spec_file, line_no, token);
+		return 1;
+	}
+	*value++ = '\0';
+
+	if (!strcmp(token, "qps")) {
+		t->qps = strtol(value, NULL, 0);
+	} else if (!strcmp(token, "size")) {
+		t->size = strtoul(value, NULL, 0);
+	} else if (!strcmp(token, "rate")) {
+		strncpy(t->rate, value, sizeof(t->rate) - 1);
+	} else if (!strcmp(token, "arrival")) {
+		if (strcmp(value, "const") && strcmp(value, "poisson")) {
+			fprintf(stderr, " %s:%d: arrival must be const or poisson\n", spec_file, line_no);
+			return 1;
+		}
+		strncpy(t->arrival, value, sizeof(t->arrival) - 1);
+	} else if (!strcmp(token, "iters")) {
+		t->iters = strtoul(value, NULL, 0);
+	} else if (!strcmp(token, "weight")) {
+		t->weight = strtod(value, NULL);
+	} else if (!strcmp(token, "cpu")) {
+		t->cpu = strtol(value, NULL, 0);
+	} else if (!strcmp(token, "server_cpu")) {
+		t->server_cpu = strtol(value, NULL, 0);
+	} else {
+		fprintf(stderr, " %s:%d: Unknown key %s\n", spec_file, line_no, token);
+		return 1;
+	}
+
+	if (t->qps <= 0 || t->weight <= 0) {
+		fprintf(stderr, " %s:%d: qps and weight must be positive\n", spec_file, line_no);
+		return 1;
+	}
+	return 0;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static int parse_spec_file(const char *spec_file)
+{
+	char line[MAX_LINE_LEN];
+	int line_no = 0;
+	int errors = 0;
+	FILE *fp;
+
+	fp = fopen(spec_file, "r");
+	if (!fp) {
+		fprintf(stderr, " Cannot open spec file %s: %s\n", spec_file, strerror(errno));
+		return 1;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		struct tenant *t = &tenants[num_tenants];
+		char *saveptr = NULL;
+		char *name, *test, *token;
+
+		line_no++;
+		line[strcspn(line, "#\n")] = '\0';
+
+		name = strtok_r(line, " \t", &saveptr);
+		if (!name)
+			continue;
+
+		if (num_tenants == MAX_TENANTS) {
+			fprintf(stderr, " %s:%d: At most %d tenants are supported\n", spec_file, line_no, MAX_TENANTS);
+			errors++;
+			break;
+		}
+
+		test = strtok_r(NULL, " \t", &saveptr);
+		if (!test || !is_supported_test(test)) {
+			fprintf(stderr, " %s:%d: Missing or unsupported test for tenant %s\n", spec_file, line_no, name);
+			errors++;
+			continue;
+		}
+
+		memset(t, 0, sizeof(*t));
+		strncpy(t->name, name, sizeof(t->name) - 1);
+		strncpy(t->test, test, sizeof(t->test) - 1);
+		t->qps = 1;
+		t->weight = 1.0;
+		t->cpu = -1;
+		t->server_cpu = -1;
+
+		while ((token = strtok_r(NULL, " \t", &saveptr)))
+			errors += parse_tenant_token(t, token, spec_file, line_no);
+
+		if (t->arrival[0] && (!t->rate[0] || is_lat_test(t))) {
+			fprintf(stderr, " %s:%d: arrival= needs rate= and a BW test\n", spec_file, line_no);
+			errors++;
+		}
+
+		num_tenants++;
+	}
+
+	fclose(fp);
+
+	if (!errors && !num_tenants) {
+		fprintf(stderr, " No tenants in %s\n", spec_file);
+		errors++;
+	}
+	return errors;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static void report_file_name(char *buf, size_t len, const struct mt_bench_params *params,
+			     const struct tenant *t, const char *side, const char *ext)
+{
+	snprintf(buf, len, "%s/%s.%s.%s", params->out_dir, t->name, side, ext);
+}
+
+/******************************************************************************
+ * Translate rate=VALUE[g|M|p] into perftest's SW rate limiter flags, or into
+ * the open loop schedule when arrival= is given.
+ ******************************************************************************/
+static int add_rate_args(char **argv, int argc, const struct tenant *t)
+{
+	static char limit_arg[MAX_TENANTS][48], units_arg[MAX_TENANTS][24], mode_arg[MAX_TENANTS][32];
+	static int slot;
+	char *end;
+	double value = strtod(t->rate, &end);
+	char units = *end ? *end : 'g';
+
+	if (slot == MAX_TENANTS)
+		slot = 0;
+
+	snprintf(limit_arg[slot], sizeof(limit_arg[slot]), "--rate_limit=%g", value);
+	snprintf(units_arg[slot], sizeof(units_arg[slot]), "--rate_units=%c", units);
+	argv[argc++] = limit_arg[slot];
+	argv[argc++] = units_arg[slot];
+	if (t->arrival[0])
+		snprintf(mode_arg[slot], sizeof(mode_arg[slot]), "--open_loop=%s", t->arrival);
+	else
+		snprintf(mode_arg[slot], sizeof(mode_arg[slot]), "--rate_limit_type=SW");
+	argv[argc++] = mode_arg[slot];
+	slot++;
+
+	return argc;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static pid_t start_tenant_side(const struct mt_bench_params *params, struct tenant *t, int is_client)
+{
+	char *argv[MAX_TENANT_ARGS + 32];
+	char binary[PATH_MAX], log_file[PATH_MAX], json_file[PATH_MAX];
+	char dev_arg[64], port_arg[16], ib_port_arg[24], gid_arg[32];
+	char qps_arg[16], size_arg[32], run_arg[32], json_arg[PATH_MAX + 32];
+	const char *side = is_client ? "client" : "server";
+	int cpu = is_client ? t->cpu : t->server_cpu;
+	int argc = 0, i;
+	pid_t pid;
+
+	snprintf(binary, sizeof(binary), "%s%sib_%s", params->bin_dir ? params->bin_dir : "",
+		 params->bin_dir ? "/" : "", t->test);
+	report_file_name(log_file, sizeof(log_file), params, t, side, "log");
+	report_file_name(json_file, sizeof(json_file), params, t, side, "json");
+
+	argv[argc++] = binary;
+	snprintf(dev_arg, sizeof(dev_arg), "--ib-dev=%s", params->ib_devname);
+	argv[argc++] = dev_arg;
+	snprintf(ib_port_arg, sizeof(ib_port_arg), "--ib-port=%d", params->ib_port);
+	argv[argc++] = ib_port_arg;
+	if (params->gid_index >= 0) {
+		snprintf(gid_arg, sizeof(gid_arg), "--gid-index=%d", params->gid_index);
+		argv[argc++] = gid_arg;
+	}
+	snprintf(port_arg, sizeof(port_arg), "--port=%d", t->port);
+	argv[argc++] = port_arg;
+	snprintf(qps_arg, sizeof(qps_arg), "--qp=%d", t->qps);
+	argv[argc++] = qps_arg;
+	if (t->size) {
+		snprintf(size_arg, sizeof(size_arg), "--size=%lu", t->size);
+		argv[argc++] = size_arg;
+	}
+	if (t->iters)
+		snprintf(run_arg, sizeof(run_arg), "--iters=%lu", t->iters);
+	else
+		snprintf(run_arg, sizeof(run_arg), "--duration=%d", params->duration);
+	argv[argc++] = run_arg;
+	if (t->rate[0] && is_client)
+		argc = add_rate_args(argv, argc, t);
+	argv[argc++] = "--report_gbits";
+	argv[argc++] = "--CPU-freq";
+	argv[argc++] = "--out_json";
+	snprintf(json_arg, sizeof(json_arg), "--out_json_file=%s", json_file);
+	argv[argc++] = json_arg;
+	for (i = 0; i < t->num_extra_args; i++)
+		argv[argc++] = t->extra_args[i];
+	if (is_client)
+		argv[argc++] = "localhost";
+	argv[argc] = NULL;
+
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, " Failed to fork %s of tenant %s: %s\n", side, t->name, strerror(errno));
+		return -1;
+	}
+
+	if (pid == 0) {
+		int fd = open(log_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+		if (fd >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+			close(fd);
+		}
+
+		if (cpu >= 0) {
+			cpu_set_t set;
+
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			sched_setaffinity(0, sizeof(set), &set);
+		}
+
+		if (params->bin_dir)
+			execv(binary, argv);
+		else
+			execvp(binary, argv);
+		fprintf(stderr, " Failed to exec %s: %s\n", binary, strerror(errno));
+		_exit(127);
+	}
+
+	return pid;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static struct tenant *find_tenant_by_pid(pid_t pid, int *is_client)
+{
+	int i;
+
+	for (i = 0; i < num_tenants; i++) {
+		if (tenants[i].server_pid == pid || tenants[i].client_pid == pid) {
+			*is_client = tenants[i].client_pid == pid;
+			return &tenants[i];
+		}
+	}
+	return NULL;
+}
+
+/******************************************************************************
+ * Reap every tenant process, killing the --duration tenants still running at
+ * the deadline. iters= tenants take as long as they take and are only waited for.
+ ******************************************************************************/
+static void wait_tenants(int running, time_t deadline)
+{
+	int i;
+
+	while (running > 0) {
+		int status, is_client = 0;
+		struct tenant *t;
+		pid_t pid;
+
+		pid = waitpid(-1, &status, WNOHANG);
+		if (pid < 0)
+			break;
+
+		if (pid == 0) {
+			if (time(NULL) < deadline) {
+				usleep(100000);
+				continue;
+			}
+			fprintf(stderr, " Deadline reached, killing remaining --duration tenants\n");
+			for (i = 0; i < num_tenants; i++) {
+				if (tenants[i].iters)
+					continue;
+				if (tenants[i].server_pid > 0)
+					kill(tenants[i].server_pid, SIGKILL);
+				if (tenants[i].client_pid > 0)
+					kill(tenants[i].client_pid, SIGKILL);
+			}
+			deadline = LONG_MAX;
+			continue;
+		}
+
+		running--;
+		t = find_tenant_by_pid(pid, &is_client);
+		if (!t)
+			continue;
+
+		if (is_client)
+			t->client_pid = 0;
+		else
+			t->server_pid = 0;
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, " Tenant %s %s failed (see %s.%s.log)\n", t->name,
+				is_client ? "client" : "server", t->name, is_client ? "client" : "server");
+			t->state = TENANT_FAILED;
+		} else if (!t->server_pid && !t->client_pid && t->state != TENANT_FAILED) {
+			t->state = TENANT_DONE;
+		}
+	}
+}
+
+/******************************************************************************
+ * perftest JSON reports are flat "key": value lists, no need for a real parser.
+ ******************************************************************************/
+static int json_get_double(const char *buf, const char *key, double *value)
+{
+	char pattern[64];
+	const char *pos;
+
+	snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+	pos = strstr(buf, pattern);
+	if (!pos)
+		return 1;
+
+	*value = strtod(pos + strlen(pattern), NULL);
+	return 0;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static void collect_tenant_results(const struct mt_bench_params *params, struct tenant *t)
+{
+	char json_file[PATH_MAX];
+	char buf[8192];
+	size_t len;
+	FILE *fp;
+
+	report_file_name(json_file, sizeof(json_file), params, t, "client", "json");
+	fp = fopen(json_file, "r");
+	if (!fp) {
+		t->state = TENANT_FAILED;
+		return;
+	}
+	len = fread(buf, 1, sizeof(buf) - 1, fp);
+	buf[len] = '\0';
+	fclose(fp);
+
+	if (is_lat_test(t)) {
+		t->has_lat = 1;
+		if (!json_get_double(buf, "t_typical", &t->lat_p50)) {
+			t->has_percentiles = 1;
+			json_get_double(buf, "t_avg", &t->lat_avg);
+			json_get_double(buf, "percentile_99", &t->lat_p99);
+			json_get_double(buf, "percentile_99.9", &t->lat_p99_9);
+		} else {
+			json_get_double(buf, "t_avg", &t->lat_avg);
+			/* Duration based latency runs only report transactions per second */
+			if (!json_get_double(buf, "tps_average", &t->msg_rate_mpps))
+				t->msg_rate_mpps /= 1e6;
+		}
+	} else {
+		t->has_bw = !json_get_double(buf, "BW_average", &t->bw_gbps);
+		json_get_double(buf, "MsgRate", &t->msg_rate_mpps);
+		if (!json_get_double(buf, "open_loop_t_p50", &t->lat_p50)) {
+			t->has_lat = t->has_percentiles = 1;
+			json_get_double(buf, "open_loop_t_avg", &t->lat_avg);
+			json_get_double(buf, "open_loop_percentile_99", &t->lat_p99);
+			json_get_double(buf, "open_loop_percentile_99.9", &t->lat_p99_9);
+		}
+	}
+}
+
+/******************************************************************************
+ * Jain's index over weight normalized bandwidth: 1 is a perfectly fair share.
+ ******************************************************************************/
+static double jain_fairness_index(int *count)
+{
+	double sum = 0, sum_sq = 0;
+	int i, n = 0;
+
+	for (i = 0; i < num_tenants; i++) {
+		double x;
+
+		if (tenants[i].state != TENANT_DONE || !tenants[i].has_bw)
+			continue;
+		x = tenants[i].bw_gbps / tenants[i].weight;
+		sum += x;
+		sum_sq += x * x;
+		n++;
+	}
+
+	*count = n;
+	if (!n || sum_sq == 0)
+		return 0;
+	return (sum * sum) / (n * sum_sq);
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static FILE *open_output(const char *file_name)
+{
+	FILE *fp;
+
+	if (!strcmp(file_name, "-"))
+		return stdout;
+
+	fp = fopen(file_name, "w");
+	if (!fp)
+		fprintf(stderr, " Cannot open %s: %s\n", file_name, strerror(errno));
+	return fp;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static void print_results_table(double jain, int jain_n)
+{
+	int i;
+
+	printf("---------------------------------------------------------------------------------------\n");
+	printf(" %-16s %-11s %-4s %-8s %-6s %-12s %-13s %-9s %-9s %-9s\n", "#tenant", "test", "qps", "size",
+	       "state", "BW[Gb/sec]", "MsgRate[Mpps]", "p50[us]", "p99[us]", "p99.9[us]");
+	for (i = 0; i < num_tenants; i++) {
+		const struct tenant *t = &tenants[i];
+
+		printf(" %-16s %-11s %-4d %-8lu %-6s", t->name, t->test, t->qps, t->size,
+		       t->state == TENANT_DONE ? "ok" : "failed");
+		if (t->has_bw)
+			printf(" %-12.2f", t->bw_gbps);
+		else
+			printf(" %-12s", "-");
+		printf(" %-13.6f", t->msg_rate_mpps);
+		if (t->has_percentiles)
+			printf(" %-9.2f %-9.2f %-9.2f\n", t->lat_p50, t->lat_p99, t->lat_p99_9);
+		else if (t->has_lat)
+			printf(" avg %.2f\n", t->lat_avg);
+		else
+			printf(" %-9s %-9s %-9s\n", "-", "-", "-");
+	}
+	printf("---------------------------------------------------------------------------------------\n");
+	if (jain_n > 1)
+		printf(" Jain's fairness index (%d bandwidth tenants): %.4f\n", jain_n, jain);
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static int write_results_csv(const char *file_name, double jain)
+{
+	FILE *fp = open_output(file_name);
+	int i;
+
+	if (!fp)
+		return 1;
+
+	fprintf(fp, "tenant,test,qps,size,weight,state,bw_gbps,msg_rate_mpps,lat_avg_us,lat_p50_us,lat_p99_us,lat_p99_9_us,jain_index\n");
+	for (i = 0; i < num_tenants; i++) {
+		const struct tenant *t = &tenants[i];
+
+		fprintf(fp, "%s,%s,%d,%lu,%g,%s,", t->name, t->test, t->qps, t->size, t->weight,
+			t->state == TENANT_DONE ? "ok" : "failed");
+		if (t->has_bw)
+			fprintf(fp, "%.4f", t->bw_gbps);
+		fprintf(fp, ",%.6f,", t->msg_rate_mpps);
+		if (t->has_lat)
+			fprintf(fp, "%.2f", t->lat_avg);
+		if (t->has_percentiles)
+			fprintf(fp, ",%.2f,%.2f,%.2f", t->lat_p50, t->lat_p99, t->lat_p99_9);
+		else
+			fprintf(fp, ",,,");
+		fprintf(fp, ",%.4f\n", jain);
+	}
+
+	if (fp != stdout)
+		fclose(fp);
+	return 0;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static int write_results_json(const char *file_name, double jain, int jain_n)
+{
+	FILE *fp = open_output(file_name);
+	int i;
+
+	if (!fp)
+		return 1;
+
+	fprintf(fp, "{\n\"jain_index\": %.4f,\n\"jain_tenants\": %d,\n\"tenants\": [\n", jain, jain_n);
+	for (i = 0; i < num_tenants; i++) {
+		const struct tenant *t = &tenants[i];
+
+		fprintf(fp, "{\"name\": \"%s\", \"test\": \"%s\", \"qps\": %d, \"size\": %lu, \"weight\": %g, \"state\": \"%s\"",
+			t->name, t->test, t->qps, t->size, t->weight, t->state == TENANT_DONE ? "ok" : "failed");
+		if (t->has_bw)
+			fprintf(fp, ", \"bw_gbps\": %.4f", t->bw_gbps);
+		fprintf(fp, ", \"msg_rate_mpps\": %.6f", t->msg_rate_mpps);
+		if (t->has_lat)
+			fprintf(fp, ", \"lat_avg_us\": %.2f", t->lat_avg);
+		if (t->has_percentiles)
+			fprintf(fp, ", \"lat_p50_us\": %.2f, \"lat_p99_us\": %.2f, \"lat_p99_9_us\": %.2f",
+				t->lat_p50, t->lat_p99, t->lat_p99_9);
+		fprintf(fp, "}%s\n", i == num_tenants - 1 ? "" : ",");
+	}
+	fprintf(fp, "]\n}\n");
+
+	if (fp != stdout)
+		fclose(fp);
+	return 0;
+}
+
+/******************************************************************************
+ * Default to the directory this binary lives in, so a build tree runs its own tests.
+ ******************************************************************************/
+static char *default_bin_dir(void)
+{
+	char self[PATH_MAX];
+	char *slash;
+	ssize_t len;
+
+	len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (len <= 0)
+		return NULL;
+	self[len] = '\0';
+
+	slash = strrchr(self, '/');
+	if (!slash)
+		return NULL;
+	strcpy(slash, "/ib_write_bw");
+	if (access(self, X_OK))
+		return NULL;
+
+	*slash = '\0';
+	return strdup(self);
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static int parse_args(struct mt_bench_params *params, int argc, char *argv[])
+{
+	static const struct option long_options[] = {
+		{ .name = "ib-dev",	.has_arg = 1, .val = 'd' },
+		{ .name = "ib-port",	.has_arg = 1, .val = 'i' },
+		{ .name = "gid-index",	.has_arg = 1, .val = 'x' },
+		{ .name = "port",	.has_arg = 1, .val = 'p' },
+		{ .name = "duration",	.has_arg = 1, .val = 'D' },
+		{ .name = "out_dir",	.has_arg = 1, .val = 'o' },
+		{ .name = "bin_dir",	.has_arg = 1, .val = 'B' },
+		{ .name = "csv",	.has_arg = 1, .val = 'C' },
+		{ .name = "json",	.has_arg = 1, .val = 'J' },
+		{ .name = "help",	.has_arg = 0, .val = 'h' },
+		{ 0 }
+	};
+	int c;
+
+	params->ib_port = 1;
+	params->gid_index = -1;
+	params->base_port = DEF_BASE_PORT;
+	params->duration = DEF_DURATION;
+
+	while ((c = getopt_long(argc, argv, "d:i:x:p:D:o:B:h", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'd': params->ib_devname = optarg; break;
+		case 'i': params->ib_port = strtol(optarg, NULL, 0); break;
+		case 'x': params->gid_index = strtol(optarg, NULL, 0); break;
+		case 'p': params->base_port = strtol(optarg, NULL, 0); break;
+		case 'D': params->duration = strtol(optarg, NULL, 0); break;
+		case 'o': params->out_dir = optarg; break;
+		case 'B': params->bin_dir = optarg; break;
+		case 'C': params->csv_file = optarg; break;
+		case 'J': params->json_file = optarg; break;
+		case 'h': usage(); exit(0);
+		default:
+			fprintf(stderr, MT_BENCH_USAGE);
+			return 1;
+		}
+	}
+
+	if (optind != argc - 1 || !params->ib_devname || params->duration <= 0) {
+		fprintf(stderr, MT_BENCH_USAGE);
+		return 1;
+	}
+	params->spec_file = argv[optind];
+
+	if (!params->bin_dir)
+		params->bin_dir = default_bin_dir();
+
+	if (!params->out_dir) {
+		static char tmp_dir[] = "/tmp/ib_mt_bench.XXXXXX";
+
+		params->out_dir = mkdtemp(tmp_dir);
+		if (!params->out_dir) {
+			fprintf(stderr, " Cannot create output directory: %s\n", strerror(errno));
+			return 1;
+		}
+	} else if (mkdir(params->out_dir, 0755) && errno != EEXIST) {
+		fprintf(stderr, " Cannot create %s: %s\n", params->out_dir, strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+/******************************************************************************
+ ******************************************************************************/
+int main(int argc, char *argv[])
+{
+	struct mt_bench_params params;
+	int i, running = 0, jain_n, failed = 0;
+	time_t deadline;
+	double jain;
+
+	memset(&params, 0, sizeof(params));
+	if (parse_args(&params, argc, argv))
+		return 1;
+
+	if (parse_spec_file(params.spec_file))
+		return 1;
+
+	printf(" Running %d tenants on %s, reports in %s\n", num_tenants, params.ib_devname, params.out_dir);
+
+	for (i = 0; i < num_tenants; i++) {
+		tenants[i].port = params.base_port + i;
+		tenants[i].server_pid = start_tenant_side(&params, &tenants[i], 0);
+		if (tenants[i].server_pid > 0) {
+			tenants[i].state = TENANT_RUNNING;
+			running++;
+		} else {
+			tenants[i].state = TENANT_FAILED;
+		}
+	}
+
+	usleep(STARTUP_DELAY_US);
+
+	/* Clients go in back to back, so the tenants overlap for the whole run */
+	for (i = 0; i < num_tenants; i++) {
+		if (tenants[i].state != TENANT_RUNNING)
+			continue;
+		tenants[i].client_pid = start_tenant_side(&params, &tenants[i], 1);
+		if (tenants[i].client_pid > 0)
+			running++;
+		else
+			tenants[i].state = TENANT_FAILED;
+	}
+
+	deadline = LONG_MAX;
+	for (i = 0; i < num_tenants; i++) {
+		if (!tenants[i].iters) {
+			deadline = time(NULL) + params.duration + WAIT_GRACE_SEC;
+			break;
+		}
+	}
+	wait_tenants(running, deadline);
+
+	for (i = 0; i < num_tenants; i++) {
+		if (tenants[i].state == TENANT_DONE)
+			collect_tenant_results(&params, &tenants[i]);
+		failed += tenants[i].state != TENANT_DONE;
+	}
+
+	jain = jain_fairness_index(&jain_n);
+	print_results_table(jain, jain_n);
+
+	if (params.csv_file && write_results_csv(params.csv_file, jain))
+		return 1;
+	if (params.json_file && write_results_json(params.json_file, jain, jain_n))
+		return 1;
+
+	return failed ? 1 : 0;
+}
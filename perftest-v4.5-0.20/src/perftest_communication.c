@@ -1896,6 +1896,52 @@ void check_sys_data(struct perftest_comm *user_comm, struct perftest_parameters
 
 }
 
+/******************************************************************************
+ *
+ ******************************************************************************/
+int check_sweep(struct perftest_comm *user_comm, struct perftest_parameters *user_param)
+{
+	struct perftest_sweep *sweep = user_param->sweep;
+	int num_phases = sweep ? sweep->num_phases : 0;
+	int m_num_phases = hton_int(num_phases);
+	int rem_num_phases = 0;
+	uint64_t m_phase[3], rem_phase[3];
+	int i;
+
+	if (user_param->dont_xchg_versions)
+		return SUCCESS;
+
+	if (ctx_xchg_data(user_comm,(void*)(&m_num_phases),(void*)(&rem_num_phases),sizeof(m_num_phases))) {
+		fprintf(stderr," Failed to exchange the --sweep phases between server and client\n");
+		return FAILURE;
+	}
+
+	rem_num_phases = ntoh_int(rem_num_phases);
+	if (rem_num_phases != num_phases) {
+		fprintf(stderr," --sweep has %d phases here and %d on the remote side, give the same --sweep on both\n",
+			num_phases, rem_num_phases);
+		return FAILURE;
+	}
+
+	for (i = 0; i < num_phases; i++) {
+		m_phase[0] = htobe64(sweep->phases[i].size);
+		m_phase[1] = htobe64((uint64_t)(int64_t)sweep->phases[i].inline_size);
+		m_phase[2] = htobe64((uint64_t)(int64_t)sweep->phases[i].tx_depth);
+
+		if (ctx_xchg_data(user_comm,(void*)(m_phase),(void*)(rem_phase),sizeof(m_phase))) {
+			fprintf(stderr," Failed to exchange the --sweep phases between server and client\n");
+			return FAILURE;
+		}
+
+		if (memcmp(m_phase, rem_phase, sizeof(m_phase))) {
+			fprintf(stderr," --sweep phase %d differs from the remote side, give the same --sweep on both\n", i + 1);
+			return FAILURE;
+		}
+	}
+
+	return SUCCESS;
+}
+
 /******************************************************************************
  *
  ******************************************************************************/
@@ -1936,7 +1982,13 @@ int check_mtu(struct ibv_context *context,struct perftest_parameters *user_param
 	}
 
 	if (user_param->connection_type == UD && user_param->size > MTU_SIZE(user_param->curr_mtu)) {
-		if (user_param->test_method == RUN_ALL || !user_param->req_size) {
+		/* Cutting the size would silently drop the top of the distribution */
+		if (user_param->size_dist) {
+			fprintf(stderr," Max msg size in UD is MTU %lu, the --size_dist sizes go up to %lu\n",
+				MTU_SIZE(user_param->curr_mtu), user_param->size);
+			return FAILURE;
+		}
+		if ((user_param->test_method == RUN_ALL && !user_param->sweep) || !user_param->req_size) {
 			fprintf(stderr," Max msg size in UD is MTU %lu\n",MTU_SIZE(user_param->curr_mtu));
 			fprintf(stderr," Changing to this MTU\n");
 			user_param->size = MTU_SIZE(user_param->curr_mtu);
@@ -1967,7 +2019,7 @@ int check_mtu(struct ibv_context *context,struct perftest_parameters *user_param
 
 			//coverity[uninit_use]
 			if (user_param->size > port_attr.max_msg_sz) {
-				if (user_param->test_method == RUN_ALL || !user_param->req_size) {
+				if ((user_param->test_method == RUN_ALL && !user_param->sweep) || !user_param->req_size) {
 					fprintf(stderr, " Max msg size is %u\n",
 						port_attr.max_msg_sz);
 					fprintf(stderr, " Changing to this size\n");
@@ -2010,7 +2062,7 @@ int check_mtu(struct ibv_context *context,struct perftest_parameters *user_param
 			}
 
 			if (user_param->size > efa_device_attr.max_rdma_size) {
-				if (user_param->test_method == RUN_ALL || !user_param->req_size) {
+				if ((user_param->test_method == RUN_ALL && !user_param->sweep) || !user_param->req_size) {
 					fprintf(stderr, " Max RDMA request size is %u\n",
 						efa_device_attr.max_rdma_size);
 					fprintf(stderr, " Changing to this size\n");
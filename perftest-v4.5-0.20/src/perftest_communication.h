@@ -437,6 +437,19 @@ void check_version_compatibility(struct perftest_parameters *user_param);
  */
 void check_sys_data(struct perftest_comm *user_comm, struct perftest_parameters *user_param);
 
+/* check_sweep
+ *
+ * Description : Exchanges the --sweep phases, which both sides must step
+ *		 through in the same order.
+ *
+ * Parameters :
+ *
+ *	 user_comm  - user communication struct.
+ *	 user_param - Perftest parameters.
+ * Return Value : SUCCESS, FAILURE if the phases differ.
+ */
+int check_sweep(struct perftest_comm *user_comm, struct perftest_parameters *user_param);
+
 /* check_mtu
  *
  * Description : Configures test MTU.
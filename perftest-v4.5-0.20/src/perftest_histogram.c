@@ -0,0 +1,100 @@
+#include <string.h>
+#include <math.h>
+
+#include "perftest_histogram.h"
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static cycles_t hist_bucket_highest(unsigned int bucket)
+{
+	unsigned int shift;
+
+	if (bucket < 2 * HIST_SUB_BUCKETS)
+		return bucket;
+
+	shift = bucket / HIST_SUB_BUCKETS - 1;
+	return (((cycles_t)(bucket - shift * HIST_SUB_BUCKETS)) << shift) + ((cycles_t)1 << shift) - 1;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+void hist_reset(struct perftest_hist *hist)
+{
+	memset(hist, 0, sizeof(*hist));
+	hist->min = (cycles_t)-1;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+void hist_merge(struct perftest_hist *dst, const struct perftest_hist *src)
+{
+	unsigned int i;
+
+	if (!src->total)
+		return;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->counts[i] += src->counts[i];
+
+	dst->total += src->total;
+	dst->sum += src->sum;
+	dst->sum_sq += src->sum_sq;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+cycles_t hist_percentile(const struct perftest_hist *hist, double pct)
+{
+	uint64_t target, seen = 0;
+	unsigned int i;
+
+	if (!hist->total)
+		return 0;
+
+	target = (uint64_t)ceil(hist->total * pct / 100.0);
+	if (target == 0)
+		target = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->counts[i];
+		if (seen >= target) {
+			cycles_t value = hist_bucket_highest(i);
+
+			/* The bucket may reach past the largest sample seen */
+			return value < hist->max ? value : hist->max;
+		}
+	}
+
+	return hist->max;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+double hist_mean(const struct perftest_hist *hist)
+{
+	return hist->total ? hist->sum / hist->total : 0;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+double hist_stdev(const struct perftest_hist *hist)
+{
+	double mean = hist_mean(hist);
+	double var;
+
+	if (!hist->total)
+		return 0;
+
+	var = hist->sum_sq / hist->total - mean * mean;
+	return var > 0 ? sqrt(var) : 0;
+}
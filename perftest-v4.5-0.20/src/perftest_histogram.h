@@ -0,0 +1,92 @@
+#ifndef PERFTEST_HISTOGRAM_H
+#define PERFTEST_HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "get_clock.h"
+
+/*
+ * Fixed size log-linear latency histogram (HDR-like).
+ *
+ * Values below 2 * HIST_SUB_BUCKETS are counted exactly. Above that every
+ * power of two range is split into HIST_SUB_BUCKETS linear buckets, which
+ * keeps the relative error of any reported value under 1 / HIST_SUB_BUCKETS
+ * (~1.6%) for the whole 64 bit cycle range, in a constant ~30KB.
+ */
+#define HIST_SUB_BUCKET_BITS	(6)
+#define HIST_SUB_BUCKETS	(1 << HIST_SUB_BUCKET_BITS)
+#define HIST_BUCKETS		((64 - HIST_SUB_BUCKET_BITS) * HIST_SUB_BUCKETS + HIST_SUB_BUCKETS)
+
+struct perftest_hist {
+	uint64_t	counts[HIST_BUCKETS];
+	uint64_t	total;
+	cycles_t	min;
+	cycles_t	max;
+	double		sum;
+	double		sum_sq;
+};
+
+/*
+ * Interval and cumulative histograms of one latency run.
+ * Samples go to the interval histogram, which is folded into the cumulative
+ * one and cleared every time an interval is reported.
+ */
+struct perftest_lat_hist {
+	struct perftest_hist	interval;
+	struct perftest_hist	cumulative;
+	cycles_t		last_post;
+	cycles_t		next_report;
+	cycles_t		report_cycles;
+	uint64_t		intervals;
+	double			cycles_rtt_quotient;	/* Cycles of RTT per reported latency unit */
+};
+
+static inline unsigned int hist_bucket(cycles_t value)
+{
+	unsigned int shift;
+
+	if (value < 2 * HIST_SUB_BUCKETS)
+		return value;
+
+	/* Keep the top HIST_SUB_BUCKET_BITS + 1 bits of the value */
+	shift = 63 - __builtin_clzll(value) - HIST_SUB_BUCKET_BITS;
+	return shift * HIST_SUB_BUCKETS + (value >> shift);
+}
+
+/*
+ * Record one sample in O(1).
+ */
+static inline void hist_record(struct perftest_hist *hist, cycles_t value)
+{
+	hist->counts[hist_bucket(value)]++;
+	hist->total++;
+	hist->sum += value;
+	hist->sum_sq += (double)value * value;
+	if (value < hist->min)
+		hist->min = value;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+/*
+ * Clear all samples.
+ */
+void hist_reset(struct perftest_hist *hist);
+
+/*
+ * Add the samples of src to dst.
+ */
+void hist_merge(struct perftest_hist *dst, const struct perftest_hist *src);
+
+/*
+ * Highest value equivalent to the sample at percentile pct (0-100].
+ */
+cycles_t hist_percentile(const struct perftest_hist *hist, double pct);
+
+/*
+ * Mean and standard deviation, in cycles.
+ */
+double hist_mean(const struct perftest_hist *hist);
+double hist_stdev(const struct perftest_hist *hist);
+
+#endif
@@ -14,6 +14,7 @@
 #include "raw_ethernet_resources.h"
 #include "host_memory.h"
 #include "mmap_memory.h"
+#include "hugepage_memory.h"
 #include "cuda_memory.h"
 #include "rocm_memory.h"
 #include "neuron_memory.h"
@@ -499,6 +500,12 @@ static void usage(const char *argv0, VerbType verb, TestType tst, int connection
 	if (tst == LAT) {
 		printf("      --latency_gap=<delay_time> ");
 		printf(" delay time between each post send\n");
+
+		printf("      --latency_hist ");
+		printf(" Keep latency samples in a fixed size histogram instead of per iteration arrays (also allows --run_infinitely)\n");
+
+		printf("      --hist_interval=<seconds> ");
+		printf(" With --latency_hist, also print the percentiles of every <seconds> interval\n");
 	}
 
 	if (connection_type != RawEth) {
@@ -506,11 +513,19 @@ static void usage(const char *argv0, VerbType verb, TestType tst, int connection
 		printf(" Use an mmap'd file as the buffer for testing P2P transfers.\n");
 		printf("      --mmap-offset=<offset> ");
 		printf(" Use an mmap'd file as the buffer for testing P2P transfers.\n");
+		printf("      --hugepage_mem=<2M|1G> ");
+		printf(" Allocate the buffers from 2M or 1G hugepages, NUMA local to the device and prefaulted\n");
+		printf("      --mem_numa=<node> ");
+		printf(" With --hugepage_mem, bind the buffers to <node> instead of the device's node\n");
 	}
 
 	if (tst == BW) {
 		printf("      --mr_per_qp ");
 		printf(" Create memory region for each qp.\n");
+
+		printf("      --threads=<num> ");
+		printf(" Post from <num> threads, each with its own QPs, MRs and send CQ (client side, default 1).\n");
+		printf("        Threads are pinned in order to the CPUs the process may run on (see taskset).\n");
 	}
 
 	#if defined HAVE_EX_ODP
@@ -557,6 +572,25 @@ static void usage(const char *argv0, VerbType verb, TestType tst, int connection
 
 		printf("      --run_infinitely ");
 		printf(" Run test forever, print results every <duration> seconds\n");
+
+		if (connection_type != RawEth) {
+			printf("      --size_dist=<dist> ");
+			printf(" Draw message sizes from uniform:<min>:<max>, bimodal:<small>:<large>:<fraction of small> or cdf:<file>\n");
+		}
+
+		if (connection_type != RawEth && verb != ATOMIC) {
+			printf("      --sweep=<phase>[,<phase>...] ");
+			printf(" Run the phases on the same QPs, a phase is <size>[:<inline>[:<tx_depth>]] or <min>-<max>[:...]\n");
+		}
+
+		printf("      --ts_file=<path|fd:N> ");
+		printf(" With --run_infinitely, write per interval counters to <path> or to file descriptor N\n");
+
+		printf("      --ts_format=<csv|ndjson> ");
+		printf(" Time series format, CSV (default) or one JSON object per line\n");
+
+		printf("      --ts_interval=<msec> ");
+		printf(" Time series interval (default: <duration> seconds)\n");
 	}
 
 	if (connection_type != RawEth) {
@@ -647,6 +681,10 @@ static void usage(const char *argv0, VerbType verb, TestType tst, int connection
 		printf(" [HW/SW/PP] Limit the QP's by HW, PP or by SW. Disabled by default. When rate_limit is not specified HW limit is Default.\n");
 		printf("        Note: in Latency under load test SW rate limit is forced\n");
 
+		printf("      --open_loop=<process>");
+		printf(" [const/poisson] Post at --rate_limit on a fixed or Poisson schedule, independent of completions,\n");
+		printf("        and report the latency of every request from its scheduled send time. Forces --cq-mod=1.\n");
+
 	}
 	#if defined HAVE_OOO_ATTR
 	printf("      --use_ooo ");
@@ -839,6 +877,8 @@ static void init_perftest_params(struct perftest_parameters *user_param)
 	user_param->mlu_device_id	= 0;
 	user_param->mmap_file		= NULL;
 	user_param->mmap_offset		= 0;
+	user_param->hugepage_size	= 0;
+	user_param->mem_numa_node	= HUGEPAGE_MEM_NUMA_DEVICE;
 	user_param->iters_per_port[0]	= 0;
 	user_param->iters_per_port[1]	= 0;
 	user_param->wait_destroy	= 0;
@@ -867,6 +907,16 @@ static void init_perftest_params(struct perftest_parameters *user_param)
 	user_param->cpu_util			= 0;
 	user_param->out_json			= 0;
 	user_param->out_json_file_name = strdup(DEFAULT_JSON_FILE_NAME);
+	user_param->latency_hist		= 0;
+	user_param->hist_interval		= 0;
+	user_param->open_loop			= OPEN_LOOP_OFF;
+	user_param->num_threads			= 1;
+	user_param->ts_file			= NULL;
+	user_param->ts_format			= TS_FORMAT_CSV;
+	user_param->ts_interval			= 0;
+	user_param->size_dist_spec		= NULL;
+	user_param->size_dist			= NULL;
+	user_param->sweep			= NULL;
 	user_param->cpu_util_data.enable	= 0;
 	user_param->retry_count			= DEF_RETRY_COUNT;
 	user_param->dont_xchg_versions		= 0;
@@ -1104,6 +1154,69 @@ void flow_rules_force_dependecies(struct perftest_parameters *user_param)
 	return;
 }
 
+/******************************************************************************
+ * --sweep=<phase>[,<phase>...], a phase is <size>[:<inline>[:<tx_depth>]] and
+ * <min>-<max> stands for all the powers of two in between. Empty fields keep
+ * the value of the test.
+ ******************************************************************************/
+static int parse_sweep(char *spec, struct perftest_sweep **sweep_ptr)
+{
+	struct perftest_sweep *sweep;
+	char *phase, *saveptr = NULL;
+
+	ALLOCATE(sweep, struct perftest_sweep, 1);
+	memset(sweep, 0, sizeof(struct perftest_sweep));
+
+	for (phase = strtok_r(spec, ",", &saveptr); phase; phase = strtok_r(NULL, ",", &saveptr)) {
+		unsigned long long min, max, size;
+		long inline_size = -1, tx_depth = -1;
+		char *end;
+
+		min = strtoull(phase, &end, 0);
+		max = min;
+		if (*end == '-')
+			max = strtoull(end + 1, &end, 0);
+		if (*end == ':') {
+			end++;
+			if (*end != ':' && *end != '\0')
+				inline_size = strtol(end, &end, 0);
+		}
+		if (*end == ':') {
+			tx_depth = strtol(end + 1, &end, 0);
+			if (tx_depth < 1)
+				goto inval;
+		}
+		if (*end != '\0' || min < 1 || min > max || max > UINT_MAX / 2 || inline_size < -1)
+			goto inval;
+
+		for (size = min; size <= max; size = (size < max && size * 2 > max) ? max : size * 2) {
+			if (sweep->num_phases == MAX_SWEEP_PHASES) {
+				fprintf(stderr, " Too many sweep phases, at most %d\n", MAX_SWEEP_PHASES);
+				free(sweep);
+				return FAILURE;
+			}
+			sweep->phases[sweep->num_phases].size = size;
+			sweep->phases[sweep->num_phases].inline_size = inline_size;
+			sweep->phases[sweep->num_phases].tx_depth = tx_depth;
+			sweep->num_phases++;
+		}
+	}
+
+	if (!sweep->num_phases) {
+		fprintf(stderr, " Empty sweep\n");
+		free(sweep);
+		return FAILURE;
+	}
+
+	*sweep_ptr = sweep;
+	return SUCCESS;
+
+inval:
+	fprintf(stderr, " Invalid sweep phase %s, use <size>[:<inline>[:<tx_depth>]] or <min>-<max>[:...]\n", phase);
+	free(sweep);
+	return FAILURE;
+}
+
 /******************************************************************************
  *
  ******************************************************************************/
@@ -1114,6 +1227,24 @@ static void force_dependecies(struct perftest_parameters *user_param)
 		user_param->rx_depth = DEF_RX_RDMA;
 	}
 
+	/* The sweep phases share the QPs, which are created for the largest tx depth */
+	if (user_param->sweep) {
+		int i;
+
+		if (user_param->tst != BW || user_param->verb == ATOMIC || user_param->test_type == DURATION ||
+		    user_param->connection_type == RawEth) {
+			printf(RESULT_LINE);
+			fprintf(stderr," --sweep is supported in non atomic BW tests in iterations mode only\n");
+			exit(1);
+		}
+
+		user_param->sweep->tx_depth = user_param->tx_depth;
+		for (i = 0; i < user_param->sweep->num_phases; i++) {
+			if (user_param->sweep->phases[i].tx_depth > user_param->tx_depth)
+				user_param->tx_depth = user_param->sweep->phases[i].tx_depth;
+		}
+	}
+
 	if (user_param->test_method != RUN_INFINITELY && user_param->test_type == ITERATIONS) {
 		if (user_param->tx_depth > user_param->iters) {
 			user_param->tx_depth = user_param->iters;
@@ -1135,6 +1266,37 @@ static void force_dependecies(struct perftest_parameters *user_param)
 		}
 	}
 
+	if (user_param->memory_type == MEMORY_HUGEPAGE && user_param->use_hugepages) {
+		printf(RESULT_LINE);
+		fprintf(stderr," --hugepage_mem and --use_hugepages are mutually exclusive\n");
+		exit(1);
+	}
+
+	if (user_param->memory_type != MEMORY_HUGEPAGE && user_param->mem_numa_node != HUGEPAGE_MEM_NUMA_DEVICE) {
+		printf(RESULT_LINE);
+		fprintf(stderr," --mem_numa requires --hugepage_mem\n");
+		exit(1);
+	}
+
+	/* Message size distribution dependencies, buffers are sized for the largest message */
+	if (user_param->size_dist_spec) {
+		if (user_param->tst != BW || user_param->duplex || user_param->test_method != RUN_REGULAR ||
+		    user_param->verb == ATOMIC || user_param->connection_type == RawEth) {
+			printf(RESULT_LINE);
+			fprintf(stderr," --size_dist is supported in unidirectional non atomic BW tests, without -a or --run_infinitely\n");
+			exit(1);
+		}
+		if (user_param->post_list > 1 || user_param->num_threads > 1 || user_param->aes_xts) {
+			printf(RESULT_LINE);
+			fprintf(stderr," --size_dist can't be used with -l, --threads or --aes_xts\n");
+			exit(1);
+		}
+		if (size_dist_parse(user_param->size_dist_spec, &user_param->size_dist))
+			exit(1);
+		user_param->size = user_param->size_dist->max;
+		user_param->noPeak = ON;
+	}
+
 	/* we disable cq_mod for large message size to prevent from incorrect BW calculation
 	 *    (and also because it is not needed)
 	 * we don't disable cq_mod for UD because it doesn't support large enough messages
@@ -1173,8 +1335,18 @@ static void force_dependecies(struct perftest_parameters *user_param)
 	if (user_param->verb == READ || user_param->verb == ATOMIC)
 		user_param->inline_size = 0;
 
-	if (user_param->test_method == RUN_ALL)
+	if (user_param->test_method == RUN_ALL) {
 		user_param->size = MAX_SIZE;
+		if (user_param->sweep) {
+			int i;
+
+			user_param->size = 0;
+			for (i = 0; i < user_param->sweep->num_phases; i++) {
+				if (user_param->sweep->phases[i].size > user_param->size)
+					user_param->size = user_param->sweep->phases[i].size;
+			}
+		}
+	}
 
 	if (user_param->verb == ATOMIC && user_param->size != DEF_SIZE_ATOMIC) {
 		printf(RESULT_LINE);
@@ -1473,6 +1645,51 @@ static void force_dependecies(struct perftest_parameters *user_param)
 		user_param->noPeak = ON;
 	}
 
+	/* Streaming latency histogram dependencies */
+	if (user_param->latency_hist) {
+		if (user_param->tst != LAT) {
+			printf(RESULT_LINE);
+			fprintf(stderr," --latency_hist is supported in latency tests only\n");
+			exit(1);
+		}
+		if (user_param->r_flag->unsorted || user_param->r_flag->histogram) {
+			printf(RESULT_LINE);
+			fprintf(stderr," --latency_hist does not keep individual samples, it can't be used with -U or -H\n");
+			exit(1);
+		}
+		/* Samples go to the histogram, only tposted[0] is needed for duration runs */
+		user_param->noPeak = ON;
+		if (user_param->test_method == RUN_INFINITELY && !user_param->hist_interval)
+			user_param->hist_interval = user_param->duration;
+	} else if (user_param->hist_interval) {
+		printf(RESULT_LINE);
+		fprintf(stderr," --hist_interval requires --latency_hist\n");
+		exit(1);
+	}
+
+	/* Open loop dependencies, the schedule replaces the rate limiter */
+	if (user_param->open_loop != OPEN_LOOP_OFF) {
+		if (user_param->tst != BW || user_param->duplex || user_param->use_event) {
+			printf(RESULT_LINE);
+			fprintf(stderr," --open_loop is supported in unidirectional BW tests without events only\n");
+			exit(1);
+		}
+		if (user_param->rate_limit <= 0 || user_param->is_rate_limit_type) {
+			printf(RESULT_LINE);
+			fprintf(stderr," --open_loop requires --rate_limit (with --rate_units) and can't be used with --rate_limit_type\n");
+			exit(1);
+		}
+		if (user_param->post_list > 1 || user_param->flows != DEF_FLOWS || user_param->test_method == RUN_INFINITELY) {
+			printf(RESULT_LINE);
+			fprintf(stderr," --open_loop posts single WQEs of one flow, it can't be used with -l, --flows or --run_infinitely\n");
+			exit(1);
+		}
+		/* Every request is signaled and timed */
+		user_param->rate_limit_type = DISABLE_RATE_LIMIT;
+		user_param->cq_mod = 1;
+		user_param->noPeak = ON;
+	}
+
 	/* Run infinitely dependencies */
 	if (user_param->test_method == RUN_INFINITELY) {
 		if (user_param->noPeak == OFF && user_param->tst == BW)
@@ -1485,9 +1702,9 @@ static void force_dependecies(struct perftest_parameters *user_param)
 			exit(1);
 		}
 
-		if (user_param->tst == LAT) {
+		if (user_param->tst == LAT && !user_param->latency_hist) {
 			printf(RESULT_LINE);
-			fprintf(stderr," run_infinitely exists only in BW tests for now.\n");
+			fprintf(stderr," run_infinitely exists only in BW tests, or in latency tests with --latency_hist.\n");
 			exit(1);
 
 		}
@@ -1741,6 +1958,55 @@ static void force_dependecies(struct perftest_parameters *user_param)
 		user_param->rate_limit = user_param->rate_limit * 8 * 1024;
 	}
 
+	/* Time series dependencies */
+	if (user_param->ts_file) {
+		if (user_param->tst != BW || user_param->test_method != RUN_INFINITELY || user_param->duplex) {
+			printf(RESULT_LINE);
+			fprintf(stderr," --ts_file is supported in unidirectional BW tests with --run_infinitely only\n");
+			exit(1);
+		}
+		if (!user_param->ts_interval)
+			user_param->ts_interval = user_param->duration * 1000;
+	} else if (user_param->ts_interval) {
+		printf(RESULT_LINE);
+		fprintf(stderr," --ts_interval requires --ts_file\n");
+		exit(1);
+	}
+
+	/* Multi threaded posting dependencies, only the client posts in unidirectional tests */
+	if (user_param->num_threads > 1 && user_param->machine == SERVER)
+		user_param->num_threads = 1;
+
+	if (user_param->num_threads > 1) {
+		if (user_param->tst != BW || user_param->duplex || user_param->use_event ||
+		    user_param->connection_type == DC || user_param->connection_type == RawEth || user_param->use_xrc) {
+			printf(RESULT_LINE);
+			fprintf(stderr," --threads is supported in unidirectional RC/UC/UD/SRD BW tests without events only\n");
+			exit(1);
+		}
+		if (user_param->rate_limit_type == SW_RATE_LIMIT || user_param->open_loop != OPEN_LOOP_OFF ||
+		    user_param->flows != DEF_FLOWS || user_param->report_per_port || user_param->test_method == RUN_INFINITELY) {
+			printf(RESULT_LINE);
+			fprintf(stderr," --threads can't be used with the SW rate limiter, --open_loop, --flows, --report-per-port or --run_infinitely\n");
+			exit(1);
+		}
+		#ifdef HAVE_TD_API
+		if (user_param->no_lock) {
+			printf(RESULT_LINE);
+			fprintf(stderr," --no_lock shares one thread domain, it can't be used with --threads\n");
+			exit(1);
+		}
+		#endif
+		if (user_param->num_threads > user_param->num_of_qps) {
+			printf(RESULT_LINE);
+			fprintf(stderr," --threads=%d needs at least as many QPs (-q)\n", user_param->num_threads);
+			exit(1);
+		}
+		/* Each QP gets its own buffer, so every MR is touched by a single thread */
+		user_param->mr_per_qp = 1;
+		user_param->noPeak = ON;
+	}
+
 	if (user_param->tst == LAT_BY_BW) {
 		if ( user_param->test_type == DURATION) {
 			fprintf(stderr, "Latency under load test is currently support iteration mode only.\n");
@@ -2315,11 +2581,20 @@ int parser(struct perftest_parameters *user_param,char *argv[], int argc)
 	static int rate_limit_flag = 0;
 	static int rate_units_flag = 0;
 	static int rate_limit_type_flag = 0;
+	static int open_loop_flag = 0;
+	static int threads_flag = 0;
+	static int ts_file_flag = 0;
+	static int ts_format_flag = 0;
+	static int ts_interval_flag = 0;
+	static int size_dist_flag = 0;
+	static int sweep_flag = 0;
 	static int verbosity_output_flag = 0;
 	static int cpu_util_flag = 0;
 	static int out_json_flag = 0;
 	static int out_json_file_flag = 0;
 	static int latency_gap_flag = 0;
+	static int latency_hist_flag = 0;
+	static int hist_interval_flag = 0;
 	static int flow_label_flag = 0;
 	static int retry_count_flag = 0;
 	static int dont_xchg_versions_flag = 0;
@@ -2334,6 +2609,8 @@ int parser(struct perftest_parameters *user_param,char *argv[], int argc)
 	static int disable_pcir_flag = 0;
 	static int mmap_file_flag = 0;
 	static int mmap_offset_flag = 0;
+	static int hugepage_mem_flag = 0;
+	static int mem_numa_flag = 0;
 	static int ipv6_flag = 0;
 	static int ipv6_addr_flag = 0;
 	static int raw_ipv6_flag = 0;
@@ -2486,11 +2763,20 @@ int parser(struct perftest_parameters *user_param,char *argv[], int argc)
 			{ .name = "rate_limit",		.has_arg = 1, .flag = &rate_limit_flag, .val = 1},
 			{ .name = "rate_limit_type",	.has_arg = 1, .flag = &rate_limit_type_flag, .val = 1},
 			{ .name = "rate_units",		.has_arg = 1, .flag = &rate_units_flag, .val = 1},
+			{ .name = "open_loop",		.has_arg = 1, .flag = &open_loop_flag, .val = 1},
+			{ .name = "threads",		.has_arg = 1, .flag = &threads_flag, .val = 1},
+			{ .name = "ts_file",		.has_arg = 1, .flag = &ts_file_flag, .val = 1},
+			{ .name = "ts_format",		.has_arg = 1, .flag = &ts_format_flag, .val = 1},
+			{ .name = "ts_interval",	.has_arg = 1, .flag = &ts_interval_flag, .val = 1},
+			{ .name = "size_dist",		.has_arg = 1, .flag = &size_dist_flag, .val = 1},
+			{ .name = "sweep",		.has_arg = 1, .flag = &sweep_flag, .val = 1},
 			{ .name = "output",		.has_arg = 1, .flag = &verbosity_output_flag, .val = 1},
 			{ .name = "cpu_util",		.has_arg = 0, .flag = &cpu_util_flag, .val = 1},
 			{ .name = "out_json",		.has_arg = 0, .flag = &out_json_flag, .val = 1},
 			{ .name = "out_json_file",	.has_arg = 1, .flag = &out_json_file_flag, .val = 1},
 			{ .name = "latency_gap",	.has_arg = 1, .flag = &latency_gap_flag, .val = 1},
+			{ .name = "latency_hist",	.has_arg = 0, .flag = &latency_hist_flag, .val = 1},
+			{ .name = "hist_interval",	.has_arg = 1, .flag = &hist_interval_flag, .val = 1},
 			{ .name = "flow_label",		.has_arg = 1, .flag = &flow_label_flag, .val = 1},
 			{ .name = "retry_count",	.has_arg = 1, .flag = &retry_count_flag, .val = 1},
 			{ .name = "dont_xchg_versions",	.has_arg = 0, .flag = &dont_xchg_versions_flag, .val = 1},
@@ -2505,6 +2791,8 @@ int parser(struct perftest_parameters *user_param,char *argv[], int argc)
 			{ .name = "use_mlu",		.has_arg = 1, .flag = &use_mlu_flag, .val = 1},
 			{ .name = "mmap",		.has_arg = 1, .flag = &mmap_file_flag, .val = 1},
 			{ .name = "mmap-offset",	.has_arg = 1, .flag = &mmap_offset_flag, .val = 1},
+			{ .name = "hugepage_mem",	.has_arg = 1, .flag = &hugepage_mem_flag, .val = 1},
+			{ .name = "mem_numa",		.has_arg = 1, .flag = &mem_numa_flag, .val = 1},
 			{ .name = "ipv6",		.has_arg = 0, .flag = &ipv6_flag, .val = 1},
 			{ .name = "ipv6-addr",		.has_arg = 0, .flag = &ipv6_addr_flag, .val = 1},
 			#ifdef HAVE_IPV6
@@ -2916,6 +3204,56 @@ int parser(struct perftest_parameters *user_param,char *argv[], int argc)
 					}
 					rate_limit_type_flag = 0;
 				}
+				if (open_loop_flag) {
+					if(strcmp("const",optarg) == 0)
+						user_param->open_loop = OPEN_LOOP_CONST;
+					else if(strcmp("poisson",optarg) == 0)
+						user_param->open_loop = OPEN_LOOP_POISSON;
+					else {
+						fprintf(stderr, " Invalid open loop process. Please use const or poisson.\n");
+						free(duplicates_checker);
+						return FAILURE;
+					}
+					open_loop_flag = 0;
+				}
+				if (threads_flag) {
+					CHECK_VALUE_IN_RANGE(user_param->num_threads,int,1,MAX_THREADS_NUM,"Number of threads",not_int_ptr);
+					threads_flag = 0;
+				}
+				if (ts_file_flag) {
+					GET_STRING(user_param->ts_file, strdupa(optarg));
+					ts_file_flag = 0;
+				}
+				if (ts_format_flag) {
+					if (strcmp("csv",optarg) == 0)
+						user_param->ts_format = TS_FORMAT_CSV;
+					else if (strcmp("ndjson",optarg) == 0)
+						user_param->ts_format = TS_FORMAT_NDJSON;
+					else {
+						fprintf(stderr, " Invalid time series format. Please use csv or ndjson.\n");
+						free(duplicates_checker);
+						return FAILURE;
+					}
+					ts_format_flag = 0;
+				}
+				if (ts_interval_flag) {
+					CHECK_VALUE_POSITIVE(user_param->ts_interval,int,"Time series interval",not_int_ptr);
+					ts_interval_flag = 0;
+				}
+				if (size_dist_flag) {
+					GET_STRING(user_param->size_dist_spec, strdupa(optarg));
+					user_param->req_size = 1;
+					size_dist_flag = 0;
+				}
+				if (sweep_flag) {
+					if (parse_sweep(strdupa(optarg), &user_param->sweep)) {
+						free(duplicates_checker);
+						return FAILURE;
+					}
+					user_param->test_method = RUN_ALL;
+					user_param->req_size = 1;
+					sweep_flag = 0;
+				}
 				if (verbosity_output_flag) {
 					if (strcmp("bandwidth",optarg) == 0) {
 						user_param->output = OUTPUT_BW;
@@ -2934,6 +3272,10 @@ int parser(struct perftest_parameters *user_param,char *argv[], int argc)
 					CHECK_VALUE_NON_NEGATIVE(user_param->latency_gap,int,"Latency gap time",not_int_ptr);
 					latency_gap_flag = 0;
 				}
+				if (hist_interval_flag) {
+					CHECK_VALUE_NON_NEGATIVE(user_param->hist_interval,int,"Histogram interval",not_int_ptr);
+					hist_interval_flag = 0;
+				}
 				/* We statically define memory type options so check if requested option is actually supported. */
 				if (((use_cuda_flag || use_cuda_bus_id_flag) && !cuda_memory_supported()) ||
 				    (use_cuda_dmabuf_flag && !cuda_memory_dmabuf_supported()) ||
@@ -2947,7 +3289,7 @@ int parser(struct perftest_parameters *user_param,char *argv[], int argc)
 				}
 				/* Memory types are mutually exclucive, make sure we were not already asked to use a different memory type. */
 				if (user_param->memory_type != MEMORY_HOST &&
-				    (mmap_file_flag || use_mlu_flag || use_rocm_flag || use_neuron_flag || use_hl_flag ||
+				    (mmap_file_flag || hugepage_mem_flag || use_mlu_flag || use_rocm_flag || use_neuron_flag || use_hl_flag ||
 				     ((use_cuda_flag || use_cuda_bus_id_flag) && user_param->memory_type != MEMORY_CUDA))) {
 					fprintf(stderr, " Can't use multiple memory types\n");
 					return FAILURE;
@@ -3037,6 +3379,25 @@ int parser(struct perftest_parameters *user_param,char *argv[], int argc)
 					CHECK_VALUE(user_param->mmap_offset,unsigned long,"mmap offset",not_int_ptr);
 					mmap_offset_flag = 0;
 				}
+				if (hugepage_mem_flag) {
+					#if defined(__FreeBSD__)
+					fprintf(stderr, " --hugepage_mem is not supported on FreeBSD\n");
+					free(duplicates_checker);
+					return FAILURE;
+					#endif
+					if (hugepage_memory_parse_size(optarg, &user_param->hugepage_size)) {
+						fprintf(stderr, " Invalid hugepage size %s, use 2M or 1G\n", optarg);
+						free(duplicates_checker);
+						return FAILURE;
+					}
+					user_param->memory_type = MEMORY_HUGEPAGE;
+					user_param->memory_create = hugepage_memory_create;
+					hugepage_mem_flag = 0;
+				}
+				if (mem_numa_flag) {
+					CHECK_VALUE_NON_NEGATIVE(user_param->mem_numa_node,int,"NUMA node",not_int_ptr);
+					mem_numa_flag = 0;
+				}
 				if (dlid_flag) {
 					CHECK_VALUE(user_param->dlid,uint16_t,"dlid",not_int_ptr);
 					dlid_flag = 0;
@@ -3235,6 +3596,9 @@ int parser(struct perftest_parameters *user_param,char *argv[], int argc)
 	if (run_inf_flag) {
 		user_param->test_method = RUN_INFINITELY;
 	}
+	if (latency_hist_flag) {
+		user_param->latency_hist = 1;
+	}
 
 	if (srq_flag) {
 		user_param->use_srq = 1;
@@ -3372,6 +3736,10 @@ int parser(struct perftest_parameters *user_param,char *argv[], int argc)
 	}
 
 	if(hugepages_flag) {
+		#if defined(__FreeBSD__)
+		fprintf(stderr, " --use_hugepages is not supported on FreeBSD\n");
+		return FAILURE;
+		#endif
 		user_param->use_hugepages = 1;
 	}
 
@@ -3535,6 +3903,17 @@ int check_link(struct ibv_context *context,struct perftest_parameters *user_para
 	/* Compute Max inline size with pre found statistics values */
 	ctx_set_max_inline(context,user_param);
 
+	/* The QPs are created for the largest inline size of the sweep */
+	if (user_param->sweep) {
+		int i;
+
+		user_param->sweep->inline_size = user_param->inline_size;
+		for (i = 0; i < user_param->sweep->num_phases && user_param->verb != READ; i++) {
+			if (user_param->sweep->phases[i].inline_size > user_param->inline_size)
+				user_param->inline_size = user_param->sweep->phases[i].inline_size;
+		}
+	}
+
 	if (user_param->verb == READ || user_param->verb == ATOMIC)
 		user_param->out_reads = ctx_set_out_reads(context,user_param);
 	else
@@ -3712,6 +4091,44 @@ static float calc_cpu_util (struct perftest_parameters *user_param)
 		return 0;
 }
 
+/******************************************************************************
+ *
+ ******************************************************************************/
+int next_run_all_phase(struct perftest_parameters *user_param, int i, int size_max_pow)
+{
+	struct perftest_sweep *sweep = user_param->sweep;
+	struct perftest_sweep_phase *phase;
+
+	if (!sweep) {
+		if (i >= size_max_pow)
+			return 0;
+		user_param->size = (uint64_t)1 << i;
+		return 1;
+	}
+
+	if (i > sweep->num_phases)
+		return 0;
+
+	/* cq_mod was fitted to the largest tx depth, keep it within every phase */
+	if (i == 1)
+		sweep->cq_mod = user_param->cq_mod;
+
+	phase = &sweep->phases[i - 1];
+	user_param->size = phase->size;
+	if (user_param->verb != READ)
+		user_param->inline_size = phase->inline_size >= 0 ? phase->inline_size : sweep->inline_size;
+	user_param->tx_depth = phase->tx_depth > 0 ? phase->tx_depth : sweep->tx_depth;
+	if (user_param->tx_depth > user_param->iters)
+		user_param->tx_depth = user_param->iters;
+	user_param->cq_mod = sweep->cq_mod < user_param->tx_depth ? sweep->cq_mod : user_param->tx_depth;
+
+	if (user_param->output == FULL_VERBOSITY && user_param->machine == CLIENT &&
+	    (phase->inline_size >= 0 || phase->tx_depth > 0))
+		printf(" # inline %d, tx depth %d\n", user_param->inline_size, user_param->tx_depth);
+
+	return 1;
+}
+
 /******************************************************************************
  *
  ******************************************************************************/
@@ -3772,7 +4189,8 @@ void print_report_bw (struct perftest_parameters *user_param, struct bw_report_d
 	}
 
 	run_inf_bi_factor = (user_param->duplex && user_param->test_method == RUN_INFINITELY) ? (user_param->verb == SEND ? 1 : 2) : 1 ;
-	tsize = run_inf_bi_factor * user_param->size;
+	/* With --size_dist the bandwidth is carried by the sizes that were actually sent */
+	tsize = run_inf_bi_factor * (user_param->size_dist ? size_dist_avg(user_param->size_dist) : user_param->size);
 	num_of_calculated_iters *= (user_param->test_type == DURATION) ? 1 : num_of_qps;
 	location_arr = (user_param->noPeak) ? 0 : num_of_calculated_iters - 1;
 	/* support in GBS format */
@@ -3798,7 +4216,7 @@ void print_report_bw (struct perftest_parameters *user_param, struct bw_report_d
 		memset(my_bw_rep, 0, sizeof(struct bw_report_data));
 	}
 
-	my_bw_rep->size = (unsigned long)user_param->size;
+	my_bw_rep->size = (unsigned long)(user_param->size_dist ? tsize + 0.5 : user_param->size);
 	my_bw_rep->iters = num_of_calculated_iters;
 	my_bw_rep->bw_peak = (double)peak_up/peak_down;
 	my_bw_rep->bw_avg = bw_avg;
@@ -3947,6 +4365,21 @@ static void write_bw_report_to_file(int out_json_fd, struct perftest_parameters
 		dprintf(out_json_fd, inc_accuracy ? REPORT_FMT_EXT_JSON : REPORT_FMT_JSON,
 								   size, iters, bw_peak, bw_avg, msgRate_avg);
 
+	if (user_param->open_loop != OPEN_LOOP_OFF && user_param->machine == CLIENT) {
+		struct perftest_hist *hist = &user_param->lat_hist->cumulative;
+		double quotient = user_param->lat_hist->cycles_rtt_quotient;
+
+		dprintf(out_json_fd, REPORT_FMT_OPEN_LOOP_JSON,
+				hist->total,
+				hist->total ? hist->min / quotient : 0,
+				hist_percentile(hist, 50) / quotient,
+				hist_mean(hist) / quotient,
+				hist_percentile(hist, 99) / quotient,
+				hist_percentile(hist, 99.9) / quotient,
+				hist_percentile(hist, 99.99) / quotient,
+				hist->max / quotient);
+	}
+
 	dprintf(out_json_fd, user_param->cpu_util_data.enable ?
 							REPORT_EXT_CPU_UTIL_JSON : REPORT_EXT_JSON, calc_cpu_util(user_param));
 
@@ -3957,6 +4390,86 @@ static void write_bw_report_to_file(int out_json_fd, struct perftest_parameters
  *
  ******************************************************************************/
 
+static void print_report_open_loop(struct perftest_parameters *user_param)
+{
+	struct perftest_hist *hist = &user_param->lat_hist->cumulative;
+	double quotient = user_param->lat_hist->cycles_rtt_quotient;
+
+	printf(RESULT_LINE);
+	printf(" Open loop latency, from the scheduled send time of each request\n");
+	printf("%s", RESULT_FMT_OPEN_LOOP);
+	printf(RESULT_EXT);
+	printf(REPORT_FMT_OPEN_LOOP,
+			hist->total,
+			hist->total ? hist->min / quotient : 0,
+			hist_percentile(hist, 50) / quotient,
+			hist_mean(hist) / quotient,
+			hist_percentile(hist, 99) / quotient,
+			hist_percentile(hist, 99.9) / quotient,
+			hist_percentile(hist, 99.99) / quotient,
+			hist->max / quotient);
+}
+
+/******************************************************************************
+ * Share of every --threads worker, over its own run time in iterations mode
+ * and over the common sampling window in duration mode.
+ ******************************************************************************/
+static void print_report_threads(struct perftest_parameters *user_param)
+{
+	double cycles_to_units = get_cpu_mhz(user_param->cpu_freq_f) * 1000000;
+	int i;
+
+	printf(RESULT_LINE);
+	printf("%s", RESULT_FMT_THREAD);
+	printf(RESULT_EXT);
+	for (i = 0; i < user_param->num_threads; i++) {
+		struct perftest_thread_stats *stats = &user_param->thread_stats[i];
+		double cycles = (user_param->test_type == DURATION) ?
+			(double)(user_param->tcompleted[0] - user_param->tposted[0]) :
+			(double)(stats->end - stats->start);
+		double msg_rate = cycles > 0 ? stats->completed * cycles_to_units / cycles : 0;
+
+		printf(REPORT_FMT_THREAD, i, stats->cpu, stats->num_of_qps, stats->completed,
+				msg_rate * user_param->size * 8 / 1000000000, msg_rate / 1000000);
+	}
+}
+
+/******************************************************************************
+ * Share of every power of two size range of --size_dist, the bandwidth of a
+ * range is its share of the bytes of the whole run.
+ ******************************************************************************/
+static void print_report_size_dist(struct perftest_parameters *user_param, double msgRate_avg)
+{
+	struct perftest_size_dist *dist = user_param->size_dist;
+	uint64_t msgs = 0, bytes = 0;
+	double bw_gbps = msgRate_avg * size_dist_avg(dist) * 8 / 1000;
+	int b;
+
+	for (b = 0; b < SIZE_DIST_BUCKETS; b++) {
+		msgs += dist->bucket_msgs[b];
+		bytes += dist->bucket_bytes[b];
+	}
+	if (!msgs)
+		return;
+
+	printf(RESULT_LINE);
+	printf("%s", RESULT_FMT_SIZE_DIST);
+	printf(RESULT_EXT);
+	for (b = 0; b < SIZE_DIST_BUCKETS; b++) {
+		if (!dist->bucket_msgs[b])
+			continue;
+
+		printf(REPORT_FMT_SIZE_DIST, b ? size_dist_bucket_max(b - 1) + 1 : 1, size_dist_bucket_max(b),
+				dist->bucket_msgs[b],
+				100.0 * dist->bucket_msgs[b] / msgs,
+				100.0 * dist->bucket_bytes[b] / bytes,
+				bw_gbps * dist->bucket_bytes[b] / bytes);
+	}
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
 void print_full_bw_report (struct perftest_parameters *user_param, struct bw_report_data *my_bw_rep, struct bw_report_data *rem_bw_rep)
 {
 
@@ -3992,6 +4505,12 @@ void print_full_bw_report (struct perftest_parameters *user_param, struct bw_rep
 			user_param->is_msgrate_limit_passed |= 1;
 	}
 
+	/* Samples are taken on the posting side only */
+	if (user_param->open_loop != OPEN_LOOP_OFF && user_param->machine == CLIENT) {
+		hist_merge(&user_param->lat_hist->cumulative, &user_param->lat_hist->interval);
+		hist_reset(&user_param->lat_hist->interval);
+	}
+
 	if(user_param->out_json) {
 		int out_json_fd = open_file_write(user_param->out_json_file_name);
 		if(out_json_fd >= 0){
@@ -4018,6 +4537,12 @@ void print_full_bw_report (struct perftest_parameters *user_param, struct bw_rep
 		fflush(stdout);
 		fprintf(stdout, user_param->cpu_util_data.enable ? REPORT_EXT_CPU_UTIL : REPORT_EXT , calc_cpu_util(user_param));
 	}
+	if (user_param->open_loop != OPEN_LOOP_OFF && user_param->machine == CLIENT && user_param->output == FULL_VERBOSITY)
+		print_report_open_loop(user_param);
+	if (user_param->thread_stats && user_param->output == FULL_VERBOSITY)
+		print_report_threads(user_param);
+	if (user_param->size_dist && user_param->machine == CLIENT && user_param->output == FULL_VERBOSITY)
+		print_report_size_dist(user_param, msgRate_avg);
 	if (user_param->counter_ctx) {
 		counters_print(user_param->counter_ctx);
 	}
@@ -4075,6 +4600,69 @@ void write_report_lat_to_file(int out_json_fd, struct perftest_parameters *user_
 	dprintf(out_json_fd, "}\n");
 }
 
+/******************************************************************************
+ *
+ ******************************************************************************/
+void print_report_lat_hist (struct perftest_parameters *user_param, int is_interval)
+{
+	struct perftest_lat_hist *lat_hist = user_param->lat_hist;
+	struct perftest_hist *hist = is_interval ? &lat_hist->interval : &lat_hist->cumulative;
+	double quotient = lat_hist->cycles_rtt_quotient;
+
+	/* Intervals are folded into the cumulative histogram when they are reported */
+	hist_merge(&lat_hist->cumulative, &lat_hist->interval);
+
+	if (!is_interval && user_param->out_json) {
+		int out_json_fd = open_file_write(user_param->out_json_file_name);
+		if(out_json_fd >= 0){
+			dprintf(out_json_fd,"{\n");
+			write_test_info_to_file(out_json_fd, user_param);
+			dprintf(out_json_fd, "\"results\": {\n");
+			dprintf(out_json_fd, REPORT_FMT_LAT_HIST_JSON,
+					(unsigned long)user_param->size,
+					hist->total,
+					hist->total ? hist->min / quotient : 0,
+					hist->max / quotient,
+					hist_percentile(hist, 50) / quotient,
+					hist_mean(hist) / quotient,
+					hist_stdev(hist) / quotient,
+					hist_percentile(hist, 99) / quotient,
+					hist_percentile(hist, 99.9) / quotient,
+					hist_percentile(hist, 99.99) / quotient);
+			dprintf(out_json_fd, user_param->cpu_util_data.enable ?
+			REPORT_EXT_CPU_UTIL_JSON : REPORT_EXT_JSON , calc_cpu_util(user_param));
+			dprintf(out_json_fd, "}\n}\n");
+			close(out_json_fd);
+		}
+	}
+
+	if (user_param->output == OUTPUT_LAT) {
+		printf("%lf\n", hist_mean(hist) / quotient);
+	} else {
+		printf(REPORT_FMT_LAT_HIST,
+				(unsigned long)user_param->size,
+				hist->total,
+				hist->total ? hist->min / quotient : 0,
+				hist->max / quotient,
+				hist_percentile(hist, 50) / quotient,
+				hist_mean(hist) / quotient,
+				hist_stdev(hist) / quotient,
+				hist_percentile(hist, 99) / quotient,
+				hist_percentile(hist, 99.9) / quotient,
+				hist_percentile(hist, 99.99) / quotient);
+		if (is_interval)
+			printf("   interval %" PRIu64 "\n", ++lat_hist->intervals);
+		else
+			printf( user_param->cpu_util_data.enable ? REPORT_EXT_CPU_UTIL : REPORT_EXT , calc_cpu_util(user_param));
+	}
+	fflush(stdout);
+
+	/* Cleared whether or not it was the one printed, or it would be merged again */
+	hist_reset(&lat_hist->interval);
+	if (!is_interval && user_param->counter_ctx)
+		counters_print(user_param->counter_ctx);
+}
+
 /******************************************************************************
  *
  ******************************************************************************/
@@ -4092,6 +4680,11 @@ void print_report_lat (struct perftest_parameters *user_param)
 	int iters_99, iters_99_9;
 	int measure_cnt;
 
+	if (user_param->latency_hist) {
+		print_report_lat_hist(user_param, 0);
+		return;
+	}
+
 	measure_cnt = (user_param->tst == LAT) ? user_param->iters - 1 : (user_param->iters) / user_param->reply_every;
 	rtt_factor = (user_param->verb == READ || user_param->verb == ATOMIC) ? 1 : 2;
 	ALLOCATE(delta, cycles_t, measure_cnt);
@@ -4225,6 +4818,11 @@ void print_report_lat_duration (struct perftest_parameters *user_param)
 	cycles_t test_sample_time;
 	double latency, tps;
 
+	if (user_param->latency_hist) {
+		print_report_lat_hist(user_param, 0);
+		return;
+	}
+
 	rtt_factor = (user_param->verb == READ || user_param->verb == ATOMIC) ? 1 : 2;
 	cycles_to_units = get_cpu_mhz(user_param->cpu_freq_f);
 
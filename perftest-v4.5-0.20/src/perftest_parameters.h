@@ -61,6 +61,9 @@
 #endif
 #include "get_clock.h"
 #include "perftest_counters.h"
+#include "perftest_histogram.h"
+#include "perftest_timeseries.h"
+#include "perftest_size_dist.h"
 #include "memory.h"
 
 #ifdef HAVE_CONFIG_H
@@ -165,6 +168,8 @@
 #define MAX_GID_IX    (64)
 #define MIN_QP_NUM    (1)
 #define MAX_QP_NUM    (16384)
+#define MAX_THREADS_NUM (256)
+#define MAX_SWEEP_PHASES (256)
 #define MIN_QP_MCAST  (1)
 #define MAX_QP_MCAST  (56)
 #define MIN_RX	      (1)
@@ -208,6 +213,8 @@
 
 #define RESULT_FMT_LAT_DUR " #bytes        #iterations       t_avg[usec]    tps average"
 
+#define RESULT_FMT_LAT_HIST " #bytes #iterations    t_min[usec]    t_max[usec]  t_typical[usec]    t_avg[usec]    t_stdev[usec]   99""%"" percentile[usec]   99.9""%"" percentile[usec]   99.99""%"" percentile[usec] "
+
 #define RESULT_EXT "\n"
 
 #define RESULT_EXT_CPU_UTIL "    CPU_Util[%%]\n"
@@ -245,6 +252,26 @@
 
 #define REPORT_FMT_LAT_DUR " %-7lu       %" PRIu64 "            %-7.2f        %-7.2f"
 
+#define REPORT_FMT_LAT_HIST " %-7lu %-15" PRIu64 "%-14.2f %-14.2f %-16.2f %-14.2f %-15.2f %-22.2f %-24.2f %-7.2f"
+
+#define REPORT_FMT_LAT_HIST_JSON "\"MsgSize\": %lu,\n\"n_iterations\": %" PRIu64 ",\n\"t_min\": %.2f,\n\"t_max\": %.2f,\n\"t_typical\": %.2f,\n\"t_avg\": %.2f,\n\
+\"t_stdev\": %.2f,\n\"percentile_99\": %.2f,\n\"percentile_99.9\": %.2f,\n\"percentile_99.99\": %.2f"
+
+#define RESULT_FMT_OPEN_LOOP " #requests       t_min[usec]    t_p50[usec]    t_avg[usec]    99""%"" percentile[usec]   99.9""%"" percentile[usec]   99.99""%"" percentile[usec]   t_max[usec]"
+
+#define REPORT_FMT_OPEN_LOOP " %-16" PRIu64 "%-14.2f %-14.2f %-14.2f %-22.2f %-24.2f %-25.2f %-7.2f\n"
+
+#define REPORT_FMT_OPEN_LOOP_JSON ",\n\"open_loop_requests\": %" PRIu64 ",\n\"open_loop_t_min\": %.2f,\n\"open_loop_t_p50\": %.2f,\n\
+\"open_loop_t_avg\": %.2f,\n\"open_loop_percentile_99\": %.2f,\n\"open_loop_percentile_99.9\": %.2f,\n\"open_loop_percentile_99.99\": %.2f,\n\"open_loop_t_max\": %.2f"
+
+#define RESULT_FMT_THREAD " #thread    cpu    #qps    #completions    BW average[Gb/sec]   MsgRate[Mpps]"
+
+#define REPORT_FMT_THREAD " %-10d %-6d %-7d %-15" PRIu64 " %-20.2f %-7.6f\n"
+
+#define RESULT_FMT_SIZE_DIST " #bytes range            #messages      messages[""%""]    bytes[""%""]    BW average[Gb/sec]"
+
+#define REPORT_FMT_SIZE_DIST " %10" PRIu64 "-%-12" PRIu64 " %-14" PRIu64 " %-14.2f %-11.2f %-7.2f\n"
+
 #define REPORT_FMT_LAT_DUR_JSON "\"MsgSize\": %lu,\n\"n_iterations\": %" PRIu64 ",\n\"t_avg\": %.2f,\n\"tps_average\": %.2f"
 
 #define REPORT_FMT_FS_RATE "%" PRIu64 "          %-7.2f        		%-7.2f      	%-7.2f  	       		%-7.2f     	%-7.2f"
@@ -395,6 +422,33 @@ enum rate_limiter_units {MEGA_BYTE_PS, GIGA_BIT_PS, PACKET_PS};
 /*Types rate limit*/
 enum rate_limiter_types {HW_RATE_LIMIT, SW_RATE_LIMIT, PP_RATE_LIMIT, DISABLE_RATE_LIMIT};
 
+/* Open loop arrival processes */
+enum open_loop_types {OPEN_LOOP_OFF, OPEN_LOOP_CONST, OPEN_LOOP_POISSON};
+
+/* Results of one --threads worker */
+struct perftest_thread_stats {
+	int		cpu;
+	int		num_of_qps;
+	uint64_t	completed;
+	cycles_t	start;
+	cycles_t	end;
+};
+
+/* One --sweep phase, -1 keeps the value the test started with */
+struct perftest_sweep_phase {
+	uint64_t	size;
+	int		inline_size;
+	int		tx_depth;
+};
+
+struct perftest_sweep {
+	struct perftest_sweep_phase	phases[MAX_SWEEP_PHASES];
+	int				num_phases;
+	int				inline_size;	/* Of the test, the QPs are created with the largest one */
+	int				tx_depth;	/* Of the test, the QPs are created with the largest one */
+	int				cq_mod;
+};
+
 /* Verbosity Levels for test report */
 enum verbosity_level {FULL_VERBOSITY=-1, OUTPUT_BW=0, OUTPUT_MR, OUTPUT_LAT };
 
@@ -443,7 +497,8 @@ enum memory_type {
 	MEMORY_ROCM,
 	MEMORY_NEURON,
 	MEMORY_HL,
-	MEMORY_MLU
+	MEMORY_MLU,
+	MEMORY_HUGEPAGE
 };
 
 struct perftest_parameters {
@@ -580,6 +635,8 @@ struct perftest_parameters {
 	int				mlu_device_id;
 	char				*mmap_file;
 	unsigned long			mmap_offset;
+	uint64_t			hugepage_size;
+	int				mem_numa_node;
 	/* New test params format pilot. will be used in all flags soon,. */
 	enum ctx_test_method 		test_method;
 	enum ibv_transport_type 	transport_type;
@@ -644,6 +701,20 @@ struct perftest_parameters {
 	int				use_ddp;
 	int				no_ddp;
 	int				connectionless;
+	int				latency_hist;
+	int				hist_interval;
+	struct perftest_lat_hist	*lat_hist;
+	enum open_loop_types		open_loop;
+	int				num_threads;
+	struct perftest_thread_stats	*thread_stats;
+	char				*ts_file;
+	enum ts_format			ts_format;
+	int				ts_interval;
+	struct ts_counters		ts_counters;
+	struct ts_context		*ts_ctx;
+	char				*size_dist_spec;
+	struct perftest_size_dist	*size_dist;
+	struct perftest_sweep		*sweep;
 };
 
 struct report_options {
@@ -774,6 +845,22 @@ int check_link_and_mtu(struct ibv_context *context,struct perftest_parameters *u
  */
 void ctx_print_test_info(struct perftest_parameters *user_param);
 
+/* next_run_all_phase
+ *
+ * Description : Sets the message size, and with --sweep the inline size and
+ *				 tx depth, of step i (from 1) of a -a or --sweep run.
+ *				 The QPs and MRs of the test are kept between steps.
+ *
+ * Parameters :
+ *
+ *	 user_param   - the parameters parameters.
+ *	 i            - the step.
+ *	 size_max_pow - -a sizes go up to 2^(size_max_pow - 1).
+ *
+ * Return Value : 1 if step i exists, 0 when the run is over.
+ */
+int next_run_all_phase(struct perftest_parameters *user_param, int i, int size_max_pow);
+
 /* print_report_bw
  *
  * Description : Calculate the peak and average throughput of the BW test.
@@ -825,6 +912,20 @@ void print_report_lat (struct perftest_parameters *user_param);
  */
 void print_report_lat_duration (struct perftest_parameters *user_param);
 
+/* print_report_lat_hist
+ *
+ * Description : Prints the latency percentiles kept in the streaming histogram (--latency_hist).
+ *				 Called every --hist_interval seconds for the interval, and at the end
+ *				 of the test for the whole run.
+ *
+ * Parameters :
+ *
+ *   user_param  - the parameters parameters.
+ *   is_interval - print and clear the current interval instead of the cumulative report.
+ *
+ */
+void print_report_lat_hist (struct perftest_parameters *user_param, int is_interval);
+
 /* print_report_fs_rate
  *
  * Description : Prints the Flow steering rate and avarage latency to create flow
@@ -1,3 +1,6 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,6 +18,7 @@
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <pthread.h>
+#include <sched.h>
 #if defined(__FreeBSD__)
 #include <sys/stat.h>
 #endif
@@ -422,7 +426,7 @@ static inline int _new_post_send(struct pingpong_context *ctx,
 			ibv_wr_set_inline_data(
 				ctx->qpx[index],
 				(void *)wr->sg_list->addr,
-				user_param->size);
+				wr->sg_list->length);
 		}
 		else
 		{
@@ -441,7 +445,7 @@ static inline int _new_post_send(struct pingpong_context *ctx,
 					ctx->qpx[index],
 					wr->sg_list->lkey,
 					wr->sg_list->addr,
-					user_param->size);
+					wr->sg_list->length);
 		}
 		wr = wr->next;
 	}
@@ -1062,6 +1066,23 @@ int alloc_ctx(struct pingpong_context *ctx, struct perftest_parameters *user_par
 	if ((user_param->tst == LAT || user_param->tst == FS_RATE) && user_param->test_type == DURATION)
 		ALLOC(user_param->tcompleted, cycles_t, 1);
 
+	if (user_param->latency_hist || user_param->open_loop != OPEN_LOOP_OFF) {
+		double cpu_mhz = get_cpu_mhz(user_param->cpu_freq_f);
+		double cycles_to_units = user_param->r_flag->cycles ? 1 : cpu_mhz;
+
+		ALLOC(user_param->lat_hist, struct perftest_lat_hist, 1);
+		memset(user_param->lat_hist, 0, sizeof(struct perftest_lat_hist));
+		hist_reset(&user_param->lat_hist->interval);
+		hist_reset(&user_param->lat_hist->cumulative);
+		/* Open loop requests are timed from schedule to completion, not as half a round trip */
+		user_param->lat_hist->cycles_rtt_quotient = cycles_to_units *
+			((user_param->open_loop != OPEN_LOOP_OFF || user_param->verb == READ || user_param->verb == ATOMIC) ? 1 : 2);
+		user_param->lat_hist->report_cycles = user_param->hist_interval * cpu_mhz * 1000000;
+	}
+
+	if (user_param->num_threads > 1)
+		ALLOC(user_param->thread_stats, struct perftest_thread_stats, user_param->num_threads);
+
 	ALLOC(ctx->qp, struct ibv_qp *, user_param->num_of_qps);
 #ifdef HAVE_IBV_WR_API
 	ALLOC(ctx->qpx, struct ibv_qp_ex *, user_param->num_of_qps);
@@ -1166,6 +1187,16 @@ void dealloc_ctx(struct pingpong_context *ctx, struct perftest_parameters *user_
 	if (user_param->tposted != NULL)
 		free(user_param->tposted);
 
+	if (user_param->lat_hist != NULL) {
+		free(user_param->lat_hist);
+		user_param->lat_hist = NULL;
+	}
+
+	if (user_param->thread_stats != NULL) {
+		free(user_param->thread_stats);
+		user_param->thread_stats = NULL;
+	}
+
 	if (((user_param->tst == LAT || user_param->tst == FS_RATE) && user_param->test_type == DURATION) ||
 		((user_param->tst == BW || user_param->tst == LAT_BY_BW) && (user_param->machine == CLIENT || user_param->duplex)) ||
 		((user_param->tst == BW || user_param->tst == LAT_BY_BW) && user_param->verb == SEND && user_param->machine == SERVER) ||
@@ -1256,6 +1287,81 @@ void dealloc_ctx(struct pingpong_context *ctx, struct perftest_parameters *user_
 	}
 }
 
+/******************************************************************************
+ * Destroy the send CQs of --threads workers 1..num_cqs-1, [0] is ctx->send_cq.
+ ******************************************************************************/
+static int destroy_thread_cqs(struct pingpong_context *ctx, int num_cqs)
+{
+	int i;
+	int ret = 0;
+
+	if (ctx->thread_cq == NULL)
+		return 0;
+
+	for (i = 1; i < num_cqs; i++)
+	{
+		if (ibv_destroy_cq(ctx->thread_cq[i]))
+		{
+			fprintf(stderr, "Failed to destroy CQ of thread %d - %s\n", i, strerror(errno));
+			ret = 1;
+		}
+	}
+
+	free(ctx->thread_cq);
+	ctx->thread_cq = NULL;
+	return ret;
+}
+
+/******************************************************************************
+ * --threads workers drive contiguous blocks of QPs, the first num_of_qps %
+ * num_threads workers one QP more, so the per QP counters of a worker share
+ * cache lines with another worker's only at the ends of its block.
+ ******************************************************************************/
+static int thread_first_qp(struct perftest_parameters *user_param, int thread)
+{
+	int base = user_param->num_of_qps / user_param->num_threads;
+	int rem = user_param->num_of_qps % user_param->num_threads;
+
+	return thread * base + (thread < rem ? thread : rem);
+}
+
+static int qp_thread(struct perftest_parameters *user_param, int qp_index)
+{
+	int base = user_param->num_of_qps / user_param->num_threads;
+	int rem = user_param->num_of_qps % user_param->num_threads;
+
+	if (qp_index < rem * (base + 1))
+		return qp_index / (base + 1);
+	return rem + (qp_index - rem * (base + 1)) / base;
+}
+
+/******************************************************************************
+ * One send CQ per --threads worker, so workers never poll the same CQ.
+ ******************************************************************************/
+static int create_thread_cqs(struct pingpong_context *ctx, struct perftest_parameters *user_param,
+							 int tx_buffer_depth)
+{
+	int qps_per_thread = (user_param->num_of_qps + user_param->num_threads - 1) / user_param->num_threads;
+	int i;
+
+	ALLOCATE(ctx->thread_cq, struct ibv_cq *, user_param->num_threads);
+	ctx->thread_cq[0] = ctx->send_cq;
+
+	for (i = 1; i < user_param->num_threads; i++)
+	{
+		ctx->thread_cq[i] = ibv_create_cq(ctx->context, tx_buffer_depth * qps_per_thread, NULL,
+										  ctx->send_channel, user_param->eq_num);
+		if (!ctx->thread_cq[i])
+		{
+			fprintf(stderr, "Couldn't create CQ for thread %d\n", i);
+			destroy_thread_cqs(ctx, i);
+			return FAILURE;
+		}
+	}
+
+	return SUCCESS;
+}
+
 /******************************************************************************
  *
  ******************************************************************************/
@@ -1350,6 +1456,9 @@ int destroy_ctx(struct pingpong_context *ctx,
 	}
 #endif
 
+	if (destroy_thread_cqs(ctx, user_param->num_threads))
+		test_result = 1;
+
 	if (ibv_destroy_cq(ctx->send_cq))
 	{
 		fprintf(stderr, "Failed to destroy CQ - %s\n", strerror(errno));
@@ -1744,6 +1853,8 @@ int create_cqs(struct pingpong_context *ctx, struct perftest_parameters *user_pa
 		need_recv_cq = 1;
 
 	ret = create_reg_cqs(ctx, user_param, tx_buffer_depth, need_recv_cq);
+	if (!ret && user_param->num_threads > 1)
+		ret = create_thread_cqs(ctx, user_param, tx_buffer_depth);
 
 	return ret;
 }
@@ -2397,6 +2508,7 @@ xrc_srq:
 #endif
 // cppcheck-suppress unusedLabelConfiguration
 cqs:
+	destroy_thread_cqs(ctx, user_param->num_threads);
 	ibv_destroy_cq(ctx->send_cq);
 
 	if ((user_param->verb == SEND || user_param->verb == WRITE_IMM) || (user_param->connection_type == DC && !dct_only))
@@ -2541,8 +2653,9 @@ struct ibv_qp *ctx_qp_create(struct pingpong_context *ctx,
 	struct hnsdv_qp_init_attr hns_attr = {};
 #endif
 
-	attr.send_cq = ctx->send_cq;
-	attr.recv_cq = (user_param->verb == SEND || user_param->verb == WRITE_IMM) ? ctx->recv_cq : ctx->send_cq;
+	/* The --threads worker driving the QP polls its send CQ */
+	attr.send_cq = ctx->thread_cq ? ctx->thread_cq[qp_thread(user_param, qp_index)] : ctx->send_cq;
+	attr.recv_cq = (user_param->verb == SEND || user_param->verb == WRITE_IMM) ? ctx->recv_cq : attr.send_cq;
 
 	is_dc_server_side = ((!(user_param->duplex || user_param->tst == LAT) &&
 						  (user_param->machine == SERVER)) ||
@@ -3833,6 +3946,10 @@ int perform_warm_up(struct pingpong_context *ctx, struct perftest_parameters *us
 		for (warmindex = 0; warmindex < warmupsession; warmindex += user_param->post_list)
 		{
 
+			/* Warm up with the sizes of the run, without accounting them */
+			if (user_param->size_dist)
+				size_dist_apply(user_param->size_dist, ctx->wr[index].sg_list, 0);
+
 			err = post_send_method(ctx, index, user_param);
 			if (err)
 			{
@@ -3867,11 +3984,426 @@ int perform_warm_up(struct pingpong_context *ctx, struct perftest_parameters *us
 		} while (warmindex);
 	}
 
+	/* The measured run starts from the top of the size table */
+	if (user_param->size_dist)
+		size_dist_reset(user_param->size_dist);
+
 cleaning:
 	free(wc_for_cleaning);
 	return return_value;
 }
 
+/******************************************************************************
+ * Rate limit converted to messages per second, -1 on unknown units.
+ ******************************************************************************/
+static double rate_limit_to_pps(struct perftest_parameters *user_param)
+{
+	/* Byte rates are met on average when the sizes vary */
+	double size = user_param->size_dist ? size_dist_avg(user_param->size_dist) : user_param->size;
+
+	switch (user_param->rate_units)
+	{
+	case MEGA_BYTE_PS:
+		return ((double)(user_param->rate_limit) / size) * 1048576;
+	case GIGA_BIT_PS:
+		return ((double)(user_param->rate_limit) / (size * 8)) * 1000000000;
+	case PACKET_PS:
+		return user_param->rate_limit;
+	default:
+		return -1;
+	}
+}
+
+/******************************************************************************
+ * Start the latency histograms afresh, once per message size.
+ ******************************************************************************/
+static void lat_hist_start(struct perftest_lat_hist *lat_hist)
+{
+	hist_reset(&lat_hist->interval);
+	hist_reset(&lat_hist->cumulative);
+	lat_hist->last_post = 0;
+	lat_hist->next_report = 0;
+	lat_hist->intervals = 0;
+}
+
+/******************************************************************************
+ * Open loop sender (--open_loop).
+ * Request k is due at a time set by the arrival process alone, and goes to
+ * QP k % num_of_qps as soon as that QP has a free send slot. Every request is
+ * signaled, and its latency runs from the due time to its completion, so time
+ * spent queued behind a full send queue is counted (no coordinated omission).
+ ******************************************************************************/
+static int run_iter_bw_open_loop(struct pingpong_context *ctx, struct perftest_parameters *user_param)
+{
+	struct perftest_hist *hist = &user_param->lat_hist->interval;
+	int num_of_qps = user_param->num_of_qps;
+	uint64_t tot_iters = (uint64_t)user_param->iters * num_of_qps;
+	uint64_t totscnt = 0;
+	uint64_t totccnt = 0;
+	cycles_t *due = NULL;	/* Due time of each outstanding request, per QP ring of tx_depth */
+	cycles_t next_due;
+	double mean_gap_cycles;
+	double rate_pps;
+	unsigned short xsubi[3];
+	struct ibv_wc *wc = NULL;
+	int index = 0;
+	int ne, i;
+	int return_value = 0;
+
+#ifdef HAVE_IBV_WR_API
+	if (user_param->connection_type != RawEth)
+		ctx_post_send_work_request_func_pointer(ctx, user_param);
+#endif
+
+	rate_pps = rate_limit_to_pps(user_param);
+	if (rate_pps <= 0) {
+		fprintf(stderr, " Failed: Unknown rate limit units\n");
+		return FAILURE;
+	}
+	mean_gap_cycles = get_cpu_mhz(user_param->cpu_freq_f) * 1000000 / rate_pps;
+	if (mean_gap_cycles <= 0) {
+		fprintf(stderr, "Failed: couldn't acquire cpu frequency for open loop schedule.\n");
+		return FAILURE;
+	}
+
+	ALLOCATE(wc, struct ibv_wc, CTX_POLL_BATCH);
+	ALLOCATE(due, cycles_t, num_of_qps * user_param->tx_depth);
+	lat_hist_start(user_param->lat_hist);
+
+	if (user_param->test_type == DURATION) {
+		duration_param = user_param;
+		duration_param->state = START_STATE;
+		signal(SIGALRM, catch_alarm);
+		if (user_param->margin > 0)
+			alarm(user_param->margin);
+		else
+			catch_alarm(0);
+
+		user_param->iters = 0;
+		tot_iters = 0;
+	}
+
+	next_due = get_cycles();
+	xsubi[0] = (unsigned short)next_due;
+	xsubi[1] = (unsigned short)(next_due >> 16);
+	xsubi[2] = (unsigned short)getpid();
+
+	if (user_param->test_type == ITERATIONS)
+		user_param->tposted[0] = next_due;
+
+	while (totscnt < tot_iters || totccnt < tot_iters ||
+	       (user_param->test_type == DURATION && user_param->state != END_STATE)) {
+
+		/* Post everything that is due, in order, while its QP has room */
+		while ((totscnt < tot_iters || user_param->test_type == DURATION) &&
+		       get_cycles() >= next_due &&
+		       ctx->scnt[index] - ctx->ccnt[index] < user_param->tx_depth) {
+
+			if (user_param->test_type == DURATION && user_param->state == END_STATE)
+				break;
+
+			if (ctx->send_rcredit) {
+				uint32_t swindow = ctx->scnt[index] + 1 - ctx->credit_buf[index];
+				if (swindow >= user_param->rx_depth)
+					break;
+			}
+
+			due[index * user_param->tx_depth + ctx->scnt[index] % user_param->tx_depth] = next_due;
+
+			if (user_param->size_dist)
+				size_dist_apply(user_param->size_dist, ctx->wr[index].sg_list,
+						user_param->test_type == ITERATIONS || user_param->state == SAMPLE_STATE);
+
+			if (post_send_method(ctx, index, user_param)) {
+				fprintf(stderr, "Couldn't post send: qp %d scnt=%lu \n", index, ctx->scnt[index]);
+				return_value = FAILURE;
+				goto cleaning;
+			}
+
+			if (user_param->size <= (ctx->cycle_buffer / 2)) {
+				increase_loc_addr(ctx->wr[index].sg_list, user_param->size, ctx->scnt[index],
+						  ctx->my_addr[index], 0, ctx->cache_line_size, ctx->cycle_buffer);
+				if (user_param->verb != SEND)
+					increase_rem_addr(&ctx->wr[index], user_param->size, ctx->scnt[index],
+							  ctx->rem_addr[index], user_param->verb,
+							  ctx->cache_line_size, ctx->cycle_buffer);
+			}
+
+			ctx->scnt[index]++;
+			totscnt++;
+			if (++index == num_of_qps)
+				index = 0;
+
+			if (user_param->open_loop == OPEN_LOOP_POISSON)
+				next_due += (cycles_t)(-log(1.0 - erand48(xsubi)) * mean_gap_cycles);
+			else
+				next_due += (cycles_t)mean_gap_cycles;
+		}
+
+		if (totccnt >= totscnt)
+			continue;
+
+		ne = ibv_poll_cq(ctx->send_cq, CTX_POLL_BATCH, wc);
+		if (ne < 0) {
+			fprintf(stderr, "poll CQ failed %d\n", ne);
+			return_value = FAILURE;
+			goto cleaning;
+		}
+
+		for (i = 0; i < ne; i++) {
+			int wc_id = (int)wc[i].wr_id;
+			cycles_t now = get_cycles();
+
+			if (wc[i].status != IBV_WC_SUCCESS) {
+				NOTIFY_COMP_ERROR_SEND(wc[i], totscnt, totccnt);
+				return_value = FAILURE;
+				goto cleaning;
+			}
+
+			/* Send queues complete in order, the oldest request of the QP is done */
+			if (user_param->test_type == ITERATIONS || user_param->state == SAMPLE_STATE) {
+				hist_record(hist, now - due[wc_id * user_param->tx_depth + ctx->ccnt[wc_id] % user_param->tx_depth]);
+				if (user_param->test_type == DURATION)
+					user_param->iters++;
+			}
+			ctx->ccnt[wc_id]++;
+			totccnt++;
+		}
+	}
+
+	if (user_param->test_type == ITERATIONS)
+		user_param->tcompleted[0] = get_cycles();
+
+cleaning:
+	free(due);
+	free(wc);
+	return return_value;
+}
+
+/* One --threads worker, driving QPs first_qp to first_qp + stats->num_of_qps - 1 */
+struct bw_thread {
+	pthread_t			thread;
+	struct pingpong_context		*ctx;
+	struct perftest_parameters	*user_param;
+	struct perftest_thread_stats	*stats;
+	struct ibv_cq			*cq;
+	int				index;
+	int				first_qp;
+	int				return_value;
+};
+
+/******************************************************************************
+ * Posting loop of run_iter_bw, over the QPs and send CQ of one worker.
+ * scnt and ccnt of the worker's QPs are kept in cache line aligned arrays of
+ * its own and written back to ctx when it is done, nothing else is written
+ * per completion.
+ ******************************************************************************/
+static void *run_iter_bw_thread(void *arg)
+{
+	struct bw_thread *thread = arg;
+	struct pingpong_context *ctx = thread->ctx;
+	struct perftest_parameters *user_param = thread->user_param;
+	struct perftest_thread_stats *stats = thread->stats;
+	int first_qp = thread->first_qp;
+	int num_of_qps = stats->num_of_qps;
+	uint64_t tot_iters = (uint64_t)user_param->iters * num_of_qps;
+	uint64_t totscnt = 0;
+	uint64_t totccnt = 0;
+	uint64_t completed = 0;
+	uint64_t *scnt = NULL;
+	uint64_t *ccnt = NULL;
+	size_t cnt_size;
+	struct ibv_wc wc[CTX_POLL_BATCH];
+	int qp, index, ne, i;
+
+	if (stats->cpu >= 0) {
+		cpu_set_t cpuset;
+
+		CPU_ZERO(&cpuset);
+		CPU_SET(stats->cpu, &cpuset);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset))
+			fprintf(stderr, " Couldn't pin thread %d to cpu %d\n", thread->index, stats->cpu);
+	}
+
+	/* Allocated after pinning, so the pages are local to the worker */
+	cnt_size = (num_of_qps * sizeof(uint64_t) + DEF_CACHE_LINE_SIZE - 1) & ~(size_t)(DEF_CACHE_LINE_SIZE - 1);
+	if (posix_memalign((void **)&scnt, DEF_CACHE_LINE_SIZE, cnt_size) ||
+	    posix_memalign((void **)&ccnt, DEF_CACHE_LINE_SIZE, cnt_size)) {
+		fprintf(stderr, "Couldn't allocate counters of thread %d\n", thread->index);
+		free(scnt);
+		thread->return_value = FAILURE;
+		return NULL;
+	}
+	memcpy(scnt, &ctx->scnt[first_qp], num_of_qps * sizeof(uint64_t));
+	memcpy(ccnt, &ctx->ccnt[first_qp], num_of_qps * sizeof(uint64_t));
+
+	stats->start = get_cycles();
+
+	while (totscnt < tot_iters || totccnt < tot_iters ||
+	       (user_param->test_type == DURATION && user_param->state != END_STATE)) {
+
+		for (qp = 0; qp < num_of_qps; qp++) {
+			index = first_qp + qp;
+			while ((scnt[qp] < user_param->iters || user_param->test_type == DURATION) &&
+			       (scnt[qp] + user_param->post_list) <= (user_param->tx_depth + ccnt[qp])) {
+
+				if (ctx->send_rcredit) {
+					uint32_t swindow = scnt[qp] + user_param->post_list - ctx->credit_buf[index];
+					if (swindow >= user_param->rx_depth)
+						break;
+				}
+				if (user_param->post_list == 1 && (scnt[qp] % user_param->cq_mod == 0 && user_param->cq_mod > 1) &&
+				    !(scnt[qp] == (user_param->iters - 1) && user_param->test_type == ITERATIONS))
+					ctx->wr[index].send_flags &= ~IBV_SEND_SIGNALED;
+
+				if (user_param->test_type == DURATION && user_param->state == END_STATE)
+					break;
+
+				if (post_send_method(ctx, index, user_param)) {
+					fprintf(stderr, "Couldn't post send: qp %d scnt=%lu \n", index, scnt[qp]);
+					thread->return_value = FAILURE;
+					goto out;
+				}
+
+				if (user_param->post_list == 1 && user_param->size <= (ctx->cycle_buffer / 2)) {
+					increase_loc_addr(ctx->wr[index].sg_list, user_param->size, scnt[qp],
+							  ctx->my_addr[index], 0, ctx->cache_line_size, ctx->cycle_buffer);
+					if (user_param->verb != SEND)
+						increase_rem_addr(&ctx->wr[index], user_param->size, scnt[qp],
+								  ctx->rem_addr[index], user_param->verb,
+								  ctx->cache_line_size, ctx->cycle_buffer);
+				}
+
+				scnt[qp] += user_param->post_list;
+				totscnt += user_param->post_list;
+
+				if (user_param->post_list == 1 &&
+				    (scnt[qp] % user_param->cq_mod == user_param->cq_mod - 1 ||
+				     (user_param->test_type == ITERATIONS && scnt[qp] == user_param->iters - 1)))
+					ctx->wr[index].send_flags |= IBV_SEND_SIGNALED;
+			}
+		}
+
+		if (totccnt < tot_iters || (user_param->test_type == DURATION && totccnt < totscnt)) {
+			ne = ibv_poll_cq(thread->cq, CTX_POLL_BATCH, wc);
+			if (ne < 0) {
+				fprintf(stderr, "poll CQ failed %d\n", ne);
+				thread->return_value = FAILURE;
+				goto out;
+			}
+
+			for (i = 0; i < ne; i++) {
+				int wc_qp = (int)wc[i].wr_id - first_qp;
+				int fill = user_param->cq_mod;
+
+				if (wc[i].status != IBV_WC_SUCCESS) {
+					NOTIFY_COMP_ERROR_SEND(wc[i], totscnt, totccnt);
+					thread->return_value = FAILURE;
+					goto out;
+				}
+				if (user_param->fill_count && ccnt[wc_qp] + user_param->cq_mod > user_param->iters)
+					fill = user_param->iters - ccnt[wc_qp];
+				ccnt[wc_qp] += fill;
+				totccnt += fill;
+
+				if (user_param->test_type == ITERATIONS)
+					completed += fill;
+				else if (user_param->state == SAMPLE_STATE)
+					completed += user_param->cq_mod;
+			}
+		}
+	}
+
+out:
+	stats->end = get_cycles();
+	stats->completed = completed;
+	memcpy(&ctx->scnt[first_qp], scnt, num_of_qps * sizeof(uint64_t));
+	memcpy(&ctx->ccnt[first_qp], ccnt, num_of_qps * sizeof(uint64_t));
+	free(scnt);
+	free(ccnt);
+	return NULL;
+}
+
+/******************************************************************************
+ * --threads: the QPs are sharded in contiguous blocks over the workers, each
+ * polling its own send CQ, and the counts are summed up for print_report_bw.
+ ******************************************************************************/
+static int run_iter_bw_threads(struct pingpong_context *ctx, struct perftest_parameters *user_param)
+{
+	int num_threads = user_param->num_threads;
+	struct bw_thread *threads = NULL;
+	cpu_set_t allowed;
+	int cpus[CPU_SETSIZE];
+	int num_cpus = 0;
+	int started, i;
+	int return_value = 0;
+
+#ifdef HAVE_IBV_WR_API
+	if (user_param->connection_type != RawEth)
+		ctx_post_send_work_request_func_pointer(ctx, user_param);
+#endif
+
+	/* Pin in order to the CPUs we were started on, e.g. by taskset */
+	if (!sched_getaffinity(0, sizeof(allowed), &allowed)) {
+		for (i = 0; i < CPU_SETSIZE; i++)
+			if (CPU_ISSET(i, &allowed))
+				cpus[num_cpus++] = i;
+	}
+
+	ALLOCATE(threads, struct bw_thread, num_threads);
+	memset(threads, 0, sizeof(struct bw_thread) * num_threads);
+	memset(user_param->thread_stats, 0, sizeof(struct perftest_thread_stats) * num_threads);
+
+	for (i = 0; i < num_threads; i++) {
+		threads[i].ctx = ctx;
+		threads[i].user_param = user_param;
+		threads[i].stats = &user_param->thread_stats[i];
+		threads[i].cq = ctx->thread_cq[i];
+		threads[i].index = i;
+		threads[i].first_qp = thread_first_qp(user_param, i);
+		threads[i].stats->cpu = num_cpus ? cpus[i % num_cpus] : -1;
+		threads[i].stats->num_of_qps = thread_first_qp(user_param, i + 1) - threads[i].first_qp;
+	}
+
+	if (user_param->test_type == DURATION) {
+		duration_param = user_param;
+		duration_param->state = START_STATE;
+		signal(SIGALRM, catch_alarm);
+		if (user_param->margin > 0)
+			alarm(user_param->margin);
+		else
+			catch_alarm(0);
+
+		user_param->iters = 0;
+	} else {
+		user_param->tposted[0] = get_cycles();
+	}
+
+	for (started = 0; started < num_threads; started++) {
+		if (pthread_create(&threads[started].thread, NULL, run_iter_bw_thread, &threads[started])) {
+			fprintf(stderr, "Couldn't create thread %d\n", started);
+			return_value = FAILURE;
+			break;
+		}
+	}
+
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i].thread, NULL);
+		if (threads[i].return_value)
+			return_value = FAILURE;
+	}
+
+	if (user_param->test_type == ITERATIONS) {
+		user_param->tcompleted[0] = get_cycles();
+	} else {
+		for (i = 0; i < num_threads; i++)
+			user_param->iters += user_param->thread_stats[i].completed;
+	}
+
+	free(threads);
+	return return_value;
+}
+
 /******************************************************************************
  *
  ******************************************************************************/
@@ -3902,6 +4434,12 @@ int run_iter_bw(struct pingpong_context *ctx, struct perftest_parameters *user_p
 	int address_offset = 0;
 	int flows_burst_iter = 0;
 
+	if (user_param->open_loop != OPEN_LOOP_OFF)
+		return run_iter_bw_open_loop(ctx, user_param);
+
+	if (user_param->num_threads > 1)
+		return run_iter_bw_threads(ctx, user_param);
+
 #ifdef HAVE_IBV_WR_API
 	if (user_param->connection_type != RawEth)
 		ctx_post_send_work_request_func_pointer(ctx, user_param);
@@ -3942,18 +4480,9 @@ int run_iter_bw(struct pingpong_context *ctx, struct perftest_parameters *user_p
 	if (user_param->rate_limit_type == SW_RATE_LIMIT)
 	{
 		/* Calculate rate limit in pps */
-		switch (user_param->rate_units)
+		rate_limit_pps = rate_limit_to_pps(user_param);
+		if (rate_limit_pps < 0)
 		{
-		case MEGA_BYTE_PS:
-			rate_limit_pps = ((double)(user_param->rate_limit) / user_param->size) * 1048576;
-			break;
-		case GIGA_BIT_PS:
-			rate_limit_pps = ((double)(user_param->rate_limit) / (user_param->size * 8)) * 1000000000;
-			break;
-		case PACKET_PS:
-			rate_limit_pps = user_param->rate_limit;
-			break;
-		default:
 			fprintf(stderr, " Failed: Unknown rate limit units\n");
 			return_value = FAILURE;
 			goto cleaning;
@@ -4010,6 +4539,10 @@ int run_iter_bw(struct pingpong_context *ctx, struct perftest_parameters *user_p
 				if (user_param->test_type == DURATION && user_param->state == END_STATE)
 					break;
 
+				if (user_param->size_dist)
+					size_dist_apply(user_param->size_dist, ctx->wr[index].sg_list,
+							user_param->test_type == ITERATIONS || user_param->state == SAMPLE_STATE);
+
 				err = post_send_method(ctx, index, user_param);
 				if (err)
 				{
@@ -4467,6 +5000,14 @@ int run_iter_bw_infinitely(struct pingpong_context *ctx, struct perftest_paramet
 	user_param->iters = 0;
 	user_param->last_iters = 0;
 
+	if (user_param->ts_file && ts_start(user_param->ts_file, user_param->ts_format, user_param->ts_interval,
+					    &user_param->ts_counters, &user_param->ts_ctx))
+	{
+		free(wc);
+		free(scnt_for_qp);
+		return FAILURE;
+	}
+
 	/* Will be 0, in case of Duration (look at force_dependencies or in the exp above) */
 	if (user_param->duplex && (user_param->use_xrc || user_param->connection_type == DC))
 		num_of_qps /= 2;
@@ -4504,6 +5045,7 @@ int run_iter_bw_infinitely(struct pingpong_context *ctx, struct perftest_paramet
 				ctx->scnt[index] += user_param->post_list;
 				scnt_for_qp[index] += user_param->post_list;
 				totscnt += user_param->post_list;
+				ts_count(&user_param->ts_counters.posted, user_param->post_list);
 
 				/* ask for completion on this wr */
 				if (user_param->post_list == 1 &&
@@ -4513,11 +5055,15 @@ int run_iter_bw_infinitely(struct pingpong_context *ctx, struct perftest_paramet
 					ctx->wr[index].send_flags |= IBV_SEND_SIGNALED;
 				}
 			}
+			if ((ctx->scnt[index] - ctx->ccnt[index] + user_param->post_list) > user_param->tx_depth)
+				ts_count(&user_param->ts_counters.sq_full, 1);
 		}
 		if (totccnt < totscnt)
 		{
 			ne = ibv_poll_cq(ctx->send_cq, CTX_POLL_BATCH, wc);
 
+			if (ne == 0)
+				ts_count(&user_param->ts_counters.cq_empty, 1);
 			if (ne > 0)
 			{
 
@@ -4534,6 +5080,8 @@ int run_iter_bw_infinitely(struct pingpong_context *ctx, struct perftest_paramet
 					totccnt += user_param->cq_mod;
 					ctx->ccnt[wc_id] += user_param->cq_mod;
 				}
+				ts_count(&user_param->ts_counters.completed, (uint64_t)ne * user_param->cq_mod);
+				ts_count(&user_param->ts_counters.bytes, (uint64_t)ne * user_param->cq_mod * user_param->size);
 			}
 			else if (ne < 0)
 			{
@@ -4550,6 +5098,8 @@ int run_iter_bw_infinitely(struct pingpong_context *ctx, struct perftest_paramet
 		}
 	}
 cleaning:
+	ts_stop(user_param->ts_ctx);
+	user_param->ts_ctx = NULL;
 	free(scnt_for_qp);
 	free(wc);
 	return return_value;
@@ -4606,13 +5156,24 @@ int run_iter_bw_infinitely_server(struct pingpong_context *ctx, struct perftest_
 	user_param->last_iters = 0;
 	user_param->tposted[0] = get_cycles();
 
+	if (user_param->ts_file && ts_start(user_param->ts_file, user_param->ts_format, user_param->ts_interval,
+					    &user_param->ts_counters, &user_param->ts_ctx))
+	{
+		return_value = FAILURE;
+		goto cleaning;
+	}
+
 	while (1)
 	{
 
 		ne = ibv_poll_cq(ctx->recv_cq, CTX_POLL_BATCH, wc);
 
+		if (ne == 0)
+			ts_count(&user_param->ts_counters.cq_empty, 1);
 		if (ne > 0)
 		{
+			ts_count(&user_param->ts_counters.completed, ne);
+			ts_count(&user_param->ts_counters.bytes, (uint64_t)ne * user_param->size);
 
 			for (i = 0; i < ne; i++)
 			{
@@ -4646,6 +5207,7 @@ int run_iter_bw_infinitely_server(struct pingpong_context *ctx, struct perftest_
 						}
 					}
 					unused_recv_for_qp[wc[i].wr_id] -= user_param->recv_post_list;
+					ts_count(&user_param->ts_counters.posted, user_param->recv_post_list);
 				}
 
 				if (!user_param->use_srq && ctx->send_rcredit)
@@ -4707,6 +5269,8 @@ int run_iter_bw_infinitely_server(struct pingpong_context *ctx, struct perftest_
 	}
 
 cleaning:
+	ts_stop(user_param->ts_ctx);
+	user_param->ts_ctx = NULL;
 	free(wc);
 	free(swc);
 	free(rcnt_for_qp);
@@ -5111,6 +5675,28 @@ cleaning:
 	return return_value;
 }
 
+/******************************************************************************
+ * Record the RTT since the previous post in the latency histogram, and print
+ * the interval report when it is due. The sample that spans a report is dropped.
+ ******************************************************************************/
+static inline void lat_hist_post(struct perftest_parameters *user_param)
+{
+	struct perftest_lat_hist *lat_hist = user_param->lat_hist;
+	cycles_t now = get_cycles();
+	int sampling = user_param->test_type == ITERATIONS || user_param->state == SAMPLE_STATE;
+
+	if (sampling && lat_hist->last_post)
+		hist_record(&lat_hist->interval, now - lat_hist->last_post);
+	lat_hist->last_post = now;
+
+	if (sampling && lat_hist->report_cycles && now >= lat_hist->next_report) {
+		if (lat_hist->next_report)
+			print_report_lat_hist(user_param, 1);
+		lat_hist->next_report = now + lat_hist->report_cycles;
+		lat_hist->last_post = 0;
+	}
+}
+
 /******************************************************************************
  *
  ******************************************************************************/
@@ -5131,6 +5717,9 @@ int run_iter_lat_write(struct pingpong_context *ctx, struct perftest_parameters
 	int total_gap_cycles = user_param->latency_gap * cpu_mhz;
 	cycles_t end_cycle, start_gap;
 
+	if (user_param->latency_hist)
+		lat_hist_start(user_param->lat_hist);
+
 #ifdef HAVE_IBV_WR_API
 	if (user_param->connection_type != RawEth)
 		ctx_post_send_work_request_func_pointer(ctx, user_param);
@@ -5187,7 +5776,9 @@ int run_iter_lat_write(struct pingpong_context *ctx, struct perftest_parameters
 				}
 			}
 
-			if (user_param->test_type == ITERATIONS)
+			if (user_param->latency_hist)
+				lat_hist_post(user_param);
+			else if (user_param->test_type == ITERATIONS)
 				user_param->tposted[scnt] = get_cycles();
 
 			*post_buf = (char)++scnt;
@@ -5256,6 +5847,9 @@ int run_iter_lat_write_imm(struct pingpong_context *ctx, struct perftest_paramet
 	int total_gap_cycles = user_param->latency_gap * cpu_mhz;
 	cycles_t end_cycle, start_gap;
 
+	if (user_param->latency_hist)
+		lat_hist_start(user_param->lat_hist);
+
 #ifdef HAVE_IBV_WR_API
 	if (user_param->connection_type != RawEth)
 		ctx_post_send_work_request_func_pointer(ctx, user_param);
@@ -5351,7 +5945,9 @@ int run_iter_lat_write_imm(struct pingpong_context *ctx, struct perftest_paramet
 				}
 			}
 
-			if (user_param->test_type == ITERATIONS)
+			if (user_param->latency_hist)
+				lat_hist_post(user_param);
+			else if (user_param->test_type == ITERATIONS)
 				user_param->tposted[scnt] = get_cycles();
 
 			*post_buf = (char)++scnt;
@@ -5413,6 +6009,9 @@ int run_iter_lat(struct pingpong_context *ctx, struct perftest_parameters *user_
 	int total_gap_cycles = user_param->latency_gap * cpu_mhz;
 	cycles_t end_cycle, start_gap;
 
+	if (user_param->latency_hist)
+		lat_hist_start(user_param->lat_hist);
+
 #ifdef HAVE_IBV_WR_API
 	if (user_param->connection_type != RawEth)
 		ctx_post_send_work_request_func_pointer(ctx, user_param);
@@ -5444,8 +6043,12 @@ int run_iter_lat(struct pingpong_context *ctx, struct perftest_parameters *user_
 				continue;
 			}
 		}
+		if (user_param->latency_hist)
+			lat_hist_post(user_param);
+		else if (user_param->test_type == ITERATIONS)
+			user_param->tposted[scnt] = get_cycles();
 		if (user_param->test_type == ITERATIONS)
-			user_param->tposted[scnt++] = get_cycles();
+			scnt++;
 
 		err = post_send_method(ctx, 0, user_param);
 
@@ -5516,6 +6119,9 @@ int run_iter_lat_send(struct pingpong_context *ctx, struct perftest_parameters *
 	uintptr_t primary_send_addr = ctx->sge_list[0].addr;
 	uintptr_t primary_recv_addr = ctx->recv_sge_list[0].addr;
 
+	if (user_param->latency_hist)
+		lat_hist_start(user_param->lat_hist);
+
 #ifdef HAVE_IBV_WR_API
 	if (user_param->connection_type != RawEth)
 		ctx_post_send_work_request_func_pointer(ctx, user_param);
@@ -5632,7 +6238,9 @@ int run_iter_lat_send(struct pingpong_context *ctx, struct perftest_parameters *
 				}
 			}
 
-			if (user_param->test_type == ITERATIONS)
+			if (user_param->latency_hist)
+				lat_hist_post(user_param);
+			else if (user_param->test_type == ITERATIONS)
 				user_param->tposted[scnt] = get_cycles();
 
 			scnt++;
@@ -5997,6 +6605,9 @@ void catch_alarm(int sig)
 		duration_param->state = SAMPLE_STATE;
 		get_cpu_stats(duration_param, 1);
 		duration_param->tposted[0] = get_cycles();
+		/* Infinite latency runs sample until killed, reporting every hist_interval */
+		if (duration_param->test_method == RUN_INFINITELY)
+			break;
 		alarm(duration_param->duration - 2 * (duration_param->margin));
 		break;
 	case SAMPLE_STATE:
@@ -186,6 +186,7 @@ struct pingpong_context {
 	struct ibv_mr				*null_mr;
 	struct ibv_cq				*send_cq;
 	struct ibv_cq				*recv_cq;
+	struct ibv_cq				**thread_cq;	/* Send CQ of each --threads worker, [0] is send_cq */
 	void					**buf;
 	struct ibv_ah				**ah;
 	struct ibv_qp				**qp;
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "perftest_parameters.h"
+#include "perftest_size_dist.h"
+
+/* Points of an empirical CDF file */
+#define SIZE_DIST_MAX_POINTS (4096)
+
+struct cdf_point {
+	uint32_t	size;
+	double		prob;	/* Cumulative, the last point is 1 */
+};
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static uint8_t size_dist_bucket(uint32_t size)
+{
+	return size <= 1 ? 0 : 64 - __builtin_clzll((uint64_t)size - 1);
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static int parse_size(const char *str, char **end, uint32_t *size)
+{
+	unsigned long long value;
+
+	errno = 0;
+	value = strtoull(str, end, 0);
+	if (errno || *end == str || value == 0 || value > UINT32_MAX)
+		return FAILURE;
+
+	*size = value;
+	return SUCCESS;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static int read_cdf(const char *path, struct cdf_point **points, int *num_points)
+{
+	FILE *fp;
+	char line[256];
+	int n = 0, line_num = 0;
+	struct cdf_point *p;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		fprintf(stderr, " Couldn't open size distribution file %s: %s\n", path, strerror(errno));
+		return FAILURE;
+	}
+
+	ALLOCATE(p, struct cdf_point, SIZE_DIST_MAX_POINTS);
+
+	while (fgets(line, sizeof(line), fp)) {
+		char *cur = line, *end;
+
+		line_num++;
+		while (*cur == ' ' || *cur == '\t')
+			cur++;
+		if (*cur == '#' || *cur == '\n' || *cur == '\0')
+			continue;
+
+		if (n == SIZE_DIST_MAX_POINTS) {
+			fprintf(stderr, " %s: more than %d points\n", path, SIZE_DIST_MAX_POINTS);
+			goto err;
+		}
+
+		if (parse_size(cur, &end, &p[n].size)) {
+			fprintf(stderr, " %s:%d: invalid size\n", path, line_num);
+			goto err;
+		}
+		cur = end;
+		p[n].prob = strtod(cur, &end);
+		if (end == cur || p[n].prob < 0 || p[n].prob > 1 ||
+		    (n && (p[n].prob < p[n - 1].prob || p[n].size < p[n - 1].size))) {
+			fprintf(stderr, " %s:%d: probabilities and sizes must be ascending, within [0,1]\n",
+				path, line_num);
+			goto err;
+		}
+		n++;
+	}
+
+	if (!n || p[n - 1].prob < 1 - 1e-9) {
+		fprintf(stderr, " %s: the last cumulative probability must be 1\n", path);
+		goto err;
+	}
+
+	fclose(fp);
+	*points = p;
+	*num_points = n;
+	return SUCCESS;
+
+err:
+	fclose(fp);
+	free(p);
+	return FAILURE;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+int size_dist_parse(const char *spec, struct perftest_size_dist **dist)
+{
+	struct perftest_size_dist *d;
+	struct cdf_point *points = NULL;
+	int num_points = 0;
+	uint32_t min = 0, max = 0;
+	double small_fraction = 0;
+	unsigned short seed[3] = {0x5eed, 0x51ce, 0xd157};	/* Same table on every run */
+	char *end;
+	int i, j;
+
+	if (!strncmp(spec, "uniform:", 8)) {
+		if (parse_size(spec + 8, &end, &min) || *end != ':' ||
+		    parse_size(end + 1, &end, &max) || *end != '\0' || min > max)
+			goto inval;
+	} else if (!strncmp(spec, "bimodal:", 8)) {
+		const char *frac;
+
+		if (parse_size(spec + 8, &end, &min) || *end != ':' ||
+		    parse_size(end + 1, &end, &max) || *end != ':')
+			goto inval;
+		frac = end + 1;
+		small_fraction = strtod(frac, &end);
+		if (end == frac || *end != '\0' || small_fraction < 0 || small_fraction > 1)
+			goto inval;
+	} else if (!strncmp(spec, "cdf:", 4)) {
+		if (read_cdf(spec + 4, &points, &num_points))
+			return FAILURE;
+	} else {
+		goto inval;
+	}
+
+	ALLOCATE(d, struct perftest_size_dist, 1);
+	memset(d, 0, sizeof(*d));
+	d->min = UINT32_MAX;
+
+	for (i = 0, j = 0; i < SIZE_DIST_TABLE; i++) {
+		double u = erand48(seed);
+		uint32_t size;
+
+		if (points) {
+			for (j = 0; j < num_points - 1 && points[j].prob < u; j++)
+				;
+			size = points[j].size;
+		} else if (!strncmp(spec, "uniform:", 8)) {
+			size = min + (uint32_t)(u * ((uint64_t)max - min + 1));
+		} else {
+			size = u < small_fraction ? min : max;
+		}
+
+		d->lengths[i] = size;
+		d->buckets[i] = size_dist_bucket(size);
+		if (size < d->min)
+			d->min = size;
+		if (size > d->max)
+			d->max = size;
+	}
+
+	free(points);
+	*dist = d;
+	return SUCCESS;
+
+inval:
+	fprintf(stderr, " Invalid size distribution %s\n", spec);
+	fprintf(stderr, " Use uniform:<min>:<max>, bimodal:<small>:<large>:<fraction of small> or cdf:<file>\n");
+	return FAILURE;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+void size_dist_reset(struct perftest_size_dist *dist)
+{
+	dist->next = 0;
+	memset(dist->bucket_msgs, 0, sizeof(dist->bucket_msgs));
+	memset(dist->bucket_bytes, 0, sizeof(dist->bucket_bytes));
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+double size_dist_avg(const struct perftest_size_dist *dist)
+{
+	uint64_t msgs = 0, bytes = 0;
+	int i;
+
+	for (i = 0; i < SIZE_DIST_BUCKETS; i++) {
+		msgs += dist->bucket_msgs[i];
+		bytes += dist->bucket_bytes[i];
+	}
+
+	if (!msgs) {
+		for (i = 0; i < SIZE_DIST_TABLE; i++)
+			bytes += dist->lengths[i];
+		return (double)bytes / SIZE_DIST_TABLE;
+	}
+
+	return (double)bytes / msgs;
+}
@@ -0,0 +1,64 @@
+#ifndef PERFTEST_SIZE_DIST_H
+#define PERFTEST_SIZE_DIST_H
+
+#include <stdint.h>
+#include <infiniband/verbs.h>
+
+/*
+ * Message sizes are drawn once into a table that the test loop walks, so
+ * posting only loads the next length. The table is a power of two.
+ */
+#define SIZE_DIST_TABLE		(1 << 16)
+#define SIZE_DIST_BUCKETS	(33)	/* Bucket b holds sizes in (2^(b-1), 2^b] */
+
+struct perftest_size_dist {
+	uint32_t	lengths[SIZE_DIST_TABLE];
+	uint8_t		buckets[SIZE_DIST_TABLE];
+	uint32_t	next;
+	uint32_t	min;
+	uint32_t	max;
+	uint64_t	bucket_msgs[SIZE_DIST_BUCKETS];
+	uint64_t	bucket_bytes[SIZE_DIST_BUCKETS];
+};
+
+/*
+ * Set the length of the next message on sge, and account it when count is set.
+ */
+static inline void size_dist_apply(struct perftest_size_dist *dist, struct ibv_sge *sge, int count)
+{
+	uint32_t i = dist->next++ & (SIZE_DIST_TABLE - 1);
+
+	sge->length = dist->lengths[i];
+	if (count) {
+		dist->bucket_msgs[dist->buckets[i]]++;
+		dist->bucket_bytes[dist->buckets[i]] += dist->lengths[i];
+	}
+}
+
+/*
+ * Build the table from one of:
+ *	uniform:<min>:<max>
+ *	bimodal:<small>:<large>:<fraction of small>
+ *	cdf:<file>	lines of "<size> <cumulative probability>", ascending
+ */
+int size_dist_parse(const char *spec, struct perftest_size_dist **dist);
+
+/*
+ * Clear the per bucket counts and restart the table.
+ */
+void size_dist_reset(struct perftest_size_dist *dist);
+
+/*
+ * Average size of the messages accounted so far, or of the table if none.
+ */
+double size_dist_avg(const struct perftest_size_dist *dist);
+
+/*
+ * Upper bound of bucket b.
+ */
+static inline uint64_t size_dist_bucket_max(int b)
+{
+	return (uint64_t)1 << b;
+}
+
+#endif
@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include "perftest_parameters.h"
+#include "perftest_timeseries.h"
+
+/* Samples in flight between the sampler and the writer */
+#define TS_RING_SIZE (256)
+
+struct ts_sample {
+	uint64_t		timestamp_ns;
+	uint64_t		duration_ns;
+	struct ts_counters	delta;
+};
+
+struct ts_context {
+	FILE			*fp;
+	enum ts_format		format;
+	uint64_t		interval_ns;
+	struct ts_counters	*counters;
+	struct ts_counters	last;
+	uint64_t		last_ns;
+	uint64_t		index;
+
+	struct ts_sample	ring[TS_RING_SIZE];
+	unsigned int		head;	/* Next slot the sampler fills */
+	unsigned int		tail;	/* Next slot the writer drains */
+	uint64_t		dropped;
+
+	pthread_mutex_t		lock;
+	pthread_cond_t		tick_cond;	/* Sampler sleeps on it, with a CLOCK_MONOTONIC deadline */
+	pthread_cond_t		ring_cond;	/* Writer sleeps on it until samples arrive */
+	int			stop;
+	pthread_t		sampler;
+	pthread_t		writer;
+};
+
+static uint64_t ts_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Take the counter deltas since the previous sample. Called with ctx->lock held. */
+static void ts_take_sample(struct ts_context *ctx)
+{
+	struct ts_counters now;
+	struct ts_sample *sample;
+	uint64_t now_ns = ts_now_ns();
+
+	now.posted = __atomic_load_n(&ctx->counters->posted, __ATOMIC_RELAXED);
+	now.completed = __atomic_load_n(&ctx->counters->completed, __ATOMIC_RELAXED);
+	now.bytes = __atomic_load_n(&ctx->counters->bytes, __ATOMIC_RELAXED);
+	now.cq_empty = __atomic_load_n(&ctx->counters->cq_empty, __ATOMIC_RELAXED);
+	now.sq_full = __atomic_load_n(&ctx->counters->sq_full, __ATOMIC_RELAXED);
+
+	if (ctx->head - ctx->tail == TS_RING_SIZE) {
+		/* The writer is stuck on a slow sink, keep sampling on time */
+		ctx->dropped++;
+	} else {
+		sample = &ctx->ring[ctx->head % TS_RING_SIZE];
+		sample->timestamp_ns = now_ns;
+		sample->duration_ns = now_ns - ctx->last_ns;
+		sample->delta.posted = now.posted - ctx->last.posted;
+		sample->delta.completed = now.completed - ctx->last.completed;
+		sample->delta.bytes = now.bytes - ctx->last.bytes;
+		sample->delta.cq_empty = now.cq_empty - ctx->last.cq_empty;
+		sample->delta.sq_full = now.sq_full - ctx->last.sq_full;
+		ctx->head++;
+		pthread_cond_signal(&ctx->ring_cond);
+	}
+
+	ctx->last = now;
+	ctx->last_ns = now_ns;
+}
+
+static void *ts_sampler(void *arg)
+{
+	struct ts_context *ctx = arg;
+	struct timespec deadline;
+	uint64_t next_ns = ctx->last_ns + ctx->interval_ns;
+
+	pthread_mutex_lock(&ctx->lock);
+	while (!ctx->stop) {
+		deadline.tv_sec = next_ns / 1000000000ULL;
+		deadline.tv_nsec = next_ns % 1000000000ULL;
+		if (pthread_cond_timedwait(&ctx->tick_cond, &ctx->lock, &deadline) == ETIMEDOUT) {
+			ts_take_sample(ctx);
+			next_ns += ctx->interval_ns;
+		}
+	}
+
+	/* Last, partial, interval */
+	ts_take_sample(ctx);
+	pthread_cond_signal(&ctx->ring_cond);
+	pthread_mutex_unlock(&ctx->lock);
+	return NULL;
+}
+
+static void ts_write_sample(struct ts_context *ctx, const struct ts_sample *sample)
+{
+	double seconds = sample->duration_ns / 1e9;
+	double bw_gbps = seconds > 0 ? sample->delta.bytes * 8 / seconds / 1e9 : 0;
+	double msg_rate_mpps = seconds > 0 ? sample->delta.completed / seconds / 1e6 : 0;
+
+	if (ctx->format == TS_FORMAT_CSV)
+		fprintf(ctx->fp, "%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+			",%" PRIu64 ",%" PRIu64 ",%.4f,%.6f\n",
+			sample->timestamp_ns, ctx->index, sample->duration_ns,
+			sample->delta.bytes, sample->delta.posted,
+			sample->delta.completed, sample->delta.cq_empty, sample->delta.sq_full,
+			bw_gbps, msg_rate_mpps);
+	else
+		fprintf(ctx->fp, "{\"timestamp_ns\": %" PRIu64 ", \"interval\": %" PRIu64 ", \"duration_ns\": %" PRIu64
+			", \"bytes\": %" PRIu64 ", \"posted\": %" PRIu64
+			", \"completed\": %" PRIu64 ", \"cq_empty_polls\": %" PRIu64 ", \"sq_full\": %" PRIu64
+			", \"bw_gbps\": %.4f, \"msg_rate_mpps\": %.6f}\n",
+			sample->timestamp_ns, ctx->index, sample->duration_ns,
+			sample->delta.bytes, sample->delta.posted,
+			sample->delta.completed, sample->delta.cq_empty, sample->delta.sq_full,
+			bw_gbps, msg_rate_mpps);
+	ctx->index++;
+}
+
+static void *ts_writer(void *arg)
+{
+	struct ts_context *ctx = arg;
+	struct ts_sample sample;
+	int done = 0;
+
+	pthread_mutex_lock(&ctx->lock);
+	while (!done || ctx->tail != ctx->head) {
+		if (ctx->tail == ctx->head) {
+			if (ctx->stop && !done) {
+				/* Let the sampler post the last interval first */
+				done = 1;
+				pthread_mutex_unlock(&ctx->lock);
+				pthread_join(ctx->sampler, NULL);
+				pthread_mutex_lock(&ctx->lock);
+				continue;
+			}
+			pthread_cond_wait(&ctx->ring_cond, &ctx->lock);
+			continue;
+		}
+
+		sample = ctx->ring[ctx->tail % TS_RING_SIZE];
+		ctx->tail++;
+
+		/* The sink may block, never hold the lock the sampler needs meanwhile */
+		pthread_mutex_unlock(&ctx->lock);
+		ts_write_sample(ctx, &sample);
+		fflush(ctx->fp);
+		pthread_mutex_lock(&ctx->lock);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	return NULL;
+}
+
+static FILE *ts_open_sink(const char *sink)
+{
+	FILE *fp;
+	int fd;
+
+	if (!strncmp(sink, "fd:", 3)) {
+		char *end;
+
+		fd = strtol(sink + 3, &end, 0);
+		if (*end != '\0' || fd < 0) {
+			fprintf(stderr, " Invalid time series sink %s\n", sink);
+			return NULL;
+		}
+		fd = dup(fd);
+	} else {
+		fd = open(sink, O_CREAT|O_WRONLY|O_TRUNC|O_CLOEXEC, S_IRUSR|S_IWUSR);
+	}
+
+	if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+		fprintf(stderr, " Couldn't open time series sink %s: %s\n", sink, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	return fp;
+}
+
+int ts_start(const char *sink, enum ts_format format, unsigned int interval_ms,
+		struct ts_counters *counters, struct ts_context **ctx)
+{
+	struct ts_context *ts;
+	pthread_condattr_t attr;
+
+	ALLOCATE(ts, struct ts_context, 1);
+	memset(ts, 0, sizeof(*ts));
+
+	ts->fp = ts_open_sink(sink);
+	if (!ts->fp) {
+		free(ts);
+		return FAILURE;
+	}
+
+	ts->format = format;
+	ts->interval_ns = (uint64_t)interval_ms * 1000000ULL;
+	ts->counters = counters;
+	ts->last.posted = __atomic_load_n(&counters->posted, __ATOMIC_RELAXED);
+	ts->last.completed = __atomic_load_n(&counters->completed, __ATOMIC_RELAXED);
+	ts->last.bytes = __atomic_load_n(&counters->bytes, __ATOMIC_RELAXED);
+	ts->last.cq_empty = __atomic_load_n(&counters->cq_empty, __ATOMIC_RELAXED);
+	ts->last.sq_full = __atomic_load_n(&counters->sq_full, __ATOMIC_RELAXED);
+	ts->last_ns = ts_now_ns();
+
+	if (format == TS_FORMAT_CSV) {
+		fprintf(ts->fp, "timestamp_ns,interval,duration_ns,bytes,posted,completed,"
+			"cq_empty_polls,sq_full,bw_gbps,msg_rate_mpps\n");
+		fflush(ts->fp);
+	}
+
+	pthread_mutex_init(&ts->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ts->tick_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&ts->ring_cond, NULL);
+
+	if (pthread_create(&ts->sampler, NULL, ts_sampler, ts)) {
+		fprintf(stderr, " Couldn't create time series sampler thread\n");
+		goto err;
+	}
+	if (pthread_create(&ts->writer, NULL, ts_writer, ts)) {
+		fprintf(stderr, " Couldn't create time series writer thread\n");
+		pthread_mutex_lock(&ts->lock);
+		ts->stop = 1;
+		pthread_cond_signal(&ts->tick_cond);
+		pthread_mutex_unlock(&ts->lock);
+		pthread_join(ts->sampler, NULL);
+		goto err;
+	}
+
+	*ctx = ts;
+	return SUCCESS;
+
+err:
+	fclose(ts->fp);
+	free(ts);
+	return FAILURE;
+}
+
+void ts_stop(struct ts_context *ctx)
+{
+	if (!ctx)
+		return;
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->stop = 1;
+	pthread_cond_signal(&ctx->tick_cond);
+	pthread_cond_signal(&ctx->ring_cond);
+	pthread_mutex_unlock(&ctx->lock);
+
+	/* The writer joins the sampler once the ring is drained */
+	pthread_join(ctx->writer, NULL);
+
+	if (ctx->dropped)
+		fprintf(stderr, " Time series: %" PRIu64 " samples dropped, the sink was too slow\n", ctx->dropped);
+	fclose(ctx->fp);
+	free(ctx);
+}
@@ -0,0 +1,39 @@
+#ifndef PERFTEST_TIMESERIES_H
+#define PERFTEST_TIMESERIES_H
+
+#include <stdint.h>
+
+enum ts_format {TS_FORMAT_CSV, TS_FORMAT_NDJSON};
+
+/*
+ * Running totals of the test loop. There is a single writer and the sampler
+ * thread only reads them, so updates are relaxed stores (plain adds on x86).
+ */
+struct ts_counters {
+	uint64_t	posted;
+	uint64_t	completed;
+	uint64_t	bytes;
+	uint64_t	cq_empty;
+	uint64_t	sq_full;
+};
+
+static inline void ts_count(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+struct ts_context;
+
+/*
+ * Open the sink (a file path, or fd:<n>) and sample the counters every
+ * interval_ms against CLOCK_MONOTONIC, from a side thread.
+ */
+int ts_start(const char *sink, enum ts_format format, unsigned int interval_ms,
+		struct ts_counters *counters, struct ts_context **ctx);
+
+/*
+ * Emit the last partial interval, stop the threads and close the sink.
+ */
+void ts_stop(struct ts_context *ctx);
+
+#endif
@@ -245,6 +245,11 @@ int main(int argc, char *argv[])
 		exchange_versions(&user_comm, &user_param);
 		check_version_compatibility(&user_param);
 		check_sys_data(&user_comm, &user_param);
+
+		if (check_sweep(&user_comm, &user_param)) {
+			dealloc_comm_struct(&user_comm,&user_param);
+			goto free_devname;
+		}
 	}
 
 	/* See if MTU is valid and supported. */
@@ -417,9 +422,8 @@ int main(int argc, char *argv[])
 		else if (user_param.connection_type == SRD)
 			size_max_pow = (int)MSG_SZ_2_EXP(user_param.size) + 1;
 
-		for (i = 1; i < size_max_pow ; ++i) {
+		for (i = 1; next_run_all_phase(&user_param, i, size_max_pow); ++i) {
 
-			user_param.size = (uint64_t)1 << i;
 
 			if (user_param.machine == CLIENT || user_param.duplex)
 				ctx_set_send_wqes(&ctx,&user_param,rem_dest);
@@ -128,6 +128,11 @@ int main(int argc, char *argv[])
 	check_version_compatibility(&user_param);
 	check_sys_data(&user_comm, &user_param);
 
+	if (check_sweep(&user_comm, &user_param)) {
+		dealloc_comm_struct(&user_comm,&user_param);
+		goto free_devname;
+	}
+
 	/* See if MTU is valid and supported. */
 	if (check_mtu(ctx.context,&user_param, &user_comm)) {
 		fprintf(stderr, " Couldn't get context for the device\n");
@@ -301,9 +306,8 @@ int main(int argc, char *argv[])
 
 	if (user_param.test_method == RUN_ALL) {
 
-		for (i = 1; i < 24 ; ++i) {
+		for (i = 1; next_run_all_phase(&user_param, i, 24); ++i) {
 
-			user_param.size = (uint64_t)1 << i;
 
 			if (user_param.machine == CLIENT || user_param.duplex)
 				ctx_set_send_wqes(&ctx,&user_param,rem_dest);
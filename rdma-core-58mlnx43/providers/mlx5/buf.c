@@ -38,7 +38,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <util/bitmap.h>
 
 #include "mlx5.h"
@@ -59,6 +61,39 @@
 #define MLX5_SHM_LENGTH         HPAGE_SIZE
 #define MLX5_Q_CHUNK_SIZE       32768
 
+/* From linux/mempolicy.h, libnuma is not a dependency */
+#define MLX5_MPOL_PREFERRED	1
+#define MLX5_MPOL_MF_MOVE	(1 << 1)
+#define MLX5_MAX_NUMA_NODES	1024
+
+/*
+ * Prefer mctx->numa_node for the pages of [addr, addr + len), addr being
+ * page aligned. Pages already faulted in elsewhere are moved. Failure only
+ * costs locality, so it is not reported to the caller.
+ */
+void mlx5_buf_bind_node(struct mlx5_context *mctx, void *addr, size_t len)
+{
+	unsigned long nodemask[MLX5_MAX_NUMA_NODES / (8 * sizeof(long))] = {};
+	unsigned int cpu, node;
+	int numa_node = mctx->numa_node;
+
+	if (numa_node == MLX5_NUMA_NODE_LOCAL) {
+		if (syscall(SYS_getcpu, &cpu, &node, NULL))
+			return;
+		numa_node = node;
+	}
+	if (numa_node < 0 || numa_node >= MLX5_MAX_NUMA_NODES)
+		return;
+
+	nodemask[numa_node / (8 * sizeof(long))] |=
+		1UL << (numa_node % (8 * sizeof(long)));
+	if (syscall(SYS_mbind, addr, len, MLX5_MPOL_PREFERRED, nodemask,
+		    MLX5_MAX_NUMA_NODES + 1, MLX5_MPOL_MF_MOVE))
+		mlx5_dbg(mctx->dbg_fp, MLX5_DBG_CONTIG,
+			 "mbind %p len %zu to node %d failed, errno %d\n",
+			 addr, len, numa_node, errno);
+}
+
 static void free_huge_mem(struct mlx5_hugetlb_mem *hmem)
 {
 	if (hmem->bitmap)
@@ -160,6 +195,8 @@ static int alloc_huge_buf(struct mlx5_context *mctx, struct mlx5_buf *buf,
 		bitmap_fill_region(hmem->bitmap, 0, nchunk);
 
 		buf->hmem = hmem;
+		mlx5_buf_bind_node(mctx, hmem->shmaddr,
+				   hmem->bmp_size * MLX5_Q_CHUNK_SIZE);
 
 		mlx5_spin_lock(&mctx->hugetlb_lock);
 		if (nchunk != hmem->bmp_size)
@@ -328,7 +365,11 @@ int mlx5_alloc_prefered_buf(struct mlx5_context *mctx,
 	if (type == MLX5_ALLOC_TYPE_EXTERNAL)
 		return mlx5_alloc_buf_extern(mctx, buf, size);
 
-	return mlx5_alloc_buf(buf, size, page_size);
+	ret = mlx5_alloc_buf(buf, size, page_size);
+	if (!ret)
+		mlx5_buf_bind_node(mctx, buf->buf, buf->length);
+
+	return ret;
 
 }
 
@@ -35,6 +35,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sched.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
@@ -119,6 +120,9 @@ int mlx5_stall_cq_poll_max = 100000;
 int mlx5_stall_cq_inc_step = 100;
 int mlx5_stall_cq_dec_step = 10;
 
+#define MLX5_CQ_POLL_EWMA_SHIFT 3
+#define MLX5_CQ_POLL_YIELD_CYCLES 20000
+
 enum {
 	MLX5_TM_MAX_SYNC_DIFF = 0x3fff
 };
@@ -158,6 +162,87 @@ static void *next_cqe_sw(struct mlx5_cq *cq)
 	return get_sw_cqe(cq, cq->cons_index);
 }
 
+enum {
+	MLX5_CQE_FORMAT_COMPRESSED = 0x3,
+};
+
+/*
+ * A compressed CQE session is a title CQE, whose byte_cnt holds the number
+ * of completions N, followed by arrays of 8 mini CQEs. It covers N slots
+ * from the title: the first array is in the slot after the title, array k
+ * in the first slot of the k'th group of 8, the rest are holes.
+ */
+struct mlx5_mini_cqe8 {
+	union {
+		__be32		rx_hash_result;
+		struct {
+			__be16	checksum;
+			__be16	stride_idx;
+		};
+		struct {
+			__be16	wqe_counter;
+			uint8_t	s_wqe_opcode;
+			uint8_t	reserved;
+		} s_wqe_info;
+	};
+	__be32		byte_cnt;
+};
+
+/*
+ * Responder fields a mini CQE may carry, which struct mlx5_cqe64 leaves
+ * reserved: the RSS hash result and the RX checksum.
+ */
+#define MLX5_CQE_RX_HASH_RES_OFF 12
+#define MLX5_CQE_CHECKSUM_OFF 20
+
+/*
+ * op_own of a CQE the batch path decodes: software owned, a REQ or responder
+ * opcode, and no inline scatter or compressed format bits.
+ */
+#define MLX5_CQ_BATCH 8
+#define MLX5_CQ_FAST_OWN_MASK (MLX5_CQE_OWNER_MASK | MLX5_INLINE_SCATTER_32 | \
+			       MLX5_INLINE_SCATTER_64)
+#define MLX5_CQ_FAST_MAX_OP (MLX5_CQE_RESP_SEND_INV << 4)
+
+/* Bit i is set if the i'th of 8 CQEs, cqe_sz apart, is fast */
+static inline unsigned int mlx5_cq_fast_mask8(const uint8_t *op_own,
+					      int cqe_sz, uint8_t sw_owner)
+{
+	unsigned int mask = 0;
+	int i;
+
+	for (i = 0; i < MLX5_CQ_BATCH; i++) {
+		uint8_t b = op_own[i * cqe_sz];
+
+		if ((b & MLX5_CQ_FAST_OWN_MASK) == sw_owner &&
+		    (b & 0xf0) <= MLX5_CQ_FAST_MAX_OP)
+			mask |= 1 << i;
+	}
+	return mask;
+}
+
+/*
+ * Number of leading CQEs from cons_index, up to n, that the batch path can
+ * decode. A batch never crosses the end of the ring, where the owner bit
+ * flips, and a short tail is left to the scalar path.
+ */
+static inline int mlx5_cq_scan_fast(struct mlx5_cq *cq, int n)
+{
+	uint32_t ci = cq->cons_index;
+	int nent = cq->verbs_cq.cq.cqe + 1;
+	uint8_t *op_own;
+	unsigned int mask;
+
+	if (n < MLX5_CQ_BATCH || nent - (int)(ci & (nent - 1)) < MLX5_CQ_BATCH ||
+	    cq->comp_cnt)
+		return 0;
+
+	op_own = (uint8_t *)get_cqe(cq, ci & (nent - 1)) + cq->cqe_sz - 1;
+	mask = mlx5_cq_fast_mask8(op_own, cq->cqe_sz, !!(ci & nent));
+
+	return __builtin_ctz(~mask);
+}
+
 static void update_cons_index(struct mlx5_cq *cq)
 {
 	cq->dbrec[MLX5_CQ_SET_CI] = htobe32(cq->cons_index & 0xffffff);
@@ -400,6 +485,57 @@ static void mlx5_get_cycles(uint64_t *cycles)
 {
 	*cycles = get_cycles();
 }
+
+/*
+ * MLX5DV_CQ_POLL_POLICY_CPU: after an empty poll the CQ isn't read again
+ * until a part of the expected CQE gap has passed, the part growing with the
+ * share of empty polls, clamped to MLX5_STALL_CQ_POLL_MIN/MAX cycles. Polls
+ * inside the backoff return nothing and give the core away if the wait is
+ * long, instead of spinning on the CQ buffer.
+ */
+static inline bool mlx5_cq_poll_backoff(struct mlx5_cq *cq)
+{
+	uint64_t now;
+
+	if (!cq->poll_resume)
+		return false;
+
+	now = get_cycles();
+	if (now >= cq->poll_resume) {
+		cq->poll_resume = 0;
+		return false;
+	}
+
+	if (cq->poll_resume - now > MLX5_CQ_POLL_YIELD_CYCLES)
+		sched_yield();
+	return true;
+}
+
+static inline void mlx5_cq_poll_update(struct mlx5_cq *cq, int npolled)
+{
+	uint64_t now = get_cycles();
+	uint64_t backoff;
+	int empty = npolled ? 0 : 1024;
+
+	cq->poll_empty_ratio += (empty - cq->poll_empty_ratio) >>
+				MLX5_CQ_POLL_EWMA_SHIFT;
+
+	if (npolled) {
+		if (cq->poll_last_cqe)
+			cq->poll_gap_cycles +=
+				((now - cq->poll_last_cqe) / npolled >>
+				 MLX5_CQ_POLL_EWMA_SHIFT) -
+				(cq->poll_gap_cycles >> MLX5_CQ_POLL_EWMA_SHIFT);
+		cq->poll_last_cqe = now;
+		return;
+	}
+
+	/* Half the gap when every poll is empty */
+	backoff = (cq->poll_gap_cycles * cq->poll_empty_ratio) >> 11;
+	backoff = max_t(uint64_t, backoff, mlx5_stall_cq_poll_min);
+	backoff = min_t(uint64_t, backoff, mlx5_stall_cq_poll_max);
+	cq->poll_resume = now + backoff;
+}
 #else
 static void mlx5_stall_poll_cq(void)
 {
@@ -410,6 +546,13 @@ static void mlx5_stall_cycles_poll_cq(uint64_t cycles)
 static void mlx5_get_cycles(uint64_t *cycles)
 {
 }
+static inline bool mlx5_cq_poll_backoff(struct mlx5_cq *cq)
+{
+	return false;
+}
+static inline void mlx5_cq_poll_update(struct mlx5_cq *cq, int npolled)
+{
+}
 #endif
 
 static inline struct mlx5_qp *get_req_context(struct mlx5_context *mctx,
@@ -531,6 +674,65 @@ static inline int get_cur_rsc(struct mlx5_context *mctx,
 
 }
 
+/*
+ * Expand the next mini CQE of the session at cons_index into comp_cqe.
+ * cons_index stays on the title until the session is done, so hardware never
+ * sees the session half consumed and can't reuse its slots under us.
+ */
+static struct mlx5_cqe64 *mlx5_next_mini_cqe(struct mlx5_cq *cq)
+{
+	uint32_t i = cq->comp_idx;
+	struct mlx5_mini_cqe8 *mini;
+	void *array;
+
+	array = get_cqe(cq, (cq->cons_index + (i < 8 ? 1 : (i & ~7))) &
+			    cq->verbs_cq.cq.cqe);
+	if (cq->cqe_sz == 128)
+		array += 64;
+	mini = (struct mlx5_mini_cqe8 *)array + (i & 7);
+	VALGRIND_MAKE_MEM_DEFINED(mini, sizeof(*mini));
+
+	cq->comp_cqe.byte_cnt = mini->byte_cnt;
+	if (mlx5dv_get_cqe_opcode(&cq->comp_cqe) == MLX5_CQE_REQ) {
+		cq->comp_cqe.wqe_counter = mini->s_wqe_info.wqe_counter;
+		cq->comp_cqe.sop_drop_qpn =
+			htobe32((uint32_t)mini->s_wqe_info.s_wqe_opcode << 24 |
+				(be32toh(cq->comp_cqe.sop_drop_qpn) & 0xffffff));
+	} else {
+		/* Responder sessions consume consecutive WQEs */
+		cq->comp_cqe.wqe_counter = htobe16(cq->comp_wqe_counter + i);
+		/* create_cq() allows HASH or CSUM only */
+		if (cq->comp_res_format == MLX5DV_CQE_RES_FORMAT_HASH)
+			memcpy((uint8_t *)&cq->comp_cqe + MLX5_CQE_RX_HASH_RES_OFF,
+			       &mini->rx_hash_result,
+			       sizeof(mini->rx_hash_result));
+		else
+			memcpy((uint8_t *)&cq->comp_cqe + MLX5_CQE_CHECKSUM_OFF,
+			       &mini->checksum, sizeof(mini->checksum));
+	}
+
+	if (++cq->comp_idx == cq->comp_cnt) {
+		/*
+		 * Holes and mini CQE arrays would pass for software owned
+		 * CQEs on a later lap.
+		 */
+		for (i = 0; i < cq->comp_cnt; i++) {
+			void *cqe = get_cqe(cq, (cq->cons_index + i) &
+					    cq->verbs_cq.cq.cqe);
+			struct mlx5_cqe64 *cqe64 =
+				(cq->cqe_sz == 64) ? cqe : cqe + 64;
+
+			cqe64->op_own = MLX5_CQE_INVALID << 4;
+		}
+		/* Before hardware may reuse the slots */
+		udma_to_device_barrier();
+		cq->cons_index += cq->comp_cnt;
+		cq->comp_cnt = 0;
+	}
+
+	return &cq->comp_cqe;
+}
+
 static inline int mlx5_get_next_cqe(struct mlx5_cq *cq,
 				    struct mlx5_cqe64 **pcqe64,
 				    void **pcqe)
@@ -542,14 +744,17 @@ static inline int mlx5_get_next_cqe(struct mlx5_cq *cq,
 	void *cqe;
 	struct mlx5_cqe64 *cqe64;
 
+	if (unlikely(cq->comp_cnt)) {
+		cqe = cqe64 = mlx5_next_mini_cqe(cq);
+		goto out;
+	}
+
 	cqe = next_cqe_sw(cq);
 	if (!cqe)
 		return CQ_EMPTY;
 
 	cqe64 = (cq->cqe_sz == 64) ? cqe : cqe + 64;
 
-	++cq->cons_index;
-
 	VALGRIND_MAKE_MEM_DEFINED(cqe64, sizeof *cqe64);
 
 	/*
@@ -558,6 +763,21 @@ static inline int mlx5_get_next_cqe(struct mlx5_cq *cq,
 	 */
 	udma_from_device_barrier();
 
+	if (unlikely(mlx5dv_get_cqe_format(cqe64) ==
+		     MLX5_CQE_FORMAT_COMPRESSED)) {
+		cq->comp_cqe = *cqe64;
+		cq->comp_cqe.op_own &= ~(MLX5_INLINE_SCATTER_32 |
+					 MLX5_INLINE_SCATTER_64);
+		cq->comp_wqe_counter = be16toh(cqe64->wqe_counter);
+		cq->comp_cnt = be32toh(cqe64->byte_cnt);
+		cq->comp_idx = 0;
+		cqe = cqe64 = mlx5_next_mini_cqe(cq);
+		goto out;
+	}
+
+	++cq->cons_index;
+
+out:
 #ifdef MLX5_DEBUG
 	{
 		struct mlx5_context *mctx = to_mctx(cq->verbs_cq.cq_ex.context);
@@ -997,6 +1217,96 @@ static inline int mlx5_poll_one(struct mlx5_cq *cq,
 	return mlx5_parse_cqe(cq, cqe64, cqe, cur_rsc, cur_srq, wc, cqe_ver, 0);
 }
 
+/* The success cases of mlx5_parse_cqe() for a CQE mlx5_cq_scan_fast() took */
+static inline int mlx5_parse_fast_cqe(struct mlx5_context *mctx,
+				      struct mlx5_cqe64 *cqe64,
+				      struct mlx5_resource **cur_rsc,
+				      struct mlx5_srq **cur_srq,
+				      struct ibv_wc *wc, int cqe_ver)
+				      ALWAYS_INLINE;
+static inline int mlx5_parse_fast_cqe(struct mlx5_context *mctx,
+				      struct mlx5_cqe64 *cqe64,
+				      struct mlx5_resource **cur_rsc,
+				      struct mlx5_srq **cur_srq,
+				      struct ibv_wc *wc, int cqe_ver)
+{
+	uint32_t qpn = be32toh(cqe64->sop_drop_qpn) & 0xffffff;
+	uint32_t srqn_uidx = be32toh(cqe64->srqn_uidx) & 0xffffff;
+	struct mlx5_qp *mqp;
+	struct mlx5_wq *wq;
+	uint8_t is_srq = 0;
+	int idx;
+
+	wc->wc_flags = 0;
+	wc->qp_num = qpn;
+
+	if (mlx5dv_get_cqe_opcode(cqe64) == MLX5_CQE_REQ) {
+		mqp = get_req_context(mctx, cur_rsc,
+				      cqe_ver ? srqn_uidx : qpn, cqe_ver);
+		if (unlikely(!mqp))
+			return CQ_POLL_ERR;
+		wq = &mqp->sq;
+		idx = be16toh(cqe64->wqe_counter) & (wq->wqe_cnt - 1);
+		handle_good_req(wc, cqe64, wq, idx);
+		wc->wr_id = wq->wrid[idx];
+		wc->status = IBV_WC_SUCCESS;
+		wq->tail = wq->wqe_head[idx] + 1;
+		return CQ_OK;
+	}
+
+	if (unlikely(get_cur_rsc(mctx, cqe_ver, qpn, srqn_uidx, cur_rsc,
+				 cur_srq, &is_srq)))
+		return CQ_POLL_ERR;
+	wc->status = handle_responder(wc, cqe64, *cur_rsc,
+				      is_srq ? *cur_srq : NULL);
+	return CQ_OK;
+}
+
+/*
+ * Decode a run of plain success CQEs behind one ownership scan and one read
+ * barrier. Returns how many were consumed, 0 leaves the next CQE to
+ * mlx5_poll_one().
+ */
+static inline int mlx5_poll_batch(struct mlx5_cq *cq,
+				  struct mlx5_resource **cur_rsc,
+				  struct mlx5_srq **cur_srq,
+				  struct ibv_wc *wc, int ne, int cqe_ver)
+				  ALWAYS_INLINE;
+static inline int mlx5_poll_batch(struct mlx5_cq *cq,
+				  struct mlx5_resource **cur_rsc,
+				  struct mlx5_srq **cur_srq,
+				  struct ibv_wc *wc, int ne, int cqe_ver)
+{
+	struct mlx5_context *mctx = to_mctx(cq->verbs_cq.cq.context);
+	int n, i;
+
+#ifdef MLX5_DEBUG
+	if (mlx5_debug_mask & MLX5_DBG_CQ_CQE)
+		return 0;
+#endif
+
+	n = mlx5_cq_scan_fast(cq, ne);
+	if (!n)
+		return 0;
+
+	udma_from_device_barrier();
+
+	for (i = 0; i < n; i++) {
+		void *cqe = get_cqe(cq, cq->cons_index & cq->verbs_cq.cq.cqe);
+		struct mlx5_cqe64 *cqe64 = (cq->cqe_sz == 64) ? cqe : cqe + 64;
+
+		VALGRIND_MAKE_MEM_DEFINED(cqe64, sizeof *cqe64);
+
+		/* Unknown QP, the scalar path reports it */
+		if (mlx5_parse_fast_cqe(mctx, cqe64, cur_rsc, cur_srq, wc + i,
+					cqe_ver))
+			break;
+		++cq->cons_index;
+	}
+
+	return i;
+}
+
 static inline int poll_cq(struct ibv_cq *ibcq, int ne,
 		      struct ibv_wc *wc, int cqe_ver)
 		      ALWAYS_INLINE;
@@ -1009,7 +1319,10 @@ static inline int poll_cq(struct ibv_cq *ibcq, int ne,
 	int npolled;
 	int err = CQ_OK;
 
-	if (cq->stall_enable) {
+	if (cq->poll_policy == MLX5DV_CQ_POLL_POLICY_CPU) {
+		if (mlx5_cq_poll_backoff(cq))
+			return 0;
+	} else if (cq->stall_enable) {
 		if (cq->stall_adaptive_enable) {
 			if (cq->stall_last_count)
 				mlx5_stall_cycles_poll_cq(cq->stall_last_count + cq->stall_cycles);
@@ -1021,17 +1334,29 @@ static inline int poll_cq(struct ibv_cq *ibcq, int ne,
 
 	mlx5_spin_lock(&cq->lock);
 
-	for (npolled = 0; npolled < ne; ++npolled) {
+	for (npolled = 0; npolled < ne;) {
+		int nbatch = mlx5_poll_batch(cq, &rsc, &srq, wc + npolled,
+					     ne - npolled, cqe_ver);
+
+		if (nbatch) {
+			npolled += nbatch;
+			continue;
+		}
+
 		err = mlx5_poll_one(cq, &rsc, &srq, wc + npolled, cqe_ver);
 		if (err != CQ_OK)
 			break;
+		++npolled;
 	}
 
 	update_cons_index(cq);
 
 	mlx5_spin_unlock(&cq->lock);
 
-	if (cq->stall_enable) {
+	if (cq->poll_policy == MLX5DV_CQ_POLL_POLICY_CPU) {
+		if (err != CQ_POLL_ERR)
+			mlx5_cq_poll_update(cq, npolled);
+	} else if (cq->stall_enable) {
 		if (cq->stall_adaptive_enable) {
 			if (npolled == 0) {
 				cq->stall_cycles = max(cq->stall_cycles-mlx5_stall_cq_dec_step,
@@ -1389,16 +1714,37 @@ static inline void mlx5_end_poll_lock(struct ibv_cq_ex *ibcq)
 	_mlx5_end_poll(ibcq, 1, 0);
 }
 
+/*
+ * With MTRDMA, completions the shaper polled early to make room in the SQ
+ * are returned first.
+ */
 int mlx5_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
 {
+#ifdef MTRDMA
+	return mtrdma_poll_cq(ibcq, ne, wc, 0);
+#else
 	return poll_cq(ibcq, ne, wc, 0);
+#endif
 }
 
 int mlx5_poll_cq_v1(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
 {
+#ifdef MTRDMA
+	return mtrdma_poll_cq(ibcq, ne, wc, 1);
+#else
 	return poll_cq(ibcq, ne, wc, 1);
+#endif
 }
 
+#ifdef MTRDMA
+int mlx5_mtrdma_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
+{
+	if (to_mctx(ibcq->context)->cqe_version)
+		return poll_cq(ibcq, ne, wc, 1);
+	return poll_cq(ibcq, ne, wc, 0);
+}
+#endif
+
 static inline enum ibv_wc_opcode mlx5_cq_read_wc_opcode(struct ibv_cq_ex *ibcq)
 {
 	struct mlx5_cq *cq = to_mcq(ibv_cq_ex_to_cq(ibcq));
@@ -1670,6 +2016,31 @@ static const struct op
 	[SINGLE_THREADED | STALL | ADAPTIVE | CLOCK_UPDATE] = POLL_FN_ENTRY(_v0, , _stall, _adaptive, _clock_update),
 };
 
+/*
+ * ibv_poll_cq honours the policy on every call. The ibv_start_poll ops are
+ * picked at creation, a CPU first CQ gets the adaptive stall ops there.
+ */
+void mlx5_cq_set_poll_policy(struct mlx5_cq *cq,
+			     enum mlx5dv_cq_poll_policy policy)
+{
+	cq->poll_policy = policy;
+	cq->poll_resume = 0;
+
+	switch (policy) {
+	case MLX5DV_CQ_POLL_POLICY_LATENCY:
+		cq->stall_enable = 0;
+		cq->stall_adaptive_enable = 0;
+		break;
+	case MLX5DV_CQ_POLL_POLICY_CPU:
+		cq->stall_enable = 1;
+		cq->stall_adaptive_enable = 1;
+		cq->stall_cycles = mlx5_stall_cq_poll_min;
+		break;
+	default:
+		break;
+	}
+}
+
 int mlx5_cq_fill_pfns(struct mlx5_cq *cq,
 		      const struct ibv_cq_init_attr_ex *cq_attr,
 		      struct mlx5_context *mctx)
@@ -1819,7 +2190,12 @@ void __mlx5_cq_clean(struct mlx5_cq *cq, uint32_t rsn, struct mlx5_srq *srq)
 	uint8_t owner_bit;
 	int cqe_version;
 
-	if (!cq || cq->flags & MLX5_CQ_FLAGS_DV_OWNED)
+	/*
+	 * A compressed CQ can't be swept in place, its owner drains it before
+	 * destroying the QP.
+	 */
+	if (!cq || cq->flags & (MLX5_CQ_FLAGS_DV_OWNED |
+				MLX5_CQ_FLAGS_COMPRESSED))
 		return;
 
 	/*
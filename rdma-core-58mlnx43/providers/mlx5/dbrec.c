@@ -71,6 +71,8 @@ static struct mlx5_db_page *__add_page(struct mlx5_context *context)
 		free(page);
 		return NULL;
 	}
+	if (page->buf.type == MLX5_ALLOC_TYPE_ANON)
+		mlx5_buf_bind_node(context, page->buf.buf, ps);
 
 	page->num_db  = pp;
 	page->use_cnt = 0;
@@ -37,11 +37,13 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/mman.h>
 #include <pthread.h>
 #include <string.h>
 #include <sched.h>
 #include <sys/param.h>
+#include <sys/syscall.h>
 
 #include <util/symver.h>
 #include <rdma/mlx5_user_ioctl_cmds.h>
@@ -553,6 +555,77 @@ out:
 	return stall_enable;
 }
 
+/* Highest possible NUMA node plus one, or 0 when unknown */
+static long mlx5_num_numa_nodes(void)
+{
+	char buf[256];
+	char *last;
+	FILE *fp;
+
+	fp = fopen("/sys/devices/system/node/possible", "r");
+	if (!fp)
+		return 0;
+	if (!fgets(buf, sizeof(buf), fp)) {
+		fclose(fp);
+		return 0;
+	}
+	fclose(fp);
+
+	/* A list of ranges, "0" or "0-3" or "0,2-3", sorted */
+	last = strrchr(buf, ',');
+	last = last ? last + 1 : buf;
+	if (strchr(last, '-'))
+		last = strchr(last, '-') + 1;
+
+	return strtol(last, NULL, 10) + 1;
+}
+
+/*
+ * MLX5_NUMA_NODE=<node>|local|none overrides the node of the device, which
+ * queue and doorbell pages are placed on by default.
+ */
+static int mlx5_numa_node(struct ibv_device *ibdev, struct mlx5_context *mctx)
+{
+	char fname[MAXPATHLEN];
+	char *env_value;
+	long num_nodes;
+	char *end;
+	long val;
+	int node;
+	FILE *fp;
+
+	env_value = getenv("MLX5_NUMA_NODE");
+	if (env_value) {
+		if (!strcasecmp(env_value, "local"))
+			return MLX5_NUMA_NODE_LOCAL;
+		if (!strcasecmp(env_value, "none"))
+			return MLX5_NUMA_NODE_NONE;
+
+		errno = 0;
+		val = strtol(env_value, &end, 10);
+		num_nodes = mlx5_num_numa_nodes();
+		if (!errno && end != env_value && !*end && val >= 0 &&
+		    val <= INT_MAX && (!num_nodes || val < num_nodes))
+			return val;
+
+		mlx5_err(mctx->dbg_fp,
+			 PFX "Warning: ignoring invalid MLX5_NUMA_NODE=%s\n",
+			 env_value);
+	}
+
+	snprintf(fname, MAXPATHLEN, "/sys/class/infiniband/%s/device/numa_node",
+		 ibv_get_device_name(ibdev));
+
+	fp = fopen(fname, "r");
+	if (!fp)
+		return MLX5_NUMA_NODE_NONE;
+	if (fscanf(fp, "%d", &node) != 1 || node < 0)
+		node = MLX5_NUMA_NODE_NONE;
+	fclose(fp);
+
+	return node;
+}
+
 static void mlx5_read_env(struct ibv_device *ibdev, struct mlx5_context *ctx)
 {
 	char *env_value;
@@ -593,6 +666,8 @@ static void mlx5_read_env(struct ibv_device *ibdev, struct mlx5_context *ctx)
 		ctx->stall_cycles = mlx5_stall_cq_poll_min;
 	}
 
+	ctx->numa_node = mlx5_numa_node(ibdev, ctx);
+
 }
 
 static int get_total_uuars(int page_size)
@@ -722,6 +797,37 @@ static int need_uuar_lock(struct mlx5_context *ctx, int uuarn)
 	return 1;
 }
 
+/*
+ * The elided lock of mlx5_spin_lock() with MLX5_LOCK_CHECK=1: an atomic
+ * test and set that always catches a second thread, and names both.
+ */
+int mlx5_spin_lock_check(struct mlx5_spinlock *lock)
+{
+	pid_t tid = syscall(SYS_gettid);
+
+	if (__atomic_exchange_n(&lock->in_use, 1, __ATOMIC_ACQ_REL)) {
+		fprintf(stderr, "*** ERROR: multithreading violation ***\n"
+			"Thread %d used a single threaded mlx5 object while\n"
+			"thread %d held it.\n", tid,
+			__atomic_load_n(&lock->owner, __ATOMIC_RELAXED));
+		abort();
+	}
+	__atomic_store_n(&lock->owner, tid, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+static int lock_check_app(void)
+{
+	char *env;
+
+	env = getenv("MLX5_LOCK_CHECK");
+	if (env)
+		return strcmp(env, "1") ? 0 : 1;
+
+	return 0;
+}
+
 static int single_threaded_app(void)
 {
 
@@ -2358,6 +2464,7 @@ static struct mlx5_context *mlx5_init_context(struct ibv_device *ibdev,
 		strcpy(context->hostname, "host_unknown");
 
 	mlx5_single_threaded = single_threaded_app();
+	mlx5_lock_check = lock_check_app();
 
 	ret = get_uar_info(mdev, &tot_uuars, &low_lat_uuars);
 	if (ret) {
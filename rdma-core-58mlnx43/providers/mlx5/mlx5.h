@@ -205,6 +205,11 @@ enum mlx5_alloc_type {
 	MLX5_ALLOC_TYPE_ALL
 };
 
+enum {
+	MLX5_NUMA_NODE_NONE	= -1,	/* Leave page placement to the kernel */
+	MLX5_NUMA_NODE_LOCAL	= -2,	/* Node of the thread creating the object */
+};
+
 enum mlx5_rsc_type {
 	MLX5_RSC_TYPE_QP,
 	MLX5_RSC_TYPE_XSRQ,
@@ -244,6 +249,7 @@ struct mlx5_spinlock {
 	pthread_spinlock_t		lock;
 	int				in_use;
 	int				need_lock;
+	pid_t				owner; /* Holder, with MLX5_LOCK_CHECK */
 };
 
 enum mlx5_uar_type {
@@ -360,6 +366,7 @@ struct mlx5_context {
 	int				stall_enable;
 	int				stall_adaptive_enable;
 	int				stall_cycles;
+	int				numa_node; /* Of queue and doorbell pages */
 	struct mlx5_bf		       *bfs;
 	FILE			       *dbg_fp;
 	char				hostname[40];
@@ -482,6 +489,7 @@ enum {
 	MLX5_CQ_FLAGS_DV_OWNED = 1 << 5,
 	MLX5_CQ_FLAGS_TM_SYNC_REQ = 1 << 6,
 	MLX5_CQ_FLAGS_RAW_WQE = 1 << 7,
+	MLX5_CQ_FLAGS_COMPRESSED = 1 << 8,
 };
 
 struct mlx5_cq {
@@ -505,9 +513,20 @@ struct mlx5_cq {
 	uint64_t			stall_last_count;
 	int				stall_adaptive_enable;
 	int				stall_cycles;
+	uint8_t				poll_policy; /* enum mlx5dv_cq_poll_policy */
+	uint16_t			poll_empty_ratio; /* EWMA, 1024 is all empty */
+	uint64_t			poll_gap_cycles; /* EWMA of cycles per CQE */
+	uint64_t			poll_last_cqe; /* TSC of the last non empty poll */
+	uint64_t			poll_resume; /* Don't read the CQ before this TSC */
 	struct mlx5_resource		*cur_rsc;
 	struct mlx5_srq			*cur_srq;
 	struct mlx5_cqe64		*cqe64;
+	/* Compressed CQE session at cons_index, comp_cnt is 0 outside one */
+	uint32_t			comp_cnt;
+	uint32_t			comp_idx; /* Next mini CQE to expand */
+	uint16_t			comp_wqe_counter; /* Of the title CQE */
+	uint8_t				comp_res_format; /* enum mlx5dv_cqe_comp_res_format */
+	struct mlx5_cqe64		comp_cqe; /* Title with the mini CQE applied */
 	uint32_t			flags;
 	int				cached_opcode;
 	struct mlx5dv_clock_info	last_clock_info;
@@ -557,6 +576,8 @@ struct mlx5_srq {
 	int				op_tail;
 	int				unexp_in;
 	int				unexp_out;
+	uint16_t			mtrdma_consumed; /* Matches counter when empty */
+	uint32_t			mtrdma_epoch; /* Last MTRDMA RQ sample */
 };
 
 
@@ -624,6 +645,12 @@ struct mlx5_bf {
 	uint32_t			uar_handle;
 	uint32_t			length;
 	uint32_t			page_id;
+#ifdef MTRDMA
+	/* Doorbells rung under need_lock, and those that waited for it */
+	uint64_t			lock_acquired;
+	uint64_t			lock_contended;
+	uint32_t			mtrdma_epoch; /* Last MTRDMA UAR sample */
+#endif
 };
 
 struct mlx5_dm {
@@ -670,6 +697,7 @@ struct mlx5_qp {
 	void				*cur_data;
 	struct mlx5_wqe_ctrl_seg	*cur_ctrl;
 	struct mlx5_mkey		*cur_mkey;
+	uint64_t			mtrdma_bytes; /* Payload of the open batch */
 	/* End of new post send API specific fields */
 
 	uint8_t				fm_cache;
@@ -708,6 +736,7 @@ struct mlx5_qp {
 	uint32_t			get_ece;
 
 	uint8_t				need_mmo_enable:1;
+	uint8_t				mtrdma:1; /* Posts go through the MTRDMA shaper */
 };
 
 struct mlx5_ah {
@@ -957,6 +986,7 @@ extern int mlx5_stall_cq_poll_max;
 extern int mlx5_stall_cq_inc_step;
 extern int mlx5_stall_cq_dec_step;
 extern int mlx5_single_threaded;
+extern int mlx5_lock_check;
 
 #define to_mxxx(xxx, type) container_of(ib##xxx, struct mlx5_##type, ibv_##xxx)
 
@@ -1080,6 +1110,7 @@ void mlx5_set_debug_mask(void);
 
 int mlx5_alloc_buf(struct mlx5_buf *buf, size_t size, int page_size);
 void mlx5_free_buf(struct mlx5_buf *buf);
+void mlx5_buf_bind_node(struct mlx5_context *mctx, void *addr, size_t len);
 int mlx5_alloc_buf_contig(struct mlx5_context *mctx, struct mlx5_buf *buf,
 			  size_t size, int page_size, const char *component);
 void mlx5_free_buf_contig(struct mlx5_context *mctx, struct mlx5_buf *buf);
@@ -1142,6 +1173,8 @@ struct ibv_cq *mlx5_create_cq(struct ibv_context *context, int cqe,
 			       int comp_vector);
 struct ibv_cq_ex *mlx5_create_cq_ex(struct ibv_context *context,
 				    struct ibv_cq_init_attr_ex *cq_attr);
+void mlx5_cq_set_poll_policy(struct mlx5_cq *cq,
+			     enum mlx5dv_cq_poll_policy policy);
 int mlx5_cq_fill_pfns(struct mlx5_cq *cq,
 		      const struct ibv_cq_init_attr_ex *cq_attr,
 		      struct mlx5_context *mctx);
@@ -1190,6 +1223,13 @@ void mlx5_init_qp_indices(struct mlx5_qp *qp);
 void mlx5_init_rwq_indices(struct mlx5_rwq *rwq);
 int mlx5_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 			  struct ibv_send_wr **bad_wr);
+#ifdef MTRDMA
+/* Device access of the MTRDMA shaper, below its interception points */
+int mlx5_mtrdma_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+			  struct ibv_send_wr **bad_wr);
+int mlx5_mtrdma_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc);
+void mlx5_mtrdma_ring_db(struct ibv_qp *ibqp, uint32_t cur_post, void *ctrl);
+#endif
 int mlx5_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr,
 			  struct ibv_recv_wr **bad_wr);
 int mlx5_post_wq_recv(struct ibv_wq *ibwq, struct ibv_recv_wr *wr,
@@ -1315,15 +1355,26 @@ static inline void *mlx5_find_uidx(struct mlx5_context *ctx, uint32_t uidx)
 	return NULL;
 }
 
+int mlx5_spin_lock_check(struct mlx5_spinlock *lock);
+
+/*
+ * need_lock is off for MLX5_SINGLE_THREADED=1, and per object for QPs, SRQs,
+ * WQs and CQs in a thread domain and CQs created single threaded.
+ */
 static inline int mlx5_spin_lock(struct mlx5_spinlock *lock)
 {
 	if (lock->need_lock)
 		return pthread_spin_lock(&lock->lock);
 
+	if (unlikely(mlx5_lock_check))
+		return mlx5_spin_lock_check(lock);
+
 	if (unlikely(lock->in_use)) {
 		fprintf(stderr, "*** ERROR: multithreading violation ***\n"
-			"You are running a multithreaded application but\n"
-			"you set MLX5_SINGLE_THREADED=1. Please unset it.\n");
+			"Two threads used an object that was created for a\n"
+			"single thread, in a thread domain, as a single threaded\n"
+			"CQ or with MLX5_SINGLE_THREADED=1. MLX5_LOCK_CHECK=1\n"
+			"names the threads.\n");
 		abort();
 	} else {
 		lock->in_use = 1;
@@ -1342,7 +1393,7 @@ static inline int mlx5_spin_unlock(struct mlx5_spinlock *lock)
 	if (lock->need_lock)
 		return pthread_spin_unlock(&lock->lock);
 
-	lock->in_use = 0;
+	__atomic_store_n(&lock->in_use, 0, __ATOMIC_RELEASE);
 
 	return 0;
 }
@@ -0,0 +1,424 @@
+/*
+ * Checks the batched ibv_poll_cq path of cq.c against the one CQE at a time
+ * path, mlx5_poll_one() and mlx5_parse_cqe(), on a CQ ring of mixed CQEs
+ * written in memory, then times both. No device is needed, the provider
+ * calls cq.c makes outside the poll path are stubbed below.
+ *
+ * -m sets how many CQEs in percent are not plain success CQEs of the first
+ * QP: inline scatter and flush errors, which the batch path leaves to
+ * mlx5_poll_one(), and CQEs of a second QP.
+ */
+
+#define _GNU_SOURCE
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* The plain provider poll path, without the MTRDMA early poll ring */
+#undef MTRDMA
+#include "cq.c"
+
+#define BENCH_NUM_QPS 2
+#define BENCH_POLL_BATCH 16
+
+struct cq_bench_params {
+	uint32_t entries;
+	uint32_t iters;
+	uint32_t slow_pct;
+	unsigned int seed;
+};
+
+uint32_t mlx5_debug_mask;
+int mlx5_freeze_on_error_cqe;
+int mlx5_lock_check;
+
+static struct mlx5_qp bench_qps[BENCH_NUM_QPS];
+
+struct mlx5_qp *mlx5_find_qp(struct mlx5_context *ctx, uint32_t qpn)
+{
+	int i;
+
+	for (i = 0; i < BENCH_NUM_QPS; i++)
+		if (bench_qps[i].rsc.rsn == qpn)
+			return &bench_qps[i];
+	return NULL;
+}
+
+int mlx5_copy_to_recv_wqe(struct mlx5_qp *qp, int idx, void *buf, int size)
+{
+	return IBV_WC_SUCCESS;
+}
+
+int mlx5_copy_to_send_wqe(struct mlx5_qp *qp, int idx, void *buf, int size)
+{
+	return IBV_WC_SUCCESS;
+}
+
+int mlx5_copy_to_recv_srq(struct mlx5_srq *srq, int idx, void *buf, int size)
+{
+	abort();
+}
+
+struct mlx5_srq *mlx5_find_srq(struct mlx5_context *ctx, uint32_t srqn)
+{
+	return NULL;
+}
+
+struct mlx5_mkey *mlx5_find_mkey(struct mlx5_context *ctx, uint32_t mkeyn)
+{
+	return NULL;
+}
+
+void mlx5_free_srq_wqe(struct mlx5_srq *srq, int ind)
+{
+	abort();
+}
+
+void mlx5_complete_odp_fault(struct mlx5_srq *srq, int ind)
+{
+	abort();
+}
+
+int mlx5_spin_lock_check(struct mlx5_spinlock *lock)
+{
+	return 0;
+}
+
+int mlx5_alloc_prefered_buf(struct mlx5_context *mctx, struct mlx5_buf *buf,
+			    size_t size, int page_size,
+			    enum mlx5_alloc_type alloc_type,
+			    const char *component)
+{
+	abort();
+}
+
+int mlx5_free_actual_buf(struct mlx5_context *ctx, struct mlx5_buf *buf)
+{
+	abort();
+}
+
+void mlx5_get_alloc_type(struct mlx5_context *context, struct ibv_pd *pd,
+			 const char *component,
+			 enum mlx5_alloc_type *alloc_type,
+			 enum mlx5_alloc_type default_alloc_type)
+{
+	abort();
+}
+
+int mlx5_use_huge(const char *key)
+{
+	return 0;
+}
+
+int mlx5dv_get_clock_info(struct ibv_context *context,
+			  struct mlx5dv_clock_info *clock_info)
+{
+	return EOPNOTSUPP;
+}
+
+static void usage(const char *argv0)
+{
+	printf("Usage: %s [options]\n", argv0);
+	printf("  -e, --entries=<n>        CQEs in the ring, a power of 2 (default 1024)\n");
+	printf("  -n, --iters=<n>          polls of the whole ring per path (default 10000)\n");
+	printf("  -m, --slow=<pct>         CQEs other than plain QP 0 ones (default 10)\n");
+	printf("  -S, --seed=<n>           seed of the CQE mix (default 1)\n");
+}
+
+static int parse_params(int argc, char **argv, struct cq_bench_params *p)
+{
+	static const struct option long_opts[] = {
+		{ "entries", 1, NULL, 'e' },
+		{ "iters", 1, NULL, 'n' },
+		{ "slow", 1, NULL, 'm' },
+		{ "seed", 1, NULL, 'S' },
+		{ "help", 0, NULL, 'h' },
+		{}
+	};
+	int c;
+
+	p->entries = 1024;
+	p->iters = 10000;
+	p->slow_pct = 10;
+	p->seed = 1;
+
+	while ((c = getopt_long(argc, argv, "e:n:m:S:h", long_opts,
+				NULL)) != -1) {
+		switch (c) {
+		case 'e':
+			p->entries = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			p->iters = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			p->slow_pct = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			p->seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (p->entries < BENCH_POLL_BATCH ||
+	    (p->entries & (p->entries - 1)) || p->slow_pct > 100 ||
+	    !p->iters) {
+		usage(argv[0]);
+		return -1;
+	}
+	return 0;
+}
+
+static void init_qp(struct mlx5_qp *qp, uint32_t qpn, uint32_t entries)
+{
+	uint32_t i;
+
+	qp->rsc.type = MLX5_RSC_TYPE_QP;
+	qp->rsc.rsn = qpn;
+	qp->sq.wqe_cnt = entries;
+	qp->sq.wrid = calloc(entries, sizeof(*qp->sq.wrid));
+	qp->sq.wqe_head = calloc(entries, sizeof(*qp->sq.wqe_head));
+	qp->sq.wr_data = calloc(entries, sizeof(*qp->sq.wr_data));
+	qp->rq.wqe_cnt = entries;
+	qp->rq.wrid = calloc(entries, sizeof(*qp->rq.wrid));
+	if (!qp->sq.wrid || !qp->sq.wqe_head || !qp->sq.wr_data ||
+	    !qp->rq.wrid) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	for (i = 0; i < entries; i++) {
+		qp->sq.wrid[i] = (uint64_t)qpn << 32 | i;
+		qp->sq.wqe_head[i] = i;
+		qp->rq.wrid[i] = (uint64_t)qpn << 32 | 0x80000000 | i;
+	}
+}
+
+/*
+ * Fills the ring for the first lap. Plain CQEs go to QP 0, the others are
+ * spread over inline scatter, flush errors and QP 1.
+ */
+static void fill_ring(struct mlx5_cq *cq, const struct cq_bench_params *p)
+{
+	static const uint8_t req_ops[] = {
+		MLX5_OPCODE_SEND, MLX5_OPCODE_RDMA_WRITE,
+		MLX5_OPCODE_RDMA_WRITE_IMM, MLX5_OPCODE_RDMA_READ,
+	};
+	static const uint8_t resp_ops[] = {
+		MLX5_CQE_RESP_SEND, MLX5_CQE_RESP_SEND_IMM,
+		MLX5_CQE_RESP_WR_IMM, MLX5_CQE_RESP_SEND_INV,
+	};
+	uint16_t sq_ctr[BENCH_NUM_QPS] = {};
+	uint32_t i;
+
+	srand(p->seed);
+	for (i = 0; i < p->entries; i++) {
+		struct mlx5_cqe64 *cqe = get_cqe(cq, i);
+		struct mlx5_err_cqe *ecqe = (struct mlx5_err_cqe *)cqe;
+		uint32_t slow = (uint32_t)rand() % 100 < p->slow_pct ?
+					(uint32_t)rand() % 3 + 1 : 0;
+		uint32_t q = slow == 3;
+		uint32_t qpn = bench_qps[q].rsc.rsn;
+		uint8_t op;
+
+		memset(cqe, 0, sizeof(*cqe));
+		cqe->byte_cnt = htobe32(rand() % 65536);
+		cqe->imm_inval_pkey = htobe32(rand());
+		cqe->flags_rqpn = htobe32(rand());
+		cqe->slid = htobe16(rand());
+		cqe->ml_path = rand();
+
+		if (rand() & 1) {
+			op = MLX5_CQE_REQ;
+			cqe->sop_drop_qpn =
+				htobe32((uint32_t)req_ops[rand() % 4] << 24 |
+					qpn);
+			cqe->wqe_counter = htobe16(sq_ctr[q]++);
+		} else {
+			op = resp_ops[rand() % 4];
+			cqe->sop_drop_qpn = htobe32(qpn);
+		}
+
+		if (slow == 2) {
+			op = op == MLX5_CQE_REQ ? MLX5_CQE_REQ_ERR :
+						  MLX5_CQE_RESP_ERR;
+			ecqe->syndrome = MLX5_CQE_SYNDROME_WR_FLUSH_ERR;
+			ecqe->vendor_err_synd = rand();
+		}
+		cqe->op_own = op << 4;
+		if (slow == 1)
+			cqe->op_own |= MLX5_INLINE_SCATTER_32;
+	}
+}
+
+static void reset_cq(struct mlx5_cq *cq)
+{
+	int i;
+
+	cq->cons_index = 0;
+	for (i = 0; i < BENCH_NUM_QPS; i++) {
+		bench_qps[i].sq.tail = 0;
+		bench_qps[i].rq.tail = 0;
+	}
+}
+
+/* Every CQE of the ring through ibv_poll_cq, with the batch path */
+static int poll_ring_batch(struct mlx5_cq *cq, struct ibv_wc *wc,
+			   uint32_t entries)
+{
+	uint32_t n = 0;
+	int ret;
+
+	while (n < entries) {
+		ret = poll_cq(&cq->verbs_cq.cq, min(BENCH_POLL_BATCH,
+						    (int)(entries - n)),
+			      wc + n, 0);
+		if (ret <= 0)
+			return -1;
+		n += ret;
+	}
+	return 0;
+}
+
+/* Every CQE of the ring through mlx5_poll_one(), as before the batch path */
+static int poll_ring_one(struct mlx5_cq *cq, struct ibv_wc *wc,
+			 uint32_t entries)
+{
+	struct mlx5_resource *rsc = NULL;
+	struct mlx5_srq *srq = NULL;
+	uint32_t n;
+
+	for (n = 0; n < entries; n++) {
+		if (mlx5_poll_one(cq, &rsc, &srq, wc + n, 0) != CQ_OK)
+			return -1;
+	}
+	update_cons_index(cq);
+	return 0;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double time_path(struct mlx5_cq *cq, struct ibv_wc *wc,
+			const struct cq_bench_params *p,
+			int (*poll_ring)(struct mlx5_cq *, struct ibv_wc *,
+					 uint32_t))
+{
+	uint64_t start = now_ns();
+	uint32_t i;
+
+	for (i = 0; i < p->iters; i++) {
+		reset_cq(cq);
+		if (poll_ring(cq, wc, p->entries))
+			return -1;
+	}
+	return (double)(now_ns() - start) / ((double)p->iters * p->entries);
+}
+
+static int check_paths(struct mlx5_cq *cq, struct ibv_wc *wc_batch,
+		       struct ibv_wc *wc_one, uint32_t entries)
+{
+	unsigned int sq_tail[BENCH_NUM_QPS], rq_tail[BENCH_NUM_QPS];
+	uint32_t i;
+
+	/* Fields a path leaves alone keep the fill pattern in both arrays */
+	memset(wc_batch, 0x5a, sizeof(*wc_batch) * entries);
+	memset(wc_one, 0x5a, sizeof(*wc_one) * entries);
+
+	reset_cq(cq);
+	if (poll_ring_one(cq, wc_one, entries)) {
+		fprintf(stderr, "mlx5_poll_one() failed\n");
+		return -1;
+	}
+	for (i = 0; i < BENCH_NUM_QPS; i++) {
+		sq_tail[i] = bench_qps[i].sq.tail;
+		rq_tail[i] = bench_qps[i].rq.tail;
+	}
+
+	reset_cq(cq);
+	if (poll_ring_batch(cq, wc_batch, entries)) {
+		fprintf(stderr, "ibv_poll_cq failed\n");
+		return -1;
+	}
+
+	for (i = 0; i < entries; i++) {
+		if (memcmp(&wc_batch[i], &wc_one[i], sizeof(*wc_one))) {
+			fprintf(stderr,
+				"CQE %u differs: wr_id %#lx/%#lx status %d/%d opcode %d/%d flags %#x/%#x\n",
+				i, wc_batch[i].wr_id, wc_one[i].wr_id,
+				wc_batch[i].status, wc_one[i].status,
+				wc_batch[i].opcode, wc_one[i].opcode,
+				wc_batch[i].wc_flags, wc_one[i].wc_flags);
+			return -1;
+		}
+	}
+	for (i = 0; i < BENCH_NUM_QPS; i++) {
+		if (sq_tail[i] != bench_qps[i].sq.tail ||
+		    rq_tail[i] != bench_qps[i].rq.tail) {
+			fprintf(stderr, "QP %u WQ tails differ\n", i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct cq_bench_params p;
+	struct mlx5_context *ctx;
+	struct ibv_wc *wc_batch, *wc_one;
+	__be32 dbrec[2] = {};
+	struct mlx5_cq cq = {};
+	double ns_batch, ns_one;
+	int i;
+
+	if (parse_params(argc, argv, &p))
+		return 1;
+
+	ctx = calloc(1, sizeof(*ctx));
+	wc_batch = calloc(p.entries, sizeof(*wc_batch));
+	wc_one = calloc(p.entries, sizeof(*wc_one));
+	if (!ctx || !wc_batch || !wc_one ||
+	    posix_memalign(&cq.buf_a.buf, 4096, (size_t)p.entries * 64)) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	ctx->dbg_fp = stderr;
+
+	for (i = 0; i < BENCH_NUM_QPS; i++)
+		init_qp(&bench_qps[i], 0x100 + i, p.entries);
+
+	cq.verbs_cq.cq.context = &ctx->ibv_ctx.context;
+	cq.verbs_cq.cq.cqe = p.entries - 1;
+	cq.active_buf = &cq.buf_a;
+	cq.cqe_sz = 64;
+	cq.dbrec = dbrec;
+	fill_ring(&cq, &p);
+
+	if (check_paths(&cq, wc_batch, wc_one, p.entries))
+		return 1;
+
+	ns_one = time_path(&cq, wc_one, &p, poll_ring_one);
+	ns_batch = time_path(&cq, wc_batch, &p, poll_ring_batch);
+	if (ns_one < 0 || ns_batch < 0) {
+		fprintf(stderr, "Poll failed while timing\n");
+		return 1;
+	}
+
+	printf("%u CQEs, %u%% not plain, %u iterations\n",
+	       p.entries, p.slow_pct, p.iters);
+	printf("batch and per CQE paths match\n");
+	printf("per CQE %.2f ns, batch %.2f ns per CQE\n", ns_one, ns_batch);
+	return 0;
+}
@@ -261,6 +261,7 @@ enum mlx5dv_cq_init_attr_mask {
 	MLX5DV_CQ_INIT_ATTR_MASK_COMPRESSED_CQE	= 1 << 0,
 	MLX5DV_CQ_INIT_ATTR_MASK_FLAGS		= 1 << 1,
 	MLX5DV_CQ_INIT_ATTR_MASK_CQE_SIZE = 1 << 2,
+	MLX5DV_CQ_INIT_ATTR_MASK_POLL_POLICY = 1 << 3,
 };
 
 enum mlx5dv_cq_init_attr_flags {
@@ -273,6 +274,13 @@ struct mlx5dv_cq_init_attr {
 	uint8_t cqe_comp_res_format; /* Use enum mlx5dv_cqe_comp_res_format */
 	uint32_t flags; /* Use enum mlx5dv_cq_init_attr_flags */
 	uint16_t cqe_size; /* when MLX5DV_CQ_INIT_ATTR_MASK_CQE_SIZE set */
+	uint8_t poll_policy; /* Use enum mlx5dv_cq_poll_policy */
+};
+
+enum mlx5dv_cq_poll_policy {
+	MLX5DV_CQ_POLL_POLICY_DEFAULT,	/* Context wide MLX5_STALL_CQ_* setup */
+	MLX5DV_CQ_POLL_POLICY_LATENCY,	/* Never stall */
+	MLX5DV_CQ_POLL_POLICY_CPU,	/* Back off on empty polls */
 };
 
 struct ibv_cq_ex *mlx5dv_create_cq(struct ibv_context *context,
@@ -1,7 +1,11 @@
 #define _GNU_SOURCE
 
 #include "mtrdma.h"
+#ifdef MTRDMA_SIM
+#include "mtrdma_sim.h"
+#else
 #include "mlx5.h"
+#endif
 #include "khash.h"
 
 KHASH_MAP_INIT_INT(qph, uint32_t);
@@ -11,6 +15,10 @@ khash_t(qph) * qp_hash;
 khash_t(cqh) * cq_hash;
 
 int use_mtrdma = -1;
+int mtrdma_wqe_defer;
+#ifndef MTRDMA_SIM
+static int mtrdma_cq_poll_policy;
+#endif
 bool control_stop;
 
 int new_use = 0;
@@ -28,6 +36,15 @@ struct mtrdma_shm_context *shm_ctx = NULL;
 static uint32_t tenant_id = -1;
 static uint32_t global_qnum = 0;
 static uint32_t global_cqnum = 0;
+
+/*
+ * qp_hash, cq_hash, qp_ctx and cq_ctx change only under the write lock, with
+ * the shaper threads stopped. Lookups from the app's threads and every pass
+ * of the shaper hold it for reading. Some readers already hold an SQ or CQ
+ * lock, so it stays reader preferring (the glibc default) and a writer never
+ * takes those locks.
+ */
+static pthread_rwlock_t mtrdma_ctx_lock = PTHREAD_RWLOCK_INITIALIZER;
 cpu_set_t th_cpu;
 cpu_set_t th_cpu_update;
 pthread_attr_t th_attr;
@@ -37,15 +54,86 @@ pthread_t daemon_thread_update;
 
 int run_times = 0;
 
-struct timeval poll_start, poll_end;
+static void update_qp_ctx(struct ibv_qp *qp, uint32_t max_send_wr,
+			  uint32_t max_recv_wr, uint32_t origin_max_send_wr,
+			  uint32_t origin_max_recv_wr, int sig_all);
+static void update_cq_ctx(struct ibv_qp *qp, uint32_t max_send_wr);
+static void update_tenant_ctx(void);
+static void mtrdma_admittion_control(void);
+
+/*
+ * Device access of the shaper. Built with MTRDMA_SIM it runs on the software
+ * device of mtrdma_sim.c instead of an mlx5 QP and CQ.
+ */
+#ifdef MTRDMA_SIM
+int mtrdma_get_sq_num(struct ibv_qp *ibqp)
+{
+	return mtrdma_sim_get_sq_num(ibqp);
+}
 
+static int mtrdma_dev_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+				struct ibv_send_wr **bad_wr)
+{
+	return mtrdma_sim_post_send(ibqp, wr, bad_wr);
+}
+
+static int mtrdma_dev_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
+{
+	return mtrdma_sim_poll_cq(ibcq, ne, wc);
+}
+#else
 int mtrdma_get_sq_num(struct ibv_qp *ibqp)
 {
 	struct mlx5_qp *qp = to_mqp(ibqp);
 	return qp->sq.head - qp->sq.tail;
 }
 
-void mtrdma_early_poll_cq()
+static int mtrdma_dev_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+				struct ibv_send_wr **bad_wr)
+{
+	return mlx5_mtrdma_post_send(ibqp, wr, bad_wr);
+}
+
+static int mtrdma_dev_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
+{
+	return mlx5_mtrdma_poll_cq(ibcq, ne, wc);
+}
+#endif
+
+/*
+ * RNR retry exhaustion is terminal (the QP goes to error) and can't happen
+ * with rnr_retry=7, so it is reported but doesn't drive the throttle.
+ * Called with mtrdma_ctx_lock held.
+ */
+static void mtrdma_count_rnr(struct ibv_wc *wc, int ne)
+{
+	khint_t k;
+
+	for (int i = 0; i < ne; i++) {
+		if (wc[i].status != IBV_WC_RNR_RETRY_EXC_ERR)
+			continue;
+
+		__atomic_fetch_add(&shm_ctx->rnr_retry_exc_per_tenant[tenant_id],
+				   1, __ATOMIC_RELAXED);
+		k = kh_get(qph, qp_hash, wc[i].qp_num);
+		if (k != kh_end(qp_hash))
+			__atomic_fetch_add(
+				&qp_ctx[kh_value(qp_hash, k)].rnr_retry_exc, 1,
+				__ATOMIC_RELAXED);
+	}
+}
+
+static int mtrdma_dev_poll_count(struct ibv_cq *ibcq, int ne,
+				 struct ibv_wc *wc)
+{
+	int polled = mtrdma_dev_poll_cq(ibcq, ne, wc);
+
+	if (polled > 0)
+		mtrdma_count_rnr(wc, polled);
+	return polled;
+}
+
+void mtrdma_early_poll_cq(void)
 {
 	//LOG_ERROR("perf_early_poll_cq()\n");
 	uint32_t cq_poll_num;
@@ -57,11 +145,10 @@ void mtrdma_early_poll_cq()
 			while (1) {
 				cq_poll_num =
 					cq_ctx[i].max_cqe - cq_ctx[i].wc_tail;
-				polled = mlx5_poll_cq_early(
+				polled = mtrdma_dev_poll_count(
 					cq_ctx[i].cq, cq_poll_num,
 					(struct ibv_wc *)(cq_ctx[i].wc_list) +
-						cq_ctx[i].wc_tail,
-					1);
+						cq_ctx[i].wc_tail);
 
 				if (polled < 0) {
 					LOG_ERROR("Error in early poll: %d\n",
@@ -91,7 +178,7 @@ void mtrdma_early_poll_cq()
 	}
 }
 
-void wr_copy(struct ibv_send_wr *dest_wr, struct ibv_send_wr *src_wr)
+static void wr_copy(struct ibv_send_wr *dest_wr, struct ibv_send_wr *src_wr)
 {
 	struct ibv_sge *origin_sg_list = dest_wr->sg_list;
 
@@ -102,7 +189,7 @@ void wr_copy(struct ibv_send_wr *dest_wr, struct ibv_send_wr *src_wr)
 	       sizeof(struct ibv_sge) * src_wr->num_sge);
 }
 
-void enqueue_wr(uint32_t q_idx, struct ibv_send_wr *wr)
+static void enqueue_wr(uint32_t q_idx, struct ibv_send_wr *wr)
 {
 	if (qp_ctx[q_idx].wr_queue_len == qp_ctx[q_idx].wr_queue_size) {
 		LOG_ERROR(
@@ -129,7 +216,7 @@ void enqueue_wr(uint32_t q_idx, struct ibv_send_wr *wr)
 	qp_ctx[q_idx].wr_queue_len++;
 }
 
-struct ibv_send_wr *get_queued_wr(uint32_t q_idx, uint32_t pwr_idx)
+static struct ibv_send_wr *get_queued_wr(uint32_t q_idx, uint32_t pwr_idx)
 {
 	if (qp_ctx[q_idx].wr_queue_len <= pwr_idx) {
 		return NULL;
@@ -141,7 +228,7 @@ struct ibv_send_wr *get_queued_wr(uint32_t q_idx, uint32_t pwr_idx)
 				       qp_ctx[q_idx].wr_queue_size]);
 }
 
-void dequeue_wr(uint32_t q_idx, uint32_t num)
+static void dequeue_wr(uint32_t q_idx, uint32_t num)
 {
 	if (qp_ctx[q_idx].wr_queue_len < num) {
 		LOG_ERROR(
@@ -158,7 +245,10 @@ void dequeue_wr(uint32_t q_idx, uint32_t num)
 
 void mtrdma_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr)
 {
-	uint32_t q_idx = kh_value(qp_hash, kh_get(qph, qp_hash, qp->qp_num));
+	uint32_t q_idx;
+
+	pthread_rwlock_rdlock(&mtrdma_ctx_lock);
+	q_idx = kh_value(qp_hash, kh_get(qph, qp_hash, qp->qp_num));
 
 	if (wr != NULL) {
 		enqueue_wr(q_idx, wr);
@@ -168,6 +258,7 @@ void mtrdma_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr)
 			enqueue_wr(q_idx, wr);
 		}
 	}
+	pthread_rwlock_unlock(&mtrdma_ctx_lock);
 }
 
 // void mtrdma_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr,
@@ -266,18 +357,23 @@ void update_mtrdma_state(struct ibv_qp *qp, uint32_t max_send_wr,
 	if (use_mtrdma == -1)
 		load_mtrdma_config();
 
-	printf("phx update\n");
 	update_qp_ctx(qp, max_send_wr, max_recv_wr, origin_max_send_wr,
 		      origin_max_recv_wr, sig_all);
 }
 
-void mtrdma_destroy_qp()
+void mtrdma_destroy_qp(void)
 {
 	if (!use_mtrdma)
 		return;
 
 	pthread_mutex_lock(&shm_ctx->lock);
 	shm_ctx->active_qps_per_tenant[tenant_id] = 0;
+	shm_ctx->tenant_pid[tenant_id] = 0;
+	shm_ctx->resp_rd_atomic_per_tenant[tenant_id] = 0;
+	shm_ctx->req_rd_atomic_per_tenant[tenant_id] = 0;
+	shm_ctx->rd_atomic_qps_per_tenant[tenant_id] = 0;
+	shm_ctx->rq_starved_per_tenant[tenant_id] = 0;
+	shm_ctx->sq_stalled_per_tenant[tenant_id] = 0;
 	pthread_mutex_unlock(&(shm_ctx->mtrdma_thread_lock[tenant_id]));
 	pthread_mutex_unlock(&shm_ctx->lock);
 
@@ -286,10 +382,29 @@ void mtrdma_destroy_qp()
 	use_mtrdma = false;
 }
 
-void load_mtrdma_config()
+void load_mtrdma_config(void)
 {
+	char *env;
+
 	use_mtrdma = 1;
 
+	/*
+	 * Build ibv_post_send WQEs straight into the SQ and gate only the
+	 * doorbell, instead of queueing ibv_send_wr copies for the shaper
+	 * thread to post.
+	 */
+	env = getenv("MTRDMA_WQE_DEFER");
+	mtrdma_wqe_defer = env && atoi(env);
+
+#ifndef MTRDMA_SIM
+	/* "latency" or "cpu" polling for the send CQs the shaper polls */
+	env = getenv("MTRDMA_CQ_POLL_POLICY");
+	if (env && !strcmp(env, "latency"))
+		mtrdma_cq_poll_policy = MLX5DV_CQ_POLL_POLICY_LATENCY;
+	else if (env && !strcmp(env, "cpu"))
+		mtrdma_cq_poll_policy = MLX5DV_CQ_POLL_POLICY_CPU;
+#endif
+
 	atexit(mtrdma_destroy_qp);
 
 	qp_hash = kh_init(qph);
@@ -315,14 +430,30 @@ void load_mtrdma_config()
 	tenant_id = shm_ctx->next_tenant_id++;
 	shm_ctx->tenant_num++;
 	shm_ctx->active_qps_per_tenant[tenant_id] = 0;
+	shm_ctx->tenant_pid[tenant_id] = getpid();
+	shm_ctx->resp_rd_atomic_per_tenant[tenant_id] = 0;
+	shm_ctx->req_rd_atomic_per_tenant[tenant_id] = 0;
+	shm_ctx->rd_atomic_qps_per_tenant[tenant_id] = 0;
+	shm_ctx->rq_starved_per_tenant[tenant_id] = 0;
+	shm_ctx->sq_stalled_per_tenant[tenant_id] = 0;
+	shm_ctx->rnr_retry_exc_per_tenant[tenant_id] = 0;
+	shm_ctx->rnr_throttle[tenant_id] = 0;
+	shm_ctx->tenant_class[tenant_id] = mtrdma_tenant_class();
+	shm_ctx->uar_db_per_tenant[tenant_id] = 0;
+	shm_ctx->uar_contended_per_tenant[tenant_id] = 0;
 	LOG_ERROR("Set Tenant ID: %d\n", tenant_id);
 	pthread_mutex_unlock(&shm_ctx->lock);
 
+	/* Wrap on smaller hosts, pthread_create fails on an offline CPU */
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1)
+		ncpu = 1;
+
 	CPU_ZERO(&th_cpu);
 	CPU_SET(0, &th_cpu);
 
 	CPU_ZERO(&th_cpu_update);
-	CPU_SET(10, &th_cpu_update);
+	CPU_SET(10 % ncpu, &th_cpu_update);
 	//CPU_SET(1, &th_cpu);
 	pthread_attr_init(&th_attr);
 	pthread_attr_setaffinity_np(&th_attr, sizeof(th_cpu), &th_cpu);
@@ -336,7 +467,29 @@ void load_mtrdma_config()
 	pthread_sigmask(SIG_SETMASK, &tSigSetMask, NULL);
 }
 
-void mtrdma_thread_end()
+/*
+ * Read on its own, the provider picks a QP's bfreg before the QP, and so
+ * the tenant, is registered.
+ */
+enum mtrdma_tenant_class mtrdma_tenant_class(void)
+{
+	static int tenant_class = -1;
+	char *env;
+
+	if (tenant_class < 0) {
+		env = getenv("MTRDMA_TENANT_CLASS");
+		if (env && !strcmp(env, "latency"))
+			tenant_class = MTRDMA_TENANT_CLASS_LATENCY;
+		else if (env && !strcmp(env, "bulk"))
+			tenant_class = MTRDMA_TENANT_CLASS_BULK;
+		else
+			tenant_class = MTRDMA_TENANT_CLASS_DEFAULT;
+	}
+
+	return tenant_class;
+}
+
+static void mtrdma_thread_end(int sig)
 {
 	sleep(1);
 
@@ -348,7 +501,160 @@ void mtrdma_thread_end()
 	exit(1);
 }
 
-void mtrdma_update_tenant_state()
+uint8_t mtrdma_rd_atomic_limit(void)
+{
+	uint32_t limit;
+
+	if (use_mtrdma != 1)
+		return 0;
+
+	limit = shm_ctx->rd_atomic_limit[tenant_id];
+	return limit > UINT8_MAX ? UINT8_MAX : limit;
+}
+
+/* Report the READ/atomic depth of all our QPs to the daemon */
+static void mtrdma_publish_rd_atomic(void)
+{
+	uint32_t resp = 0, req = 0, qps = 0;
+
+	for (uint32_t i = 0; i < global_qnum; i++) {
+		resp += qp_ctx[i].max_dest_rd_atomic;
+		req += qp_ctx[i].max_rd_atomic;
+		if (qp_ctx[i].max_dest_rd_atomic || qp_ctx[i].max_rd_atomic)
+			qps++;
+	}
+
+	shm_ctx->resp_rd_atomic_per_tenant[tenant_id] = resp;
+	shm_ctx->req_rd_atomic_per_tenant[tenant_id] = req;
+	shm_ctx->rd_atomic_qps_per_tenant[tenant_id] = qps;
+}
+
+/* Called after a successful modify_qp of a shaped QP */
+void mtrdma_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
+		      int attr_mask)
+{
+	struct mtrdma_qp_context *q;
+	khint_t k;
+
+	if (use_mtrdma != 1 ||
+	    !(attr_mask & (IBV_QP_MAX_QP_RD_ATOMIC | IBV_QP_MAX_DEST_RD_ATOMIC |
+			   IBV_QP_STATE)))
+		return;
+
+	pthread_rwlock_rdlock(&mtrdma_ctx_lock);
+	k = kh_get(qph, qp_hash, qp->qp_num);
+	if (k == kh_end(qp_hash))
+		goto out;
+	q = &qp_ctx[kh_value(qp_hash, k)];
+
+	if (attr_mask & IBV_QP_MAX_QP_RD_ATOMIC)
+		q->max_rd_atomic = attr->max_rd_atomic;
+	if (attr_mask & IBV_QP_MAX_DEST_RD_ATOMIC)
+		q->max_dest_rd_atomic = attr->max_dest_rd_atomic;
+	/* Depths are reloaded by the next INIT to RTR and RTR to RTS */
+	if ((attr_mask & IBV_QP_STATE) && (attr->qp_state == IBV_QPS_RESET ||
+					   attr->qp_state == IBV_QPS_ERR)) {
+		q->max_rd_atomic = 0;
+		q->max_dest_rd_atomic = 0;
+	}
+
+	mtrdma_publish_rd_atomic();
+out:
+	pthread_rwlock_unlock(&mtrdma_ctx_lock);
+}
+
+#ifndef MTRDMA_SIM
+/*
+ * An RC receive queue that has been used but holds no buffer makes the peer
+ * retry on RNR NAKs. RQs never posted to belong to write/read only QPs and
+ * aren't counted. QPs sharing an SRQ count it once per sample.
+ */
+static void mtrdma_sample_rq(void)
+{
+	static uint32_t epoch;
+	uint32_t starved = 0;
+	bool used;
+
+	epoch++;
+	for (uint32_t i = 0; i < global_qnum; i++) {
+		struct mtrdma_qp_context *q = &qp_ctx[i];
+		struct ibv_qp *ibqp = q->qp;
+
+		if (ibqp->qp_type != IBV_QPT_RC ||
+		    (ibqp->state != IBV_QPS_RTR && ibqp->state != IBV_QPS_RTS))
+			continue;
+
+		if (ibqp->srq) {
+			struct mlx5_srq *srq = to_msrq(ibqp->srq);
+
+			q->rq_depth = (uint16_t)(srq->counter -
+						 srq->mtrdma_consumed);
+			used = srq->counter || srq->mtrdma_consumed;
+			if (srq->mtrdma_epoch == epoch)
+				continue;
+			srq->mtrdma_epoch = epoch;
+		} else {
+			struct mlx5_qp *mqp = to_mqp(ibqp);
+
+			q->rq_depth = mqp->rq.head - mqp->rq.tail;
+			used = mqp->rq.head;
+		}
+
+		if (used && !q->rq_depth)
+			starved++;
+	}
+
+	shm_ctx->rq_starved_per_tenant[tenant_id] = starved;
+}
+
+/*
+ * An RC send queue with WQEs outstanding whose tail hasn't moved since the
+ * last sample is waiting on the peer, typically retrying on RNR NAKs.
+ */
+static void mtrdma_sample_sq(void)
+{
+	uint32_t stalled = 0;
+
+	for (uint32_t i = 0; i < global_qnum; i++) {
+		struct mtrdma_qp_context *q = &qp_ctx[i];
+		struct ibv_qp *ibqp = q->qp;
+		struct mlx5_qp *mqp = to_mqp(ibqp);
+		uint32_t tail = mqp->sq.tail;
+
+		if (ibqp->qp_type != IBV_QPT_RC || ibqp->state != IBV_QPS_RTS)
+			continue;
+
+		if (mqp->sq.head != tail && tail == q->sq_tail)
+			stalled++;
+		q->sq_tail = tail;
+	}
+
+	shm_ctx->sq_stalled_per_tenant[tenant_id] = stalled;
+}
+
+/* Doorbell lock counters of the shared bfregs the tenant's QPs ring */
+static void mtrdma_sample_uar(void)
+{
+	static uint32_t epoch;
+	uint64_t db = 0, contended = 0;
+
+	epoch++;
+	for (uint32_t i = 0; i < global_qnum; i++) {
+		struct mlx5_bf *bf = to_mqp(qp_ctx[i].qp)->bf;
+
+		if (!bf || !bf->need_lock || bf->mtrdma_epoch == epoch)
+			continue;
+		bf->mtrdma_epoch = epoch;
+		db += bf->lock_acquired;
+		contended += bf->lock_contended;
+	}
+
+	shm_ctx->uar_db_per_tenant[tenant_id] = db;
+	shm_ctx->uar_contended_per_tenant[tenant_id] = contended;
+}
+#endif
+
+static void mtrdma_update_tenant_state(void)
 {
 	struct timeval now;
 	gettimeofday(&now, NULL);
@@ -382,6 +688,11 @@ void mtrdma_update_tenant_state()
 		tenant_ctx.sq_ins_idx =
 			(tenant_ctx.sq_ins_idx + 1) % tenant_ctx.sq_history_len;
 		gettimeofday(&(tenant_ctx.last_sq_check_time), NULL);
+#ifndef MTRDMA_SIM
+		mtrdma_sample_rq();
+		mtrdma_sample_sq();
+		mtrdma_sample_uar();
+#endif
 		//if(tenant_ctx.delay_sensitive)
 		//  LOG_ERROR("MAX SQ NUM : %d\n", tenant_ctx.sq_history[tenant_ctx.sq_max_idx]);
 	}
@@ -390,7 +701,7 @@ void mtrdma_update_tenant_state()
 	    1000000 * (now.tv_sec - tenant_ctx.last_active_check_time.tv_sec);
 }
 
-void *mtrdma_thread(void *para)
+static void *mtrdma_thread(void *para)
 {
 	signal(SIGKILL, mtrdma_thread_end); // MUST be disabled when using CRAIL
 	signal(SIGINT, mtrdma_thread_end);
@@ -399,33 +710,63 @@ void *mtrdma_thread(void *para)
 		if (new_qp_create)
 			pthread_exit(NULL);
 
+		pthread_rwlock_rdlock(&mtrdma_ctx_lock);
 		mtrdma_update_tenant_state();
 
 		mtrdma_admittion_control();
+		pthread_rwlock_unlock(&mtrdma_ctx_lock);
 
 		usleep(0);
 	}
 	return NULL;
 }
 
-void *mtrdma_udpate_credit_thread(void *para)
+static void *mtrdma_udpate_credit_thread(void *para)
 {
 	while (1) {
 		if (new_qp_create)
 			pthread_exit(NULL);
 
-		tenant_ctx.quantam_data += 400000;
+		/* Halved per step while the tenant keeps exhausting RNR retries */
+		__atomic_fetch_add(&tenant_ctx.quantam_data,
+				   400000 >> shm_ctx->rnr_throttle[tenant_id],
+				   __ATOMIC_RELAXED);
 
 		usleep(1);
 	}
 	return NULL;
 }
 
-bool mtrdma_large_process(uint32_t q_idx, struct ibv_send_wr *wr)
+static int64_t mtrdma_credit(void)
+{
+	return __atomic_load_n(&tenant_ctx.quantam_data, __ATOMIC_RELAXED);
+}
+
+/* Take bytes out of the credit if it covers them, never below zero */
+static bool mtrdma_take_credit(uint64_t bytes)
+{
+	int64_t credit = mtrdma_credit();
+
+	do {
+		if (credit < 0 || (uint64_t)credit < bytes)
+			return false;
+	} while (!__atomic_compare_exchange_n(&tenant_ctx.quantam_data, &credit,
+					      credit - (int64_t)bytes, true,
+					      __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+	return true;
+}
+
+static void mtrdma_return_credit(uint64_t bytes)
+{
+	__atomic_fetch_add(&tenant_ctx.quantam_data, (int64_t)bytes,
+			   __ATOMIC_RELAXED);
+}
+
+static bool mtrdma_large_process(uint32_t q_idx, struct ibv_send_wr *wr)
 {
 	struct timeval poll_start, poll_end;
 	uint64_t poll_time = 5; //us
-	bool poll_break = false;
 
 	if (qp_ctx[q_idx].max_wr - mtrdma_get_sq_num(qp_ctx[q_idx].qp) < 1) {
 		gettimeofday(&poll_start, NULL);
@@ -433,18 +774,16 @@ bool mtrdma_large_process(uint32_t q_idx, struct ibv_send_wr *wr)
 		gettimeofday(&poll_end, NULL);
 		uint64_t t = (poll_end.tv_sec - poll_start.tv_sec) * 1000000 +
 			     (poll_end.tv_usec - poll_start.tv_usec);
-		if (t > poll_time) {
-			poll_break = true;
+		if (t > poll_time)
 			return false;
-		}
 		if (qp_ctx[q_idx].max_wr - mtrdma_get_sq_num(qp_ctx[q_idx].qp) <
 		    1) {
 			return false;
 		}
 	}
 
-	struct ibv_send_wr **bad_wr;
-	if (mlx5_post_send2(qp_ctx[q_idx].qp, wr, bad_wr) != 0) {
+	struct ibv_send_wr *bad_wr;
+	if (mtrdma_dev_post_send(qp_ctx[q_idx].qp, wr, &bad_wr) != 0) {
 		LOG_ERROR("Send dummy error: %d %d\n", qp_ctx[q_idx].max_wr,
 			  mtrdma_get_sq_num(qp_ctx[q_idx].qp));
 		exit(1);
@@ -454,14 +793,90 @@ bool mtrdma_large_process(uint32_t q_idx, struct ibv_send_wr *wr)
 	return true;
 }
 
-void mtrdma_admittion_control()
+#ifndef MTRDMA_SIM
+static uint32_t qp_ctx_idx(struct ibv_qp *qp)
+{
+	return kh_value(qp_hash, kh_get(qph, qp_hash, qp->qp_num));
+}
+
+/*
+ * Called from wr_complete of the new post send API, and from ibv_post_send
+ * with mtrdma_wqe_defer, under the SQ lock with the batch already built into
+ * the SQ. Returns true if the caller may ring the doorbell now, otherwise the
+ * batch is queued and released by mtrdma_db_release() in order.
+ */
+bool mtrdma_db_admit(struct ibv_qp *qp, uint64_t bytes, uint32_t cur_post,
+		     void *ctrl)
+{
+	struct mtrdma_qp_context *q;
+	struct mtrdma_db_batch *batch;
+	bool admit = false;
+
+	pthread_rwlock_rdlock(&mtrdma_ctx_lock);
+	q = &qp_ctx[qp_ctx_idx(qp)];
+	if (!atomic_load(&q->db_len) && mtrdma_take_credit(bytes)) {
+		admit = true;
+		goto out;
+	}
+
+	/* One entry per batch and each batch holds a WQE, so it can't fill */
+	batch = &q->db_batches[q->db_tail];
+	batch->bytes = bytes;
+	batch->cur_post = cur_post;
+	batch->ctrl = ctrl;
+	q->db_tail = (q->db_tail + 1) % q->db_size;
+	atomic_fetch_add(&q->db_len, 1);
+out:
+	pthread_rwlock_unlock(&mtrdma_ctx_lock);
+	return admit;
+}
+
+static void mtrdma_db_release(uint32_t q_idx)
+{
+	struct mtrdma_qp_context *q = &qp_ctx[q_idx];
+	struct mtrdma_db_batch *batch;
+	uint32_t head = q->db_head, num = 0, len = atomic_load(&q->db_len);
+	uint32_t cur_post = 0;
+	void *ctrl = NULL;
+
+	/* Everything in credit goes out with one doorbell */
+	while (num < len) {
+		batch = &q->db_batches[head];
+		if (!mtrdma_take_credit(batch->bytes))
+			break;
+
+		cur_post = batch->cur_post;
+		ctrl = batch->ctrl;
+		head = (head + 1) % q->db_size;
+		num++;
+	}
+
+	if (!num)
+		return;
+
+	/*
+	 * Dequeue only after the doorbell, until then wr_complete keeps
+	 * queueing behind us instead of ringing a later producer index.
+	 */
+	mlx5_mtrdma_ring_db(q->qp, cur_post, ctrl);
+	q->db_head = head;
+	atomic_fetch_sub(&q->db_len, num);
+}
+#endif
+
+static void mtrdma_admittion_control(void)
 {
 	while (1) {
 		control_stop = true;
+#ifndef MTRDMA_SIM
+		for (uint32_t i = 0; i < global_qnum; i++) {
+			if (atomic_load(&qp_ctx[i].db_len))
+				mtrdma_db_release(i);
+		}
+#endif
 		for (uint32_t i = 0; i < global_qnum; i++) {
 			//LOG_ERROR("start perf_wr_queue_manage: %d %d %d\n", i, perf_check_paused(i), qp_ctx[i].wr_queue_len);
-			if (!qp_ctx[i].wr_queue_len ||
-			    tenant_ctx.quantam_data == 0)
+			if (!qp_ctx[i].wr_queue_len || mtrdma_credit() <= 0)
 				continue;
 
 			// if (!qp_ctx[i].wr_queue_len)
@@ -474,8 +889,7 @@ void mtrdma_admittion_control()
 					get_queued_wr(i, p_num);
 
 				if (wr == NULL ||
-				    wr->sg_list->length >
-					    tenant_ctx.quantam_data) {
+				    !mtrdma_take_credit(wr->sg_list->length)) {
 					// LOG_ERROR("no more credit");
 					break;
 				}
@@ -499,11 +913,10 @@ void mtrdma_admittion_control()
 				}
 
 				if (mtrdma_large_process(i, wr)) {
-					// printf("phx test\n");
 					p_num++;
-					tenant_ctx.quantam_data -=
-						wr->sg_list->length;
 				} else {
+					mtrdma_return_credit(
+						wr->sg_list->length);
 					break;
 				}
 
@@ -523,15 +936,16 @@ void mtrdma_admittion_control()
 	}
 }
 
-void update_qp_ctx(struct ibv_qp *qp, uint32_t max_send_wr,
-		   uint32_t max_recv_wr, uint32_t origin_max_send_wr,
-		   uint32_t origin_max_recv_wr, int sig_all)
+static void update_qp_ctx(struct ibv_qp *qp, uint32_t max_send_wr,
+			  uint32_t max_recv_wr, uint32_t origin_max_send_wr,
+			  uint32_t origin_max_recv_wr, int sig_all)
 {
 	new_qp_create = 1;
 	pthread_join(daemon_thread, NULL);
 	pthread_join(daemon_thread_update, NULL);
 	new_qp_create = 0;
 
+	pthread_rwlock_wrlock(&mtrdma_ctx_lock);
 	int k = kh_get(qph, qp_hash, qp->qp_num);
 	if (k != kh_end(qp_hash)) {
 		LOG_ERROR("Error! Duplicated QP is created\n");
@@ -565,60 +979,148 @@ void update_qp_ctx(struct ibv_qp *qp, uint32_t max_send_wr,
 			sizeof(struct ibv_sge) * MAX_SGE_LEN);
 	}
 
+	qp_ctx[q_idx].db_size = max_send_wr + 1;
+	qp_ctx[q_idx].db_batches = (struct mtrdma_db_batch *)malloc(
+		sizeof(struct mtrdma_db_batch) * qp_ctx[q_idx].db_size);
+	qp_ctx[q_idx].db_head = 0;
+	qp_ctx[q_idx].db_tail = 0;
+	qp_ctx[q_idx].db_len = 0;
+
+	qp_ctx[q_idx].max_rd_atomic = 0;
+	qp_ctx[q_idx].max_dest_rd_atomic = 0;
+	qp_ctx[q_idx].rq_depth = 0;
+	qp_ctx[q_idx].sq_tail = 0;
+	qp_ctx[q_idx].rnr_retry_exc = 0;
+
 	update_cq_ctx(qp, origin_max_send_wr);
 
 	if (global_qnum == 1)
 		update_tenant_ctx();
+	pthread_rwlock_unlock(&mtrdma_ctx_lock);
 
 	pthread_create(&daemon_thread, &th_attr, mtrdma_thread, NULL);
 	pthread_create(&daemon_thread_update, &th_attr_update,
 		       mtrdma_udpate_credit_thread, NULL);
 }
 
-void update_cq_ctx(struct ibv_qp *qp, uint32_t max_send_wr)
+static void update_cq_ctx(struct ibv_qp *qp, uint32_t max_send_wr)
 {
-	//LOG_ERROR("update_mtrdma_cq_state()\n");
-	//updqte cq_ctx
-	uint32_t cq_num = 0;
 	uint32_t q_idx = global_qnum - 1;
-	for (uint32_t i = 0; i < global_qnum - 1; i++) {
-		if (qp->send_cq != qp_ctx[i].qp->send_cq)
-			cq_num++;
-		else {
-			cq_num = qp_ctx[i].cq_num;
-			cq_ctx[cq_num].max_cqe += max_send_wr * 4;
-			cq_ctx[cq_num].wc_list = (void *)realloc(
-				cq_ctx[cq_num].wc_list,
-				sizeof(struct ibv_wc) *
-					(cq_ctx[cq_num].max_cqe + 10));
+	uint32_t cq_num;
+	khint_t k;
+	int ret;
+
+	/* QPs sharing a send CQ share its early poll ring */
+	k = kh_get(cqh, cq_hash, qp->send_cq->handle);
+	if (k != kh_end(cq_hash)) {
+		cq_num = kh_value(cq_hash, k);
+		cq_ctx[cq_num].cq = qp->send_cq;
+		cq_ctx[cq_num].max_cqe += max_send_wr * 4;
+		cq_ctx[cq_num].wc_list = (void *)realloc(
+			cq_ctx[cq_num].wc_list,
+			sizeof(struct ibv_wc) * (cq_ctx[cq_num].max_cqe + 10));
+		qp_ctx[q_idx].cq_num = cq_num;
+		return;
+	}
+
+	cq_num = global_cqnum;
+	cq_ctx = (struct mtrdma_cq_context *)realloc(
+		cq_ctx, (global_cqnum + 1) * sizeof(struct mtrdma_cq_context));
+	cq_ctx[cq_num].max_cqe = max_send_wr * 4;
+	cq_ctx[cq_num].wc_list = (void *)malloc(
+		sizeof(struct ibv_wc) * (cq_ctx[cq_num].max_cqe + 10));
+	cq_ctx[cq_num].cq = qp->send_cq;
+	cq_ctx[cq_num].wc_head = 0;
+	cq_ctx[cq_num].wc_tail = 0;
+	cq_ctx[cq_num].early_poll_num = 0;
+	pthread_mutex_init(&(cq_ctx[cq_num].lock), NULL);
+
+	qp_ctx[q_idx].cq_num = cq_num;
+
+	k = kh_put(cqh, cq_hash, qp->send_cq->handle, &ret);
+	kh_value(cq_hash, k) = cq_num;
+
+#ifndef MTRDMA_SIM
+	if (mtrdma_cq_poll_policy)
+		mlx5_cq_set_poll_policy(to_mcq(qp->send_cq),
+					mtrdma_cq_poll_policy);
+#endif
+
+	global_cqnum++;
+}
+
+/*
+ * Called by destroy_qp before the QP goes away, so that neither the shaper
+ * nor the samplers reach it, or its bfreg, afterwards. WRs and doorbells
+ * still queued for it are dropped. The send CQ is no longer polled early once
+ * its last shaped QP is gone, completions polled before stay for the app.
+ */
+void mtrdma_unregister_qp(struct ibv_qp *qp)
+{
+	struct mtrdma_qp_context *q;
+	uint32_t q_idx, cq_num, i;
+	khint_t k;
+
+	if (use_mtrdma != 1)
+		return;
+
+	pthread_rwlock_wrlock(&mtrdma_ctx_lock);
+	k = kh_get(qph, qp_hash, qp->qp_num);
+	if (k == kh_end(qp_hash))
+		goto out;
+	q_idx = kh_value(qp_hash, k);
+	kh_del(qph, qp_hash, k);
+
+	q = &qp_ctx[q_idx];
+	cq_num = q->cq_num;
+	for (i = 0; i < q->wr_queue_size; i++)
+		free(q->wr_queue[i].sg_list);
+	free(q->wr_queue);
+	free(q->db_batches);
+
+	/* The last QP moves into the hole, indexes stay dense */
+	global_qnum--;
+	if (q_idx != global_qnum) {
+		qp_ctx[q_idx] = qp_ctx[global_qnum];
+		k = kh_get(qph, qp_hash, qp_ctx[q_idx].qp->qp_num);
+		kh_value(qp_hash, k) = q_idx;
+	}
+
+	for (i = 0; i < global_qnum; i++) {
+		if (qp_ctx[i].cq_num == cq_num)
 			break;
-		}
 	}
+	if (i == global_qnum)
+		cq_ctx[cq_num].cq = NULL;
 
-	if (global_cqnum == cq_num) {
-		cq_ctx = (struct mtrdma_cq_context *)realloc(
-			cq_ctx,
-			(global_cqnum + 1) * sizeof(struct mtrdma_cq_context));
-		cq_ctx[cq_num].max_cqe = max_send_wr * 4;
-		cq_ctx[cq_num].wc_list = (void *)malloc(
-			sizeof(struct ibv_wc) * (cq_ctx[cq_num].max_cqe + 10));
-		cq_ctx[cq_num].cq = qp->send_cq;
-		cq_ctx[cq_num].wc_head = 0;
-		cq_ctx[cq_num].wc_tail = 0;
-		cq_ctx[cq_num].early_poll_num = 0;
-		pthread_mutex_init(&(cq_ctx[cq_num].lock), NULL);
+	mtrdma_publish_rd_atomic();
+out:
+	pthread_rwlock_unlock(&mtrdma_ctx_lock);
+}
 
-		qp_ctx[q_idx].cq_num = cq_num;
+/* Called by destroy_cq, the kernel refuses while a QP still uses the CQ */
+void mtrdma_unregister_cq(struct ibv_cq *cq)
+{
+	uint32_t cq_num;
+	khint_t k;
 
-		int ret;
-		uint32_t k = kh_put(cqh, cq_hash, qp->send_cq->handle, &ret);
-		kh_value(cq_hash, k) = cq_num;
+	if (use_mtrdma != 1)
+		return;
 
-		global_cqnum++;
+	pthread_rwlock_wrlock(&mtrdma_ctx_lock);
+	k = kh_get(cqh, cq_hash, cq->handle);
+	if (k != kh_end(cq_hash)) {
+		cq_num = kh_value(cq_hash, k);
+		kh_del(cqh, cq_hash, k);
+		cq_ctx[cq_num].cq = NULL;
+		cq_ctx[cq_num].early_poll_num = 0;
+		free(cq_ctx[cq_num].wc_list);
+		cq_ctx[cq_num].wc_list = NULL;
 	}
+	pthread_rwlock_unlock(&mtrdma_ctx_lock);
 }
 
-void update_tenant_ctx()
+static void update_tenant_ctx(void)
 {
 	//LOG_ERROR("update_mtrdma_tenant_state()\n");
 
@@ -635,7 +1137,7 @@ void update_tenant_ctx()
 
 	tenant_ctx.avg_msg_size = 0;
 	tenant_ctx.max_msg_size = 0;
-	tenant_ctx.quantam_data = 0;
+	__atomic_store_n(&tenant_ctx.quantam_data, 0, __ATOMIC_RELAXED);
 
 	tenant_ctx.active_qps_num = 0;
 
@@ -650,11 +1152,25 @@ void update_tenant_ctx()
 int mtrdma_poll_cq(struct ibv_cq *cq, uint32_t ne, struct ibv_wc *wc,
 		   int cqe_ver)
 {
-	uint32_t cq_idx = kh_value(cq_hash, kh_get(cqh, cq_hash, cq->handle));
+	khint_t k;
+	uint32_t cq_idx;
+	int ret;
+
+	/* Not a send CQ of a shaped QP, nothing was polled early */
+	if (use_mtrdma != 1)
+		return mtrdma_dev_poll_cq(cq, ne, wc);
+
+	pthread_rwlock_rdlock(&mtrdma_ctx_lock);
+	k = kh_get(cqh, cq_hash, cq->handle);
+	if (k == kh_end(cq_hash)) {
+		ret = mtrdma_dev_poll_count(cq, ne, wc);
+		goto out;
+	}
+	cq_idx = kh_value(cq_hash, k);
 
 	//pthread_mutex_lock(&(cq_ctx[cq_idx].lock));
 	if (cq_ctx[cq_idx].early_poll_num) {
-		int ret = cq_ctx[cq_idx].early_poll_num < ne ?
+		ret = cq_ctx[cq_idx].early_poll_num < ne ?
 				  cq_ctx[cq_idx].early_poll_num :
 				  ne;
 
@@ -679,11 +1195,14 @@ int mtrdma_poll_cq(struct ibv_cq *cq, uint32_t ne, struct ibv_wc *wc,
 		cq_ctx[cq_idx].early_poll_num -= ret;
 		//LOG_ERROR("Copy early polled: %d, wc_head: %d, %d %d\n", ret, cq_ctx[cq_idx].wc_head, cq_idx, cq_ctx[cq_idx].early_poll_num);
 		//pthread_mutex_unlock(&(cq_ctx[cq_idx].lock));
-		return ret;
+		goto out;
 	}
 	//pthread_mutex_unlock(&(cq_ctx[cq_idx].lock));
 
-	return mlx5_poll_cq_early(cq, ne, wc, cqe_ver);
+	ret = mtrdma_dev_poll_count(cq, ne, wc);
+out:
+	pthread_rwlock_unlock(&mtrdma_ctx_lock);
+	return ret;
 
 	/* 
   int ret =   mlx5_poll_cq2(cq, ne, wc, cqe_ver, 1);
@@ -4,6 +4,8 @@
 #include <infiniband/verbs.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
 #include <sys/time.h>
 #include <time.h>
 #include <signal.h>
@@ -53,11 +55,36 @@
 
 // mtrdma global functions
 int mtrdma_get_sq_num(struct ibv_qp *ibqp);
-int mtrdma_early_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc);
+void mtrdma_early_poll_cq(void);
 void mtrdma_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr);
+int mtrdma_poll_cq(struct ibv_cq *cq, uint32_t ne, struct ibv_wc *wc,
+		   int cqe_ver);
 void update_mtrdma_state(struct ibv_qp *qp, uint32_t max_send_wr,
 			 uint32_t max_recv_wr, uint32_t origin_max_send_wr,
 			 uint32_t origin_max_recv_wr, int sig_all);
+void load_mtrdma_config(void);
+void mtrdma_unregister_qp(struct ibv_qp *qp);
+void mtrdma_unregister_cq(struct ibv_cq *cq);
+bool mtrdma_db_admit(struct ibv_qp *qp, uint64_t bytes, uint32_t cur_post,
+		     void *ctrl);
+
+extern int mtrdma_wqe_defer;
+void mtrdma_destroy_qp(void);
+uint8_t mtrdma_rd_atomic_limit(void);
+void mtrdma_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
+		      int attr_mask);
+
+/*
+ * Latency tenants get dedicated bfregs while they last, bulk tenants are
+ * packed onto shared ones. Unset keeps the provider's own choice.
+ */
+enum mtrdma_tenant_class {
+	MTRDMA_TENANT_CLASS_DEFAULT,
+	MTRDMA_TENANT_CLASS_LATENCY,
+	MTRDMA_TENANT_CLASS_BULK,
+};
+
+enum mtrdma_tenant_class mtrdma_tenant_class(void);
 
 struct mtrdma_tenant_context {
 	uint32_t sq_history_len;
@@ -70,6 +97,13 @@ struct mtrdma_tenant_context {
 	double avg_msg_size;
 	uint64_t max_msg_size;
 
+	/*
+	 * Bytes the tenant may still post. Refilled by the credit thread and
+	 * charged by the shaper and by doorbell admission on the app's threads,
+	 * so only ever changed atomically.
+	 */
+	int64_t quantam_data;
+
 	struct timeval last_active_check_time;
 
 	uint32_t active_qps_num;
@@ -81,6 +115,13 @@ struct mtrdma_tenant_context {
 	pthread_cond_t poll_cond;
 };
 
+/* A batch of WQEs built in the SQ and waiting for its doorbell */
+struct mtrdma_db_batch {
+	uint64_t bytes;
+	uint32_t cur_post;
+	void *ctrl;
+};
+
 struct mtrdma_qp_context {
 	struct ibv_qp *qp;
 
@@ -101,6 +142,19 @@ struct mtrdma_qp_context {
 	uint32_t post_num;
 
 	uint64_t chunk_sent_bytes;
+
+	struct mtrdma_db_batch *db_batches;
+	uint32_t db_head;
+	uint32_t db_tail;
+	atomic_int db_len;
+	uint32_t db_size;
+
+	uint8_t max_rd_atomic;
+	uint8_t max_dest_rd_atomic;
+
+	uint32_t rq_depth;	/* Posted receive buffers at the last sample */
+	uint32_t sq_tail;	/* SQ tail at the last sample */
+	uint32_t rnr_retry_exc;
 };
 
 struct mtrdma_cq_context {
@@ -121,8 +175,34 @@ struct mtrdma_shm_context {
 	uint32_t active_tenant_num;
 	uint64_t active_qps_num;
 	uint32_t max_qps_limit;
+	uint32_t active_rrtenant_num;
+	uint32_t starved_rqtenant_num;
 
 	uint32_t active_qps_per_tenant[MAX_TENANT_NUM];
+	int32_t tenant_pid[MAX_TENANT_NUM];
+
+	/* Inbound READ/atomic depth the tenant's QPs accept (max_dest_rd_atomic) */
+	uint32_t resp_rd_atomic_per_tenant[MAX_TENANT_NUM];
+	/* Outbound READ/atomic depth the tenant's QPs issue (max_rd_atomic) */
+	uint32_t req_rd_atomic_per_tenant[MAX_TENANT_NUM];
+	uint32_t rd_atomic_qps_per_tenant[MAX_TENANT_NUM];
+	/* Per QP max_dest_rd_atomic cap set by the daemon, 0 for none */
+	uint32_t rd_atomic_limit[MAX_TENANT_NUM];
+
+	/* Connected RQs and SRQs found without a posted buffer */
+	uint32_t rq_starved_per_tenant[MAX_TENANT_NUM];
+	/* RC SQs with WQEs outstanding and no completion since the last sample */
+	uint32_t sq_stalled_per_tenant[MAX_TENANT_NUM];
+	/* Sends that failed with IBV_WC_RNR_RETRY_EXC_ERR, never reset */
+	uint64_t rnr_retry_exc_per_tenant[MAX_TENANT_NUM];
+	/* Credit refill is shifted right by this, set by the daemon */
+	uint32_t rnr_throttle[MAX_TENANT_NUM];
+
+	/* enum mtrdma_tenant_class, from MTRDMA_TENANT_CLASS */
+	uint32_t tenant_class[MAX_TENANT_NUM];
+	/* Doorbells rung through shared bfregs, and those that found it locked */
+	uint64_t uar_db_per_tenant[MAX_TENANT_NUM];
+	uint64_t uar_contended_per_tenant[MAX_TENANT_NUM];
 
 	pthread_mutex_t mtrdma_thread_lock[MAX_TENANT_NUM];
 	pthread_cond_t mtrdma_thread_cond[MAX_TENANT_NUM];
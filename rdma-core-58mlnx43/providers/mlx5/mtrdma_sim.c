@@ -0,0 +1,242 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mtrdma_sim.h"
+
+static uint32_t next_cq_handle;
+
+uint64_t mtrdma_sim_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct mtrdma_sim_dev *mtrdma_sim_open(uint64_t link_mbps, uint64_t wqe_ns)
+{
+	struct mtrdma_sim_dev *dev;
+
+	if (!link_mbps) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return NULL;
+
+	dev->link_mbps = link_mbps;
+	dev->wqe_ns = wqe_ns;
+	pthread_mutex_init(&dev->lock, NULL);
+	return dev;
+}
+
+void mtrdma_sim_close(struct mtrdma_sim_dev *dev)
+{
+	pthread_mutex_destroy(&dev->lock);
+	free(dev);
+}
+
+struct ibv_cq *mtrdma_sim_create_cq(struct mtrdma_sim_dev *dev, int cqe)
+{
+	struct mtrdma_sim_cq *cq;
+
+	cq = calloc(1, sizeof(*cq));
+	if (!cq)
+		return NULL;
+
+	cq->ibcq.cqe = cqe;
+	cq->ibcq.handle = __atomic_fetch_add(&next_cq_handle, 1,
+					     __ATOMIC_RELAXED);
+	pthread_mutex_init(&cq->ibcq.mutex, NULL);
+	pthread_cond_init(&cq->ibcq.cond, NULL);
+	return &cq->ibcq;
+}
+
+void mtrdma_sim_destroy_cq(struct ibv_cq *ibcq)
+{
+	struct mtrdma_sim_cq *cq = to_sim_cq(ibcq);
+
+	pthread_cond_destroy(&cq->ibcq.cond);
+	pthread_mutex_destroy(&cq->ibcq.mutex);
+	free(cq);
+}
+
+struct ibv_qp *mtrdma_sim_create_qp(struct mtrdma_sim_dev *dev,
+				    struct ibv_cq *send_cq, uint32_t depth,
+				    uint32_t qp_num, int sig_all)
+{
+	struct mtrdma_sim_cq *cq = to_sim_cq(send_cq);
+	struct mtrdma_sim_qp *qp;
+
+	qp = calloc(1, sizeof(*qp));
+	if (!qp)
+		return NULL;
+
+	qp->wqes = calloc(depth, sizeof(*qp->wqes));
+	if (!qp->wqes) {
+		free(qp);
+		return NULL;
+	}
+
+	qp->ibqp.qp_num = qp_num;
+	qp->ibqp.qp_type = IBV_QPT_RC;
+	qp->ibqp.state = IBV_QPS_RTS;
+	qp->ibqp.send_cq = send_cq;
+	qp->ibqp.recv_cq = send_cq;
+	pthread_mutex_init(&qp->ibqp.mutex, NULL);
+	pthread_cond_init(&qp->ibqp.cond, NULL);
+
+	qp->dev = dev;
+	qp->depth = depth;
+	qp->sig_all = sig_all;
+	pthread_mutex_init(&qp->lock, NULL);
+
+	qp->next_in_cq = cq->qps;
+	cq->qps = qp;
+	return &qp->ibqp;
+}
+
+void mtrdma_sim_destroy_qp(struct ibv_qp *ibqp)
+{
+	struct mtrdma_sim_qp *qp = to_sim_qp(ibqp);
+	struct mtrdma_sim_cq *cq = to_sim_cq(ibqp->send_cq);
+	struct mtrdma_sim_qp **pos;
+
+	for (pos = &cq->qps; *pos; pos = &(*pos)->next_in_cq) {
+		if (*pos == qp) {
+			*pos = qp->next_in_cq;
+			break;
+		}
+	}
+
+	pthread_mutex_destroy(&qp->lock);
+	pthread_cond_destroy(&qp->ibqp.cond);
+	pthread_mutex_destroy(&qp->ibqp.mutex);
+	free(qp->wqes);
+	free(qp);
+}
+
+static enum ibv_wc_opcode wr_to_wc_opcode(enum ibv_wr_opcode opcode)
+{
+	switch (opcode) {
+	case IBV_WR_RDMA_WRITE:
+	case IBV_WR_RDMA_WRITE_WITH_IMM:
+		return IBV_WC_RDMA_WRITE;
+	case IBV_WR_RDMA_READ:
+		return IBV_WC_RDMA_READ;
+	case IBV_WR_ATOMIC_CMP_AND_SWP:
+		return IBV_WC_COMP_SWAP;
+	case IBV_WR_ATOMIC_FETCH_AND_ADD:
+		return IBV_WC_FETCH_ADD;
+	default:
+		return IBV_WC_SEND;
+	}
+}
+
+int mtrdma_sim_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+			 struct ibv_send_wr **bad_wr)
+{
+	struct mtrdma_sim_qp *qp = to_sim_qp(ibqp);
+	struct mtrdma_sim_dev *dev = qp->dev;
+	int err = 0;
+
+	pthread_mutex_lock(&qp->lock);
+	for (; wr; wr = wr->next) {
+		struct mtrdma_sim_wqe *wqe;
+		uint64_t bytes = 0, start, cost, now;
+		int i;
+
+		if (qp->head - qp->tail == qp->depth) {
+			__atomic_fetch_add(&dev->sq_full, 1, __ATOMIC_RELAXED);
+			err = ENOMEM;
+			*bad_wr = wr;
+			break;
+		}
+
+		for (i = 0; i < wr->num_sge; i++)
+			bytes += wr->sg_list[i].length;
+
+		/* bits / Mbps = us, so bytes * 8000 / Mbps is in ns */
+		cost = dev->wqe_ns + bytes * 8000 / dev->link_mbps;
+		now = mtrdma_sim_now_ns();
+
+		pthread_mutex_lock(&dev->lock);
+		start = dev->link_free_ns > now ? dev->link_free_ns : now;
+		dev->link_free_ns = start + cost;
+		dev->wqes++;
+		dev->bytes += bytes;
+		dev->busy_ns += cost;
+		pthread_mutex_unlock(&dev->lock);
+
+		wqe = &qp->wqes[qp->head % qp->depth];
+		wqe->wr_id = wr->wr_id;
+		wqe->done_ns = start + cost;
+		wqe->byte_len = bytes;
+		wqe->opcode = wr_to_wc_opcode(wr->opcode);
+		wqe->signaled = qp->sig_all || (wr->send_flags & IBV_SEND_SIGNALED);
+		qp->head++;
+	}
+	pthread_mutex_unlock(&qp->lock);
+
+	return err;
+}
+
+/*
+ * WQEs finish in order. As on hardware, unsignaled WQEs leave the SQ only
+ * when the CQE of a later signaled WQE is polled.
+ */
+static int poll_qp(struct mtrdma_sim_qp *qp, int ne, struct ibv_wc *wc,
+		   uint64_t now)
+{
+	uint32_t idx;
+	int npolled = 0;
+
+	pthread_mutex_lock(&qp->lock);
+	for (idx = qp->tail; idx != qp->head && npolled < ne; idx++) {
+		struct mtrdma_sim_wqe *wqe = &qp->wqes[idx % qp->depth];
+
+		if (wqe->done_ns > now)
+			break;
+		if (!wqe->signaled)
+			continue;
+
+		memset(&wc[npolled], 0, sizeof(wc[npolled]));
+		wc[npolled].wr_id = wqe->wr_id;
+		wc[npolled].status = IBV_WC_SUCCESS;
+		wc[npolled].opcode = wqe->opcode;
+		wc[npolled].byte_len = wqe->byte_len;
+		wc[npolled].qp_num = qp->ibqp.qp_num;
+		npolled++;
+		qp->tail = idx + 1;
+	}
+	pthread_mutex_unlock(&qp->lock);
+
+	return npolled;
+}
+
+int mtrdma_sim_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
+{
+	struct mtrdma_sim_cq *cq = to_sim_cq(ibcq);
+	struct mtrdma_sim_qp *qp;
+	uint64_t now = mtrdma_sim_now_ns();
+	int npolled = 0;
+
+	for (qp = cq->qps; qp && npolled < ne; qp = qp->next_in_cq)
+		npolled += poll_qp(qp, ne - npolled, wc + npolled, now);
+
+	return npolled;
+}
+
+int mtrdma_sim_get_sq_num(struct ibv_qp *ibqp)
+{
+	struct mtrdma_sim_qp *qp = to_sim_qp(ibqp);
+
+	return __atomic_load_n(&qp->head, __ATOMIC_RELAXED) -
+	       __atomic_load_n(&qp->tail, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,87 @@
+#ifndef MTRDMA_SIM_H
+#define MTRDMA_SIM_H
+
+#include <infiniband/verbs.h>
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * Software model of the parts of an mlx5 device the MTRDMA shaper talks to:
+ * a send queue of fixed depth, a send CQ and a link. Every WQE occupies the
+ * link for a fixed processing cost plus its bytes at the link rate, in post
+ * order across all QPs, and completes in real time when that slot ends. The
+ * shaper runs unmodified on top, so its accuracy and overhead can be measured
+ * without a NIC.
+ */
+
+struct mtrdma_sim_dev {
+	uint64_t link_mbps;
+	uint64_t wqe_ns;
+
+	pthread_mutex_t lock;
+	uint64_t link_free_ns;	/* When the link finishes the last posted WQE */
+
+	uint64_t wqes;
+	uint64_t bytes;
+	uint64_t busy_ns;
+	uint64_t sq_full;
+};
+
+struct mtrdma_sim_wqe {
+	uint64_t wr_id;
+	uint64_t done_ns;
+	uint32_t byte_len;
+	enum ibv_wc_opcode opcode;
+	int signaled;
+};
+
+struct mtrdma_sim_qp {
+	struct ibv_qp ibqp;
+	struct mtrdma_sim_dev *dev;
+
+	pthread_mutex_t lock;
+	struct mtrdma_sim_wqe *wqes;
+	uint32_t depth;
+	uint32_t head;
+	uint32_t tail;
+	int sig_all;
+
+	struct mtrdma_sim_qp *next_in_cq;
+};
+
+struct mtrdma_sim_cq {
+	struct ibv_cq ibcq;
+	struct mtrdma_sim_qp *qps;
+};
+
+static inline struct mtrdma_sim_qp *to_sim_qp(struct ibv_qp *ibqp)
+{
+	return (struct mtrdma_sim_qp *)ibqp;
+}
+
+static inline struct mtrdma_sim_cq *to_sim_cq(struct ibv_cq *ibcq)
+{
+	return (struct mtrdma_sim_cq *)ibcq;
+}
+
+uint64_t mtrdma_sim_now_ns(void);
+
+struct mtrdma_sim_dev *mtrdma_sim_open(uint64_t link_mbps, uint64_t wqe_ns);
+void mtrdma_sim_close(struct mtrdma_sim_dev *dev);
+
+struct ibv_cq *mtrdma_sim_create_cq(struct mtrdma_sim_dev *dev, int cqe);
+void mtrdma_sim_destroy_cq(struct ibv_cq *ibcq);
+
+struct ibv_qp *mtrdma_sim_create_qp(struct mtrdma_sim_dev *dev,
+				    struct ibv_cq *send_cq, uint32_t depth,
+				    uint32_t qp_num, int sig_all);
+void mtrdma_sim_destroy_qp(struct ibv_qp *ibqp);
+
+/* Same contract as ibv_post_send and ibv_poll_cq on a real device */
+int mtrdma_sim_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+			 struct ibv_send_wr **bad_wr);
+int mtrdma_sim_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc);
+
+int mtrdma_sim_get_sq_num(struct ibv_qp *ibqp);
+
+#endif
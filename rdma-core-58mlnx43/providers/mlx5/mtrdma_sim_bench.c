@@ -0,0 +1,262 @@
+/*
+ * Runs the MTRDMA shaper of mtrdma.c against the software device of
+ * mtrdma_sim.c, so shaping accuracy and overhead can be checked on a
+ * machine without a NIC. Start mtrdma_main (or rdma_monitor --mtrdma) first,
+ * the shaper registers with it as a tenant like any other process.
+ *
+ * With -u the WRs go straight to the device, which gives the unshaped
+ * baseline, and no daemon is needed.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "mtrdma.h"
+#include "mtrdma_sim.h"
+
+#define POLL_BATCH 16
+
+struct sim_bench_params {
+	uint64_t link_mbps;
+	uint64_t wqe_ns;
+	uint32_t tx_depth;
+	uint32_t num_qps;
+	uint32_t size;
+	uint32_t duration;
+	uint64_t expect_mbps;
+	double tolerance;
+	bool unshaped;
+};
+
+static void usage(const char *argv0)
+{
+	printf("Usage: %s [options]\n", argv0);
+	printf("  -r, --rate=<Mbps>        link rate of the device (default 100000)\n");
+	printf("  -c, --wqe_cost=<ns>      device time per WQE (default 80)\n");
+	printf("  -d, --tx_depth=<n>       WRs in flight per QP (default 128)\n");
+	printf("  -q, --qps=<n>            QPs sharing one send CQ (default 1)\n");
+	printf("  -s, --size=<bytes>       message size (default 65536)\n");
+	printf("  -t, --duration=<sec>     run time (default 5)\n");
+	printf("  -e, --expect=<Mbps>      fail unless the achieved rate is within\n");
+	printf("  -a, --tolerance=<pct>    <pct> percent of <Mbps> (default 5)\n");
+	printf("  -u, --unshaped           post to the device directly, without MTRDMA\n");
+}
+
+static int parse_params(int argc, char **argv, struct sim_bench_params *p)
+{
+	static const struct option long_opts[] = {
+		{ "rate", 1, NULL, 'r' },
+		{ "wqe_cost", 1, NULL, 'c' },
+		{ "tx_depth", 1, NULL, 'd' },
+		{ "qps", 1, NULL, 'q' },
+		{ "size", 1, NULL, 's' },
+		{ "duration", 1, NULL, 't' },
+		{ "expect", 1, NULL, 'e' },
+		{ "tolerance", 1, NULL, 'a' },
+		{ "unshaped", 0, NULL, 'u' },
+		{ "help", 0, NULL, 'h' },
+		{}
+	};
+	int c;
+
+	p->link_mbps = 100000;
+	p->wqe_ns = 80;
+	p->tx_depth = 128;
+	p->num_qps = 1;
+	p->size = 65536;
+	p->duration = 5;
+	p->expect_mbps = 0;
+	p->tolerance = 5;
+	p->unshaped = false;
+
+	while ((c = getopt_long(argc, argv, "r:c:d:q:s:t:e:a:uh", long_opts,
+				NULL)) != -1) {
+		switch (c) {
+		case 'r':
+			p->link_mbps = strtoull(optarg, NULL, 0);
+			break;
+		case 'c':
+			p->wqe_ns = strtoull(optarg, NULL, 0);
+			break;
+		case 'd':
+			p->tx_depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			p->num_qps = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			p->size = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			p->duration = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			p->expect_mbps = strtoull(optarg, NULL, 0);
+			break;
+		case 'a':
+			p->tolerance = strtod(optarg, NULL);
+			break;
+		case 'u':
+			p->unshaped = true;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (!p->link_mbps || !p->tx_depth || !p->num_qps || !p->size ||
+	    !p->duration) {
+		fprintf(stderr, "Invalid parameters\n");
+		usage(argv[0]);
+		return -1;
+	}
+	return 0;
+}
+
+static bool shaper_daemon_running(void)
+{
+	int fd = shm_open("/mtrdma-shm", O_RDWR, 0);
+
+	if (fd < 0)
+		return false;
+	close(fd);
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	struct sim_bench_params p;
+	struct mtrdma_sim_dev *dev;
+	struct ibv_cq *cq;
+	struct ibv_qp **qps;
+	uint32_t *outstanding;
+	struct ibv_sge sge = {};
+	struct ibv_send_wr wr = {};
+	struct ibv_wc wc[POLL_BATCH];
+	uint64_t start, end, now, post_ns = 0, posted = 0, completed = 0;
+	double mbps, mpps;
+	uint32_t i, qp_depth;
+	int ne, j, ret = 0;
+
+	if (parse_params(argc, argv, &p))
+		return 1;
+
+	if (!p.unshaped && !shaper_daemon_running()) {
+		fprintf(stderr,
+			"No MTRDMA shared memory, start mtrdma_main first or use -u\n");
+		return 1;
+	}
+
+	dev = mtrdma_sim_open(p.link_mbps, p.wqe_ns);
+	if (!dev) {
+		perror("mtrdma_sim_open");
+		return 1;
+	}
+
+	/* The same SQ sizing create_qp() applies when MTRDMA is on */
+	qp_depth = p.tx_depth * 2 < 256 ? 256 : p.tx_depth * 2;
+
+	cq = mtrdma_sim_create_cq(dev, qp_depth * p.num_qps);
+	qps = calloc(p.num_qps, sizeof(*qps));
+	outstanding = calloc(p.num_qps, sizeof(*outstanding));
+	if (!cq || !qps || !outstanding) {
+		fprintf(stderr, "Couldn't allocate the device\n");
+		return 1;
+	}
+
+	for (i = 0; i < p.num_qps; i++) {
+		qps[i] = mtrdma_sim_create_qp(dev, cq, qp_depth, i + 1, 0);
+		if (!qps[i]) {
+			fprintf(stderr, "Couldn't create QP %u\n", i);
+			return 1;
+		}
+		if (!p.unshaped)
+			update_mtrdma_state(qps[i], qp_depth, qp_depth * 2,
+					    p.tx_depth, p.tx_depth, 0);
+	}
+
+	sge.length = p.size;
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.opcode = IBV_WR_RDMA_WRITE;
+	wr.send_flags = IBV_SEND_SIGNALED;
+
+	printf("link %lu Mbps, %lu ns per WQE, %u QPs, tx depth %u, %u bytes, %s\n",
+	       p.link_mbps, p.wqe_ns, p.num_qps, p.tx_depth, p.size,
+	       p.unshaped ? "unshaped" : "shaped");
+
+	start = mtrdma_sim_now_ns();
+	end = start + p.duration * 1000000000ULL;
+	for (now = start; now < end; now = mtrdma_sim_now_ns()) {
+		for (i = 0; i < p.num_qps; i++) {
+			uint64_t t0;
+
+			if (outstanding[i] == p.tx_depth)
+				continue;
+
+			wr.wr_id = i;
+			t0 = mtrdma_sim_now_ns();
+			if (p.unshaped) {
+				struct ibv_send_wr *bad_wr;
+
+				if (mtrdma_sim_post_send(qps[i], &wr, &bad_wr))
+					continue;
+			} else {
+				mtrdma_post_send(qps[i], &wr);
+			}
+			post_ns += mtrdma_sim_now_ns() - t0;
+			outstanding[i]++;
+			posted++;
+		}
+
+		if (p.unshaped)
+			ne = mtrdma_sim_poll_cq(cq, POLL_BATCH, wc);
+		else
+			ne = mtrdma_poll_cq(cq, POLL_BATCH, wc, 1);
+		if (ne < 0) {
+			fprintf(stderr, "Poll CQ failed\n");
+			return 1;
+		}
+		for (j = 0; j < ne; j++) {
+			if (wc[j].status != IBV_WC_SUCCESS) {
+				fprintf(stderr, "Completion with status %d\n",
+					wc[j].status);
+				return 1;
+			}
+			outstanding[wc[j].wr_id]--;
+		}
+		completed += ne;
+	}
+
+	mbps = (double)completed * p.size * 8 / ((now - start) / 1e3);
+	mpps = (double)completed / ((now - start) / 1e3);
+	printf("completed %lu WRs, %.3f Mpps, %.1f Mbps, link busy %.1f%%\n",
+	       completed, mpps, mbps,
+	       100.0 * dev->busy_ns / (double)(dev->link_free_ns > now ?
+							dev->link_free_ns - start :
+							now - start));
+	printf("post cost %.1f ns per WR, device SQ full %lu times\n",
+	       posted ? (double)post_ns / posted : 0, dev->sq_full);
+
+	if (p.expect_mbps) {
+		double err = 100.0 * (mbps - p.expect_mbps) / p.expect_mbps;
+
+		printf("expected %lu Mbps, error %+.2f%%\n", p.expect_mbps, err);
+		if (err > p.tolerance || err < -p.tolerance) {
+			printf("FAIL: outside %.2f%%\n", p.tolerance);
+			ret = 2;
+		}
+	}
+
+	/* The shaper threads keep running on the QPs, exit without tearing down */
+	return ret;
+}
@@ -757,6 +757,27 @@ static inline int mlx5_post_send_underlay(struct mlx5_qp *qp,
 	return 0;
 }
 
+#ifdef MTRDMA
+/* mmio_wc_spinlock() on a shared bfreg, counting how often it was held */
+static inline void mlx5_bf_lock(struct mlx5_bf *bf)
+{
+	if (pthread_spin_trylock(&bf->lock.lock)) {
+		mmio_wc_spinlock(&bf->lock.lock);
+		bf->lock_contended++;
+	} else {
+#if !defined(__i386__) && !defined(__x86_64__)
+		mmio_wc_start();
+#endif
+	}
+	bf->lock_acquired++;
+}
+#else
+static inline void mlx5_bf_lock(struct mlx5_bf *bf)
+{
+	mmio_wc_spinlock(&bf->lock.lock);
+}
+#endif
+
 static inline void post_send_db(struct mlx5_qp *qp, struct mlx5_bf *bf,
 				int nreq, int inl, int size, void *ctrl)
 {
@@ -779,7 +800,7 @@ static inline void post_send_db(struct mlx5_qp *qp, struct mlx5_bf *bf,
 	 */
 	ctx = to_mctx(qp->ibv_qp->context);
 	if (bf->need_lock)
-		mmio_wc_spinlock(&bf->lock.lock);
+		mlx5_bf_lock(bf);
 	else
 		mmio_wc_start();
 
@@ -806,8 +827,12 @@ static inline void post_send_db(struct mlx5_qp *qp, struct mlx5_bf *bf,
 		mlx5_spin_unlock(&bf->lock);
 }
 
-static inline int _mlx5_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
-				  struct ibv_send_wr **bad_wr)
+static inline int __mlx5_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+				   struct ibv_send_wr **bad_wr,
+				   bool mtrdma_defer) ALWAYS_INLINE;
+static inline int __mlx5_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+				   struct ibv_send_wr **bad_wr,
+				   bool mtrdma_defer)
 {
 	struct mlx5_qp *qp = to_mqp(ibqp);
 	void *seg;
@@ -829,6 +854,7 @@ static inline int _mlx5_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 	uint8_t fence;
 	uint8_t next_fence;
 	uint32_t max_tso = 0;
+	uint64_t mtrdma_bytes = 0;
 	FILE *fp =
 		to_mctx(ibqp->context)
 			->dbg_fp; /* The compiler ignores in non-debug mode */
@@ -1174,6 +1200,10 @@ static inline int _mlx5_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 		qp->sq.wqe_head[idx] = qp->sq.head + nreq;
 		qp->sq.cur_post += DIV_ROUND_UP(size * 16, MLX5_SEND_WQE_BB);
 
+		if (mtrdma_defer)
+			for (i = 0; i < wr->num_sge; i++)
+				mtrdma_bytes += wr->sg_list[i].length;
+
 #ifdef MLX5_DEBUG
 		if (mlx5_debug_mask & MLX5_DBG_QP_SEND)
 			dump_wqe(to_mctx(ibqp->context), idx, size, qp);
@@ -1182,6 +1212,17 @@ static inline int _mlx5_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 
 out:
 	qp->fm_cache = next_fence;
+
+#ifdef MTRDMA
+	/* Same doorbell gating as wr_complete, see mlx5_send_wr_complete() */
+	if (mtrdma_defer && nreq &&
+	    !mtrdma_db_admit(ibqp, mtrdma_bytes, qp->sq.cur_post, ctrl)) {
+		qp->sq.head += nreq;
+		mlx5_spin_unlock(&qp->sq.lock);
+		return err;
+	}
+#endif
+
 	post_send_db(qp, bf, nreq, inl, size, ctrl);
 
 	mlx5_spin_unlock(&qp->sq.lock);
@@ -1189,6 +1230,12 @@ out:
 	return err;
 }
 
+static inline int _mlx5_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+				  struct ibv_send_wr **bad_wr)
+{
+	return __mlx5_post_send(ibqp, wr, bad_wr, false);
+}
+
 int mlx5_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 		   struct ibv_send_wr **bad_wr)
 {
@@ -1206,15 +1253,58 @@ int mlx5_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 	}
 #endif
 
+#ifdef MTRDMA
+	if (to_mqp(ibqp)->mtrdma) {
+		/* Built now, the doorbell waits for credit */
+		if (mtrdma_wqe_defer)
+			return __mlx5_post_send(ibqp, wr, bad_wr, true);
+
+		/* Queued, the shaper thread posts it once the tenant has credit */
+		mtrdma_post_send(ibqp, wr);
+		return 0;
+	}
+#endif
+
+	return _mlx5_post_send(ibqp, wr, bad_wr);
+}
+
+#ifdef MTRDMA
+int mlx5_mtrdma_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+			  struct ibv_send_wr **bad_wr)
+{
 	return _mlx5_post_send(ibqp, wr, bad_wr);
+}
+
+/*
+ * Ring the doorbell for WQEs the new post send API built and counted in
+ * sq.head earlier but left for the shaper, up to cur_post. ctrl is the last
+ * of them.
+ */
+void mlx5_mtrdma_ring_db(struct ibv_qp *ibqp, uint32_t cur_post, void *ctrl)
+{
+	struct mlx5_qp *qp = to_mqp(ibqp);
+	struct mlx5_bf *bf = qp->bf;
+
+	mlx5_spin_lock(&qp->sq.lock);
+
+	udma_to_device_barrier();
+	qp->db[MLX5_SND_DBR] = htobe32(cur_post & 0xffff);
+
+	if (bf->need_lock)
+		mlx5_bf_lock(bf);
+	else
+		mmio_wc_start();
 
-	// MTRDMA phx change start -- intercept user's wrs
+	mmio_write64_be(bf->reg + bf->offset, *(__be64 *)ctrl);
 
-	// mtrdma_post_send(ibqp, wr);
-	// return 0;
+	mmio_flush_writes();
+	bf->offset ^= bf->buf_size;
+	if (bf->need_lock)
+		mlx5_spin_unlock(&bf->lock);
 
-	// MTRDMA phx change end -- intercept user's wrs
+	mlx5_spin_unlock(&qp->sq.lock);
 }
+#endif
 
 enum {
 	WQE_REQ_SETTERS_UD_XRC_DC = 2,
@@ -1231,6 +1321,7 @@ static void mlx5_send_wr_start(struct ibv_qp_ex *ibqp)
 	mqp->err = 0;
 	mqp->nreq = 0;
 	mqp->inl_wqe = 0;
+	mqp->mtrdma_bytes = 0;
 }
 
 static int mlx5_send_wr_complete_error(struct ibv_qp_ex *ibqp)
@@ -1256,6 +1347,20 @@ static int mlx5_send_wr_complete(struct ibv_qp_ex *ibqp)
 		goto out;
 	}
 
+#ifdef MTRDMA
+	/*
+	 * The whole batch is charged here. Without credit it stays built in
+	 * the SQ, counted in sq.head so later batches queue behind it, and the
+	 * shaper rings the doorbell for it later.
+	 */
+	if (mqp->mtrdma && mqp->nreq &&
+	    !mtrdma_db_admit((struct ibv_qp *)ibqp, mqp->mtrdma_bytes,
+			     mqp->sq.cur_post, mqp->cur_ctrl)) {
+		mqp->sq.head += mqp->nreq;
+		goto out;
+	}
+#endif
+
 	post_send_db(mqp, mqp->bf, mqp->nreq, mqp->inl_wqe, mqp->cur_size,
 		     mqp->cur_ctrl);
 
@@ -1685,6 +1790,9 @@ static inline void _mlx5_send_wr_set_sge(struct mlx5_qp *mqp, uint32_t lkey,
 	dseg->lkey = htobe32(lkey);
 	dseg->addr = htobe64(addr);
 	mqp->cur_size += sizeof(*dseg) / 16;
+#ifdef MTRDMA
+	mqp->mtrdma_bytes += length;
+#endif
 }
 
 static void mlx5_send_wr_set_sge_rc_uc(struct ibv_qp_ex *ibqp, uint32_t lkey,
@@ -1772,6 +1880,9 @@ static inline void _mlx5_send_wr_set_sge_list(struct mlx5_qp *mqp,
 		dseg->addr = htobe64(sg_list[i].addr);
 		dseg++;
 		mqp->cur_size += (sizeof(*dseg) / 16);
+#ifdef MTRDMA
+		mqp->mtrdma_bytes += sg_list[i].length;
+#endif
 	}
 }
 
@@ -1911,6 +2022,9 @@ static inline void _mlx5_send_wr_set_inline_data(struct mlx5_qp *mqp,
 	memcpy_to_wqe(mqp, (void *)dseg + sizeof(*dseg), addr, length);
 	dseg->byte_count = htobe32(length | MLX5_INLINE_SEG);
 	mqp->cur_size += DIV_ROUND_UP(length + sizeof(*dseg), 16);
+#ifdef MTRDMA
+	mqp->mtrdma_bytes += length;
+#endif
 }
 
 static void mlx5_send_wr_set_inline_data_rc_uc(struct ibv_qp_ex *ibqp,
@@ -2001,6 +2115,9 @@ _mlx5_send_wr_set_inline_data_list(struct mlx5_qp *mqp, size_t num_buf,
 
 	dseg->byte_count = htobe32(inl_size | MLX5_INLINE_SEG);
 	mqp->cur_size += DIV_ROUND_UP(inl_size + sizeof(*dseg), 16);
+#ifdef MTRDMA
+	mqp->mtrdma_bytes += inl_size;
+#endif
 }
 
 static void
@@ -78,6 +78,9 @@ void mlx5_free_srq_wqe(struct mlx5_srq *srq, int ind)
 	next = get_wqe(srq, srq->tail);
 	next->next_wqe_index = htobe16(ind);
 	srq->tail = ind;
+#ifdef MTRDMA
+	srq->mtrdma_consumed++;
+#endif
 
 	mlx5_spin_unlock(&srq->lock);
 }
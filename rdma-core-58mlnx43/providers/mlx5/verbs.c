@@ -61,6 +61,7 @@
 #include "mtrdma.h"
 
 int mlx5_single_threaded = 0;
+int mlx5_lock_check = 0;
 
 static inline int is_xrc_tgt(int type)
 {
@@ -362,7 +363,12 @@ static int mlx5_alloc_qp_uar(struct ibv_context *context, bool dedicated)
 	return 0;
 }
 
-static struct mlx5_bf *mlx5_get_qp_uar(struct ibv_context *context)
+/*
+ * With prefer_shared the QP goes to the least used shared bfreg even while
+ * dedicated ones are left, so they stay for QPs that need the lock free path.
+ */
+static struct mlx5_bf *mlx5_get_qp_uar(struct ibv_context *context,
+				       bool prefer_shared)
 {
 	struct mlx5_context *ctx = to_mctx(context);
 	struct mlx5_bf *bf = NULL, *bf_entry;
@@ -370,18 +376,23 @@ static struct mlx5_bf *mlx5_get_qp_uar(struct ibv_context *context)
 	if (ctx->shut_up_bf || !ctx->bf_reg_size)
 		return ctx->nc_uar;
 
+	if (!ctx->qp_max_shared_uuars)
+		prefer_shared = false;
+
 	pthread_mutex_lock(&ctx->dyn_bfregs_mutex);
 	do {
-		bf = list_pop(&ctx->dyn_uar_qp_dedicated_list, struct mlx5_bf,
-			      uar_entry);
-		if (bf)
-			break;
-
-		if (ctx->qp_alloc_dedicated_uuars <
-		    ctx->qp_max_dedicated_uuars) {
-			if (mlx5_alloc_qp_uar(context, true))
+		if (!prefer_shared) {
+			bf = list_pop(&ctx->dyn_uar_qp_dedicated_list,
+				      struct mlx5_bf, uar_entry);
+			if (bf)
 				break;
-			continue;
+
+			if (ctx->qp_alloc_dedicated_uuars <
+			    ctx->qp_max_dedicated_uuars) {
+				if (mlx5_alloc_qp_uar(context, true))
+					break;
+				continue;
+			}
 		}
 
 		if (ctx->qp_alloc_shared_uuars < ctx->qp_max_shared_uuars) {
@@ -935,7 +946,8 @@ enum {
 	MLX5_DV_CREATE_CQ_SUP_COMP_MASK =
 		(MLX5DV_CQ_INIT_ATTR_MASK_COMPRESSED_CQE |
 		 MLX5DV_CQ_INIT_ATTR_MASK_FLAGS |
-		 MLX5DV_CQ_INIT_ATTR_MASK_CQE_SIZE),
+		 MLX5DV_CQ_INIT_ATTR_MASK_CQE_SIZE |
+		 MLX5DV_CQ_INIT_ATTR_MASK_POLL_POLICY),
 };
 
 static struct ibv_cq_ex *create_cq(struct ibv_context *context,
@@ -1008,6 +1020,29 @@ static struct ibv_cq_ex *create_cq(struct ibv_context *context,
 			goto err;
 		}
 		cq->parent_domain = cq_attr->parent_domain;
+		/* The thread domain's single thread polls it */
+		if (to_mparent_domain(cq->parent_domain)->mtd)
+			cq->flags |= MLX5_CQ_FLAGS_SINGLE_THREADED;
+	}
+
+#ifdef MTRDMA
+	/*
+	 * Any CQ may become the send CQ of a shaped QP, which the MTRDMA
+	 * shaper thread polls next to the application. Decide it here, before
+	 * the poll ops and the lock are picked, not once the CQ is live.
+	 */
+	cq->flags &= ~MLX5_CQ_FLAGS_SINGLE_THREADED;
+#endif
+
+	if (mlx5cq_attr &&
+	    mlx5cq_attr->comp_mask & MLX5DV_CQ_INIT_ATTR_MASK_POLL_POLICY) {
+		if (mlx5cq_attr->poll_policy > MLX5DV_CQ_POLL_POLICY_CPU) {
+			mlx5_dbg(fp, MLX5_DBG_CQ, "poll_policy %d\n",
+				 mlx5cq_attr->poll_policy);
+			errno = EINVAL;
+			goto err;
+		}
+		mlx5_cq_set_poll_policy(cq, mlx5cq_attr->poll_policy);
 	}
 
 	if (cq_alloc_flags & MLX5_CQ_FLAGS_EXTENDED) {
@@ -1022,8 +1057,15 @@ static struct ibv_cq_ex *create_cq(struct ibv_context *context,
 	resp_drv = &resp_ex.drv_payload;
 	cq->cons_index = 0;
 
-	if (mlx5_spinlock_init(&cq->lock, !mlx5_single_threaded))
+#ifdef MTRDMA
+	if (mlx5_spinlock_init(&cq->lock, 1))
 		goto err;
+#else
+	if (mlx5_spinlock_init(&cq->lock,
+			       !mlx5_single_threaded &&
+			       !(cq->flags & MLX5_CQ_FLAGS_SINGLE_THREADED)))
+		goto err;
+#endif
 
 	ncqe = align_queue_size(cq_attr->cqe + 1);
 	if ((ncqe > (1 << 24)) || (ncqe < (cq_attr->cqe + 1))) {
@@ -1064,12 +1106,27 @@ static struct ibv_cq_ex *create_cq(struct ibv_context *context,
 	if (mlx5cq_attr) {
 		if (mlx5cq_attr->comp_mask &
 		    MLX5DV_CQ_INIT_ATTR_MASK_COMPRESSED_CQE) {
+			uint8_t fmt = mlx5cq_attr->cqe_comp_res_format;
+
+			/*
+			 * One mini CQE format per CQ, the poll path has no
+			 * striding RQ support to use stride indexes with.
+			 */
+			if (fmt & (fmt - 1) ||
+			    fmt == MLX5DV_CQE_RES_FORMAT_CSUM_STRIDX) {
+				mlx5_dbg(fp, MLX5_DBG_CQ,
+					 "Unsupported CQE compression format 0x%x\n",
+					 fmt);
+				errno = EINVAL;
+				goto err_db;
+			}
+
 			if (mctx->cqe_comp_caps.max_num &&
-			    (mlx5cq_attr->cqe_comp_res_format &
-			     mctx->cqe_comp_caps.supported_format)) {
+			    (fmt & mctx->cqe_comp_caps.supported_format)) {
 				cmd_drv->cqe_comp_en = 1;
-				cmd_drv->cqe_comp_res_format =
-					mlx5cq_attr->cqe_comp_res_format;
+				cmd_drv->cqe_comp_res_format = fmt;
+				cq->comp_res_format = fmt;
+				cq->flags |= MLX5_CQ_FLAGS_COMPRESSED;
 			} else {
 				mlx5_dbg(fp, MLX5_DBG_CQ,
 					 "CQE Compression is not supported\n");
@@ -1141,6 +1198,7 @@ static struct ibv_cq_ex *create_cq(struct ibv_context *context,
 	cq->stall_enable = to_mctx(context)->stall_enable;
 	cq->stall_adaptive_enable = to_mctx(context)->stall_adaptive_enable;
 	cq->stall_cycles = to_mctx(context)->stall_cycles;
+	mlx5_cq_set_poll_policy(cq, cq->poll_policy);
 
 	return &cq->verbs_cq.cq_ex;
 
@@ -1234,6 +1292,10 @@ int mlx5_resize_cq(struct ibv_cq *ibcq, int cqe)
 	if (((long long)cqe * 64) > INT_MAX)
 		return EINVAL;
 
+	/* The copy to the new buffer can't carry a compressed CQE session */
+	if (cq->flags & MLX5_CQ_FLAGS_COMPRESSED)
+		return EINVAL;
+
 	mlx5_spin_lock(&cq->lock);
 	cq->active_cqes = cq->verbs_cq.cq.cqe;
 	if (cq->active_buf == &cq->buf_a)
@@ -1293,6 +1355,10 @@ int mlx5_destroy_cq(struct ibv_cq *cq)
 	if (ret)
 		return ret;
 
+#ifdef MTRDMA
+	mtrdma_unregister_cq(cq);
+#endif
+
 	mlx5_free_db(to_mctx(cq->context), mcq->dbrec, mcq->parent_domain,
 		     mcq->custom_db);
 	mlx5_free_cq_buf(to_mctx(cq->context), mcq->active_buf);
@@ -1450,6 +1516,10 @@ int mlx5_destroy_srq(struct ibv_srq *srq)
 		msrq->cmd_qp = NULL;
 	}
 
+	/*
+	 * Fails while QPs are still attached, so the MTRDMA RQ sampler has
+	 * dropped every QP using this SRQ in mlx5_destroy_qp already.
+	 */
 	ret = ibv_cmd_destroy_srq(srq);
 	if (ret)
 		return ret;
@@ -2617,7 +2687,12 @@ static struct ibv_qp *create_qp(struct ibv_context *context,
 		bf = mparent_domain->mtd->bf;
 
 	if (!bf && !(ctx->flags & MLX5_CTX_FLAGS_NO_KERN_DYN_UAR)) {
-		bf = mlx5_get_qp_uar(context);
+#ifdef MTRDMA
+		bf = mlx5_get_qp_uar(context, mtrdma_tenant_class() ==
+						      MTRDMA_TENANT_CLASS_BULK);
+#else
+		bf = mlx5_get_qp_uar(context, false);
+#endif
 		if (!bf)
 			goto err_free_uidx;
 	}
@@ -2703,9 +2778,24 @@ static struct ibv_qp *create_qp(struct ibv_context *context,
 
 	set_qp_operational_state(qp, IBV_QPS_RESET);
 
-	// update_mtrdma_state(ibqp, attr->cap.max_send_wr, attr->cap.max_recv_wr,
-	// 		    origin_max_send_wr, origin_max_recv_wr,
-	// 		    attr->sq_sig_all);
+#ifdef MTRDMA
+	if (attr->qp_type == IBV_QPT_RC || attr->qp_type == IBV_QPT_UC ||
+	    attr->qp_type == IBV_QPT_UD) {
+		update_mtrdma_state(ibqp, attr->cap.max_send_wr,
+				    attr->cap.max_recv_wr, origin_max_send_wr,
+				    origin_max_recv_wr, attr->sq_sig_all);
+		qp->mtrdma = 1;
+		/*
+		 * The shaper thread posts to the SQ too, a thread domain
+		 * doesn't make it single threaded. Send CQs keep their lock
+		 * from create_cq().
+		 */
+		qp->sq.lock.need_lock = 1;
+	}
+#else
+	(void)origin_max_send_wr;
+	(void)origin_max_recv_wr;
+#endif
 
 	return ibqp;
 
@@ -2803,6 +2893,14 @@ int mlx5_destroy_qp(struct ibv_qp *ibqp)
 	int ret;
 	struct mlx5_parent_domain *mparent_domain = to_mparent_domain(ibqp->pd);
 
+#ifdef MTRDMA
+	/* The shaper and samplers must be done with the QP and its bfreg */
+	if (qp->mtrdma) {
+		mtrdma_unregister_qp(ibqp);
+		qp->mtrdma = 0;
+	}
+#endif
+
 	if (qp->rss_qp) {
 		ret = ibv_cmd_destroy_qp(ibqp);
 		if (ret)
@@ -3015,10 +3113,29 @@ int mlx5_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr, int attr_mask)
 	struct mlx5_context *context = to_mctx(qp->context);
 	int ret;
 	__be32 *db;
+#ifdef MTRDMA
+	uint8_t rd_atomic_limit;
+#endif
 
 	if (mqp->dc_type == MLX5DV_DCTYPE_DCT)
 		return modify_dct(qp, attr, attr_mask);
 
+#ifdef MTRDMA
+	/*
+	 * Inbound READ/atomic depth capped by the MTRDMA daemon. The peer
+	 * sized its max_rd_atomic from the value given here, so a request
+	 * above the cap fails rather than being lowered behind its back.
+	 */
+	rd_atomic_limit = mqp->mtrdma ? mtrdma_rd_atomic_limit() : 0;
+	if (rd_atomic_limit && (attr_mask & IBV_QP_MAX_DEST_RD_ATOMIC) &&
+	    attr->max_dest_rd_atomic > rd_atomic_limit) {
+		mlx5_dbg(context->dbg_fp, MLX5_DBG_QP,
+			 "max_dest_rd_atomic %u above the MTRDMA cap %u\n",
+			 attr->max_dest_rd_atomic, rd_atomic_limit);
+		return EINVAL;
+	}
+#endif
+
 	if (mqp->rss_qp)
 		return EOPNOTSUPP;
 
@@ -3116,6 +3233,11 @@ int mlx5_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr, int attr_mask)
 	if (!ret && (attr_mask & IBV_QP_STATE))
 		set_qp_operational_state(mqp, attr->qp_state);
 
+#ifdef MTRDMA
+	if (!ret && mqp->mtrdma)
+		mtrdma_modify_qp(qp, attr, attr_mask);
+#endif
+
 	return ret;
 }
 
@@ -3996,6 +4118,9 @@ int mlx5_query_device_ex(struct ibv_context *context,
 	unsigned major;
 	unsigned minor;
 	int err;
+#ifdef MTRDMA
+	uint8_t rd_atomic_limit;
+#endif
 
 	err = ibv_cmd_query_device_any(context, input, attr, attr_size,
 				       &resp.ibv_resp, &resp_size);
@@ -4034,6 +4159,16 @@ int mlx5_query_device_ex(struct ibv_context *context,
 	snprintf(a->fw_ver, sizeof(a->fw_ver), "%d.%d.%04d", major, minor,
 		 sub_minor);
 
+#ifdef MTRDMA
+	/*
+	 * rdma_cm advertises max_qp_rd_atom as the responder resources, keep
+	 * it within the MTRDMA cap so modify_qp doesn't refuse them later.
+	 */
+	rd_atomic_limit = mtrdma_rd_atomic_limit();
+	if (rd_atomic_limit && a->max_qp_rd_atom > rd_atomic_limit)
+		a->max_qp_rd_atom = rd_atomic_limit;
+#endif
+
 	return 0;
 }
 
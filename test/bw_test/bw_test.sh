@@ -10,24 +10,15 @@ echo "bytes,avg_bw,avg_msg_rate" > $OUTPUT_FILE
 
 # 注：请将user替换为实际的用户名，可能需要设置免密登录
 
-# 循环测试不同的消息大小
-for ((size=16; size<=4096; size*=2)); do
-    echo "Testing with message size: $size bytes"
-    
-    # 运行客户端测试
-    result=$(timeout 7 ib_write_bw  -F -s $size --run_infinitely --report_gbits -d $DEVICE -D 1 -p $(($size + 50000)) > /dev/null & ssh phx@115.157.197.8 "timeout 5 ib_write_bw  -F -s $size --run_infinitely --report_gbits -d $DEVICE -D 1 $SERVER_IP -p $(($size + 50000))" )
-    
-    echo "$result" > "result_$size.txt"
-
-    # 提取所需数据
-    avg_bw=$(echo "$result" | awk '/^ '$size'/ {print $4}' | tail -1)
-    avg_msg_rate=$(echo "$result" | awk '/^ '$size'/ {print $5}' | tail -1)
-    
-    # 将结果写入文件
-    echo "$size,$avg_bw,$avg_msg_rate" >> $OUTPUT_FILE
-    
-    # 每次测试间隔
-    sleep 1
-done
-
-echo "All tests completed. Results saved to $OUTPUT_FILE"
\ No newline at end of file
+# 一次连接内扫描全部消息大小（--sweep 复用已连接的QP和MR，不再每个大小重新建连）
+SIZES="16-4096"
+ITERS=100000
+
+result=$(timeout 60 ib_write_bw  -F --sweep=$SIZES -n $ITERS --report_gbits -d $DEVICE -p 50000 > /dev/null & sleep 1; ssh phx@115.157.197.8 "timeout 60 ib_write_bw  -F --sweep=$SIZES -n $ITERS --report_gbits -d $DEVICE $SERVER_IP -p 50000" )
+
+echo "$result" > "result_sweep.txt"
+
+# 提取所需数据：每个大小一行 "#bytes #iterations BW_peak BW_average MsgRate"
+echo "$result" | awk '$1 ~ /^[0-9]+$/ && NF >= 5 {print $1","$4","$5}' >> $OUTPUT_FILE
+
+echo "All tests completed. Results saved to $OUTPUT_FILE"